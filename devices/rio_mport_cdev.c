@@ -32,6 +32,13 @@
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/mman.h>
+#include <linux/sizes.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/file.h>
+#include <linux/anon_inodes.h>
+#include <linux/hashtable.h>
 
 #include <linux/dma-mapping.h>
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
@@ -39,6 +46,10 @@
 #endif
 
 #include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#endif
 
 #include "../include/rio.h"
 #include "../include/rio_ids.h"
@@ -96,12 +107,27 @@ static int dma_timeout = 3000; /* DMA transfer timeout in msec */
 module_param(dma_timeout, int, S_IRUGO);
 MODULE_PARM_DESC(dma_timeout, "DMA Transfer Timeout in msec (default: 3000)");
 
+static unsigned int dma_poll_budget = 50; /* busy-poll time in usec */
+module_param(dma_poll_budget, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(dma_poll_budget,
+	"Busy-poll time for polled DMA transfers in usec (default: 50)");
+
+static unsigned int dma_stripe_min = SZ_4M; /* min striped transfer size */
+module_param(dma_stripe_min, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(dma_stripe_min,
+	"Min size of DMA transfer striped over all DMA channels, 0 = off (default: 4M)");
+
 #ifdef DEBUG
 static u32 dbg_level = DBG_NONE;
 module_param(dbg_level, uint, S_IWUSR | S_IWGRP | S_IRUGO);
 MODULE_PARM_DESC(dbg_level, "Debugging output level (default 0 = none)");
 #endif
 
+static unsigned int obw_cache = 4; /* idle outbound windows kept */
+module_param(obw_cache, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(obw_cache,
+	"Number of idle outbound windows kept mapped for reuse (default: 4)");
+
 static unsigned long rio_res_mem;
 module_param(rio_res_mem, ulong, S_IRUGO);
 MODULE_PARM_DESC(rio_res_mem, "Base address of reserved memory space");
@@ -140,9 +166,13 @@ struct rio_mport_mapping {
 	dma_addr_t phys_addr; /* for mmap */
 	dma_addr_t dma_addr;
 	void *virt_addr; /* kernel address, for dma_free_coherent */
+	struct page *page; /* node-local buffer, for __free_pages */
 	u64 size;
 	struct kref ref; /* refcount of vmas sharing the mapping */
 	struct file *filp;
+	struct hlist_node obw_node; /* outbound: lookup by rioid/rio_addr */
+	bool idle; /* outbound: unused, kept on the idle list for reuse */
+	bool wc; /* outbound: write-combining mmap */
 };
 
 struct rio_mport_dma_map {
@@ -154,6 +184,8 @@ struct rio_mport_dma_map {
 
 #define MPORT_MAX_DMA_BUFS	16
 #define MPORT_EVENT_DEPTH	10
+#define MPORT_DB_BATCH		32	/* doorbells per submission */
+#define MPORT_OBW_HASH_BITS	6
 
 /*
  * mport_dev  driver-specific structure that represents mport device
@@ -169,6 +201,9 @@ struct rio_mport_dma_map {
  * @portwrites queue of inbound portwrites
  * @pw_lock    lock for port write queue
  * @mappings   queue for memory mappings
+ * @obw_hash   outbound mappings, active and idle, hashed by rioid/rio_addr
+ * @obw_idle   idle outbound mappings, least recently used first
+ * @obw_idle_cnt number of idle outbound mappings
  * @dma_chan   DMA channels associated with this device
  * @dma_ref:
  * @comp:
@@ -183,11 +218,13 @@ struct mport_dev {
 	struct mutex		file_mutex;
 	struct list_head	file_list;
 	struct rio_mport_properties	properties;
-	struct list_head		doorbells;
 	spinlock_t			db_lock;
 	struct list_head		portwrites;
 	spinlock_t			pw_lock;
 	struct list_head	mappings;
+	DECLARE_HASHTABLE(obw_hash, MPORT_OBW_HASH_BITS);
+	struct list_head	obw_idle;
+	unsigned int		obw_idle_cnt;
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
 	struct dma_chan *dma_chan;
 	struct kref	dma_ref;
@@ -207,6 +244,7 @@ struct mport_dev {
  * @event_rx_wait wait queue for this descriptor
  * @fifo_lock     lock for event_fifo
  * @event_mask    event mask for this descriptor
+ * @ering         event ring shared with user space (optional)
  * @dmach DMA engine channel allocated for specific file object
  */
 struct mport_cdev_priv {
@@ -219,6 +257,9 @@ struct mport_cdev_priv {
 	wait_queue_head_t       event_rx_wait;
 	spinlock_t              fifo_lock;
 	u32			event_mask; /* RIO_DOORBELL, RIO_PORTWRITE */
+	struct mport_event_ring	*ering;
+	u32			alloc_flags;	/* RIO_ALLOC_* */
+	int			alloc_node;
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
 	struct dma_chan		*dmach;
 	struct list_head	async_list;
@@ -226,6 +267,13 @@ struct mport_cdev_priv {
 	struct mutex		dma_lock;
 	struct kref		dma_ref;
 	struct completion	comp;
+	struct list_head	reg_bufs;	/* registered user buffers */
+	struct mutex		reg_lock;
+	u64			reg_next;	/* next buffer handle */
+	struct dma_chan		*stripe_ch[RIO_DMA_MAX_STRIPE];
+	unsigned int		stripe_num;	/* 0 if not requested */
+	atomic_t		stripe_users;	/* striped transfers in flight */
+	struct work_struct	stripe_work;	/* releases idle channels */
 #endif
 };
 
@@ -245,18 +293,53 @@ struct rio_mport_pw_filter {
 
 /*
  * rio_mport_db_filter - structure to describe a doorbell filter
- * @data_node reference to device node
  * @priv_node node in private data
  * @priv      reference to private data
  * @filter    actual doorbell filter
+ *
+ * Each filter binds its own inbound doorbell range, so the core doorbell
+ * dispatch table passes the filter straight to the doorbell handler.
  */
 struct rio_mport_db_filter {
-	struct list_head data_node;
 	struct list_head priv_node;
 	struct mport_cdev_priv *priv;
 	struct rio_doorbell_filter filter;
 };
 
+/*
+ * mport_event_ring - event ring shared with user space
+ * @ref       references held by file descriptor owning it and by ring file
+ * @area      vmalloc_user() shared area
+ * @size      size of @area
+ * @ring      ring indexes in @area
+ * @events    ring entries in @area
+ * @entries   number of ring entries, power of two
+ * @head      producer index, kernel copy
+ * @woken     producer index at last wake up
+ * @wake_count  number of events to wake up waiter after
+ * @wake_timeout  time to wake up waiter after first pending event
+ * @timer     wake up timer
+ * @lock      serializes producers and wake up timer
+ * @wq        ring file wait queue
+ * @dead      owning file descriptor has been released
+ */
+struct mport_event_ring {
+	struct kref		ref;
+	void			*area;
+	size_t			size;
+	struct rio_event_ring	*ring;
+	struct rio_event	*events;
+	u32			entries;
+	u32			head;
+	u32			woken;
+	u32			wake_count;
+	ktime_t			wake_timeout;
+	struct hrtimer		timer;
+	spinlock_t		lock;
+	wait_queue_head_t	wq;
+	bool			dead;
+};
+
 static LIST_HEAD(mport_devs);
 static DEFINE_MUTEX(mport_devs_lock);
 
@@ -298,8 +381,9 @@ static int rio_mport_maint_rd(struct mport_cdev_priv *priv, void __user *arg,
 			ret = __rio_local_read_config_32(mport,
 				offset, &buffer[i]);
 		else
-			ret = rio_mport_read_config_32(mport, maint_io.rioid,
-				maint_io.hopcount, offset, &buffer[i]);
+			ret = rio_mport_read_config_32_cansleep(mport,
+				maint_io.rioid, maint_io.hopcount, offset,
+				&buffer[i]);
 		if (ret)
 			goto out;
 
@@ -351,7 +435,8 @@ static int rio_mport_maint_wr(struct mport_cdev_priv *priv, void __user *arg,
 			ret = __rio_local_write_config_32(mport,
 							  offset, buffer[i]);
 		else
-			ret = rio_mport_write_config_32(mport, maint_io.rioid,
+			ret = rio_mport_write_config_32_cansleep(mport,
+							maint_io.rioid,
 							maint_io.hopcount,
 							offset, buffer[i]);
 		if (ret)
@@ -369,9 +454,75 @@ out:
 /*
  * Inbound/outbound memory mapping functions
  */
+
+static inline u64 mport_obw_key(u16 rioid, u64 raddr)
+{
+	return raddr ^ ((u64)rioid << 48);
+}
+
+/*
+ * mport_obw_lookup - finds active or idle outbound mapping
+ *
+ * NOTE: Shall be called while holding buf_mutex.
+ */
+static struct rio_mport_mapping *
+mport_obw_lookup(struct mport_dev *md, u16 rioid, u64 raddr)
+{
+	struct rio_mport_mapping *map;
+
+	hash_for_each_possible(md->obw_hash, map, obw_node,
+			       mport_obw_key(rioid, raddr)) {
+		if (map->rioid == rioid && map->rio_addr == raddr)
+			return map;
+	}
+
+	return NULL;
+}
+
+/*
+ * mport_obw_evict - unmaps idle outbound window and frees its mapping
+ *
+ * NOTE: Shall be called while holding buf_mutex.
+ */
+static void mport_obw_evict(struct mport_dev *md,
+			    struct rio_mport_mapping *map)
+{
+	rmcd_debug(OBW, "did=%d ra=0x%llx", map->rioid, map->rio_addr);
+
+	list_del(&map->node);
+	md->obw_idle_cnt--;
+	hash_del(&map->obw_node);
+	rio_unmap_outb_region(md->mport, map->rioid, map->rio_addr);
+	kfree(map);
+}
+
+/*
+ * mport_obw_park - keeps released outbound window mapped for reuse
+ *
+ * Returns true if the mapping has been moved to the idle list. The least
+ * recently used idle windows are unmapped to stay within obw_cache.
+ * NOTE: Shall be called while holding buf_mutex.
+ */
+static bool mport_obw_park(struct mport_dev *md,
+			   struct rio_mport_mapping *map)
+{
+	if (!obw_cache || !atomic_read(&md->active))
+		return false;
+
+	map->idle = true;
+	map->filp = NULL;
+	list_add_tail(&map->node, &md->obw_idle);
+	md->obw_idle_cnt++;
+
+	while (md->obw_idle_cnt > obw_cache)
+		mport_obw_evict(md, list_first_entry(&md->obw_idle,
+					struct rio_mport_mapping, node));
+	return true;
+}
+
 static int
 rio_mport_create_outbound_mapping(struct mport_dev *md, struct file *filp,
-				  u16 rioid, u64 raddr, u32 size,
+				  u16 rioid, u64 raddr, u32 size, bool wc,
 				  dma_addr_t *paddr)
 {
 	struct rio_mport *mport = md->mport;
@@ -394,45 +545,80 @@ rio_mport_create_outbound_mapping(struct mport_dev *md, struct file *filp,
 	map->size = size;
 	map->phys_addr = *paddr;
 	map->dma_addr = *paddr;
+	map->wc = wc;
 	map->filp = filp;
 	map->md = md;
 	kref_init(&map->ref);
 	list_add_tail(&map->node, &md->mappings);
+	hash_add(md->obw_hash, &map->obw_node, mport_obw_key(rioid, raddr));
 	return 0;
 err_map_outb:
 	kfree(map);
 	return ret;
 }
 
+/*
+ * rio_mport_get_outbound_mapping - finds or creates outbound mapping
+ *
+ * An exact match of an active mapping is shared, an exact match of an idle
+ * one is reused without reprogramming the window. If the mport is out of
+ * outbound windows or BAR space, idle windows are unmapped starting from
+ * the least recently used one.
+ */
 static int
 rio_mport_get_outbound_mapping(struct mport_dev *md, struct file *filp,
-			       u16 rioid, u64 raddr, u32 size,
+			       u16 rioid, u64 raddr, u32 size, bool wc,
 			       dma_addr_t *paddr)
 {
-	struct rio_mport_mapping *map;
-	int err = -ENOMEM;
+	struct rio_mport_mapping *map, *_map;
+	int err;
 
 	mutex_lock(&md->buf_mutex);
-	list_for_each_entry(map, &md->mappings, node) {
-		if (map->dir != MAP_OUTBOUND)
-			continue;
+
+	map = mport_obw_lookup(md, rioid, raddr);
+	if (map && map->size == size) {
+		if (map->idle) {
+			rmcd_debug(OBW, "reuse idle did=%d ra=0x%llx",
+				   rioid, raddr);
+			list_move_tail(&map->node, &md->mappings);
+			md->obw_idle_cnt--;
+			map->idle = false;
+			map->wc = wc;
+			map->filp = filp;
+			kref_init(&map->ref);
+		}
+		*paddr = map->phys_addr;
+		err = 0;
+		goto out;
+	}
+
+	/* Idle windows never block a new mapping */
+	list_for_each_entry_safe(map, _map, &md->obw_idle, node) {
 		if (rioid == map->rioid &&
-		    raddr == map->rio_addr && size == map->size) {
-			*paddr = map->phys_addr;
-			err = 0;
-			break;
-		} else if (rioid == map->rioid &&
-			   raddr < (map->rio_addr + map->size - 1) &&
-			   (raddr + size) > map->rio_addr) {
+		    raddr < (map->rio_addr + map->size) &&
+		    (raddr + size) > map->rio_addr)
+			mport_obw_evict(md, map);
+	}
+
+	list_for_each_entry(map, &md->mappings, node) {
+		if (map->dir == MAP_OUTBOUND && rioid == map->rioid &&
+		    raddr < (map->rio_addr + map->size - 1) &&
+		    (raddr + size) > map->rio_addr) {
 			err = -EBUSY;
-			break;
+			goto out;
 		}
 	}
 
-	/* If not found, create new */
-	if (err == -ENOMEM)
+	err = rio_mport_create_outbound_mapping(md, filp, rioid, raddr,
+						size, wc, paddr);
+	while ((err == -EBUSY || err == -ENOMEM) &&
+	       !list_empty(&md->obw_idle)) {
+		mport_obw_evict(md, list_first_entry(&md->obw_idle,
+					struct rio_mport_mapping, node));
 		err = rio_mport_create_outbound_mapping(md, filp, rioid, raddr,
-						size, paddr);
+							size, wc, paddr);
+	}
+out:
 	mutex_unlock(&md->buf_mutex);
 	return err;
 }
@@ -452,7 +638,9 @@ static int rio_mport_obw_map(struct file *filp, void __user *arg)
 		   map.rioid, map.rio_addr, map.length);
 
 	ret = rio_mport_get_outbound_mapping(data, filp, map.rioid,
-					     map.rio_addr, map.length, &paddr);
+					     map.rio_addr, map.length,
+					     !!(map.flags & RIO_MAP_WC),
+					     &paddr);
 	if (ret < 0) {
 		rmcd_error("Failed to set OBW err= %d", ret);
 		return ret;
@@ -544,8 +732,151 @@ static int maint_comptag_set(struct mport_cdev_priv *priv, void __user *arg)
 	return 0;
 }
 
+/*
+ * rio_mport_set_alloc_policy - sets allocation policy for buffers allocated
+ * by the driver for inbound windows and DMA (RIO_MAP_ANY_ADDR requests)
+ */
+static int rio_mport_set_alloc_policy(struct mport_cdev_priv *priv,
+				      void __user *arg)
+{
+	struct rio_alloc_policy policy;
+
+	if (copy_from_user(&policy, arg, sizeof(policy)))
+		return -EFAULT;
+
+	if (policy.flags & ~RIO_ALLOC_NODE_LOCAL)
+		return -EINVAL;
+	if (policy.node != NUMA_NO_NODE &&
+	    (policy.node < 0 || policy.node >= nr_node_ids ||
+	     !node_online(policy.node)))
+		return -EINVAL;
+
+	priv->alloc_flags = policy.flags;
+	priv->alloc_node = policy.node;
+
+	rmcd_debug(MMAP, "flags=0x%x node=%d", policy.flags, policy.node);
+	return 0;
+}
+
+/*
+ * mport_dma_nosync - checks if streaming mapping of pages needs no syncs
+ *
+ * Node-local buffers are mapped for streaming DMA once, then accessed by user
+ * space and by the remote side at any time. That is only valid if DMA of the
+ * device is cache coherent and the mapping is not bounced.
+ */
+static bool mport_dma_nosync(struct device *dev, struct page *page,
+			     u64 size)
+{
+#if defined(CONFIG_ARM) || defined(CONFIG_ARM64)
+	if (!is_device_dma_coherent(dev))
+		return false;
+#elif defined(CONFIG_NOT_COHERENT_CACHE)
+	return false;
+#endif
+	/* Memory out of reach of a directly mapped device is bounced */
+	return !dev->dma_mask ||
+	       page_to_phys(page) + size - 1 <= *dev->dma_mask;
+}
+
+/*
+ * mport_alloc_buf - allocates memory for inbound or DMA mapping
+ * @priv: file private data holding the allocation policy
+ * @map: mapping to allocate memory for (map->size is set)
+ *
+ * By default memory is obtained from dma_alloc_coherent(). In node-local
+ * mode it is a physically contiguous, naturally aligned block of pages
+ * taken from the requested NUMA node (defaults to the node of the mport
+ * device) and mapped for streaming DMA. Such a buffer is mapped cacheable
+ * into user space and, being aligned to its size, lets an IOMMU use large
+ * pages for it. Node-local mode is available only where the mapping needs
+ * no syncs (see mport_dma_nosync()).
+ *
+ * Buffers beyond the page allocator limit (order MAX_ORDER - 1) are taken
+ * from dma_alloc_coherent(), which uses the contiguous memory area (CMA)
+ * where configured: dma_alloc_from_contiguous() and the hugetlb pool
+ * allocators are not exported to modules. Neither kind of buffer is backed
+ * by huge pages in user space: mport_cdev_mmap() maps it with base page
+ * PTEs, because huge PMDs can be inserted only from a huge_fault handler,
+ * which the core invokes for DAX and THP enabled mappings only. Contiguous
+ * buffers larger than CMA can provide have to come from the reserved memory
+ * region given by the rio_res_mem and rio_res_size parameters.
+ */
+static int mport_alloc_buf(struct mport_cdev_priv *priv,
+			   struct rio_mport_mapping *map)
+{
+	struct device *dev = priv->md->mport->dev.parent;
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN;
+	int order, node;
+
+	order = get_order(map->size);
+	if (!(priv->alloc_flags & RIO_ALLOC_NODE_LOCAL) ||
+	    order >= MAX_ORDER) {
+		if (priv->alloc_flags & RIO_ALLOC_NODE_LOCAL)
+			rmcd_debug(MMAP, "0x%llx too large for node-local buffer",
+				   map->size);
+		map->virt_addr = dma_alloc_coherent(dev, map->size,
+						    &map->dma_addr, GFP_KERNEL);
+		return map->virt_addr ? 0 : -ENOMEM;
+	}
+
+	node = priv->alloc_node;
+	if (node == NUMA_NO_NODE)
+		node = dev_to_node(dev);
+	if (node != NUMA_NO_NODE)
+		gfp |= __GFP_THISNODE;
+
+	map->page = alloc_pages_node(node, gfp, order);
+	if (!map->page)
+		return -ENOMEM;
+
+	if (!mport_dma_nosync(dev, map->page, map->size)) {
+		rmcd_debug(MMAP, "node-local buffer needs DMA syncs");
+		__free_pages(map->page, order);
+		map->page = NULL;
+		return -EOPNOTSUPP;
+	}
+
+	map->dma_addr = dma_map_page(dev, map->page, 0, map->size,
+				     DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, map->dma_addr)) {
+		rmcd_warn("failed to map page");
+		__free_pages(map->page, order);
+		map->page = NULL;
+		return -EIO;
+	}
+
+	map->virt_addr = NULL;
+	map->phys_addr = page_to_phys(map->page);
+
+	rmcd_debug(MMAP, "node %d buffer 0x%llx @ %pad", node, map->size,
+		   &map->dma_addr);
+	return 0;
+}
+
+/*
+ * mport_free_buf - releases memory of inbound or DMA mapping
+ * @dev: device the memory has been mapped for
+ * @map: mapping to release memory of
+ */
+static void mport_free_buf(struct device *dev, struct rio_mport_mapping *map)
+{
+	if (map->virt_addr) {
+		dma_free_coherent(dev, map->size, map->virt_addr,
+				  map->dma_addr);
+		return;
+	}
+
+	/* Node-local or reserved memory buffer */
+	dma_unmap_page(dev, map->dma_addr, map->size, DMA_BIDIRECTIONAL);
+	if (map->page)
+		__free_pages(map->page, get_order(map->size));
+}
+
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
 
+#define MPORT_DMA_MAX_VEC	1024	/* max transfers per transaction */
+
 struct mport_dma_req {
 	struct kref refcount;
 	struct list_head node;
@@ -556,6 +887,12 @@ struct mport_dma_req {
 	struct page **page_list;
 	unsigned int nr_pages;
 	struct rio_mport_mapping *map;
+	/* vectored transaction elements and kernel buffers they use */
+	struct rio_dma_seg *segs;
+	unsigned int nsegs;
+	struct rio_mport_mapping **maps;
+	struct mport_reg_buf *rbuf;	/* registered buffer used by request */
+	bool striped;		/* holds additional DMA channels of file */
 	struct dma_chan *dmach;
 	enum dma_data_direction dir;
 	dma_cookie_t cookie;
@@ -582,6 +919,156 @@ static void mport_release_dma(struct kref *dma_ref)
 	complete(&priv->comp);
 }
 
+/*
+ * mport_reg_buf - user space buffer registered for DMA
+ * @ref: buffer refcount, held by registration and by requests using it
+ * @node: node in file's list of registered buffers
+ * @priv: file object the buffer is registered with
+ * @handle: handle returned to user space
+ * @length: buffer length
+ * @pages: pinned pages
+ * @nr_pages: number of pinned pages
+ * @sgt: SG table of the buffer mapped for DMA
+ * @nents: number of mapped SG entries
+ * @dev: device used for DMA mapping
+ * @mm: address space the buffer belongs to
+ * @free_work: deferred release, last reference may be dropped in atomic context
+ */
+struct mport_reg_buf {
+	struct kref		ref;
+	struct list_head	node;
+	struct mport_cdev_priv	*priv;
+	u64			handle;
+	u64			length;
+	struct page		**pages;
+	unsigned long		nr_pages;
+	struct sg_table		sgt;
+	int			nents;
+	struct device		*dev;
+	struct mm_struct	*mm;
+	struct work_struct	free_work;
+};
+
+/*
+ * Pages of registered buffers are accounted in pinned_vm of the owner mm and
+ * limited by RLIMIT_MEMLOCK of the registering process. Since 5.1 pinned_vm
+ * is an atomic counter updated without mmap_sem.
+ */
+static int mport_acct_pinned(struct mm_struct *mm, unsigned long nr_pages)
+{
+	unsigned long lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	int ret = 0;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0))
+	if (atomic64_add_return(nr_pages, &mm->pinned_vm) > lock_limit &&
+	    !capable(CAP_IPC_LOCK)) {
+		atomic64_sub(nr_pages, &mm->pinned_vm);
+		ret = -ENOMEM;
+	}
+#else
+	down_write(&mm->mmap_sem);
+	if (mm->pinned_vm + nr_pages > lock_limit && !capable(CAP_IPC_LOCK))
+		ret = -ENOMEM;
+	else
+		mm->pinned_vm += nr_pages;
+	up_write(&mm->mmap_sem);
+#endif
+
+	return ret;
+}
+
+static void mport_unacct_pinned(struct mm_struct *mm, unsigned long nr_pages)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0))
+	atomic64_sub(nr_pages, &mm->pinned_vm);
+#else
+	down_write(&mm->mmap_sem);
+	mm->pinned_vm -= nr_pages;
+	up_write(&mm->mmap_sem);
+#endif
+}
+
+/*
+ * mport_reg_buf_sync() - syncs part of registered buffer used by request
+ * @req: DMA request, its SG entries point into registered buffer mapping
+ * @for_cpu: sync for CPU access after transfer (for device before it)
+ */
+static void mport_reg_buf_sync(struct mport_dma_req *req, bool for_cpu)
+{
+	struct scatterlist *sg;
+	int i;
+
+	for_each_sg(req->sgt.sgl, sg, req->sgt.nents, i) {
+		if (for_cpu)
+			dma_sync_single_for_cpu(req->rbuf->dev,
+						sg_dma_address(sg),
+						sg_dma_len(sg),
+						DMA_BIDIRECTIONAL);
+		else
+			dma_sync_single_for_device(req->rbuf->dev,
+						   sg_dma_address(sg),
+						   sg_dma_len(sg),
+						   DMA_BIDIRECTIONAL);
+	}
+}
+
+static void mport_reg_buf_free_work(struct work_struct *work)
+{
+	struct mport_reg_buf *rb = container_of(work, struct mport_reg_buf,
+						free_work);
+	struct mport_cdev_priv *priv = rb->priv;
+	unsigned long i;
+
+	if (rb->nents)
+		dma_unmap_sg(rb->dev, rb->sgt.sgl, rb->sgt.orig_nents,
+			     DMA_BIDIRECTIONAL);
+	sg_free_table(&rb->sgt);
+
+	for (i = 0; i < rb->nr_pages; i++) {
+		set_page_dirty_lock(rb->pages[i]);
+		put_page(rb->pages[i]);
+	}
+	vfree(rb->pages);
+
+	mport_unacct_pinned(rb->mm, rb->nr_pages);
+	mmdrop(rb->mm);
+	kfree(rb);
+	kref_put(&priv->dma_ref, mport_release_dma);
+}
+
+static void mport_reg_buf_release(struct kref *ref)
+{
+	struct mport_reg_buf *rb = container_of(ref, struct mport_reg_buf, ref);
+
+	schedule_work(&rb->free_work);
+}
+
+static void release_stripe_channels(struct mport_cdev_priv *priv)
+{
+	if (priv->stripe_num > 1)
+		rio_release_dma_stripe(&priv->stripe_ch[1],
+				       priv->stripe_num - 1);
+	priv->stripe_num = 0;
+}
+
+static void stripe_release_work(struct work_struct *work)
+{
+	struct mport_cdev_priv *priv = container_of(work,
+				struct mport_cdev_priv, stripe_work);
+
+	mutex_lock(&priv->dma_lock);
+	if (!atomic_read(&priv->stripe_users))
+		release_stripe_channels(priv);
+	mutex_unlock(&priv->dma_lock);
+}
+
+/* Can be called from DMA completion callback */
+static void put_stripe_channels(struct mport_cdev_priv *priv)
+{
+	if (atomic_dec_and_test(&priv->stripe_users))
+		schedule_work(&priv->stripe_work);
+}
+
 static void dma_req_free(struct kref *ref)
 {
 	struct mport_dma_req *req = container_of(ref, struct mport_dma_req,
@@ -589,8 +1076,12 @@ static void dma_req_free(struct kref *ref)
 	struct mport_cdev_priv *priv = req->priv;
 	unsigned int i;
 
-	dma_unmap_sg(req->dmach->device->dev,
-		     req->sgt.sgl, req->sgt.nents, req->dir);
+	if (req->rbuf) {
+		mport_reg_buf_sync(req, true);
+		kref_put(&req->rbuf->ref, mport_reg_buf_release);
+	} else
+		dma_unmap_sg(req->dmach->device->dev,
+			     req->sgt.sgl, req->sgt.nents, req->dir);
 	sg_free_table(&req->sgt);
 	if (req->page_list) {
 		for (i = 0; i < req->nr_pages; i++)
@@ -604,6 +1095,19 @@ static void dma_req_free(struct kref *ref)
 		mutex_unlock(&req->map->md->buf_mutex);
 	}
 
+	if (req->maps) {
+		mutex_lock(&priv->md->buf_mutex);
+		for (i = 0; i < req->nsegs; i++)
+			if (req->maps[i])
+				kref_put(&req->maps[i]->ref,
+					 mport_release_mapping);
+		mutex_unlock(&priv->md->buf_mutex);
+		kfree(req->maps);
+	}
+	kfree(req->segs);
+
+	if (req->striped)
+		put_stripe_channels(priv);
 	kref_put(&priv->dma_ref, mport_release_dma);
 
 	kfree(req);
@@ -620,47 +1124,76 @@ static void dma_xfer_callback(void *param)
 	kref_put(&req->refcount, dma_req_free);
 }
 
+static void dma_stripe_callback(void *param, enum dma_status status)
+{
+	struct mport_dma_req *req = (struct mport_dma_req *)param;
+
+	req->status = status;
+	complete(&req->req_comp);
+	kref_put(&req->refcount, dma_req_free);
+}
+
 /*
- * prep_dma_xfer() - Configure and send request to DMAengine to prepare DMA
- *                   transfer object.
- * Returns pointer to DMA transaction descriptor allocated by DMA driver on
- * success or ERR_PTR (and/or NULL) if failed. Caller must check returned
- * non-NULL pointer using IS_ERR macro.
+ * fill_dma_data() - Converts transfer descriptor into RIO DMA data descriptor
  */
-static struct dma_async_tx_descriptor
-*prep_dma_xfer(struct dma_chan *chan, struct rio_transfer_io *transfer,
-	struct sg_table *sgt, int nents, enum dma_transfer_direction dir,
-	enum dma_ctrl_flags flags)
+static int fill_dma_data(struct rio_dma_data *tx_data,
+	struct rio_transfer_io *transfer, struct sg_table *sgt, int nents,
+	enum dma_transfer_direction dir)
 {
-	struct rio_dma_data tx_data;
-
-	tx_data.sg = sgt->sgl;
-	tx_data.sg_len = nents;
-	tx_data.rio_addr_u = 0;
-	tx_data.rio_addr = transfer->rio_addr;
-	tx_data.ssdist = transfer->ssdist;
-	tx_data.sssize = transfer->sssize;
-	tx_data.dsdist = transfer->dsdist;
-	tx_data.dssize = transfer->dssize;
+	tx_data->sg = sgt->sgl;
+	tx_data->sg_len = nents;
+	tx_data->rio_addr_u = 0;
+	tx_data->rio_addr = transfer->rio_addr;
+	tx_data->ssdist = transfer->ssdist;
+	tx_data->sssize = transfer->sssize;
+	tx_data->dsdist = transfer->dsdist;
+	tx_data->dssize = transfer->dssize;
 	if (dir == DMA_MEM_TO_DEV) {
 		switch (transfer->method) {
 		case RIO_EXCHANGE_NWRITE:
-			tx_data.wr_type = RDW_ALL_NWRITE;
+			tx_data->wr_type = RDW_ALL_NWRITE;
 			break;
 		case RIO_EXCHANGE_NWRITE_R_ALL:
-			tx_data.wr_type = RDW_ALL_NWRITE_R;
+			tx_data->wr_type = RDW_ALL_NWRITE_R;
 			break;
 		case RIO_EXCHANGE_NWRITE_R:
-			tx_data.wr_type = RDW_LAST_NWRITE_R;
+			tx_data->wr_type = RDW_LAST_NWRITE_R;
 			break;
 		case RIO_EXCHANGE_DEFAULT:
-			tx_data.wr_type = RDW_DEFAULT;
+			tx_data->wr_type = RDW_DEFAULT;
 			break;
 		default:
-			return ERR_PTR(-EINVAL);
+			return -EINVAL;
 		}
 	}
 
+	return 0;
+}
+
+/*
+ * prep_dma_xfer() - Configure and send request to DMAengine to prepare DMA
+ *                   transfer object.
+ * Returns pointer to DMA transaction descriptor allocated by DMA driver on
+ * success or ERR_PTR (and/or NULL) if failed. Caller must check returned
+ * non-NULL pointer using IS_ERR macro.
+ */
+static struct dma_async_tx_descriptor
+*prep_dma_xfer(struct dma_chan *chan, struct rio_transfer_io *transfer,
+	struct sg_table *sgt, int nents, struct rio_dma_seg *segs,
+	unsigned int nsegs, enum dma_transfer_direction dir,
+	enum dma_ctrl_flags flags)
+{
+	struct rio_dma_data tx_data;
+	int ret;
+
+	ret = fill_dma_data(&tx_data, transfer, sgt, nents, dir);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (nsegs)
+		return rio_dma_prep_xfer_vec(chan, &tx_data, segs, nsegs,
+					     dir, flags);
+
 	return rio_dma_prep_xfer(chan, transfer->rioid, &tx_data, dir, flags);
 }
 
@@ -706,6 +1239,157 @@ static void put_dma_channel(struct mport_cdev_priv *priv)
 	kref_put(&priv->dma_ref, mport_release_dma);
 }
 
+/*
+ * get_stripe_channels() - Requests additional DMA channels for striping
+ * @priv: file object with DMA channel already assigned
+ *
+ * Additional channels are held while striped transfers of the file are in
+ * flight and are released when the last of them completes, so that idle
+ * files do not keep channels other users could get. Returns number of
+ * channels available for a striped transfer. If it is more than one, the
+ * transfer must drop its hold with put_stripe_channels().
+ */
+static unsigned int get_stripe_channels(struct mport_cdev_priv *priv)
+{
+	unsigned int num;
+
+	mutex_lock(&priv->dma_lock);
+	if (!priv->stripe_num) {
+		num = rio_request_mport_dma_stripe(priv->md->mport,
+						   &priv->stripe_ch[1],
+						   RIO_DMA_MAX_STRIPE - 1);
+		if (num) {
+			priv->stripe_ch[0] = priv->dmach;
+			priv->stripe_num = 1 + num;
+			rmcd_debug(DMA, "using %u DMA channels for striping",
+				   priv->stripe_num);
+		}
+	}
+	num = priv->stripe_num ? priv->stripe_num : 1;
+	if (num > 1)
+		atomic_inc(&priv->stripe_users);
+	mutex_unlock(&priv->dma_lock);
+
+	return num;
+}
+
+/*
+ * mport_pin_user_pages() - pins pages of user space buffer for DMA
+ * @start: page aligned start address
+ * @nr_pages: number of pages to pin
+ * @pages: array to store pinned pages
+ * @write: true if the pages will be written by DMA
+ *
+ * Returns number of pinned pages or negative error code.
+ */
+static long mport_pin_user_pages(unsigned long start, unsigned long nr_pages,
+				 struct page **pages, bool write)
+{
+	long pinned;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0))
+	down_read(&current->mm->mmap_sem);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0))
+	pinned = get_user_pages(current, current->mm,
+#else
+	pinned = get_user_pages(
+#endif
+				start, nr_pages, write, 0, pages, NULL);
+	up_read(&current->mm->mmap_sem);
+#else /* KERNEL_VERSION >= 4.9 */
+	pinned = get_user_pages_unlocked(start, nr_pages, pages,
+					 write ? FOLL_WRITE : 0);
+#endif
+	return pinned;
+}
+
+/*
+ * mport_reg_buf_sg() - builds request SG table from registered buffer
+ * @priv: file object the buffer is registered with
+ * @req: DMA request
+ * @xfer: transfer descriptor referring to the buffer by handle and offset
+ *
+ * SG entries are set up with DMA addresses of the registered mapping,
+ * no pinning or mapping is performed per transfer.
+ */
+static int mport_reg_buf_sg(struct mport_cdev_priv *priv,
+			    struct mport_dma_req *req,
+			    struct rio_transfer_io *xfer)
+{
+	struct mport_reg_buf *rb;
+	int ret = -EINVAL;
+
+	mutex_lock(&priv->reg_lock);
+	list_for_each_entry(rb, &priv->reg_bufs, node) {
+		if (rb->handle == xfer->handle) {
+			ret = 0;
+			break;
+		}
+	}
+
+	if (!ret && rb->mm != current->mm)
+		ret = -EPERM;
+	if (!ret && (xfer->offset >= rb->length ||
+		     xfer->length > rb->length - xfer->offset))
+		ret = -EINVAL;
+	if (!ret) {
+		kref_get(&rb->ref);
+		req->rbuf = rb;
+	}
+	mutex_unlock(&priv->reg_lock);
+
+	if (ret)
+		return ret;
+
+	ret = rio_dma_sg_slice(&req->sgt, rb->sgt.sgl, rb->nents,
+			       xfer->offset, xfer->length);
+	if (ret)
+		return ret;
+
+	/* Only the range used by transfer is synced */
+	mport_reg_buf_sync(req, false);
+	return 0;
+}
+
+/*
+ * mport_dma_poll() - polls for completion of DMA request
+ * @req: DMA request
+ * @tmo: timeout in jiffies
+ *
+ * Spins on the transfer status for up to dma_poll_budget usec, then sleeps
+ * between status checks. Completion interrupt is not raised for polled
+ * requests, status checks are what retires the transfer.
+ */
+static int mport_dma_poll(struct mport_dma_req *req, unsigned long tmo)
+{
+	struct dma_chan *chan = req->priv->dmach;
+	unsigned long end = jiffies + tmo;
+	ktime_t start = ktime_get();
+	enum dma_status status;
+
+	do {
+		status = dma_async_is_tx_complete(chan, req->cookie,
+						  NULL, NULL);
+		if (status != DMA_IN_PROGRESS)
+			goto done;
+		cpu_relax();
+	} while (ktime_us_delta(ktime_get(), start) < dma_poll_budget &&
+		 !need_resched());
+
+	while (status == DMA_IN_PROGRESS) {
+		if (time_after(jiffies, end))
+			return -ETIMEDOUT;
+		if (signal_pending(current))
+			return -EINTR;
+		usleep_range(10, 50);
+		status = dma_async_is_tx_complete(chan, req->cookie,
+						  NULL, NULL);
+	}
+done:
+	req->status = status;
+	return 0;
+}
+
 /*
  * DMA transfer functions
  */
@@ -734,8 +1418,45 @@ static int do_dma_request(struct mport_dma_req *req,
 		   dev_name(&chan->dev->device),
 		   (dir == DMA_DEV_TO_MEM)?"READ":"WRITE");
 
-	/* Initialize DMA transaction request */
-	tx = prep_dma_xfer(chan, xfer, sgt, nents, dir,
+	/*
+	 * Large transfer is split between all DMA channels of mport,
+	 * completion is reported when all parts are done.
+	 */
+	if (sync != RIO_TRANSFER_POLL && !req->nsegs && dma_stripe_min &&
+	    (priv->md->properties.flags & RIO_MPORT_DMA_VEC) &&
+	    xfer->length >= dma_stripe_min &&
+	    !(xfer->ssdist || xfer->sssize || xfer->dsdist || xfer->dssize) &&
+	    get_stripe_channels(priv) > 1) {
+		struct rio_dma_data tx_data;
+
+		req->striped = true;
+		ret = fill_dma_data(&tx_data, xfer, sgt, nents, dir);
+		if (ret)
+			goto err_out;
+
+		req->status = DMA_IN_PROGRESS;
+		kref_get(&req->refcount);
+
+		ret = rio_dma_xfer_stripe(priv->stripe_ch, priv->stripe_num,
+					  xfer->rioid, &tx_data, dir,
+					  dma_stripe_callback, req, &cookie);
+		if (ret) {
+			rmcd_error("striped submit err=%d (addr:0x%llx len:0x%llx)",
+				   ret, xfer->rio_addr, xfer->length);
+			kref_put(&req->refcount, dma_req_free);
+			goto err_out;
+		}
+
+		req->cookie = cookie;
+		goto wait;
+	}
+
+	/*
+	 * Initialize DMA transaction request. Polled request does not need
+	 * completion interrupt and callback.
+	 */
+	tx = prep_dma_xfer(chan, xfer, sgt, nents, req->segs, req->nsegs, dir,
+			   (sync == RIO_TRANSFER_POLL) ? DMA_CTRL_ACK :
 			   DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
 
 	if (!tx) {
@@ -752,8 +1473,13 @@ static int do_dma_request(struct mport_dma_req *req,
 		goto err_out;
 	}
 
-	tx->callback = dma_xfer_callback;
-	tx->callback_param = req;
+	if (sync == RIO_TRANSFER_POLL) {
+		tx->callback = NULL;
+		tx->callback_param = NULL;
+	} else {
+		tx->callback = dma_xfer_callback;
+		tx->callback_param = req;
+	}
 
 	req->status = DMA_IN_PROGRESS;
 	kref_get(&req->refcount);
@@ -774,6 +1500,7 @@ static int do_dma_request(struct mport_dma_req *req,
 
 	dma_async_issue_pending(chan);
 
+wait:
 	if (sync == RIO_TRANSFER_ASYNC) {
 		spin_lock(&priv->req_lock);
 		list_add_tail(&req->node, &priv->async_list);
@@ -782,6 +1509,27 @@ static int do_dma_request(struct mport_dma_req *req,
 	} else if (sync == RIO_TRANSFER_FAF)
 		return 0;
 
+	if (sync == RIO_TRANSFER_POLL) {
+		ret = mport_dma_poll(req, tmo);
+		if (ret) {
+			rmcd_error("%s(%d) polling for DMA_%s %d failed err=%d",
+				current->comm, task_pid_nr(current),
+				(dir == DMA_DEV_TO_MEM)?"READ":"WRITE",
+				cookie, ret);
+			/*
+			 * DMA may be in progress: keep the request until
+			 * the file is released.
+			 */
+			spin_lock(&priv->req_lock);
+			list_add_tail(&req->node, &priv->async_list);
+			spin_unlock(&priv->req_lock);
+			return ret;
+		}
+		/* Drop reference otherwise released by completion callback */
+		kref_put(&req->refcount, dma_req_free);
+		goto check_status;
+	}
+
 	wret = wait_for_completion_interruptible_timeout(&req->req_comp, tmo);
 
 	if (wret == 0) {
@@ -800,6 +1548,7 @@ static int do_dma_request(struct mport_dma_req *req,
 		return -EINTR;
 	}
 
+check_status:
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
 	if (req->status != DMA_COMPLETE) {
 #else
@@ -872,7 +1621,11 @@ rio_dma_transfer(struct file *filp, u32 transfer_mode,
 	 * used for DMA data transfers: build single entry SG table using
 	 * offset within the internal buffer specified by handle parameter.
 	 */
-	if (xfer->loc_addr) {
+	if (!xfer->loc_addr && (xfer->handle & RIO_REG_BUF_HANDLE)) {
+		ret = mport_reg_buf_sg(priv, req, xfer);
+		if (ret)
+			goto err_req;
+	} else if (xfer->loc_addr) {
 		unsigned long offset;
 		long pinned;
 
@@ -886,23 +1639,9 @@ rio_dma_transfer(struct file *filp, u32 transfer_mode,
 			goto err_req;
 		}
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0))
-		down_read(&current->mm->mmap_sem);
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0))
-		pinned = get_user_pages(current, current->mm,
-#else
-		pinned = get_user_pages(
-#endif
-				(unsigned long)xfer->loc_addr & PAGE_MASK,
-				nr_pages, dir == DMA_FROM_DEVICE, 0,
-				page_list, NULL);
-		up_read(&current->mm->mmap_sem);
-#else /* KERNEL_VERSION >= 4.9 */
-		pinned = get_user_pages_unlocked(
+		pinned = mport_pin_user_pages(
 				(unsigned long)xfer->loc_addr & PAGE_MASK,
-				nr_pages, page_list,
-				dir == DMA_FROM_DEVICE ? FOLL_WRITE : 0);
-#endif
+				nr_pages, page_list, dir == DMA_FROM_DEVICE);
 		if (pinned != nr_pages) {
 			if (pinned < 0) {
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0))
@@ -971,7 +1710,7 @@ rio_dma_transfer(struct file *filp, u32 transfer_mode,
 		}
 	}
 
-	if (!(map && !map->virt_addr)) {
+	if (!req->rbuf && !(map && !map->virt_addr)) {
 		nents = dma_map_sg(chan->device->dev,
 				   req->sgt.sgl, req->sgt.nents, dir);
 		if (nents == -EFAULT) {
@@ -1001,6 +1740,213 @@ err_req:
 	return ret;
 }
 
+/*
+ * rio_dma_transfer_vec() - Perform vectored RapidIO DMA data transfer
+ * @filp: file pointer associated with the call
+ * @sync: synchronization mode
+ * @dir: DMA transfer direction
+ * @xfer: array of data transfer descriptors
+ * @count: number of descriptors in @xfer
+ *
+ * Builds buffers of all transfers into one SG list and submits it as a
+ * single DMA transaction with one completion. In synchronous mode the
+ * completion status of every transfer is returned in its completion_code.
+ * Returns -EOPNOTSUPP if the transaction cannot be vectored, in this case
+ * transfers have to be submitted one by one.
+ */
+static int
+rio_dma_transfer_vec(struct file *filp, enum rio_transfer_sync sync,
+		     enum dma_data_direction dir, struct rio_transfer_io *xfer,
+		     u32 count)
+{
+	struct mport_cdev_priv *priv = filp->private_data;
+	struct mport_dev *md = priv->md;
+	struct rio_mport_mapping *map;
+	struct mport_dma_req *req;
+	struct scatterlist *sg;
+	struct dma_chan *chan;
+	unsigned long nr_pages = 0;
+	unsigned long offset, len, npg, j;
+	unsigned int nents = 0;
+	u32 i;
+	long pinned;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		if (xfer[i].length == 0)
+			return -EINVAL;
+		/* Write method and stride settings apply to whole list */
+		if (xfer[i].method != xfer[0].method ||
+		    xfer[i].ssdist != xfer[0].ssdist ||
+		    xfer[i].sssize != xfer[0].sssize ||
+		    xfer[i].dsdist != xfer[0].dsdist ||
+		    xfer[i].dssize != xfer[0].dssize)
+			return -EOPNOTSUPP;
+
+		if (xfer[i].loc_addr) {
+			offset = (unsigned long)(uintptr_t)xfer[i].loc_addr &
+				 ~PAGE_MASK;
+			npg = PAGE_ALIGN(xfer[i].length + offset) >> PAGE_SHIFT;
+			nr_pages += npg;
+			nents += npg;
+		} else if (xfer[i].handle & RIO_REG_BUF_HANDLE)
+			return -EOPNOTSUPP; /* already mapped, not vectored */
+		else
+			nents++;
+	}
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	ret = get_dma_channel(priv);
+	if (ret) {
+		kfree(req);
+		return ret;
+	}
+	chan = priv->dmach;
+
+	kref_init(&req->refcount);
+	init_completion(&req->req_comp);
+	req->dir = dir;
+	req->filp = filp;
+	req->priv = priv;
+	req->dmach = chan;
+	req->sync = sync;
+	req->nsegs = count;
+
+	req->segs = kcalloc(count, sizeof(*req->segs), GFP_KERNEL);
+	req->maps = kcalloc(count, sizeof(*req->maps), GFP_KERNEL);
+	if (nr_pages)
+		req->page_list = kmalloc_array(nr_pages,
+					       sizeof(*req->page_list),
+					       GFP_KERNEL);
+	if (!req->segs || !req->maps || (nr_pages && !req->page_list)) {
+		ret = -ENOMEM;
+		goto err_req;
+	}
+
+	ret = sg_alloc_table(&req->sgt, nents, GFP_KERNEL);
+	if (ret) {
+		rmcd_error("sg_alloc_table failed with err=%d", ret);
+		goto err_req;
+	}
+	req->sgt.nents = 0; /* not mapped yet */
+
+	/*
+	 * Pin user buffers and find kernel buffers, filling SG entries of
+	 * every transfer in order. Pinned pages and referenced mappings are
+	 * recorded in the request as we go and released by dma_req_free().
+	 */
+	sg = req->sgt.sgl;
+	for (i = 0; i < count; i++) {
+		req->segs[i].destid = xfer[i].rioid;
+		req->segs[i].rio_addr = xfer[i].rio_addr;
+		req->segs[i].rio_addr_u = 0;
+
+		if (xfer[i].loc_addr) {
+			struct page **pages = &req->page_list[req->nr_pages];
+
+			offset = (unsigned long)(uintptr_t)xfer[i].loc_addr &
+				 ~PAGE_MASK;
+			npg = PAGE_ALIGN(xfer[i].length + offset) >> PAGE_SHIFT;
+
+			pinned = mport_pin_user_pages(
+				(unsigned long)xfer[i].loc_addr & PAGE_MASK,
+				npg, pages, dir == DMA_FROM_DEVICE);
+			if (pinned > 0)
+				req->nr_pages += pinned;
+			if (pinned != npg) {
+				rmcd_error("pinned %ld out of %ld pages",
+					   pinned, npg);
+				ret = -EFAULT;
+				goto err_req;
+			}
+
+			len = xfer[i].length;
+			for (j = 0; j < npg; j++) {
+				unsigned long plen = min(len,
+							 PAGE_SIZE - offset);
+
+				sg_set_page(sg, pages[j], plen, offset);
+				sg = sg_next(sg);
+				len -= plen;
+				offset = 0;
+			}
+			req->segs[i].sg_len = npg;
+		} else {
+			dma_addr_t baddr = (dma_addr_t)xfer[i].handle;
+
+			mutex_lock(&md->buf_mutex);
+			list_for_each_entry(map, &md->mappings, node) {
+				if (baddr >= map->dma_addr &&
+				    baddr < (map->dma_addr + map->size)) {
+					kref_get(&map->ref);
+					req->maps[i] = map;
+					break;
+				}
+			}
+			mutex_unlock(&md->buf_mutex);
+
+			if (req->maps[i] == NULL) {
+				ret = -ENOMEM;
+				goto err_req;
+			}
+
+			map = req->maps[i];
+			if (xfer[i].length + xfer[i].offset > map->size) {
+				ret = -EINVAL;
+				goto err_req;
+			}
+
+			/* Reserved memory cannot be mapped as part of a list */
+			if (!map->virt_addr) {
+				ret = -EOPNOTSUPP;
+				goto err_req;
+			}
+
+			sg_set_buf(sg, map->virt_addr +
+				   (baddr - map->dma_addr) + xfer[i].offset,
+				   xfer[i].length);
+			sg = sg_next(sg);
+			req->segs[i].sg_len = 1;
+		}
+	}
+
+	ret = dma_map_sg(chan->device->dev, req->sgt.sgl, nents, dir);
+	if (ret == 0) {
+		rmcd_error("Failed to map SG list");
+		ret = -EFAULT;
+		goto err_req;
+	}
+	req->sgt.nents = nents; /* unmapped with the original count */
+
+	/*
+	 * If IOMMU merged SG entries, transfer boundaries are lost and
+	 * the list cannot be split between remote targets.
+	 */
+	if (ret != nents) {
+		ret = -EOPNOTSUPP;
+		goto err_req;
+	}
+
+	ret = do_dma_request(req, &xfer[0], sync, nents);
+
+	if (ret >= 0 && sync == RIO_TRANSFER_ASYNC)
+		return ret; /* return ASYNC cookie */
+
+	if ((sync == RIO_TRANSFER_SYNC || sync == RIO_TRANSFER_POLL) &&
+	    (ret == 0 || ret == -EIO)) {
+		for (i = 0; i < count; i++)
+			xfer[i].completion_code = -req->segs[i].status;
+	} else if (ret < 0)
+		rmcd_debug(DMA, "do_dma_request failed with err=%d", ret);
+
+err_req:
+	kref_put(&req->refcount, dma_req_free);
+	return ret;
+}
+
 static int rio_mport_transfer_ioctl(struct file *filp, void __user *arg)
 {
 	struct mport_cdev_priv *priv = filp->private_data;
@@ -1012,7 +1958,7 @@ static int rio_mport_transfer_ioctl(struct file *filp, void __user *arg)
 	if (unlikely(copy_from_user(&transaction, arg, sizeof(transaction))))
 		return -EFAULT;
 
-	if (transaction.count != 1) /* only single transfer for now */
+	if (transaction.count == 0 || transaction.count > MPORT_DMA_MAX_VEC)
 		return -EINVAL;
 
 	if ((transaction.transfer_mode &
@@ -1032,9 +1978,26 @@ static int rio_mport_transfer_ioctl(struct file *filp, void __user *arg)
 
 	dir = (transaction.dir == RIO_TRANSFER_DIR_READ) ?
 					DMA_FROM_DEVICE : DMA_TO_DEVICE;
-	for (i = 0; i < transaction.count && ret == 0; i++)
-		ret = rio_dma_transfer(filp, transaction.transfer_mode,
-			transaction.sync, dir, &transfer[i]);
+
+	ret = -EOPNOTSUPP;
+	if (transaction.count > 1 &&
+	    (priv->md->properties.flags & RIO_MPORT_DMA_VEC))
+		ret = rio_dma_transfer_vec(filp, transaction.sync, dir,
+					   transfer, transaction.count);
+
+	if (ret == -EOPNOTSUPP) {
+		/* Only one cookie can be returned for asynchronous request */
+		if (transaction.count > 1 &&
+		    transaction.sync == RIO_TRANSFER_ASYNC) {
+			ret = -EINVAL;
+			goto out_free;
+		}
+
+		ret = 0;
+		for (i = 0; i < transaction.count && ret == 0; i++)
+			ret = rio_dma_transfer(filp, transaction.transfer_mode,
+				transaction.sync, dir, &transfer[i]);
+	}
 
 	if (unlikely(copy_to_user((void __user *)(uintptr_t)transaction.block,
 				  transfer,
@@ -1136,18 +2099,19 @@ static int rio_mport_create_dma_mapping(struct mport_dev *md, struct file *filp,
 			struct rio_mport_mapping **mapping)
 {
 	struct rio_mport_mapping *map;
+	int ret;
 
 	map = kzalloc(sizeof(*map), GFP_KERNEL);
 	if (map == NULL)
 		return -ENOMEM;
 
+	map->size = dm->length;
+
 	if (dm->address == RIO_MAP_ANY_ADDR) {
-		map->virt_addr = dma_alloc_coherent(md->mport->dev.parent,
-						    dm->length, &map->dma_addr,
-						    GFP_KERNEL);
-		if (!map->virt_addr) {
+		ret = mport_alloc_buf(filp->private_data, map);
+		if (ret) {
 			kfree(map);
-			return -ENOMEM;
+			return ret;
 		}
 	} else {
 		struct page *page;
@@ -1178,7 +2142,6 @@ static int rio_mport_create_dma_mapping(struct mport_dev *md, struct file *filp,
 	}
 
 	map->dir = MAP_DMA;
-	map->size = dm->length;
 	map->filp = filp;
 	map->md = md;
 	kref_init(&map->ref);
@@ -1226,57 +2189,214 @@ static int rio_mport_alloc_dma(struct file *filp, void __user *arg)
 	if (unlikely(copy_from_user(&map, arg, sizeof(map))))
 		return -EFAULT;
 
-	if (map.address != RIO_MAP_ANY_ADDR) {
-		ret = rio_mport_check_dma_mapping(md, &map);
-		if (ret)
-			return ret;
+	if (map.address != RIO_MAP_ANY_ADDR) {
+		ret = rio_mport_check_dma_mapping(md, &map);
+		if (ret)
+			return ret;
+	}
+
+	ret = rio_mport_create_dma_mapping(md, filp, &map, &mapping);
+	if (ret)
+		return ret;
+
+	map.dma_handle = mapping->dma_addr;
+
+	if (unlikely(copy_to_user(arg, &map, sizeof(map)))) {
+		mutex_lock(&md->buf_mutex);
+		kref_put(&mapping->ref, mport_release_mapping);
+		mutex_unlock(&md->buf_mutex);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static int rio_mport_free_dma(struct file *filp, void __user *arg)
+{
+	struct mport_cdev_priv *priv = filp->private_data;
+	struct mport_dev *md = priv->md;
+	u64 handle;
+	int ret = -EFAULT;
+	struct rio_mport_mapping *map, *_map;
+
+	if (copy_from_user(&handle, arg, sizeof(handle)))
+		return -EFAULT;
+	rmcd_debug(EXIT, "filp=%p", filp);
+
+	mutex_lock(&md->buf_mutex);
+	list_for_each_entry_safe(map, _map, &md->mappings, node) {
+		if (map->dir == MAP_DMA && map->dma_addr == handle &&
+		    map->filp == filp) {
+			kref_put(&map->ref, mport_release_mapping);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&md->buf_mutex);
+
+	if (ret == -EFAULT) {
+		rmcd_debug(DMA, "ERR no matching mapping");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * rio_mport_register_buffer() - pins and maps user buffer for DMA
+ * @filp: file pointer associated with the call
+ * @arg: buffer description, returns buffer handle
+ */
+static int rio_mport_register_buffer(struct file *filp, void __user *arg)
+{
+	struct mport_cdev_priv *priv = filp->private_data;
+	struct rio_reg_buf rbuf;
+	struct mport_reg_buf *rb;
+	unsigned long offset, nr_pages;
+	long pinned;
+	int ret;
+
+	if (copy_from_user(&rbuf, arg, sizeof(rbuf)))
+		return -EFAULT;
+	if (!rbuf.address || !rbuf.length ||
+	    rbuf.address + rbuf.length < rbuf.address)
+		return -EINVAL;
+
+	offset = (unsigned long)rbuf.address & ~PAGE_MASK;
+	nr_pages = PAGE_ALIGN(rbuf.length + offset) >> PAGE_SHIFT;
+
+	ret = mport_acct_pinned(current->mm, nr_pages);
+	if (ret)
+		return ret;
+
+	ret = get_dma_channel(priv);
+	if (ret)
+		goto err_acct;
+
+	rb = kzalloc(sizeof(*rb), GFP_KERNEL);
+	if (!rb) {
+		ret = -ENOMEM;
+		goto err_dma;
+	}
+
+	rb->pages = vmalloc(nr_pages * sizeof(*rb->pages));
+	if (!rb->pages) {
+		ret = -ENOMEM;
+		goto err_rb;
+	}
+
+	pinned = mport_pin_user_pages((unsigned long)rbuf.address & PAGE_MASK,
+				      nr_pages, rb->pages, true);
+	if (pinned != nr_pages) {
+		rmcd_error("pinned %ld out of %ld pages", pinned, nr_pages);
+		ret = -EFAULT;
+		goto err_pg;
 	}
 
-	ret = rio_mport_create_dma_mapping(md, filp, &map, &mapping);
-	if (ret)
-		return ret;
+	ret = sg_alloc_table_from_pages(&rb->sgt, rb->pages, nr_pages,
+					offset, rbuf.length, GFP_KERNEL);
+	if (ret) {
+		rmcd_error("sg_alloc_table failed with err=%d", ret);
+		goto err_pg;
+	}
 
-	map.dma_handle = mapping->dma_addr;
+	rb->dev = priv->dmach->device->dev;
+	rb->nents = dma_map_sg(rb->dev, rb->sgt.sgl, rb->sgt.orig_nents,
+			       DMA_BIDIRECTIONAL);
+	if (rb->nents == 0) {
+		rmcd_error("Failed to map SG list");
+		ret = -EFAULT;
+		sg_free_table(&rb->sgt);
+		goto err_pg;
+	}
 
-	if (unlikely(copy_to_user(arg, &map, sizeof(map)))) {
-		mutex_lock(&md->buf_mutex);
-		kref_put(&mapping->ref, mport_release_mapping);
-		mutex_unlock(&md->buf_mutex);
+	kref_init(&rb->ref);
+	INIT_WORK(&rb->free_work, mport_reg_buf_free_work);
+	rb->priv = priv;
+	rb->length = rbuf.length;
+	rb->nr_pages = nr_pages;
+	rb->mm = current->mm;
+	atomic_inc(&rb->mm->mm_count);
+
+	mutex_lock(&priv->reg_lock);
+	rb->handle = RIO_REG_BUF_HANDLE | priv->reg_next++;
+	list_add_tail(&rb->node, &priv->reg_bufs);
+	mutex_unlock(&priv->reg_lock);
+
+	rmcd_debug(DMA, "registered %lu pages as 0x%llx", nr_pages,
+		   (unsigned long long)rb->handle);
+
+	rbuf.handle = rb->handle;
+	if (copy_to_user(arg, &rbuf, sizeof(rbuf))) {
+		mutex_lock(&priv->reg_lock);
+		list_del(&rb->node);
+		mutex_unlock(&priv->reg_lock);
+		kref_put(&rb->ref, mport_reg_buf_release);
 		return -EFAULT;
 	}
 
 	return 0;
+
+err_pg:
+	if (pinned > 0)
+		while (pinned--)
+			put_page(rb->pages[pinned]);
+	vfree(rb->pages);
+err_rb:
+	kfree(rb);
+err_dma:
+	put_dma_channel(priv);
+err_acct:
+	mport_unacct_pinned(current->mm, nr_pages);
+	return ret;
 }
 
-static int rio_mport_free_dma(struct file *filp, void __user *arg)
+/*
+ * rio_mport_unregister_buffer() - releases registered user buffer
+ * @filp: file pointer associated with the call
+ * @arg: buffer handle
+ *
+ * The buffer is unpinned when all transfers that use it are complete.
+ */
+static int rio_mport_unregister_buffer(struct file *filp, void __user *arg)
 {
 	struct mport_cdev_priv *priv = filp->private_data;
-	struct mport_dev *md = priv->md;
+	struct mport_reg_buf *rb;
 	u64 handle;
-	int ret = -EFAULT;
-	struct rio_mport_mapping *map, *_map;
+	int ret = -EINVAL;
 
 	if (copy_from_user(&handle, arg, sizeof(handle)))
 		return -EFAULT;
-	rmcd_debug(EXIT, "filp=%p", filp);
 
-	mutex_lock(&md->buf_mutex);
-	list_for_each_entry_safe(map, _map, &md->mappings, node) {
-		if (map->dir == MAP_DMA && map->dma_addr == handle &&
-		    map->filp == filp) {
-			kref_put(&map->ref, mport_release_mapping);
+	mutex_lock(&priv->reg_lock);
+	list_for_each_entry(rb, &priv->reg_bufs, node) {
+		if (rb->handle == handle) {
+			list_del(&rb->node);
 			ret = 0;
 			break;
 		}
 	}
-	mutex_unlock(&md->buf_mutex);
+	mutex_unlock(&priv->reg_lock);
 
-	if (ret == -EFAULT) {
-		rmcd_debug(DMA, "ERR no matching mapping");
-		return ret;
-	}
+	if (!ret)
+		kref_put(&rb->ref, mport_reg_buf_release);
 
-	return 0;
+	return ret;
+}
+
+static void mport_unregister_all(struct mport_cdev_priv *priv)
+{
+	struct mport_reg_buf *rb, *_rb;
+	LIST_HEAD(list);
+
+	mutex_lock(&priv->reg_lock);
+	list_splice_init(&priv->reg_bufs, &list);
+	mutex_unlock(&priv->reg_lock);
+
+	list_for_each_entry_safe(rb, _rb, &list, node) {
+		list_del(&rb->node);
+		kref_put(&rb->ref, mport_reg_buf_release);
+	}
 }
 #else
 static int rio_mport_transfer_ioctl(struct file *filp, void *arg)
@@ -1284,6 +2404,16 @@ static int rio_mport_transfer_ioctl(struct file *filp, void *arg)
 	return -ENODEV;
 }
 
+static int rio_mport_register_buffer(struct file *filp, void __user *arg)
+{
+	return -ENODEV;
+}
+
+static int rio_mport_unregister_buffer(struct file *filp, void __user *arg)
+{
+	return -ENODEV;
+}
+
 static int rio_mport_wait_for_async_dma(struct file *filp, void __user *arg)
 {
 	return -ENODEV;
@@ -1325,14 +2455,12 @@ rio_mport_create_inbound_mapping(struct mport_dev *md, struct file *filp,
 	if (map == NULL)
 		return -ENOMEM;
 
+	map->size = size;
+
 	if (ib->address == RIO_MAP_ANY_ADDR) {
-		/* Allocate DMA coherent buffer */
-		map->virt_addr = dma_alloc_coherent(mport->dev.parent, size,
-						&map->dma_addr, GFP_KERNEL);
-		if (map->virt_addr == NULL) {
-			ret = -ENOMEM;
+		ret = mport_alloc_buf(filp->private_data, map);
+		if (ret)
 			goto err_dma_alloc;
-		}
 	} else {
 		struct page *page;
 
@@ -1368,7 +2496,6 @@ rio_mport_create_inbound_mapping(struct mport_dev *md, struct file *filp,
 
 	map->dir = MAP_INBOUND;
 	map->rio_addr = raddr;
-	map->size = size;
 	map->filp = filp;
 	map->md = md;
 	kref_init(&map->ref);
@@ -1379,12 +2506,7 @@ rio_mport_create_inbound_mapping(struct mport_dev *md, struct file *filp,
 	return 0;
 
 err_map_inb:
-	if (map->virt_addr)
-		dma_free_coherent(mport->dev.parent, size,
-				  map->virt_addr, map->dma_addr);
-	else
-		dma_unmap_page(mport->dev.parent, map->dma_addr,
-			       size, DMA_BIDIRECTIONAL);
+	mport_free_buf(mport->dev.parent, map);
 
 err_dma_alloc:
 	kfree(map);
@@ -1523,6 +2645,77 @@ static int maint_port_idx_get(struct mport_cdev_priv *priv, void __user *arg)
 	return 0;
 }
 
+static void mport_ering_release(struct kref *ref)
+{
+	struct mport_event_ring *er =
+			container_of(ref, struct mport_event_ring, ref);
+
+	vfree(er->area);
+	kfree(er);
+}
+
+static void mport_ering_put(struct mport_event_ring *er)
+{
+	kref_put(&er->ref, mport_ering_release);
+}
+
+static enum hrtimer_restart mport_ering_timer(struct hrtimer *timer)
+{
+	struct mport_event_ring *er =
+			container_of(timer, struct mport_event_ring, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&er->lock, flags);
+	er->woken = er->head;
+	spin_unlock_irqrestore(&er->lock, flags);
+
+	wake_up_interruptible(&er->wq);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * mport_ering_add - places event into shared event ring
+ * @er: event ring
+ * @event: event to place
+ *
+ * Wakes up the ring waiter once wake_count events are pending, otherwise
+ * arms the wake up timer for the first pending event.
+ * Returns: true if the event has been queued, false if the ring is full.
+ */
+static bool mport_ering_add(struct mport_event_ring *er,
+			    struct rio_event *event)
+{
+	unsigned long flags;
+	bool queued = false;
+	u32 head, tail;
+
+	spin_lock_irqsave(&er->lock, flags);
+	head = er->head;
+	tail = er->ring->tail;
+	smp_rmb(); /* read consumer index before reusing its slot */
+
+	/* Tail is controlled by user space, treat bogus values as full */
+	if (head - tail >= er->entries) {
+		er->ring->dropped++;
+	} else {
+		er->events[head & (er->entries - 1)] = *event;
+		smp_wmb(); /* publish entry before moving head */
+		er->head = head + 1;
+		er->ring->head = er->head;
+		queued = true;
+	}
+
+	if (er->head - er->woken >= er->wake_count || !queued) {
+		er->woken = er->head;
+		wake_up_interruptible(&er->wq);
+	} else if (ktime_to_ns(er->wake_timeout) && !hrtimer_active(&er->timer)) {
+		hrtimer_start(&er->timer, er->wake_timeout, HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&er->lock, flags);
+
+	return queued;
+}
+
 static int rio_mport_add_event(struct mport_cdev_priv *priv,
 			       struct rio_event *event)
 {
@@ -1532,6 +2725,11 @@ static int rio_mport_add_event(struct mport_cdev_priv *priv,
 		return -EACCES;
 
 	spin_lock(&priv->fifo_lock);
+	if (priv->ering) {
+		overflow = !mport_ering_add(priv->ering, event);
+		spin_unlock(&priv->fifo_lock);
+		return overflow ? -EBUSY : 0;
+	}
 	overflow = kfifo_avail(&priv->event_fifo) < sizeof(*event)
 		|| kfifo_in(&priv->event_fifo, (unsigned char *)event,
 			sizeof(*event)) != sizeof(*event);
@@ -1550,34 +2748,22 @@ static int rio_mport_add_event(struct mport_cdev_priv *priv,
 static void rio_mport_doorbell_handler(struct rio_mport *mport, void *dev_id,
 				       u16 src, u16 dst, u16 info)
 {
-	struct mport_dev *data = dev_id;
-	struct mport_cdev_priv *priv;
-	struct rio_mport_db_filter *db_filter;
+	struct rio_mport_db_filter *db_filter = dev_id;
 	struct rio_event event;
-	int handled;
+
+	if (db_filter->filter.rioid != RIO_INVALID_DESTID &&
+	    db_filter->filter.rioid != src) {
+		dev_warn(&db_filter->priv->md->dev,
+			"%s: spurious DB received from 0x%x, info=0x%04x\n",
+			__func__, src, info);
+		return;
+	}
 
 	event.header = RIO_DOORBELL;
 	event.u.doorbell.rioid = src;
 	event.u.doorbell.payload = info;
-
-	handled = 0;
-	spin_lock(&data->db_lock);
-	list_for_each_entry(db_filter, &data->doorbells, data_node) {
-		if (((db_filter->filter.rioid == RIO_INVALID_DESTID ||
-		      db_filter->filter.rioid == src)) &&
-		      info >= db_filter->filter.low &&
-		      info <= db_filter->filter.high) {
-			priv = db_filter->priv;
-			rio_mport_add_event(priv, &event);
-			handled = 1;
-		}
-	}
-	spin_unlock(&data->db_lock);
-
-	if (!handled)
-		dev_warn(&data->dev,
-			"%s: spurious DB received from 0x%x, info=0x%04x\n",
-			__func__, src, info);
+	event.count = 1;
+	rio_mport_add_event(db_filter->priv, &event);
 }
 
 static int rio_mport_add_db_filter(struct mport_cdev_priv *priv,
@@ -1595,34 +2781,38 @@ static int rio_mport_add_db_filter(struct mport_cdev_priv *priv,
 	if (filter.low > filter.high)
 		return -EINVAL;
 
-	ret = rio_request_inb_dbell(md->mport, md, filter.low, filter.high,
-				    rio_mport_doorbell_handler);
+	db_filter = kzalloc(sizeof(*db_filter), GFP_KERNEL);
+	if (db_filter == NULL)
+		return -ENOMEM;
+
+	db_filter->filter = filter;
+	db_filter->priv = priv;
+
+	ret = rio_request_inb_dbell(md->mport, db_filter, filter.low,
+				    filter.high, rio_mport_doorbell_handler);
 	if (ret) {
 		rmcd_error("%s failed to register IBDB, err=%d",
 			   dev_name(&md->dev), ret);
+		kfree(db_filter);
 		return ret;
 	}
 
-	db_filter = kzalloc(sizeof(*db_filter), GFP_KERNEL);
-	if (db_filter == NULL) {
-		rio_release_inb_dbell(md->mport, filter.low, filter.high);
-		return -ENOMEM;
-	}
-
-	db_filter->filter = filter;
-	db_filter->priv = priv;
 	spin_lock_irqsave(&md->db_lock, flags);
 	list_add_tail(&db_filter->priv_node, &priv->db_filters);
-	list_add_tail(&db_filter->data_node, &md->doorbells);
 	spin_unlock_irqrestore(&md->db_lock, flags);
 
 	return 0;
 }
 
-static void rio_mport_delete_db_filter(struct rio_mport_db_filter *db_filter)
+/*
+ * rio_mport_delete_db_filter - releases doorbell range of a filter and
+ * frees it. The filter must be already removed from the list of filters.
+ */
+static void rio_mport_delete_db_filter(struct mport_dev *md,
+				       struct rio_mport_db_filter *db_filter)
 {
-	list_del(&db_filter->data_node);
-	list_del(&db_filter->priv_node);
+	rio_release_inb_dbell(md->mport, db_filter->filter.low,
+			      db_filter->filter.high);
 	kfree(db_filter);
 }
 
@@ -1645,7 +2835,7 @@ static int rio_mport_remove_db_filter(struct mport_cdev_priv *priv,
 		if (db_filter->filter.rioid == filter.rioid &&
 		    db_filter->filter.low == filter.low &&
 		    db_filter->filter.high == filter.high) {
-			rio_mport_delete_db_filter(db_filter);
+			list_del(&db_filter->priv_node);
 			ret = 0;
 			break;
 		}
@@ -1653,7 +2843,7 @@ static int rio_mport_remove_db_filter(struct mport_cdev_priv *priv,
 	spin_unlock_irqrestore(&priv->md->db_lock, flags);
 
 	if (!ret)
-		rio_release_inb_dbell(priv->md->mport, filter.low, filter.high);
+		rio_mport_delete_db_filter(priv->md, db_filter);
 
 	return ret;
 }
@@ -1668,7 +2858,7 @@ static int rio_mport_match_pw(union rio_pw_msg *msg,
 }
 
 static int rio_mport_pw_handler(struct rio_mport *mport, void *context,
-				union rio_pw_msg *msg, int step)
+				union rio_pw_msg *msg, int count)
 {
 	struct mport_dev *md = context;
 	struct mport_cdev_priv *priv;
@@ -1678,6 +2868,7 @@ static int rio_mport_pw_handler(struct rio_mport *mport, void *context,
 
 	event.header = RIO_PORTWRITE;
 	memcpy(event.u.portwrite.payload, msg->raw, RIO_PW_MSG_SIZE);
+	event.count = count;
 
 	handled = 0;
 	spin_lock(&md->pw_lock);
@@ -1804,7 +2995,7 @@ static void rio_release_dev(struct device *dev)
 
 	rdev = to_rio_dev(dev);
 	pr_info(DRV_PREFIX "%s: %s\n", __func__, rio_name(rdev));
-	kfree(rdev);
+	kfree_rcu(rdev, rcu);
 }
 
 
@@ -1857,13 +3048,13 @@ static int rio_mport_add_riodev(struct mport_cdev_priv *priv,
 	destid = dev_info.destid;
 	hopcount = dev_info.hopcount;
 
-	if (rio_mport_read_config_32(mport, destid, hopcount,
-				     RIO_PEF_CAR, &rval))
+	if (rio_mport_read_config_32_cansleep(mport, destid, hopcount,
+					      RIO_PEF_CAR, &rval))
 		return -EIO;
 
 	if (rval & RIO_PEF_SWITCH) {
-		rio_mport_read_config_32(mport, destid, hopcount,
-					 RIO_SWP_INFO_CAR, &swpinfo);
+		rio_mport_read_config_32_cansleep(mport, destid, hopcount,
+						  RIO_SWP_INFO_CAR, &swpinfo);
 		size += (RIO_GET_TOTAL_PORTS(swpinfo) *
 			 sizeof(rswitch->nextdev[0])) + sizeof(*rswitch);
 	}
@@ -1898,18 +3089,18 @@ static int rio_mport_add_riodev(struct mport_cdev_priv *priv,
 	rdev->net = mport->net;
 	rdev->pef = rval;
 	rdev->swpinfo = swpinfo;
-	rio_mport_read_config_32(mport, destid, hopcount,
-				 RIO_DEV_ID_CAR, &rval);
+	rio_mport_read_config_32_cansleep(mport, destid, hopcount,
+					  RIO_DEV_ID_CAR, &rval);
 	rdev->did = rval >> 16;
 	rdev->vid = rval & 0xffff;
-	rio_mport_read_config_32(mport, destid, hopcount, RIO_DEV_INFO_CAR,
-				 &rdev->device_rev);
-	rio_mport_read_config_32(mport, destid, hopcount, RIO_ASM_ID_CAR,
-				 &rval);
+	rio_mport_read_config_32_cansleep(mport, destid, hopcount,
+					  RIO_DEV_INFO_CAR, &rdev->device_rev);
+	rio_mport_read_config_32_cansleep(mport, destid, hopcount,
+					  RIO_ASM_ID_CAR, &rval);
 	rdev->asm_did = rval >> 16;
 	rdev->asm_vid = rval & 0xffff;
-	rio_mport_read_config_32(mport, destid, hopcount, RIO_ASM_INFO_CAR,
-				 &rval);
+	rio_mport_read_config_32_cansleep(mport, destid, hopcount,
+					  RIO_ASM_INFO_CAR, &rval);
 	rdev->asm_rev = rval >> 16;
 
 	if (rdev->pef & RIO_PEF_EXT_FEATURES) {
@@ -1921,10 +3112,10 @@ static int rio_mport_add_riodev(struct mport_cdev_priv *priv,
 						hopcount, RIO_EFB_ERR_MGMNT);
 	}
 
-	rio_mport_read_config_32(mport, destid, hopcount, RIO_SRC_OPS_CAR,
-				 &rdev->src_ops);
-	rio_mport_read_config_32(mport, destid, hopcount, RIO_DST_OPS_CAR,
-				 &rdev->dst_ops);
+	rio_mport_read_config_32_cansleep(mport, destid, hopcount,
+					  RIO_SRC_OPS_CAR, &rdev->src_ops);
+	rio_mport_read_config_32_cansleep(mport, destid, hopcount,
+					  RIO_DST_OPS_CAR, &rdev->dst_ops);
 
 	rdev->comp_tag = dev_info.comptag;
 	rdev->destid = destid;
@@ -1983,11 +3174,10 @@ static int rio_mport_del_riodev(struct mport_cdev_priv *priv, void __user *arg)
 					      dev_info.name);
 		if (dev)
 			rdev = to_rio_dev(dev);
-	} else {
+	} else if (mport->net) {
 		do {
-			rdev = rio_get_comptag(dev_info.comptag, rdev);
-			if (rdev && rdev->dev.parent == &mport->net->dev &&
-			    rdev->destid == dev_info.destid &&
+			rdev = rio_get_destid(mport->net, dev_info.destid, rdev);
+			if (rdev && rdev->comp_tag == dev_info.comptag &&
 			    rdev->hopcount == dev_info.hopcount)
 				break;
 		} while (rdev);
@@ -2013,6 +3203,264 @@ static int rio_mport_del_riodev(struct mport_cdev_priv *priv, void __user *arg)
 	return 0;
 }
 
+/*
+ * rio_mport_topo_get - returns snapshot of the network topology
+ *
+ * Fails with -ENOSPC and returns the required size if user buffer is too
+ * small.
+ */
+static int rio_mport_topo_get(struct mport_cdev_priv *priv, void __user *arg)
+{
+	struct rio_mport *mport = priv->md->mport;
+	struct rio_topo_buf tbuf;
+	void *snap = NULL;
+	ssize_t len;
+	int ret = 0;
+
+	if (copy_from_user(&tbuf, arg, sizeof(tbuf)))
+		return -EFAULT;
+
+	for (;;) {
+		len = rio_mport_get_topology(mport, NULL, 0);
+		if (len < 0)
+			return len;
+
+		if (len > tbuf.length) {
+			tbuf.length = len;
+			ret = -ENOSPC;
+			goto out;
+		}
+
+		snap = vmalloc(len);
+		if (!snap)
+			return -ENOMEM;
+
+		len = rio_mport_get_topology(mport, snap, len);
+		/* Network has grown meanwhile, try again */
+		if (len != -ENOSPC)
+			break;
+		vfree(snap);
+		snap = NULL;
+	}
+
+	if (len < 0) {
+		ret = len;
+		goto out_free;
+	}
+
+	if (copy_to_user((void __user *)(uintptr_t)tbuf.address, snap, len)) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+	tbuf.length = len;
+
+out:
+	if (copy_to_user(arg, &tbuf, sizeof(tbuf)))
+		ret = -EFAULT;
+out_free:
+	vfree(snap);
+	return ret;
+}
+
+/*
+ * rio_mport_topo_set - sets topology snapshot for next enumeration
+ */
+static int rio_mport_topo_set(struct mport_cdev_priv *priv, void __user *arg)
+{
+	struct rio_mport *mport = priv->md->mport;
+	struct rio_topo_buf tbuf;
+	void *snap;
+	int ret;
+
+	if (copy_from_user(&tbuf, arg, sizeof(tbuf)))
+		return -EFAULT;
+
+	if (!tbuf.address)
+		return rio_mport_set_topology(mport, NULL, 0);
+
+	if (tbuf.length > RIO_TOPO_MAX_SIZE)
+		return -EINVAL;
+
+	snap = vmalloc(tbuf.length);
+	if (!snap)
+		return -ENOMEM;
+
+	if (copy_from_user(snap, (void __user *)(uintptr_t)tbuf.address,
+			   tbuf.length))
+		ret = -EFAULT;
+	else
+		ret = rio_mport_set_topology(mport, snap, tbuf.length);
+
+	vfree(snap);
+	return ret;
+}
+
+static int mport_ering_file_release(struct inode *inode, struct file *filp)
+{
+	mport_ering_put(filp->private_data);
+	return 0;
+}
+
+static int mport_ering_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct mport_event_ring *er = filp->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > er->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, er->area, 0);
+}
+
+static unsigned int mport_ering_poll(struct file *filp, poll_table *wait)
+{
+	struct mport_event_ring *er = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &er->wq, wait);
+
+	/* Only events released by wake up coalescing make the ring readable */
+	if ((s32)(er->woken - er->ring->tail) > 0)
+		mask |= POLLIN | POLLRDNORM;
+	if (er->dead)
+		mask |= POLLHUP;
+
+	return mask;
+}
+
+static const struct file_operations mport_ering_fops = {
+	.owner		= THIS_MODULE,
+	.release	= mport_ering_file_release,
+	.mmap		= mport_ering_mmap,
+	.poll		= mport_ering_poll,
+};
+
+/*
+ * rio_mport_ering_setup() - Attach shared event ring to file descriptor
+ * @priv: file descriptor data
+ * @arg: ring setup parameters
+ *
+ * Allocates a shared area holding the event ring and returns a new file
+ * descriptor used to mmap() it and to wait for events. Once attached,
+ * events are placed into the ring instead of the event FIFO read by
+ * mport_read().
+ */
+static int rio_mport_ering_setup(struct mport_cdev_priv *priv,
+				 void __user *arg)
+{
+	struct rio_event_ring_setup setup;
+	struct mport_event_ring *er;
+	struct file *file;
+	unsigned long flags;
+	int fd, ret;
+
+	if (copy_from_user(&setup, arg, sizeof(setup)))
+		return -EFAULT;
+	if (setup.entries == 0 ||
+	    setup.entries > RIO_EVENT_RING_MAX_ENTRIES ||
+	    (setup.entries & (setup.entries - 1)))
+		return -EINVAL;
+
+	er = kzalloc(sizeof(*er), GFP_KERNEL);
+	if (!er)
+		return -ENOMEM;
+
+	/* Ring indexes on their own cache line, then entries */
+	setup.ring = 0;
+	setup.events = L1_CACHE_BYTES;
+	setup.map_size = PAGE_ALIGN(setup.events +
+				    setup.entries * sizeof(struct rio_event));
+
+	er->area = vmalloc_user(setup.map_size);
+	if (!er->area) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	kref_init(&er->ref);
+	er->size = setup.map_size;
+	er->ring = er->area + setup.ring;
+	er->events = er->area + setup.events;
+	er->entries = setup.entries;
+	er->wake_count = min(setup.wake_count, setup.entries);
+	er->wake_timeout = ns_to_ktime((u64)setup.wake_timeout *
+				       NSEC_PER_USEC);
+	hrtimer_init(&er->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	er->timer.function = mport_ering_timer;
+	spin_lock_init(&er->lock);
+	init_waitqueue_head(&er->wq);
+
+	fd = get_unused_fd_flags(O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto err_free;
+	}
+
+	/* File owns the initial reference from now on */
+	file = anon_inode_getfile("[rio_mport_events]", &mport_ering_fops, er,
+				  O_RDWR);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		put_unused_fd(fd);
+		goto err_free;
+	}
+
+	setup.fd = fd;
+	if (copy_to_user(arg, &setup, sizeof(setup))) {
+		ret = -EFAULT;
+		goto err_file;
+	}
+
+	spin_lock_irqsave(&priv->fifo_lock, flags);
+	if (priv->ering) {
+		spin_unlock_irqrestore(&priv->fifo_lock, flags);
+		ret = -EBUSY;
+		goto err_file;
+	}
+	/* Reference held by the file descriptor owning the ring */
+	kref_get(&er->ref);
+	priv->ering = er;
+	spin_unlock_irqrestore(&priv->fifo_lock, flags);
+
+	fd_install(fd, file);
+	return 0;
+
+err_file:
+	fput(file);
+	put_unused_fd(fd);
+	return ret;
+err_free:
+	vfree(er->area);
+	kfree(er);
+	return ret;
+}
+
+/*
+ * rio_mport_ering_detach() - Detach shared event ring from file descriptor
+ * @priv: file descriptor data
+ *
+ * No events can reach the ring once detached. Ring file descriptor reports
+ * POLLHUP after that.
+ */
+static void rio_mport_ering_detach(struct mport_cdev_priv *priv)
+{
+	struct mport_event_ring *er;
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->fifo_lock, flags);
+	er = priv->ering;
+	priv->ering = NULL;
+	spin_unlock_irqrestore(&priv->fifo_lock, flags);
+
+	if (!er)
+		return;
+
+	hrtimer_cancel(&er->timer);
+	er->dead = true;
+	er->woken = er->head;
+	wake_up_interruptible(&er->wq);
+	mport_ering_put(er);
+}
+
 /*
  * Mport cdev management
  */
@@ -2049,6 +3497,7 @@ static int mport_cdev_open(struct inode *inode, struct file *filp)
 	}
 
 	priv->md = chdev;
+	priv->alloc_node = NUMA_NO_NODE;
 
 	mutex_lock(&chdev->file_mutex);
 	list_add_tail(&priv->list, &chdev->file_list);
@@ -2071,6 +3520,10 @@ static int mport_cdev_open(struct inode *inode, struct file *filp)
 	INIT_LIST_HEAD(&priv->async_list);
 	spin_lock_init(&priv->req_lock);
 	mutex_init(&priv->dma_lock);
+	atomic_set(&priv->stripe_users, 0);
+	INIT_WORK(&priv->stripe_work, stripe_release_work);
+	INIT_LIST_HEAD(&priv->reg_bufs);
+	mutex_init(&priv->reg_lock);
 #endif
 
 	filp->private_data = priv;
@@ -2108,6 +3561,9 @@ static void mport_cdev_release_dma(struct file *filp)
 
 	md = priv->md;
 
+	/* Buffers drop their DMA channel references once released */
+	mport_unregister_all(priv);
+
 	spin_lock(&priv->req_lock);
 	if (!list_empty(&priv->async_list)) {
 		rmcd_debug(EXIT, "async list not empty filp=%p %s(%d)",
@@ -2135,6 +3591,9 @@ static void mport_cdev_release_dma(struct file *filp)
 			current->comm, task_pid_nr(current), wret);
 	}
 
+	cancel_work_sync(&priv->stripe_work);
+	release_stripe_channels(priv);
+
 	if (priv->dmach != priv->md->dma_chan) {
 		rmcd_debug(EXIT, "Release DMA channel for filp=%p %s(%d)",
 			   filp, current->comm, task_pid_nr(current));
@@ -2159,6 +3618,7 @@ static int mport_cdev_release(struct inode *inode, struct file *filp)
 	struct mport_dev *chdev;
 	struct rio_mport_pw_filter *pw_filter, *pw_filter_next;
 	struct rio_mport_db_filter *db_filter, *db_filter_next;
+	LIST_HEAD(db_list);
 	struct rio_mport_mapping *map, *_map;
 	unsigned long flags;
 
@@ -2178,12 +3638,16 @@ static int mport_cdev_release(struct inode *inode, struct file *filp)
 	spin_unlock_irqrestore(&chdev->pw_lock, flags);
 
 	spin_lock_irqsave(&chdev->db_lock, flags);
+	list_splice_init(&priv->db_filters, &db_list);
+	spin_unlock_irqrestore(&chdev->db_lock, flags);
+
 	list_for_each_entry_safe(db_filter, db_filter_next,
-				 &priv->db_filters, priv_node) {
-		rio_mport_delete_db_filter(db_filter);
+				 &db_list, priv_node) {
+		list_del(&db_filter->priv_node);
+		rio_mport_delete_db_filter(chdev, db_filter);
 	}
-	spin_unlock_irqrestore(&chdev->db_lock, flags);
 
+	rio_mport_ering_detach(priv);
 	kfifo_free(&priv->event_fifo);
 
 	mutex_lock(&chdev->buf_mutex);
@@ -2272,10 +3736,22 @@ static long mport_cdev_ioctl(struct file *filp,
 		return rio_mport_wait_for_async_dma(filp, (void __user *)arg);
 	case RIO_TRANSFER:
 		return rio_mport_transfer_ioctl(filp, (void __user *)arg);
+	case RIO_REGISTER_BUFFER:
+		return rio_mport_register_buffer(filp, (void __user *)arg);
+	case RIO_UNREGISTER_BUFFER:
+		return rio_mport_unregister_buffer(filp, (void __user *)arg);
 	case RIO_DEV_ADD:
 		return rio_mport_add_riodev(data, (void __user *)arg);
 	case RIO_DEV_DEL:
 		return rio_mport_del_riodev(data, (void __user *)arg);
+	case RIO_MPORT_GET_TOPOLOGY:
+		return rio_mport_topo_get(data, (void __user *)arg);
+	case RIO_MPORT_SET_TOPOLOGY:
+		return rio_mport_topo_set(data, (void __user *)arg);
+	case RIO_EVENT_RING_SETUP:
+		return rio_mport_ering_setup(data, (void __user *)arg);
+	case RIO_SET_ALLOC_POLICY:
+		return rio_mport_set_alloc_policy(data, (void __user *)arg);
 	default:
 		break;
 	}
@@ -2305,14 +3781,12 @@ static void mport_release_mapping(struct kref *ref)
 	case MAP_INBOUND:
 		rio_unmap_inb_region(mport, map->dma_addr);
 	case MAP_DMA:
-		if (map->virt_addr)
-			dma_free_coherent(mport->dev.parent, map->size,
-					  map->virt_addr, map->dma_addr);
-		else
-			dma_unmap_page(mport->dev.parent, map->dma_addr,
-				       map->size, DMA_BIDIRECTIONAL);
+		mport_free_buf(mport->dev.parent, map);
 		break;
 	case MAP_OUTBOUND:
+		if (mport_obw_park(map->md, map))
+			return;
+		hash_del(&map->obw_node);
 		rio_unmap_outb_region(mport, map->rioid, map->rio_addr);
 		break;
 	}
@@ -2389,7 +3863,13 @@ static int mport_cdev_mmap(struct file *filp, struct vm_area_struct *vma)
 					      size, vma->vm_page_prot);
 		}
 	} else if (map->dir == MAP_OUTBOUND) {
-		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+		/* Write-combining lets PIO writes to be posted in bursts */
+		if (map->wc)
+			vma->vm_page_prot =
+				pgprot_writecombine(vma->vm_page_prot);
+		else
+			vma->vm_page_prot =
+				pgprot_noncached(vma->vm_page_prot);
 		ret = vm_iomap_memory(vma, map->phys_addr, map->size);
 	} else {
 		rmcd_error("Attempt to mmap unsupported mapping type");
@@ -2451,13 +3931,23 @@ static ssize_t mport_read(struct file *filp, char __user *buf, size_t count,
 	return ret;
 }
 
+/*
+ * mport_write() - Send doorbells described by array of RIO_DOORBELL events.
+ *
+ * Doorbells are submitted to mport in batches, each batch is waited for
+ * (sleeping) before the next one is submitted. Returns number of bytes of events sent,
+ * which is less than @count if mport doorbell queue becomes full or sending
+ * of a doorbell fails. Error is returned if the first doorbell fails.
+ */
 static ssize_t mport_write(struct file *filp, const char __user *buf,
 			 size_t count, loff_t *ppos)
 {
 	struct mport_cdev_priv *priv = filp->private_data;
 	struct rio_mport *mport = priv->md->mport;
+	struct rio_dbell_msg db[MPORT_DB_BATCH];
+	int status[MPORT_DB_BATCH];
 	struct rio_event event;
-	int len, ret;
+	int len, num, ret, i;
 
 	if (!count)
 		return 0;
@@ -2467,20 +3957,32 @@ static ssize_t mport_write(struct file *filp, const char __user *buf,
 
 	len = 0;
 	while ((count - len) >= (int)sizeof(event)) {
-		if (copy_from_user(&event, buf, sizeof(event)))
-			return -EFAULT;
+		for (num = 0; num < MPORT_DB_BATCH &&
+		     (count - len) >= (num + 1) * sizeof(event); num++) {
+			if (copy_from_user(&event, buf + num * sizeof(event),
+					   sizeof(event)))
+				return len ? len : -EFAULT;
 
-		if (event.header != RIO_DOORBELL)
-			return -EINVAL;
+			if (event.header != RIO_DOORBELL)
+				return len ? len : -EINVAL;
+
+			db[num].destid = event.u.doorbell.rioid;
+			db[num].data = event.u.doorbell.payload;
+		}
 
-		ret = rio_mport_send_doorbell(mport,
-					      event.u.doorbell.rioid,
-					      event.u.doorbell.payload);
+		ret = rio_send_doorbells(mport, db, num, status,
+					 RIO_DBELL_SLEEP);
 		if (ret < 0)
-			return ret;
+			return len ? len : ret;
 
-		len += sizeof(event);
-		buf += sizeof(event);
+		for (i = 0; i < ret; i++) {
+			if (status[i])
+				return len ? len : status[i];
+			len += sizeof(event);
+			buf += sizeof(event);
+		}
+		if (ret < num)
+			break;
 	}
 
 	return len;
@@ -2556,11 +4058,12 @@ static struct mport_dev *mport_cdev_add(struct rio_mport *mport)
 
 	get_device(&md->dev);
 
-	INIT_LIST_HEAD(&md->doorbells);
 	spin_lock_init(&md->db_lock);
 	INIT_LIST_HEAD(&md->portwrites);
 	spin_lock_init(&md->pw_lock);
 	INIT_LIST_HEAD(&md->mappings);
+	hash_init(md->obw_hash);
+	INIT_LIST_HEAD(&md->obw_idle);
 
 	md->properties.id = mport->id;
 	md->properties.sys_size = mport->sys_size;
@@ -2680,6 +4183,8 @@ static void mport_cdev_remove(struct mport_dev *md)
 	list_for_each_entry_safe(map, _map, &md->mappings, node) {
 		kref_put(&map->ref, mport_release_mapping);
 	}
+	list_for_each_entry_safe(map, _map, &md->obw_idle, node)
+		mport_obw_evict(md, map);
 	mutex_unlock(&md->buf_mutex);
 
 	if (!list_empty(&md->mappings))
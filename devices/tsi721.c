@@ -34,10 +34,15 @@
 #include <linux/interrupt.h>
 #include <linux/kfifo.h>
 #include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
 #include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "tsi721.h"
+#include "../include/rio_trace.h"
 
 #ifdef DEBUG
 u32 dbg_level;
@@ -106,70 +111,175 @@ static int tsi721_lcwrite(struct rio_mport *mport, int index, u32 offset,
 }
 
 /**
- * tsi721_maint_dma - Helper function to generate RapidIO maintenance
- *                    transactions using designated Tsi721 DMA channel.
+ * tsi721_maint_poll - Waits until maintenance BDMA channel stops
+ * @regs: maintenance BDMA channel registers
+ * @ch_stat: returns channel status
+ *
+ * Returns %0 if the channel stopped or %-ETIMEDOUT if it is still running.
+ */
+static int tsi721_maint_poll(void __iomem *regs, u32 *ch_stat)
+{
+	int i = 0;
+
+	while ((*ch_stat = ioread32(regs + TSI721_DMAC_STS))
+							& TSI721_DMAC_STS_RUN) {
+		udelay(1);
+		if (++i >= 5000000)
+			return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+static void tsi721_maint_done(struct rio_maint_op *op,
+			      struct tsi721_dma_desc *bd_ptr, int status)
+{
+	op->status = status;
+	if (!op->write)
+		op->data = status ? 0xffffffff : be32_to_cpu(bd_ptr->data[0]);
+}
+
+/*
+ * tsi721_maint_stats - accounts and traces completed batch of maintenance
+ *                      transactions
+ */
+static void tsi721_maint_stats(struct tsi721_device *priv,
+			       struct rio_maint_op *ops, int num, u64 ts)
+{
+	struct tsi721_qstats *st = &priv->mdma.stats;
+	int i;
+
+	/* Batch latency is accounted once, counters are per transaction */
+	tsi721_qstats_add(st, num * 4, tsi721_ts() - ts);
+	st->ops += num - 1;
+
+	for (i = 0; i < num; i++) {
+		if (ops[i].status)
+			st->errors++;
+		trace_rio_maint(&priv->mport, ops[i].destid, ops[i].hopcount,
+				ops[i].offset, ops[i].write, ops[i].data,
+				ops[i].status);
+	}
+}
+
+/**
+ * tsi721_maint_start - Places batch of maintenance transactions into
+ *                      the maintenance BDMA channel and starts it
  * @priv: pointer to tsi721 private data
  * @sys_size: RapdiIO transport system size
- * @destid: Destination ID of transaction
- * @hopcount: Number of hops to target device
- * @offset: Offset into configuration space
- * @len: Length (in bytes) of the maintenance transaction
- * @data: Location to be read from or write into
- * @do_wr: Operation flag (1 == MAINT_WR)
+ * @req: batch request to be filled in
+ * @ops: array of maintenance transactions
+ * @num: number of transactions in @ops
  *
- * Generates a RapidIO maintenance transaction (Read or Write).
- * Returns %0 on success and %-EINVAL or %-EFAULT on failure.
+ * Places as many transactions as the descriptor ring holds into it.
+ * Must be called with mdma.lock held and no batch in flight.
  */
-static int tsi721_maint_dma(struct tsi721_device *priv, u32 sys_size,
-			u16 destid, u8 hopcount, u32 offset, int len,
-			u32 *data, int do_wr)
+static void tsi721_maint_start(struct tsi721_device *priv, u32 sys_size,
+			       struct tsi721_maint_req *req,
+			       struct rio_maint_op *ops, int num)
 {
-	void __iomem *regs = priv->regs + TSI721_DMAC_BASE(priv->mdma.ch_id);
-	struct tsi721_dma_desc *bd_ptr;
-	u32 rd_count, swr_ptr, ch_stat;
-	int i, err = 0;
-	u32 op = do_wr ? MAINT_WR : MAINT_RD;
+	struct tsi721_bdma_maint *mdma = &priv->mdma;
+	void __iomem *regs = priv->regs + TSI721_DMAC_BASE(mdma->ch_id);
+	struct tsi721_dma_desc *bd_ptr = mdma->bd_base;
+	u32 rd_count, wr_count, idx, op;
+	int n;
 
-	if (offset > (RIO_MAINT_SPACE_SZ - len) || (len != sizeof(u32)))
-		return -EINVAL;
+	rd_count = ioread32(regs + TSI721_DMAC_DRDCNT);
+	wr_count = rd_count;
+	idx = rd_count % mdma->bd_num;
+
+	/* Initialize DMA descriptors */
+	for (n = 0; n < num && n < mdma->bd_num - 1; n++) {
+		if (idx == mdma->bd_num - 1) {
+			/* skip ring link descriptor */
+			idx = 0;
+			wr_count++;
+		}
 
-	bd_ptr = priv->mdma.bd_base;
+		op = ops[n].write ? MAINT_WR : MAINT_RD;
+		bd_ptr[idx].type_id = cpu_to_le32((DTYPE2 << 29) |
+					(op << 19) | ops[n].destid);
+		bd_ptr[idx].bcount = cpu_to_le32((sys_size << 26) | 0x04);
+		bd_ptr[idx].raddr_lo = cpu_to_le32((ops[n].hopcount << 24) |
+						   ops[n].offset);
+		bd_ptr[idx].raddr_hi = 0;
+		if (ops[n].write)
+			bd_ptr[idx].data[0] = cpu_to_be32(ops[n].data);
+		else
+			bd_ptr[idx].data[0] = 0xffffffff;
 
-	rd_count = ioread32(regs + TSI721_DMAC_DRDCNT);
+		req->pos[n] = idx++;
+		req->cnt[n] = ++wr_count;
+	}
 
-	/* Initialize DMA descriptor */
-	bd_ptr[0].type_id = cpu_to_le32((DTYPE2 << 29) | (op << 19) | destid);
-	bd_ptr[0].bcount = cpu_to_le32((sys_size << 26) | 0x04);
-	bd_ptr[0].raddr_lo = cpu_to_le32((hopcount << 24) | offset);
-	bd_ptr[0].raddr_hi = 0;
-	if (do_wr)
-		bd_ptr[0].data[0] = cpu_to_be32p(data);
-	else
-		bd_ptr[0].data[0] = 0xffffffff;
+	req->ops = ops;
+	req->n = n;
+	req->timeout = false;
 
 	mb();
 
+	if (req->use_irq) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
+		reinit_completion(&mdma->done);
+#else
+		INIT_COMPLETION(mdma->done);
+#endif
+		iowrite32(TSI721_DMAC_INT_DONE, regs + TSI721_DMAC_INTE);
+	}
+
 	/* Start DMA operation */
-	iowrite32(rd_count + 2,	regs + TSI721_DMAC_DWRCNT);
+	mdma->req = req;
+	req->ts = tsi721_ts();
+	iowrite32(wr_count, regs + TSI721_DMAC_DWRCNT);
 	ioread32(regs + TSI721_DMAC_DWRCNT);
-	i = 0;
+}
 
-	/* Wait until DMA transfer is finished */
-	while ((ch_stat = ioread32(regs + TSI721_DMAC_STS))
-							& TSI721_DMAC_STS_RUN) {
-		udelay(1);
-		if (++i >= 5000000) {
-			tsi_debug(MAINT, &priv->pdev->dev,
-				"DMA[%d] read timeout ch_status=%x",
-				priv->mdma.ch_id, ch_stat);
-			if (!do_wr)
-				*data = 0xffffffff;
-			err = -EIO;
-			goto err_out;
-		}
+/**
+ * tsi721_maint_retire - Completes batch of maintenance transactions
+ * @priv: pointer to tsi721 private data
+ * @err: %-ETIMEDOUT if the channel did not stop, %0 otherwise
+ * @ch_stat: channel status
+ *
+ * Returns completion status of every transaction of the batch in flight
+ * in its @status field. If a transaction failed, transactions before it
+ * are complete, the batch is cut after the failed one and the channel is
+ * reinitialized. Must be called with mdma.lock held.
+ */
+static void tsi721_maint_retire(struct tsi721_device *priv, int err,
+				u32 ch_stat)
+{
+	struct tsi721_bdma_maint *mdma = &priv->mdma;
+	struct tsi721_maint_req *req = mdma->req;
+	void __iomem *regs = priv->regs + TSI721_DMAC_BASE(mdma->ch_id);
+	struct tsi721_dma_desc *bd_ptr = mdma->bd_base;
+	struct rio_maint_op *ops = req->ops;
+	u32 rd_count, swr_ptr;
+	int i;
+
+	if (req->use_irq) {
+		iowrite32(0, regs + TSI721_DMAC_INTE);
+		iowrite32(TSI721_DMAC_INT_ALL, regs + TSI721_DMAC_INT);
 	}
 
-	if (ch_stat & TSI721_DMAC_STS_ABORT) {
+	if (err) {
+		tsi_debug(MAINT, &priv->pdev->dev,
+			"DMA[%d] timeout ch_status=%x",
+			mdma->ch_id, ch_stat);
+		for (i = 0; i < req->n; i++)
+			tsi721_maint_done(&ops[i], NULL, -EIO);
+		req->timeout = true;
+	} else if (ch_stat & TSI721_DMAC_STS_ABORT) {
+		/* Transactions before the failed one are complete */
+		rd_count = ioread32(regs + TSI721_DMAC_DRDCNT);
+		for (i = 0; i < req->n &&
+			    (s32)(rd_count - req->cnt[i]) >= 0; i++)
+			tsi721_maint_done(&ops[i], &bd_ptr[req->pos[i]], 0);
+
+		if (i == req->n)
+			i--;
+		tsi721_maint_done(&ops[i], NULL, -EIO);
+		req->n = i + 1;
+
 		/* If DMA operation aborted due to error,
 		 * reinitialize DMA channel
 		 */
@@ -177,32 +287,174 @@ static int tsi721_maint_dma(struct tsi721_device *priv, u32 sys_size,
 			  ch_stat);
 		tsi_debug(MAINT, &priv->pdev->dev,
 			  "OP=%d : destid=%x hc=%x off=%x",
-			  do_wr ? MAINT_WR : MAINT_RD,
-			  destid, hopcount, offset);
+			  ops[i].write ? MAINT_WR : MAINT_RD,
+			  ops[i].destid, ops[i].hopcount, ops[i].offset);
 		iowrite32(TSI721_DMAC_INT_ALL, regs + TSI721_DMAC_INT);
 		iowrite32(TSI721_DMAC_CTL_INIT, regs + TSI721_DMAC_CTL);
 		udelay(10);
 		iowrite32(0, regs + TSI721_DMAC_DWRCNT);
 		udelay(1);
-		if (!do_wr)
-			*data = 0xffffffff;
-		err = -EIO;
-		goto err_out;
+	} else {
+		for (i = 0; i < req->n; i++)
+			tsi721_maint_done(&ops[i], &bd_ptr[req->pos[i]], 0);
+
+		/*
+		 * Update descriptor status FIFO RD pointer.
+		 * NOTE: Skipping check and clear FIFO entries because
+		 * we are waiting for transfer to be completed.
+		 */
+		swr_ptr = ioread32(regs + TSI721_DMAC_DSWP);
+		iowrite32(swr_ptr, regs + TSI721_DMAC_DSRP);
 	}
 
-	if (!do_wr)
-		*data = be32_to_cpu(bd_ptr[0].data[0]);
+	tsi721_maint_stats(priv, ops, req->n, req->ts);
+	mdma->req = NULL;
+	if (req->use_irq)
+		complete(&mdma->done);
+}
 
-	/*
-	 * Update descriptor status FIFO RD pointer.
-	 * NOTE: Skipping check and clear FIFO entries because we are waiting
-	 * for transfer to be completed.
-	 */
-	swr_ptr = ioread32(regs + TSI721_DMAC_DSWP);
-	iowrite32(swr_ptr, regs + TSI721_DMAC_DSRP);
-err_out:
+/**
+ * tsi721_maint_sleep - Sleeps until batch of maintenance transactions is
+ *                      retired
+ * @priv: pointer to tsi721 private data
+ * @req: batch request in flight
+ *
+ * Waits for the completion interrupt if it is available, otherwise polls
+ * the channel between short sleeps. The batch is retired here unless an
+ * atomic user of the channel did it first.
+ */
+static void tsi721_maint_sleep(struct tsi721_device *priv,
+			       struct tsi721_maint_req *req)
+{
+	struct tsi721_bdma_maint *mdma = &priv->mdma;
+	void __iomem *regs = priv->regs + TSI721_DMAC_BASE(mdma->ch_id);
+	unsigned long end = jiffies + msecs_to_jiffies(5000);
+	unsigned long flags;
+	u32 ch_stat;
+	int err;
 
-	return err;
+	for (;;) {
+		if (req->use_irq)
+			wait_for_completion_timeout(&mdma->done,
+				max_t(long, (long)(end - jiffies), 1));
+		else
+			usleep_range(10, 20);
+
+		spin_lock_irqsave(&mdma->lock, flags);
+		if (mdma->req != req) {
+			spin_unlock_irqrestore(&mdma->lock, flags);
+			return;
+		}
+
+		err = time_after(jiffies, end) ? -ETIMEDOUT : 0;
+		ch_stat = ioread32(regs + TSI721_DMAC_STS);
+		if (!(ch_stat & TSI721_DMAC_STS_RUN) || err) {
+			if (!(ch_stat & TSI721_DMAC_STS_RUN))
+				err = 0;
+			tsi721_maint_retire(priv, err, ch_stat);
+			spin_unlock_irqrestore(&mdma->lock, flags);
+			return;
+		}
+		spin_unlock_irqrestore(&mdma->lock, flags);
+	}
+}
+
+/**
+ * tsi721_maint_xfer - Generates RapidIO maintenance transactions
+ *                     using designated Tsi721 DMA channel.
+ * @priv: pointer to tsi721 private data
+ * @sys_size: RapdiIO transport system size
+ * @ops: array of maintenance transactions
+ * @num: number of transactions in @ops
+ * @sleep: caller can sleep while waiting for completion
+ *
+ * Places as many transactions as the descriptor ring holds into it and
+ * starts the channel once per batch. A caller that can sleep releases the
+ * channel while its batch runs and waits for the completion interrupt, if
+ * MSI-X is in use. Other callers poll for completion holding the channel,
+ * after retiring the batch of a sleeping caller that may still be in
+ * flight. If a transaction fails, transactions before it are complete and
+ * processing continues with the next one after the channel is
+ * reinitialized. Completion status of every transaction is returned in its
+ * @status field.
+ */
+static void tsi721_maint_xfer(struct tsi721_device *priv, u32 sys_size,
+			      struct rio_maint_op *ops, int num, bool sleep)
+{
+	struct tsi721_bdma_maint *mdma = &priv->mdma;
+	void __iomem *regs = priv->regs + TSI721_DMAC_BASE(mdma->ch_id);
+	struct tsi721_maint_req req;
+	unsigned long flags;
+	u32 ch_stat;
+	int i, err;
+
+	req.use_irq = sleep && mdma->irq;
+
+	while (num) {
+		spin_lock_irqsave(&mdma->lock, flags);
+		if (mdma->req) {
+			err = tsi721_maint_poll(regs, &ch_stat);
+			tsi721_maint_retire(priv, err, ch_stat);
+		}
+
+		tsi721_maint_start(priv, sys_size, &req, ops, num);
+
+		if (!sleep) {
+			err = tsi721_maint_poll(regs, &ch_stat);
+			tsi721_maint_retire(priv, err, ch_stat);
+		}
+		spin_unlock_irqrestore(&mdma->lock, flags);
+
+		if (sleep)
+			tsi721_maint_sleep(priv, &req);
+
+		if (req.timeout) {
+			/* Transactions after the batch were not issued */
+			for (i = req.n; i < num; i++)
+				tsi721_maint_done(&ops[i], NULL, -EIO);
+			return;
+		}
+
+		ops += req.n;
+		num -= req.n;
+	}
+}
+
+/**
+ * tsi721_maint_dma - Helper function to generate RapidIO maintenance
+ *                    transactions using designated Tsi721 DMA channel.
+ * @priv: pointer to tsi721 private data
+ * @sys_size: RapdiIO transport system size
+ * @destid: Destination ID of transaction
+ * @hopcount: Number of hops to target device
+ * @offset: Offset into configuration space
+ * @len: Length (in bytes) of the maintenance transaction
+ * @data: Location to be read from or write into
+ * @do_wr: Operation flag (1 == MAINT_WR)
+ *
+ * Generates a RapidIO maintenance transaction (Read or Write).
+ * Returns %0 on success and %-EINVAL or %-EIO on failure.
+ */
+static int tsi721_maint_dma(struct tsi721_device *priv, u32 sys_size,
+			u16 destid, u8 hopcount, u32 offset, int len,
+			u32 *data, int do_wr)
+{
+	struct rio_maint_op op;
+
+	if (offset > (RIO_MAINT_SPACE_SZ - len) || (len != sizeof(u32)))
+		return -EINVAL;
+
+	op.destid = destid;
+	op.hopcount = hopcount;
+	op.write = do_wr;
+	op.offset = offset;
+	op.data = *data;
+
+	tsi721_maint_xfer(priv, sys_size, &op, 1, false);
+
+	if (!do_wr)
+		*data = op.data;
+	return op.status;
 }
 
 /**
@@ -252,6 +504,34 @@ static int tsi721_cwrite_dma(struct rio_mport *mport, int index, u16 destid,
 				offset, len, &temp, 1);
 }
 
+/**
+ * tsi721_cmaint_vec - Generate batch of RapidIO maintenance transactions
+ *                     using Tsi721 BDMA engine
+ * @mport: RapidIO master port control structure
+ * @index: ID of RapdiIO interface
+ * @ops: array of maintenance transactions
+ * @num: number of transactions in @ops
+ * @flags: RIO_MAINT_* flags
+ *
+ * Keeps up to TSI721_DMACH_MAINT_NBD - 1 transactions in flight.
+ * Returns %0 if transactions were processed or %-EINVAL if any of them
+ * is invalid, completion status of each is returned in its @status field.
+ */
+static int tsi721_cmaint_vec(struct rio_mport *mport, int index,
+			     struct rio_maint_op *ops, int num, u32 flags)
+{
+	struct tsi721_device *priv = mport->priv;
+	int i;
+
+	for (i = 0; i < num; i++)
+		if (ops[i].offset > (RIO_MAINT_SPACE_SZ - sizeof(u32)))
+			return -EINVAL;
+
+	tsi721_maint_xfer(priv, mport->sys_size, ops, num,
+			  !!(flags & RIO_MAINT_SLEEP));
+	return 0;
+}
+
 /**
  * tsi721_pw_handler - Tsi721 inbound port-write interrupt handler
  * @priv:  tsi721 device private structure
@@ -339,70 +619,319 @@ static int tsi721_pw_enable(struct rio_mport *mport, int enable)
 }
 
 /**
- * tsi721_dsend - Send a RapidIO doorbell
- * @mport: RapidIO master port info
- * @index: ID of RapidIO interface
+ * tsi721_odb_write - Writes outbound doorbell into doorbell window
+ * @priv: tsi721 device-specific data structure
+ * @req: Doorbell to send
+ *
+ * Tsi721 generates one doorbell at a time. Completion of the doorbell is
+ * reported through ODB bits of SR2PC channel 0 interrupt status.
+ */
+static void tsi721_odb_write(struct tsi721_device *priv,
+			     struct tsi721_odb_req *req)
+{
+	u32 offset;
+
+	offset = (((priv->mport.sys_size) ? RIO_TT_CODE_16 : RIO_TT_CODE_8)
+		  << 18) | (req->destid << 2);
+
+	tsi_debug(ODBELL, &priv->pdev->dev,
+		  "Send Doorbell 0x%04x to destID 0x%x", req->data, req->destid);
+	iowrite16be(req->data, priv->odb_base + offset);
+}
+
+/**
+ * tsi721_odb_start - Starts transmission of next queued doorbell
+ * @priv: tsi721 device-specific data structure
+ *
+ * Must be called with odb_lock held.
+ */
+static void tsi721_odb_start(struct tsi721_device *priv)
+{
+	if (priv->odb_busy || priv->odb_rd == priv->odb_wr)
+		return;
+
+	priv->odb_busy = true;
+	priv->odb_rtry = ODB_RETRY;
+	tsi721_odb_write(priv, &priv->odb_queue[priv->odb_rd % ODB_QSIZE]);
+}
+
+/**
+ * tsi721_odb_complete - Completes in-flight outbound doorbell
+ * @priv: tsi721 device-specific data structure
+ * @status: Completion status
+ *
+ * Errors of doorbells nobody waits for are only counted and logged
+ * (rate limited). Must be called with odb_lock held.
+ */
+static void tsi721_odb_complete(struct tsi721_device *priv, int status)
+{
+	struct tsi721_odb_req *req = &priv->odb_queue[priv->odb_rd % ODB_QSIZE];
+
+	if (status) {
+		priv->odb_err_count++;
+		if (!req->status)
+			dev_err_ratelimited(&priv->pdev->dev,
+				"%s: ERROR Send Doorbell 0x%04x to destID 0x%x failed, err=%d\n",
+				__func__, req->data, req->destid, status);
+	}
+
+	if (req->status) {
+		*req->status = status;
+		wake_up(&priv->odb_wq);
+	}
+	priv->odb_rd++;
+	priv->odb_busy = false;
+}
+
+/**
+ * tsi721_odb_handler - Services outbound doorbell queue
+ * @priv: tsi721 device-specific data structure
+ *
+ * Checks if the in-flight doorbell has been completed by hardware and
+ * starts the next one. Called from interrupt handler or by a requester
+ * polling for completion, with odb_lock held.
+ */
+static void tsi721_odb_handler(struct tsi721_device *priv)
+{
+	u32 rval;
+
+	rval = ioread32(priv->regs + TSI721_SR_CHINT(0)) & TSI721_SR_CHINT_ODB;
+	if (!rval)
+		return;
+
+	iowrite32(rval, priv->regs + TSI721_SR_CHINT(0));
+	if (!priv->odb_busy)
+		goto next;
+
+	if (rval & TSI721_SR_CHINT_ODBOK)
+		tsi721_odb_complete(priv, 0);
+	else if (rval & (TSI721_SR_CHINT_ODBTO | TSI721_SR_CHINT_ODBERR))
+		tsi721_odb_complete(priv, -EIO);
+	else if (priv->odb_rtry) {
+		priv->odb_rtry--;
+		tsi721_odb_write(priv,
+				 &priv->odb_queue[priv->odb_rd % ODB_QSIZE]);
+		return;
+	} else
+		tsi721_odb_complete(priv, -EAGAIN);
+
+next:
+	tsi721_odb_start(priv);
+}
+
+static void tsi721_odb_irq(struct tsi721_device *priv)
+{
+	spin_lock(&priv->odb_lock);
+	tsi721_odb_handler(priv);
+	spin_unlock(&priv->odb_lock);
+}
+
+/**
+ * tsi721_odb_add - Adds doorbell into outbound doorbell queue
+ * @priv: tsi721 device-specific data structure
  * @destid: Destination ID of target device
  * @data: 16-bit info field of RapidIO doorbell
+ * @status: Where to store completion status or %NULL
  *
- * Sends a RapidIO doorbell message.
+ * Must be called with odb_lock held. Returns %0 on success or %-EBUSY if
+ * the queue is full.
  */
-static int tsi721_dsend(struct rio_mport *mport, int index,
-			u16 destid, u16 data)
+static int tsi721_odb_add(struct tsi721_device *priv, u16 destid, u16 data,
+			  int *status)
 {
-	struct tsi721_device *priv = mport->priv;
-	u32 offset, rval = 0;
-	int i, rtry_cnt = 100;
-	u32 odb_count = 0;
+	struct tsi721_odb_req *req;
 
-	/* This function uses only Tsi721 ODB channel 0 */
+	if (priv->odb_wr - priv->odb_rd >= ODB_QSIZE)
+		return -EBUSY;
 
-	/* Clear ODB interrupts from previous request */
-	iowrite32(TSI721_SR_CHINT_ODBOK | TSI721_SR_CHINT_ODBTO |
-		  TSI721_SR_CHINT_ODBRTRY | TSI721_SR_CHINT_ODBERR,
-		  priv->regs + TSI721_SR_CHINT(0));
+	req = &priv->odb_queue[priv->odb_wr % ODB_QSIZE];
+	req->destid = destid;
+	req->data = data;
+	req->status = status;
+	priv->odb_wr++;
+	return 0;
+}
 
-	offset = (((mport->sys_size) ? RIO_TT_CODE_16 : RIO_TT_CODE_8) << 18) |
-		 (destid << 2);
+/**
+ * tsi721_odb_cancel - Stops waiting for queued outbound doorbell
+ * @priv: tsi721 device-specific data structure
+ * @status: Completion status location of the doorbell
+ *
+ * Detaches @status from its queue entry and sets it to %-ETIME. If the
+ * doorbell is in flight, hardware has not reported its completion in time
+ * and the doorbell is dropped to let the queue proceed. Must be called
+ * with odb_lock held.
+ */
+static void tsi721_odb_cancel(struct tsi721_device *priv, int *status)
+{
+	struct tsi721_odb_req *req;
+	u32 i;
 
-	tsi_debug(ODBELL, &priv->pdev->dev,
-		  "Send Doorbell 0x%04x to destID 0x%x", data, destid);
-retry:
-	iowrite16be(data, priv->odb_base + offset);
+	for (i = priv->odb_rd; i != priv->odb_wr; i++) {
+		req = &priv->odb_queue[i % ODB_QSIZE];
+		if (req->status != status)
+			continue;
 
-	/* Wait until ODB counters have been updated */
-	for (i = 0; !(odb_count & TSI721_ODB_CNT_OK) && i < 1000; i++) {
-		udelay(1);
-		odb_count = ioread32(priv->regs + TSI721_ODB_CNT(0));
+		if (i == priv->odb_rd && priv->odb_busy) {
+			tsi721_odb_complete(priv, -ETIME);
+			tsi721_odb_start(priv);
+		} else {
+			req->status = NULL;
+			*status = -ETIME;
+		}
+		break;
 	}
+}
 
-	if (!odb_count) {
-		tsi_err(&priv->pdev->dev,
-			"Send Doorbell 0x%04x to destID 0x%x error, CNT=0x%08x",
-			data, destid, odb_count);
-		return -ETIME;
+/**
+ * tsi721_odb_wait - Waits for completion of queued outbound doorbells
+ * @priv: tsi721 device-specific data structure
+ * @status: Completion status locations of the doorbells
+ * @num: Number of doorbells to wait for
+ * @tmo: Timeout in microseconds
+ *
+ * Completion is polled because the caller may run in atomic context.
+ * Doorbells not completed within @tmo are cancelled.
+ */
+static void tsi721_odb_wait(struct tsi721_device *priv, int *status, int num,
+			    u32 tmo)
+{
+	unsigned long flags;
+	u32 i;
+	int j;
+
+	for (i = 0; ; i++) {
+		spin_lock_irqsave(&priv->odb_lock, flags);
+		tsi721_odb_handler(priv);
+		for (j = 0; j < num && i >= tmo; j++)
+			if (status[j] == -EINPROGRESS)
+				tsi721_odb_cancel(priv, &status[j]);
+		spin_unlock_irqrestore(&priv->odb_lock, flags);
+
+		for (j = 0; j < num; j++)
+			if (status[j] == -EINPROGRESS)
+				break;
+		if (j == num)
+			break;
+		udelay(1);
 	}
+}
 
-	if (odb_count & TSI721_ODB_CNT_OK)
-		return 0;
+static bool tsi721_odb_done(int *status, int num)
+{
+	int j;
 
-	rval = ioread32(priv->regs + TSI721_SR_CHINT(0));
+	for (j = 0; j < num; j++)
+		if (READ_ONCE(status[j]) == -EINPROGRESS)
+			return false;
+	return true;
+}
 
-	tsi_err(&priv->pdev->dev,
-		 "Send Doorbell 0x%04x to destID 0x%x failed, STS=0x%x CNT=0x%08x",
-		 data, destid, rval, odb_count);
+/**
+ * tsi721_odb_wait_sleep - Sleeps until queued outbound doorbells complete
+ * @priv: tsi721 device-specific data structure
+ * @status: Completion status locations of the doorbells
+ * @num: Number of doorbells to wait for
+ * @tmo: Timeout in microseconds
+ *
+ * Doorbells are retired by the ODB interrupt handler, which wakes the
+ * requester up. Doorbells not completed within @tmo are cancelled.
+ */
+static void tsi721_odb_wait_sleep(struct tsi721_device *priv, int *status,
+				  int num, u32 tmo)
+{
+	unsigned long flags;
+	int j;
 
-	if (rval & TSI721_SR_CHINT_ODBTO)
-		return -EIO;
-	if (rval & TSI721_SR_CHINT_ODBERR)
-		return -EIO;
+	if (wait_event_timeout(priv->odb_wq, tsi721_odb_done(status, num),
+			       usecs_to_jiffies(tmo) + 1))
+		return;
+
+	spin_lock_irqsave(&priv->odb_lock, flags);
+	tsi721_odb_handler(priv);
+	for (j = 0; j < num; j++)
+		if (status[j] == -EINPROGRESS)
+			tsi721_odb_cancel(priv, &status[j]);
+	spin_unlock_irqrestore(&priv->odb_lock, flags);
+}
+
+/**
+ * tsi721_dsend_vec - Queue RapidIO doorbells for transmission
+ * @mport: RapidIO master port info
+ * @index: ID of RapidIO interface
+ * @db: Doorbells to send
+ * @num: Number of doorbells in @db
+ * @status: Where to store completion status of queued doorbells or %NULL
+ * @flags: RIO_DBELL_SLEEP if the caller can sleep waiting for completion
+ *
+ * Queues doorbells and returns without waiting for their transmission
+ * unless @status is given. Transmission errors of doorbells sent without
+ * @status are counted by the interrupt handler. Returns number of doorbells
+ * queued or %-EBUSY if the queue is full.
+ */
+static int tsi721_dsend_vec(struct rio_mport *mport, int index,
+			    const struct rio_dbell_msg *db, int num,
+			    int *status, u32 flags)
+{
+	struct tsi721_device *priv = mport->priv;
+	unsigned long flags;
+	u32 tmo;
+	int i;
 
-	if ((rval & TSI721_SR_CHINT_ODBRTRY) && rtry_cnt) {
-		rtry_cnt--;
-		goto retry;
+	spin_lock_irqsave(&priv->odb_lock, flags);
+	for (i = 0; i < num; i++) {
+		if (status)
+			status[i] = -EINPROGRESS;
+		if (tsi721_odb_add(priv, db[i].destid, db[i].data,
+				   status ? &status[i] : NULL))
+			break;
+	}
+	/* Allow 1ms for each queued doorbell */
+	tmo = 1000 * (priv->odb_wr - priv->odb_rd);
+	tsi721_odb_start(priv);
+	spin_unlock_irqrestore(&priv->odb_lock, flags);
+
+	if (status && i) {
+		if (flags & RIO_DBELL_SLEEP)
+			tsi721_odb_wait_sleep(priv, status, i, tmo);
+		else
+			tsi721_odb_wait(priv, status, i, tmo);
 	}
 
-	return -EAGAIN;
+	return i ? i : -EBUSY;
+}
+
+/**
+ * tsi721_dsend - Send a RapidIO doorbell
+ * @mport: RapidIO master port info
+ * @index: ID of RapidIO interface
+ * @destid: Destination ID of target device
+ * @data: 16-bit info field of RapidIO doorbell
+ *
+ * Sends a RapidIO doorbell message through the outbound doorbell queue
+ * and waits for its completion. Completion is polled because the caller
+ * may run in atomic context.
+ */
+static int tsi721_dsend(struct rio_mport *mport, int index,
+			u16 destid, u16 data)
+{
+	struct tsi721_device *priv = mport->priv;
+	int status = -EINPROGRESS;
+	unsigned long flags;
+	u32 tmo;
+
+	spin_lock_irqsave(&priv->odb_lock, flags);
+	if (tsi721_odb_add(priv, destid, data, &status)) {
+		spin_unlock_irqrestore(&priv->odb_lock, flags);
+		return -EBUSY;
+	}
+	/* Allow 1ms for each doorbell ahead of this one */
+	tmo = 1000 * (priv->odb_wr - priv->odb_rd);
+	tsi721_odb_start(priv);
+	spin_unlock_irqrestore(&priv->odb_lock, flags);
+
+	tsi721_odb_wait(priv, &status, 1, tmo);
+	return status;
 }
 
 /**
@@ -417,8 +946,6 @@ static int
 tsi721_dbell_handler(struct tsi721_device *priv)
 {
 	struct rio_mport *mport;
-	struct rio_dbell *dbell;
-	int found = 0;
 	u32 wr_ptr, rd_ptr;
 	u64 *idb_entry;
 	u32 regval;
@@ -451,18 +978,9 @@ repeat:
 		*idb_entry = 0;
 
 		/* Process one doorbell */
-		list_for_each_entry(dbell, &mport->dbells, node) {
-			if ((dbell->res->start <= DBELL_INF(idb.bytes)) &&
-			    (dbell->res->end >= DBELL_INF(idb.bytes))) {
-				found = 1;
-				break;
-			}
-		}
-
-		if (found) {
-			dbell->dinb(mport, dbell->dev_id, DBELL_SID(idb.bytes),
-				    DBELL_TID(idb.bytes), DBELL_INF(idb.bytes));
-		} else {
+		if (rio_dispatch_inb_dbell(mport, DBELL_SID(idb.bytes),
+					   DBELL_TID(idb.bytes),
+					   DBELL_INF(idb.bytes))) {
 			tsi_debug(DBELL, &priv->pdev->dev,
 				  "spurious IDB sid %2.2x tid %2.2x info %4.4x",
 				  DBELL_SID(idb.bytes), DBELL_TID(idb.bytes),
@@ -513,7 +1031,11 @@ static irqreturn_t tsi721_irqhandler(int irq, void *ptr)
 						TSI721_SR_CHINT(IDB_QUEUE));
 			if (intval & TSI721_SR_CHINT_IDBQRCV)
 				tsi721_dbell_handler(priv);
-			else
+			/* Outbound doorbells use the same channel */
+			if (intval & TSI721_SR_CHINT_ODB)
+				tsi721_odb_irq(priv);
+			if (!(intval & (TSI721_SR_CHINT_IDBQRCV |
+					TSI721_SR_CHINT_ODB)))
 				tsi_info(&priv->pdev->dev,
 					"Unexpected SR_CH_INT %x", intval);
 		}
@@ -606,7 +1128,7 @@ static void tsi721_interrupts_init(struct tsi721_device *priv)
 	/* Enable IDB interrupts */
 	iowrite32(TSI721_SR_CHINT_ALL,
 		priv->regs + TSI721_SR_CHINT(IDB_QUEUE));
-	iowrite32(TSI721_SR_CHINT_IDBQRCV,
+	iowrite32(TSI721_SR_CHINT_IDBQRCV | TSI721_SR_CHINT_ODB,
 		priv->regs + TSI721_SR_CHINTE(IDB_QUEUE));
 
 	/* Enable SRIO MAC interrupts */
@@ -708,6 +1230,40 @@ static irqreturn_t tsi721_sr2pc_ch_idb_msix(int irq, void *ptr)
 	return IRQ_HANDLED;
 }
 
+/**
+ * tsi721_sr2pc_ch_odb_msix - Tsi721 MSI-X SR2PC Channel interrupt handler
+ * @irq: Linux interrupt number
+ * @ptr: Pointer to interrupt-specific data (tsi721_device structure)
+ *
+ * Handles Tsi721 Outbound Doorbell completion interrupts from SR2PC
+ * Channel 0.
+ */
+static irqreturn_t tsi721_sr2pc_ch_odb_msix(int irq, void *ptr)
+{
+	tsi721_odb_irq((struct tsi721_device *)ptr);
+	return IRQ_HANDLED;
+}
+
+#ifdef CONFIG_RAPIDIO_DMA_ENGINE
+/**
+ * tsi721_maint_msix - MSI-X interrupt handler for maintenance BDMA channel
+ * @irq: Linux interrupt number
+ * @ptr: Pointer to interrupt-specific data (tsi721_device structure)
+ *
+ * Wakes up requester waiting for completion of maintenance transactions.
+ */
+static irqreturn_t tsi721_maint_msix(int irq, void *ptr)
+{
+	struct tsi721_device *priv = (struct tsi721_device *)ptr;
+
+	iowrite32(TSI721_DMAC_INT_ALL,
+		  priv->regs + TSI721_DMAC_BASE(priv->mdma.ch_id) +
+		  TSI721_DMAC_INT);
+	complete(&priv->mdma.done);
+	return IRQ_HANDLED;
+}
+#endif
+
 /**
  * tsi721_request_msix - register interrupt service for MSI-X mode.
  * @priv: tsi721 device-specific data structure
@@ -734,6 +1290,26 @@ static int tsi721_request_msix(struct tsi721_device *priv)
 		return err;
 	}
 
+	err = request_irq(priv->msix[TSI721_VECT_ODB].vector,
+			tsi721_sr2pc_ch_odb_msix, 0,
+			priv->msix[TSI721_VECT_ODB].irq_name, (void *)priv);
+	if (err) {
+		free_irq(priv->msix[TSI721_VECT_PWRX].vector, (void *)priv);
+		free_irq(priv->msix[TSI721_VECT_IDB].vector, (void *)priv);
+		return err;
+	}
+
+#ifdef CONFIG_RAPIDIO_DMA_ENGINE
+	/* Without it maintenance transactions complete by polling */
+	if (!request_irq(priv->msix[TSI721_VECT_DMA0_DONE +
+				    TSI721_DMACH_MAINT].vector,
+			 tsi721_maint_msix, 0,
+			 priv->msix[TSI721_VECT_DMA0_DONE +
+				    TSI721_DMACH_MAINT].irq_name,
+			 (void *)priv))
+		priv->mdma.irq = true;
+#endif
+
 	return 0;
 }
 
@@ -752,6 +1328,7 @@ static int tsi721_enable_msix(struct tsi721_device *priv)
 
 	entries[TSI721_VECT_IDB].entry = TSI721_MSIX_SR2PC_IDBQ_RCV(IDB_QUEUE);
 	entries[TSI721_VECT_PWRX].entry = TSI721_MSIX_SRIO_MAC_INT;
+	entries[TSI721_VECT_ODB].entry = TSI721_MSIX_SR2PC_CH_INT(0);
 
 	/*
 	 * Initialize MSI-X entries for Messaging Engine:
@@ -804,6 +1381,9 @@ static int tsi721_enable_msix(struct tsi721_device *priv)
 	priv->msix[TSI721_VECT_PWRX].vector = entries[TSI721_VECT_PWRX].vector;
 	snprintf(priv->msix[TSI721_VECT_PWRX].irq_name, IRQ_DEVICE_NAME_MAX,
 		 DRV_NAME "-pwrx@pci:%s", pci_name(priv->pdev));
+	priv->msix[TSI721_VECT_ODB].vector = entries[TSI721_VECT_ODB].vector;
+	snprintf(priv->msix[TSI721_VECT_ODB].irq_name, IRQ_DEVICE_NAME_MAX,
+		 DRV_NAME "-odb@pci:%s", pci_name(priv->pdev));
 
 	for (i = 0; i < RIO_MAX_MBOX; i++) {
 		priv->msix[TSI721_VECT_IMB0_RCV + i].vector =
@@ -877,65 +1457,91 @@ static void tsi721_free_irq(struct tsi721_device *priv)
 	if (priv->flags & TSI721_USING_MSIX) {
 		free_irq(priv->msix[TSI721_VECT_IDB].vector, (void *)priv);
 		free_irq(priv->msix[TSI721_VECT_PWRX].vector, (void *)priv);
+		free_irq(priv->msix[TSI721_VECT_ODB].vector, (void *)priv);
+#ifdef CONFIG_RAPIDIO_DMA_ENGINE
+		if (priv->mdma.irq) {
+			priv->mdma.irq = false;
+			free_irq(priv->msix[TSI721_VECT_DMA0_DONE +
+					    TSI721_DMACH_MAINT].vector,
+				 (void *)priv);
+		}
+#endif
 	} else
 #endif
 	free_irq(priv->pdev->irq, (void *)priv);
 }
 
+/**
+ * tsi721_obw_alloc - places an outbound window into PCIe BAR space
+ * @priv: pointer to tsi721 private data
+ * @pbar: BAR to allocate the window from
+ * @size: window size (power of two)
+ * @win_id: returned index of allocated window
+ *
+ * BAR space is handed out in power-of-two sized zones: a window starts at an
+ * address aligned to its size. Of the free gaps between windows of the BAR,
+ * the smallest one that holds such a zone is used (best fit), so windows
+ * refill holes left by windows of similar size and large aligned ranges stay
+ * available for large windows. Mapping and unmapping of windows thus does
+ * not fragment the BAR.
+ */
 static int
 tsi721_obw_alloc(struct tsi721_device *priv, struct tsi721_obw_bar *pbar,
 		 u32 size, int *win_id)
 {
-	u64 win_base;
-	u64 bar_base;
-	u64 bar_end;
-	u32 align;
+	struct tsi721_ob_win *used[TSI721_OBWIN_NUM];
 	struct tsi721_ob_win *win;
 	struct tsi721_ob_win *new_win = NULL;
 	int new_win_idx = -1;
-	int i = 0;
+	u64 gap_start, gap_end, zone;
+	u64 win_base = 0, best = 0;
+	int nused = 0;
+	int i, j;
 
-	bar_base = pbar->base;
-	bar_end =  bar_base + pbar->size;
-	win_base = bar_base;
-	align = size/TSI721_PC2SR_ZONES;
-
-	while (i < TSI721_IBWIN_NUM) {
-		for (i = 0; i < TSI721_IBWIN_NUM; i++) {
-			if (!priv->ob_win[i].active) {
-				if (new_win == NULL) {
-					new_win = &priv->ob_win[i];
-					new_win_idx = i;
-				}
-				continue;
-			}
+	/* Collect windows of the BAR sorted by address */
+	for (i = 0; i < TSI721_OBWIN_NUM; i++) {
+		win = &priv->ob_win[i];
 
-			/*
-			 * If this window belongs to the current BAR check it
-			 * for overlap
-			 */
-			win = &priv->ob_win[i];
-
-			if (win->base >= bar_base && win->base < bar_end) {
-				if (win_base < (win->base + win->size) &&
-						(win_base + size) > win->base) {
-					/* Overlap detected */
-					win_base = win->base + win->size;
-					win_base = ALIGN(win_base, align);
-					break;
-				}
+		if (!win->active) {
+			if (new_win == NULL) {
+				new_win = win;
+				new_win_idx = i;
 			}
+			continue;
 		}
-	}
 
-	if (win_base + size > bar_end)
-		return -ENOMEM;
+		if (win->pbar != pbar)
+			continue;
+
+		for (j = nused; j > 0 && used[j - 1]->base > win->base; j--)
+			used[j] = used[j - 1];
+		used[j] = win;
+		nused++;
+	}
 
 	if (!new_win) {
 		tsi_err(&priv->pdev->dev, "OBW count tracking failed");
 		return -EIO;
 	}
 
+	gap_start = pbar->base;
+	for (i = 0; i <= nused; i++) {
+		gap_end = (i < nused) ? used[i]->base : pbar->base + pbar->size;
+		zone = ALIGN(gap_start, size);
+
+		if (zone + size <= gap_end &&
+		    (!best || gap_end - gap_start < best)) {
+			best = gap_end - gap_start;
+			win_base = zone;
+		}
+
+		if (i < nused)
+			gap_start = used[i]->base + used[i]->size;
+	}
+
+	if (!best)
+		return -ENOMEM;
+
 	new_win->active = true;
 	new_win->base = win_base;
 	new_win->size = size;
@@ -954,6 +1560,7 @@ static int tsi721_map_outb_win(struct rio_mport *mport, u16 destid, u64 rstart,
 	struct tsi721_obw_bar *pbar;
 	struct tsi721_ob_win *ob_win;
 	int obw = -1;
+	int first;
 	u32 rval;
 	u64 rio_addr;
 	u32 zsize;
@@ -968,9 +1575,17 @@ static int tsi721_map_outb_win(struct rio_mport *mport, u16 destid, u64 rstart,
 	if (priv->obwin_cnt == 0)
 		return -EBUSY;
 
+	/*
+	 * Best fit: try the BAR with less free space first, keeping larger
+	 * free space of the other BAR for large windows.
+	 */
+	first = (priv->p2r_bar[1].free >= size &&
+		 (priv->p2r_bar[0].free < size ||
+		  priv->p2r_bar[1].free < priv->p2r_bar[0].free)) ? 1 : 0;
+
 	for (i = 0; i < 2; i++) {
-		if (priv->p2r_bar[i].free >= size) {
-			pbar = &priv->p2r_bar[i];
+		pbar = &priv->p2r_bar[first ^ i];
+		if (pbar->free >= size) {
 			ret = tsi721_obw_alloc(priv, pbar, size, &obw);
 			if (!ret)
 				break;
@@ -1395,6 +2010,11 @@ static int tsi721_doorbell_init(struct tsi721_device *priv)
 	 * Simply read counters register to ensure that it is cleared.
 	 */
 	ioread32(priv->regs + TSI721_ODB_CNT(0));
+	spin_lock_init(&priv->odb_lock);
+	init_waitqueue_head(&priv->odb_wq);
+	priv->odb_rd = priv->odb_wr = 0;
+	priv->odb_busy = false;
+	priv->odb_err_count = 0;
 
 	/* Initialize Inbound Doorbell processing DPC and queue */
 	priv->db_discard_count = 0;
@@ -1451,7 +2071,7 @@ static int tsi721_bdma_maint_init(struct tsi721_device *priv)
 	u64		*sts_ptr;
 	dma_addr_t	bd_phys, sts_phys;
 	int		sts_size;
-	int		bd_num = 2;
+	int		bd_num = TSI721_DMACH_MAINT_NBD;
 	void __iomem	*regs;
 
 	tsi_debug(MAINT, &priv->pdev->dev,
@@ -1462,6 +2082,8 @@ static int tsi721_bdma_maint_init(struct tsi721_device *priv)
 	 */
 
 	priv->mdma.ch_id = TSI721_DMACH_MAINT;
+	spin_lock_init(&priv->mdma.lock);
+	init_completion(&priv->mdma.done);
 	regs = priv->regs + TSI721_DMAC_BASE(TSI721_DMACH_MAINT);
 
 	/* Allocate space for DMA descriptors */
@@ -1687,32 +2309,64 @@ tsi721_omsg_interrupt_disable(struct tsi721_device *priv, int ch,
 }
 
 /**
- * tsi721_add_outb_message - Add message to the Tsi721 outbound message queue
- * @mport: Master port with outbound message queue
+ * tsi721_omsg_unmap_done - Release zero-copy buffers of sent OB messages
+ * @priv: pointer to tsi721 private data
+ * @mbox: Outbound mailbox
+ * @done_slot: Ring slot of the next message to be sent
+ * @status: Completion status of the messages
+ *
+ * Unmaps client buffers of all messages completed before @done_slot and
+ * accounts their completion. Must be called with omsg_ring[mbox].lock held.
+ */
+static void tsi721_omsg_unmap_done(struct tsi721_device *priv, int mbox,
+				   u32 done_slot, int status)
+{
+	struct tsi721_omsg_ring *ring = &priv->omsg_ring[mbox];
+	u32 i = ring->zc_rdptr;
+	u64 now = tsi721_ts();
+
+	while (i != done_slot) {
+		if (status)
+			ring->stats.errors++;
+		else
+			tsi721_qstats_add(&ring->stats, ring->omq_len[i],
+					  now - ring->omq_ts[i]);
+		trace_rio_omsg_done(&priv->mport, mbox, i, status,
+				    now - ring->omq_ts[i]);
+
+		if (ring->omq_zc_len[i]) {
+			dma_unmap_single(&priv->pdev->dev,
+					 ring->omq_zc_phys[i],
+					 ring->omq_zc_len[i], DMA_TO_DEVICE);
+			ring->omq_zc_len[i] = 0;
+		}
+
+		if (++i == ring->size)
+			i = 0;
+	}
+
+	ring->zc_rdptr = done_slot;
+}
+
+/**
+ * tsi721_omsg_post - Build OB message descriptor
+ * @priv: pointer to tsi721 private data
  * @rdev: Target of outbound message
  * @mbox: Outbound mailbox
- * @buffer: Message to add to outbound queue
+ * @dmbox: Destination mailbox
+ * @buf_phys: Bus address of message data
  * @len: Length of message
+ *
+ * Descriptor is passed to the messaging engine by tsi721_omsg_kick().
+ * Must be called with omsg_ring[mbox].lock held.
  */
-static int
-tsi721_add_outb_message(struct rio_mport *mport, struct rio_dev *rdev, int mbox,
-			void *buffer, size_t len)
+static void tsi721_omsg_post(struct tsi721_device *priv, struct rio_dev *rdev,
+			     int mbox, int dmbox, dma_addr_t buf_phys,
+			     size_t len)
 {
-	struct tsi721_device *priv = mport->priv;
+	struct rio_mport *mport = &priv->mport;
 	struct tsi721_omsg_desc *desc;
-	u32 tx_slot;
-	unsigned long flags;
-
-	if (!priv->omsg_init[mbox] ||
-	    len > TSI721_MSG_MAX_SIZE || len < 8)
-		return -EINVAL;
-
-	spin_lock_irqsave(&priv->omsg_ring[mbox].lock, flags);
-
-	tx_slot = priv->omsg_ring[mbox].tx_slot;
-
-	/* Copy copy message into transfer buffer */
-	memcpy(priv->omsg_ring[mbox].omq_base[tx_slot], buffer, len);
+	u32 tx_slot = priv->omsg_ring[mbox].tx_slot;
 
 	if (len & 0x7)
 		len += 8;
@@ -1720,19 +2374,19 @@ tsi721_add_outb_message(struct rio_mport *mport, struct rio_dev *rdev, int mbox,
 	/* Build descriptor associated with buffer */
 	desc = priv->omsg_ring[mbox].omd_base;
 	desc[tx_slot].type_id = cpu_to_le32((DTYPE4 << 29) | rdev->destid);
-#ifdef TSI721_OMSG_DESC_INT
 	/* Request IOF_DONE interrupt generation for each N-th frame in queue */
-	if (tx_slot % 4 == 0)
+	if (priv->omsg_ring[mbox].tx_frames &&
+	    tx_slot % priv->omsg_ring[mbox].tx_frames == 0)
 		desc[tx_slot].type_id |= cpu_to_le32(TSI721_OMD_IOF);
-#endif
 	desc[tx_slot].msg_info =
-		cpu_to_le32((mport->sys_size << 26) | (mbox << 22) |
+		cpu_to_le32((mport->sys_size << 26) | (dmbox << 22) |
 			    (0xe << 12) | (len & 0xff8));
-	desc[tx_slot].bufptr_lo =
-		cpu_to_le32((u64)priv->omsg_ring[mbox].omq_phys[tx_slot] &
-			    0xffffffff);
-	desc[tx_slot].bufptr_hi =
-		cpu_to_le32((u64)priv->omsg_ring[mbox].omq_phys[tx_slot] >> 32);
+	desc[tx_slot].bufptr_lo = cpu_to_le32((u64)buf_phys & 0xffffffff);
+	desc[tx_slot].bufptr_hi = cpu_to_le32((u64)buf_phys >> 32);
+
+	priv->omsg_ring[mbox].omq_ts[tx_slot] = tsi721_ts();
+	priv->omsg_ring[mbox].omq_len[tx_slot] = len;
+	trace_rio_omsg_enq(mport, mbox, tx_slot, rdev->destid, len);
 
 	priv->omsg_ring[mbox].wr_count++;
 
@@ -1742,18 +2396,177 @@ tsi721_add_outb_message(struct rio_mport *mport, struct rio_dev *rdev, int mbox,
 		/* Move through the ring link descriptor at the end */
 		priv->omsg_ring[mbox].wr_count++;
 	}
+}
 
+/**
+ * tsi721_omsg_kick - Pass all built OB message descriptors to the engine
+ * @priv: pointer to tsi721 private data
+ * @mbox: Outbound mailbox
+ *
+ * Must be called with omsg_ring[mbox].lock held.
+ */
+static void tsi721_omsg_kick(struct tsi721_device *priv, int mbox)
+{
 	mb();
 
 	/* Set new write count value */
 	iowrite32(priv->omsg_ring[mbox].wr_count,
 		priv->regs + TSI721_OBDMAC_DWRCNT(mbox));
+}
 
-	spin_unlock_irqrestore(&priv->omsg_ring[mbox].lock, flags);
+/**
+ * tsi721_omsg_queue - Place message into the Tsi721 outbound message ring
+ * @priv: pointer to tsi721 private data
+ * @mbox: Outbound mailbox
+ * @msg: Message to queue
+ *
+ * Message that consists of single 8-byte aligned fragment is sent directly
+ * from the caller's buffer, which stays mapped for DMA until transfer
+ * completion is reported: the descriptor buffer pointer must be 8-byte
+ * aligned. Other messages are copied (or gathered) into the ring's own
+ * message buffer. Frames of network stacks rarely start aligned (their IP
+ * header is aligned instead), callers that need zero-copy have to
+ * allocate their buffers with 8-byte aligned data.
+ * Must be called with omsg_ring[mbox].lock held.
+ */
+static int tsi721_omsg_queue(struct tsi721_device *priv, int mbox,
+			     struct rio_outb_msg *msg)
+{
+	struct tsi721_omsg_ring *ring = &priv->omsg_ring[mbox];
+	struct scatterlist *sgl = msg->sgl;
+	u32 tx_slot = ring->tx_slot;
+	dma_addr_t buf_phys = 0;
+	u32 map_len = ALIGN(msg->len, 8);
+
+	if (msg->len > TSI721_MSG_MAX_SIZE || msg->len < 8 ||
+	    msg->dmbox < 0 || msg->dmbox >= RIO_MAX_MBOX ||
+	    (sgl && msg->nents < 1))
+		return -EINVAL;
+
+	/* Release mapping left in slot if completion was not reported */
+	if (ring->omq_zc_len[tx_slot]) {
+		dma_unmap_single(&priv->pdev->dev, ring->omq_zc_phys[tx_slot],
+				 ring->omq_zc_len[tx_slot], DMA_TO_DEVICE);
+		ring->omq_zc_len[tx_slot] = 0;
+	}
+
+	if (sgl && msg->nents == 1 && IS_ALIGNED(sgl->offset, 8) &&
+	    sgl->length >= msg->len && !PageHighMem(sg_page(sgl))) {
+		buf_phys = dma_map_single(&priv->pdev->dev, sg_virt(sgl),
+					  map_len, DMA_TO_DEVICE);
+		if (dma_mapping_error(&priv->pdev->dev, buf_phys))
+			buf_phys = 0; /* fall back to copy */
+	}
+
+	if (buf_phys) {
+		ring->omq_zc_phys[tx_slot] = buf_phys;
+		ring->omq_zc_len[tx_slot] = map_len;
+	} else {
+		if (sgl)
+			sg_copy_to_buffer(sgl, msg->nents,
+					  ring->omq_base[tx_slot], msg->len);
+		else
+			memcpy(ring->omq_base[tx_slot], msg->buffer, msg->len);
+		buf_phys = ring->omq_phys[tx_slot];
+	}
 
+	tsi721_omsg_post(priv, msg->rdev, mbox, msg->dmbox, buf_phys,
+			 msg->len);
 	return 0;
 }
 
+/**
+ * tsi721_add_outb_messages - Add multiple messages to the Tsi721 outbound
+ *                            message queue
+ * @mport: Master port with outbound message queue
+ * @mbox: Outbound mailbox
+ * @msgs: Array of messages to add to outbound queue
+ * @num: Number of messages in @msgs
+ *
+ * All messages are passed to the messaging engine with single update of
+ * the descriptor write count register.
+ * Returns number of queued messages or negative error code if no message
+ * was queued.
+ */
+static int
+tsi721_add_outb_messages(struct rio_mport *mport, int mbox,
+			 struct rio_outb_msg *msgs, int num)
+{
+	struct tsi721_device *priv = mport->priv;
+	unsigned long flags;
+	int i, rc = 0;
+
+	if (!priv->omsg_init[mbox])
+		return -EINVAL;
+
+	spin_lock_irqsave(&priv->omsg_ring[mbox].lock, flags);
+
+	for (i = 0; i < num; i++) {
+		rc = tsi721_omsg_queue(priv, mbox, &msgs[i]);
+		if (rc)
+			break;
+	}
+
+	if (i)
+		tsi721_omsg_kick(priv, mbox);
+
+	spin_unlock_irqrestore(&priv->omsg_ring[mbox].lock, flags);
+
+	return i ? i : rc;
+}
+
+/**
+ * tsi721_add_outb_message - Add message to the Tsi721 outbound message queue
+ * @mport: Master port with outbound message queue
+ * @rdev: Target of outbound message
+ * @mbox: Outbound mailbox
+ * @buffer: Message to add to outbound queue
+ * @len: Length of message
+ */
+static int
+tsi721_add_outb_message(struct rio_mport *mport, struct rio_dev *rdev, int mbox,
+			void *buffer, size_t len)
+{
+	struct rio_outb_msg msg = {
+		.rdev = rdev,
+		.dmbox = mbox,
+		.buffer = buffer,
+		.len = len,
+	};
+	int rc;
+
+	rc = tsi721_add_outb_messages(mport, mbox, &msg, 1);
+	return rc < 0 ? rc : 0;
+}
+
+/**
+ * tsi721_add_outb_message_sg - Add message described by SG list to the Tsi721
+ *                              outbound message queue
+ * @mport: Master port with outbound message queue
+ * @rdev: Target of outbound message
+ * @mbox: Outbound mailbox
+ * @sgl: List of message fragments
+ * @nents: Number of entries in @sgl
+ * @len: Length of message
+ */
+static int
+tsi721_add_outb_message_sg(struct rio_mport *mport, struct rio_dev *rdev,
+			   int mbox, struct scatterlist *sgl, int nents,
+			   size_t len)
+{
+	struct rio_outb_msg msg = {
+		.rdev = rdev,
+		.dmbox = mbox,
+		.sgl = sgl,
+		.nents = nents,
+		.len = len,
+	};
+	int rc;
+
+	rc = tsi721_add_outb_messages(mport, mbox, &msg, 1);
+	return rc < 0 ? rc : 0;
+}
+
 /**
  * tsi721_omsg_handler - Outbound Message Interrupt Handler
  * @priv: pointer to tsi721 private data
@@ -1844,6 +2657,8 @@ static void tsi721_omsg_handler(struct tsi721_device *priv, int ch)
 		if (tx_slot == priv->omsg_ring[ch].size)
 			tx_slot = 0;
 
+		tsi721_omsg_unmap_done(priv, ch, tx_slot, 0);
+
 		dev_id = priv->omsg_ring[ch].dev_id;
 		do_callback = 1;
 	}
@@ -1869,6 +2684,7 @@ no_sts_update:
 		dev_id = priv->omsg_ring[ch].dev_id;
 		tx_slot = priv->omsg_ring[ch].tx_slot;
 		do_callback = 1;
+		tsi721_omsg_unmap_done(priv, ch, tx_slot, -EIO);
 
 		/* Synch tx_slot tracking */
 		iowrite32(priv->omsg_ring[ch].tx_slot,
@@ -1934,6 +2750,9 @@ static int tsi721_open_outb_mbox(struct rio_mport *mport, void *dev_id,
 	priv->omsg_ring[mbox].dev_id = dev_id;
 	priv->omsg_ring[mbox].size = entries;
 	priv->omsg_ring[mbox].sts_rdptr = 0;
+	priv->omsg_ring[mbox].zc_rdptr = 0;
+	for (i = 0; i < entries; i++)
+		priv->omsg_ring[mbox].omq_zc_len[i] = 0;
 	spin_lock_init(&priv->omsg_ring[mbox].lock);
 
 	/* Outbound Msg Buffer allocation based on
@@ -2027,6 +2846,9 @@ static int tsi721_open_outb_mbox(struct rio_mport *mport, void *dev_id,
 			free_irq(priv->msix[idx].vector, (void *)priv);
 			goto out_stat;
 		}
+
+		tsi721_msix_affinity(priv, TSI721_VECT_OMB0_DONE + mbox, true);
+		tsi721_msix_affinity(priv, TSI721_VECT_OMB0_INT + mbox, true);
 	}
 #endif /* CONFIG_PCI_MSI */
 
@@ -2108,6 +2930,8 @@ static void tsi721_close_outb_mbox(struct rio_mport *mport, int mbox)
 
 #ifdef CONFIG_PCI_MSI
 	if (priv->flags & TSI721_USING_MSIX) {
+		tsi721_msix_affinity(priv, TSI721_VECT_OMB0_DONE + mbox, false);
+		tsi721_msix_affinity(priv, TSI721_VECT_OMB0_INT + mbox, false);
 		free_irq(priv->msix[TSI721_VECT_OMB0_DONE + mbox].vector,
 			 (void *)priv);
 		free_irq(priv->msix[TSI721_VECT_OMB0_INT + mbox].vector,
@@ -2134,6 +2958,14 @@ static void tsi721_close_outb_mbox(struct rio_mport *mport, int mbox)
 
 	/* Free message buffers */
 	for (i = 0; i < priv->omsg_ring[mbox].size; i++) {
+		if (priv->omsg_ring[mbox].omq_zc_len[i]) {
+			dma_unmap_single(&priv->pdev->dev,
+					 priv->omsg_ring[mbox].omq_zc_phys[i],
+					 priv->omsg_ring[mbox].omq_zc_len[i],
+					 DMA_TO_DEVICE);
+			priv->omsg_ring[mbox].omq_zc_len[i] = 0;
+		}
+
 		if (priv->omsg_ring[mbox].omq_base[i]) {
 			dma_free_coherent(&priv->pdev->dev,
 				TSI721_MSG_BUFFER_SIZE,
@@ -2145,6 +2977,84 @@ static void tsi721_close_outb_mbox(struct rio_mport *mport, int mbox)
 	}
 }
 
+/**
+ * tsi721_imsg_itr_start - Start inbound message interrupt hold-off interval
+ * @priv: pointer to tsi721 private data
+ * @mbox: inbound mailbox number
+ *
+ * Masks DQ_RCV interrupt of the mailbox until the hold-off timer expires.
+ * Messages received in the meantime are signaled by a single interrupt once
+ * DQ_RCV is unmasked. In adaptive mode the hold-off interval is adjusted
+ * first, based on the number of messages received since previous interrupt.
+ * Called from tsi721_imsg_handler() with imsg_ring[mbox].lock held.
+ */
+static void tsi721_imsg_itr_start(struct tsi721_device *priv, int mbox)
+{
+	struct tsi721_imsg_ring *ring = &priv->imsg_ring[mbox];
+	int ch = mbox + 4;
+	u32 wr_ptr, frames, rval;
+
+	spin_lock(&ring->itr_lock);
+
+	if (ring->coal.adaptive) {
+		wr_ptr = ioread32(priv->regs + TSI721_IBDMAC_DQWR(ch)) &
+			 (ring->size - 1);
+		frames = (wr_ptr - ring->itr_wrptr) & (ring->size - 1);
+		ring->itr_wrptr = wr_ptr;
+
+		if (frames >= ring->coal.frames) {
+			ring->itr_usecs = min_t(u32,
+				max_t(u32, ring->itr_usecs * 2,
+				      TSI721_IMSG_ITR_MIN),
+				ring->coal.usecs ?: TSI721_IMSG_ITR_MAX);
+		} else if (frames < ring->coal.frames / 2) {
+			ring->itr_usecs /= 2;
+			if (ring->itr_usecs < TSI721_IMSG_ITR_MIN)
+				ring->itr_usecs = 0;
+		}
+	}
+
+	if (ring->itr_usecs && priv->imsg_init[mbox]) {
+		rval = ioread32(priv->regs + TSI721_IBDMAC_INTE(ch));
+		iowrite32(rval & ~TSI721_IBDMAC_INT_DQ_RCV,
+			  priv->regs + TSI721_IBDMAC_INTE(ch));
+		ring->itr_active = true;
+		hrtimer_start(&ring->itr_timer,
+			      ns_to_ktime((u64)ring->itr_usecs * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	}
+
+	spin_unlock(&ring->itr_lock);
+}
+
+/**
+ * tsi721_imsg_itr_timer - Inbound message interrupt hold-off timer handler
+ * @timer: hold-off timer of inbound mailbox
+ *
+ * Unmasks DQ_RCV interrupt at the end of hold-off interval unless the mailbox
+ * client keeps it masked (see tsi721_set_inb_mbox_irq()).
+ */
+static enum hrtimer_restart tsi721_imsg_itr_timer(struct hrtimer *timer)
+{
+	struct tsi721_imsg_ring *ring =
+		container_of(timer, struct tsi721_imsg_ring, itr_timer);
+	struct tsi721_device *priv = ring->priv;
+	int mbox = ring - priv->imsg_ring;
+	int ch = mbox + 4;
+	u32 rval;
+
+	spin_lock(&ring->itr_lock);
+	ring->itr_active = false;
+	if (!ring->irq_off && priv->imsg_init[mbox]) {
+		rval = ioread32(priv->regs + TSI721_IBDMAC_INTE(ch));
+		iowrite32(rval | TSI721_IBDMAC_INT_DQ_RCV,
+			  priv->regs + TSI721_IBDMAC_INTE(ch));
+	}
+	spin_unlock(&ring->itr_lock);
+
+	return HRTIMER_NORESTART;
+}
+
 /**
  * tsi721_imsg_handler - Inbound Message Interrupt Handler
  * @priv: pointer to tsi721 private data
@@ -2175,10 +3085,15 @@ static void tsi721_imsg_handler(struct tsi721_device *priv, int ch)
 	iowrite32(imsg_int, priv->regs + TSI721_IBDMAC_INT(ch));
 
 	/* If an IB Msg is received notify the upper layer */
+	if (imsg_int & TSI721_IBDMAC_INT_DQ_RCV)
+		priv->imsg_ring[mbox].irq_ts = tsi721_ts();
+
 	if (imsg_int & TSI721_IBDMAC_INT_DQ_RCV &&
-		mport->inb_msg[mbox].mcback)
+		mport->inb_msg[mbox].mcback) {
 		mport->inb_msg[mbox].mcback(mport,
 				priv->imsg_ring[mbox].dev_id, mbox, -1);
+		tsi721_imsg_itr_start(priv, mbox);
+	}
 
 	if (!(priv->flags & TSI721_USING_MSIX)) {
 		u32 ch_inte;
@@ -2226,10 +3141,22 @@ static int tsi721_open_inb_mbox(struct rio_mport *mport, void *dev_id,
 	priv->imsg_ring[mbox].rx_slot = 0;
 	priv->imsg_ring[mbox].desc_rdptr = 0;
 	priv->imsg_ring[mbox].fq_wrptr = 0;
+	priv->imsg_ring[mbox].fq_cnt = 0;
+	priv->imsg_ring[mbox].zc =
+		!!(mport->inb_msg[mbox].flags & RIO_MSG_ZEROCOPY);
 	for (i = 0; i < priv->imsg_ring[mbox].size; i++)
 		priv->imsg_ring[mbox].imq_base[i] = NULL;
 	spin_lock_init(&priv->imsg_ring[mbox].lock);
 
+	/*
+	 * In zero-copy mode messages are received directly into buffers
+	 * posted by mailbox owner. Skip allocation of intermediate buffers.
+	 */
+	if (priv->imsg_ring[mbox].zc) {
+		priv->imsg_ring[mbox].buf_base = NULL;
+		goto alloc_fq;
+	}
+
 	/* Allocate buffers for incoming messages */
 	priv->imsg_ring[mbox].buf_base =
 		dma_alloc_coherent(&priv->pdev->dev,
@@ -2244,6 +3171,7 @@ static int tsi721_open_inb_mbox(struct rio_mport *mport, void *dev_id,
 		goto out;
 	}
 
+alloc_fq:
 	/* Allocate memory for circular free list */
 	priv->imsg_ring[mbox].imfq_base =
 		dma_alloc_coherent(&priv->pdev->dev,
@@ -2272,9 +3200,9 @@ static int tsi721_open_inb_mbox(struct rio_mport *mport, void *dev_id,
 		goto out_dma;
 	}
 
-	/* Fill free buffer pointer list */
+	/* Fill free buffer pointer list (zero-copy: filled as buffers added) */
 	free_ptr = priv->imsg_ring[mbox].imfq_base;
-	for (i = 0; i < entries; i++)
+	for (i = 0; i < entries && !priv->imsg_ring[mbox].zc; i++)
 		free_ptr[i] = cpu_to_le64(
 				(u64)(priv->imsg_ring[mbox].buf_phys) +
 				i * 0x1000);
@@ -2343,17 +3271,29 @@ static int tsi721_open_inb_mbox(struct rio_mport *mport, void *dev_id,
 				(void *)priv);
 			goto out_desc;
 		}
+
+		tsi721_msix_affinity(priv, TSI721_VECT_IMB0_RCV + mbox, true);
+		tsi721_msix_affinity(priv, TSI721_VECT_IMB0_INT + mbox, true);
 	}
 #endif /* CONFIG_PCI_MSI */
 
+	/* Restart interrupt moderation with configured settings */
+	priv->imsg_ring[mbox].itr_usecs = priv->imsg_ring[mbox].coal.adaptive ?
+					0 : priv->imsg_ring[mbox].coal.usecs;
+	priv->imsg_ring[mbox].itr_wrptr = 0;
+	priv->imsg_ring[mbox].itr_active = false;
+	priv->imsg_ring[mbox].irq_off = false;
+
 	tsi721_imsg_interrupt_enable(priv, ch, TSI721_IBDMAC_INT_ALL);
 
 	/* Initialize Inbound Message Engine */
 	iowrite32(TSI721_IBDMAC_CTL_INIT, priv->regs + TSI721_IBDMAC_CTL(ch));
 	ioread32(priv->regs + TSI721_IBDMAC_CTL(ch));
 	udelay(10);
-	priv->imsg_ring[mbox].fq_wrptr = entries - 1;
-	iowrite32(entries - 1, priv->regs + TSI721_IBDMAC_FQWP(ch));
+	priv->imsg_ring[mbox].fq_wrptr =
+				priv->imsg_ring[mbox].zc ? 0 : entries - 1;
+	iowrite32(priv->imsg_ring[mbox].fq_wrptr,
+		  priv->regs + TSI721_IBDMAC_FQWP(ch));
 
 	priv->imsg_init[mbox] = 1;
 	return 0;
@@ -2377,10 +3317,11 @@ out_dma:
 	priv->imsg_ring[mbox].imfq_base = NULL;
 
 out_buf:
-	dma_free_coherent(&priv->pdev->dev,
-		priv->imsg_ring[mbox].size * TSI721_MSG_BUFFER_SIZE,
-		priv->imsg_ring[mbox].buf_base,
-		priv->imsg_ring[mbox].buf_phys);
+	if (priv->imsg_ring[mbox].buf_base)
+		dma_free_coherent(&priv->pdev->dev,
+			priv->imsg_ring[mbox].size * TSI721_MSG_BUFFER_SIZE,
+			priv->imsg_ring[mbox].buf_base,
+			priv->imsg_ring[mbox].buf_phys);
 
 	priv->imsg_ring[mbox].buf_base = NULL;
 
@@ -2410,6 +3351,8 @@ static void tsi721_close_inb_mbox(struct rio_mport *mport, int mbox)
 
 #ifdef CONFIG_PCI_MSI
 	if (priv->flags & TSI721_USING_MSIX) {
+		tsi721_msix_affinity(priv, TSI721_VECT_IMB0_RCV + mbox, false);
+		tsi721_msix_affinity(priv, TSI721_VECT_IMB0_INT + mbox, false);
 		free_irq(priv->msix[TSI721_VECT_IMB0_RCV + mbox].vector,
 				(void *)priv);
 		free_irq(priv->msix[TSI721_VECT_IMB0_INT + mbox].vector,
@@ -2417,15 +3360,26 @@ static void tsi721_close_inb_mbox(struct rio_mport *mport, int mbox)
 	}
 #endif /* CONFIG_PCI_MSI */
 
-	/* Clear Inbound Buffer Queue */
-	for (rx_slot = 0; rx_slot < priv->imsg_ring[mbox].size; rx_slot++)
+	hrtimer_cancel(&priv->imsg_ring[mbox].itr_timer);
+
+	/* Clear Inbound Buffer Queue (unmap client buffers in zero-copy mode) */
+	for (rx_slot = 0; rx_slot < priv->imsg_ring[mbox].size; rx_slot++) {
+		if (priv->imsg_ring[mbox].zc &&
+		    priv->imsg_ring[mbox].imq_base[rx_slot])
+			dma_unmap_single(&priv->pdev->dev,
+					 priv->imsg_ring[mbox].imq_dma[rx_slot],
+					 TSI721_MSG_BUFFER_SIZE,
+					 DMA_FROM_DEVICE);
 		priv->imsg_ring[mbox].imq_base[rx_slot] = NULL;
+	}
+	priv->imsg_ring[mbox].fq_cnt = 0;
 
 	/* Free memory allocated for message buffers */
-	dma_free_coherent(&priv->pdev->dev,
-		priv->imsg_ring[mbox].size * TSI721_MSG_BUFFER_SIZE,
-		priv->imsg_ring[mbox].buf_base,
-		priv->imsg_ring[mbox].buf_phys);
+	if (priv->imsg_ring[mbox].buf_base)
+		dma_free_coherent(&priv->pdev->dev,
+			priv->imsg_ring[mbox].size * TSI721_MSG_BUFFER_SIZE,
+			priv->imsg_ring[mbox].buf_base,
+			priv->imsg_ring[mbox].buf_phys);
 
 	priv->imsg_ring[mbox].buf_base = NULL;
 
@@ -2446,6 +3400,57 @@ static void tsi721_close_inb_mbox(struct rio_mport *mport, int mbox)
 	priv->imsg_ring[mbox].imd_base = NULL;
 }
 
+/**
+ * tsi721_add_inb_buffer_zc - Post client buffer into IB message free queue
+ * @priv: pointer to tsi721 private data
+ * @mbox: Inbound mailbox number
+ * @buf: Buffer to add to inbound queue
+ *
+ * Maps buffer for DMA and passes it to the messaging engine directly.
+ * Buffers are consumed by the engine in order they are posted.
+ * Free queue can hold up to (size - 1) buffers.
+ */
+static int tsi721_add_inb_buffer_zc(struct tsi721_device *priv, int mbox,
+				    void *buf)
+{
+	struct tsi721_imsg_ring *ring = &priv->imsg_ring[mbox];
+	u64 *free_ptr = ring->imfq_base;
+	u32 wr_ptr = ring->fq_wrptr;
+	dma_addr_t buf_phys;
+
+	if (ring->fq_cnt >= ring->size - 1)
+		return -ENOSPC;
+
+	buf_phys = dma_map_single(&priv->pdev->dev, buf,
+				  TSI721_MSG_BUFFER_SIZE, DMA_FROM_DEVICE);
+	if (dma_mapping_error(&priv->pdev->dev, buf_phys)) {
+		tsi_err(&priv->pdev->dev,
+			"IB MBOX%d failed to map inbound buffer", mbox);
+		return -ENOMEM;
+	}
+
+	if (!IS_ALIGNED(buf_phys, 8)) {
+		tsi_err(&priv->pdev->dev,
+			"IB MBOX%d unaligned inbound buffer", mbox);
+		dma_unmap_single(&priv->pdev->dev, buf_phys,
+				 TSI721_MSG_BUFFER_SIZE, DMA_FROM_DEVICE);
+		return -EINVAL;
+	}
+
+	ring->imq_base[wr_ptr] = buf;
+	ring->imq_dma[wr_ptr] = buf_phys;
+	free_ptr[wr_ptr] = cpu_to_le64((u64)buf_phys);
+	wmb();
+
+	if (++wr_ptr == ring->size)
+		wr_ptr = 0;
+	ring->fq_wrptr = wr_ptr;
+	ring->fq_cnt++;
+
+	iowrite32(wr_ptr, priv->regs + TSI721_IBDMAC_FQWP(mbox + 4));
+	return 0;
+}
+
 /**
  * tsi721_add_inb_buffer - Add buffer to the Tsi721 inbound message queue
  * @mport: Master port implementing the Inbound Messaging Engine
@@ -2458,6 +3463,9 @@ static int tsi721_add_inb_buffer(struct rio_mport *mport, int mbox, void *buf)
 	u32 rx_slot;
 	int rc = 0;
 
+	if (priv->imsg_ring[mbox].zc)
+		return tsi721_add_inb_buffer_zc(priv, mbox, buf);
+
 	rx_slot = priv->imsg_ring[mbox].rx_slot;
 	if (priv->imsg_ring[mbox].imq_base[rx_slot]) {
 		tsi_err(&priv->pdev->dev,
@@ -2496,32 +3504,63 @@ static void *tsi721_get_inb_message(struct rio_mport *mport, int mbox,
 	u64 *free_ptr;
 	int ch = mbox + 4;
 	int msg_size;
+	u32 desc_slot;
 
 	if (!priv->imsg_init[mbox])
 		return NULL;
 
+	desc_slot = priv->imsg_ring[mbox].desc_rdptr;
 	desc = priv->imsg_ring[mbox].imd_base;
-	desc += priv->imsg_ring[mbox].desc_rdptr;
+	desc += desc_slot;
 
 	if (!(le32_to_cpu(desc->msg_info) & TSI721_IMD_HO))
 		goto out;
 
+	rx_phys = ((u64)le32_to_cpu(desc->bufptr_hi) << 32) |
+			le32_to_cpu(desc->bufptr_lo);
+	msg_size = le32_to_cpu(desc->msg_info) & TSI721_IMD_BCOUNT;
+	if (msg_size == 0)
+		msg_size = RIO_MAX_MSG_SIZE;
+
+	if (priv->imsg_ring[mbox].zc) {
+		/* Message is already in client's buffer, just unmap it */
+		rx_slot = priv->imsg_ring[mbox].rx_slot;
+		buf = priv->imsg_ring[mbox].imq_base[rx_slot];
+		if (!buf || priv->imsg_ring[mbox].imq_dma[rx_slot] != rx_phys) {
+			tsi_err(&priv->pdev->dev,
+				"IB MBOX%d zero-copy buffer mismatch", mbox);
+			buf = NULL;
+			goto out;
+		}
+
+		dma_unmap_single(&priv->pdev->dev, rx_phys,
+				 TSI721_MSG_BUFFER_SIZE, DMA_FROM_DEVICE);
+		priv->imsg_ring[mbox].imq_base[rx_slot] = NULL;
+		if (++priv->imsg_ring[mbox].rx_slot ==
+						priv->imsg_ring[mbox].size)
+			priv->imsg_ring[mbox].rx_slot = 0;
+		priv->imsg_ring[mbox].fq_cnt--;
+
+		desc->msg_info &= cpu_to_le32(~TSI721_IMD_HO);
+		if (++priv->imsg_ring[mbox].desc_rdptr ==
+						priv->imsg_ring[mbox].size)
+			priv->imsg_ring[mbox].desc_rdptr = 0;
+
+		iowrite32(priv->imsg_ring[mbox].desc_rdptr,
+			priv->regs + TSI721_IBDMAC_DQRP(ch));
+		goto out_size;
+	}
+
 	rx_slot = priv->imsg_ring[mbox].rx_slot;
 	while (priv->imsg_ring[mbox].imq_base[rx_slot] == NULL) {
 		if (++rx_slot == priv->imsg_ring[mbox].size)
 			rx_slot = 0;
 	}
 
-	rx_phys = ((u64)le32_to_cpu(desc->bufptr_hi) << 32) |
-			le32_to_cpu(desc->bufptr_lo);
-
 	rx_virt = priv->imsg_ring[mbox].buf_base +
 		  (rx_phys - (u64)priv->imsg_ring[mbox].buf_phys);
 
 	buf = priv->imsg_ring[mbox].imq_base[rx_slot];
-	msg_size = le32_to_cpu(desc->msg_info) & TSI721_IMD_BCOUNT;
-	if (msg_size == 0)
-		msg_size = RIO_MAX_MSG_SIZE;
 
 	memcpy(buf, rx_virt, msg_size);
 	priv->imsg_ring[mbox].imq_base[rx_slot] = NULL;
@@ -2542,12 +3581,135 @@ static void *tsi721_get_inb_message(struct rio_mport *mport, int mbox,
 
 	iowrite32(priv->imsg_ring[mbox].fq_wrptr,
 		priv->regs + TSI721_IBDMAC_FQWP(ch));
+out_size:
+	tsi721_qstats_add(&priv->imsg_ring[mbox].stats, msg_size,
+			  tsi721_ts() - priv->imsg_ring[mbox].irq_ts);
+	trace_rio_imsg_rx(mport, mbox, desc_slot, msg_size);
 	if (msize)
 		*msize = msg_size;
 out:
 	return buf;
 }
 
+/**
+ * tsi721_set_inb_mbox_irq - Mask/unmask Tsi721 inbound message interrupt
+ * @mport: Master port implementing the Inbound Messaging Engine
+ * @mbox: Inbound mailbox number
+ * @enable: 1 = unmask, 0 = mask message receive (DQ_RCV) interrupt
+ *
+ * Used by mailbox clients that drain the inbound queue by polling.
+ * Pending receive status is not cleared on unmask so a message that arrived
+ * while the interrupt was masked is signaled immediately. If the interrupt
+ * is held off by interrupt moderation, unmask is deferred until the end of
+ * hold-off interval.
+ */
+static int tsi721_set_inb_mbox_irq(struct rio_mport *mport, int mbox,
+				   int enable)
+{
+	struct tsi721_device *priv = mport->priv;
+	struct tsi721_imsg_ring *ring;
+	int ch = mbox + 4;
+	unsigned long flags;
+	u32 rval;
+
+	if (mbox < 0 || mbox >= RIO_MAX_MBOX || !priv->imsg_init[mbox])
+		return -EINVAL;
+
+	ring = &priv->imsg_ring[mbox];
+	spin_lock_irqsave(&ring->itr_lock, flags);
+	ring->irq_off = !enable;
+	if (!ring->itr_active) {
+		rval = ioread32(priv->regs + TSI721_IBDMAC_INTE(ch));
+		if (enable)
+			rval |= TSI721_IBDMAC_INT_DQ_RCV;
+		else
+			rval &= ~TSI721_IBDMAC_INT_DQ_RCV;
+		iowrite32(rval, priv->regs + TSI721_IBDMAC_INTE(ch));
+	}
+	spin_unlock_irqrestore(&ring->itr_lock, flags);
+
+	return 0;
+}
+
+/**
+ * tsi721_get_mbox_coalesce - Read mailbox interrupt moderation settings
+ * @mport: Master port implementing the Messaging Engine
+ * @mbox: Mailbox number
+ * @inb: true = inbound, false = outbound mailbox
+ * @ec: Pointer to structure to be filled with current settings
+ */
+static int tsi721_get_mbox_coalesce(struct rio_mport *mport, int mbox,
+				    bool inb, struct rio_mbox_coalesce *ec)
+{
+	struct tsi721_device *priv = mport->priv;
+
+	if (mbox < 0 || mbox >= RIO_MAX_MBOX)
+		return -EINVAL;
+
+	if (inb) {
+		*ec = priv->imsg_ring[mbox].coal;
+	} else {
+		ec->usecs = 0;
+		ec->frames = priv->omsg_ring[mbox].tx_frames;
+		ec->adaptive = false;
+	}
+
+	return 0;
+}
+
+/**
+ * tsi721_set_mbox_coalesce - Change mailbox interrupt moderation settings
+ * @mport: Master port implementing the Messaging Engine
+ * @mbox: Mailbox number
+ * @inb: true = inbound, false = outbound mailbox
+ * @ec: New interrupt moderation settings
+ *
+ * Outbound messaging engine supports frame count moderation only: IOF_DONE
+ * interrupt is requested for each N-th descriptor (0 = notify only when the
+ * engine completes all queued descriptors). Inbound messaging engine has no
+ * frame count threshold and is moderated by holding off DQ_RCV interrupt
+ * for specified interval. In adaptive mode the interval is tuned to deliver
+ * about @ec->frames messages per interrupt.
+ */
+static int tsi721_set_mbox_coalesce(struct rio_mport *mport, int mbox,
+				    bool inb, const struct rio_mbox_coalesce *ec)
+{
+	struct tsi721_device *priv = mport->priv;
+	struct tsi721_imsg_ring *ring;
+	unsigned long flags;
+
+	if (mbox < 0 || mbox >= RIO_MAX_MBOX)
+		return -EINVAL;
+
+	if (!inb) {
+		if (ec->usecs || ec->adaptive ||
+		    ec->frames > TSI721_OMSGD_RING_SIZE)
+			return -EINVAL;
+		priv->omsg_ring[mbox].tx_frames = ec->frames;
+		return 0;
+	}
+
+	/* Frame count is used only as a target of adaptive mode */
+	if (ec->usecs > TSI721_IMSG_ITR_MAX ||
+	    ec->frames > TSI721_IMSGD_RING_SIZE ||
+	    (ec->adaptive != !!ec->frames))
+		return -EINVAL;
+
+	ring = &priv->imsg_ring[mbox];
+	spin_lock_irqsave(&ring->itr_lock, flags);
+	ring->coal = *ec;
+	if (!ec->adaptive)
+		ring->itr_usecs = ec->usecs;
+	else if (ec->usecs && ring->itr_usecs > ec->usecs)
+		ring->itr_usecs = ec->usecs;
+	spin_unlock_irqrestore(&ring->itr_lock, flags);
+
+	tsi_debug(IMSG, &priv->pdev->dev,
+		  "IB MBOX%d: usecs=%u frames=%u adaptive=%d",
+		  mbox, ec->usecs, ec->frames, ec->adaptive);
+	return 0;
+}
+
 /**
  * tsi721_messages_init - Initialization of Messaging Engine
  * @priv: pointer to tsi721 private data
@@ -2557,6 +3719,7 @@ out:
 static int tsi721_messages_init(struct tsi721_device *priv)
 {
 	int	ch;
+	int	mbox;
 
 	iowrite32(0, priv->regs + TSI721_SMSG_ECC_LOG);
 	iowrite32(0, priv->regs + TSI721_RETRY_GEN_CNT);
@@ -2576,6 +3739,17 @@ static int tsi721_messages_init(struct tsi721_device *priv)
 				priv->regs + TSI721_SMSG_ECC_NCOR(ch));
 	}
 
+	/* Inbound mailbox interrupt moderation is off by default */
+	for (mbox = 0; mbox < RIO_MAX_MBOX; mbox++) {
+		struct tsi721_imsg_ring *ring = &priv->imsg_ring[mbox];
+
+		ring->priv = priv;
+		spin_lock_init(&ring->itr_lock);
+		hrtimer_init(&ring->itr_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		ring->itr_timer.function = tsi721_imsg_itr_timer;
+	}
+
 	return 0;
 }
 
@@ -2602,13 +3776,14 @@ static int tsi721_query_mport(struct rio_mport *mport,
 		attr->link_speed = RIO_LINK_DOWN;
 
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
-	attr->flags = RIO_MPORT_DMA | RIO_MPORT_DMA_SG;
+	attr->flags = RIO_MPORT_DMA | RIO_MPORT_DMA_SG | RIO_MPORT_DMA_VEC;
 	attr->dma_max_sge = 0;
 	attr->dma_max_size = TSI721_BDMA_MAX_BCOUNT;
 	attr->dma_align = 0;
 #else
 	attr->flags = 0;
 #endif
+	attr->flags |= RIO_MPORT_IBMSG_ZC;
 	return 0;
 }
 
@@ -2668,12 +3843,16 @@ static struct rio_ops tsi721_rio_ops = {
 	.lcwrite		= tsi721_lcwrite,
 	.cread			= tsi721_cread_dma,
 	.cwrite			= tsi721_cwrite_dma,
+	.cmaint_vec		= tsi721_cmaint_vec,
 	.dsend			= tsi721_dsend,
+	.dsend_vec		= tsi721_dsend_vec,
 	.open_inb_mbox		= tsi721_open_inb_mbox,
 	.close_inb_mbox		= tsi721_close_inb_mbox,
 	.open_outb_mbox		= tsi721_open_outb_mbox,
 	.close_outb_mbox	= tsi721_close_outb_mbox,
 	.add_outb_message	= tsi721_add_outb_message,
+	.add_outb_message_sg	= tsi721_add_outb_message_sg,
+	.add_outb_messages	= tsi721_add_outb_messages,
 	.add_inb_buffer		= tsi721_add_inb_buffer,
 	.get_inb_message	= tsi721_get_inb_message,
 	.map_inb		= tsi721_rio_map_inb_mem,
@@ -2682,6 +3861,9 @@ static struct rio_ops tsi721_rio_ops = {
 	.query_mport		= tsi721_query_mport,
 	.map_outb		= tsi721_map_outb_win,
 	.unmap_outb		= tsi721_unmap_outb_win,
+	.set_inb_mbox_irq	= tsi721_set_inb_mbox_irq,
+	.get_mbox_coalesce	= tsi721_get_mbox_coalesce,
+	.set_mbox_coalesce	= tsi721_set_mbox_coalesce,
 };
 
 static void tsi721_mport_release(struct device *dev)
@@ -2774,6 +3956,84 @@ err_exit:
 	return err;
 }
 
+static void tsi721_qstats_show(struct seq_file *m, const char *name, int id,
+			       struct tsi721_qstats *st)
+{
+	int i;
+
+	seq_printf(m, "%s%-3d %12llu %14llu %8llu %8llu %10llu %10llu ",
+		   name, id, st->ops, st->bytes, st->errors, st->busy,
+		   st->ops ? div64_u64(st->lat_sum, st->ops) : 0,
+		   st->lat_max);
+	for (i = 0; i < TSI721_LAT_BUCKETS; i++)
+		seq_printf(m, " %llu", st->lat[i]);
+	seq_putc(m, '\n');
+}
+
+/*
+ * tsi721_stats_show - shows statistics of messaging and DMA queues
+ *
+ * Latency columns are in ns. The histogram counts latencies below
+ * 2^N * 1024 ns in column N, the last column counts all longer ones.
+ */
+static int tsi721_stats_show(struct seq_file *m, void *v)
+{
+	struct tsi721_device *priv = m->private;
+	int i;
+
+	seq_printf(m, "%-8s %12s %14s %8s %8s %10s %10s  %s\n",
+		   "queue", "ops", "bytes", "errors", "busy", "lat_avg",
+		   "lat_max", "lat_hist");
+
+	for (i = 0; i < TSI721_OMSG_CHNUM; i++)
+		if (priv->omsg_init[i])
+			tsi721_qstats_show(m, "omsg", i,
+					   &priv->omsg_ring[i].stats);
+	for (i = 0; i < TSI721_IMSG_CHNUM; i++)
+		if (priv->imsg_init[i])
+			tsi721_qstats_show(m, "imsg", i,
+					   &priv->imsg_ring[i].stats);
+	tsi721_qstats_show(m, "maint", priv->mdma.ch_id, &priv->mdma.stats);
+#ifdef CONFIG_RAPIDIO_DMA_ENGINE
+	for (i = 0; i < TSI721_DMA_CHNUM; i++)
+		if (i != priv->mdma.ch_id && priv->bdma[i].bd_base)
+			tsi721_qstats_show(m, "bdma", i, &priv->bdma[i].stats);
+#endif
+
+	seq_printf(m, "ib_dbell_discard %u ob_dbell_err %u pw_discard %u\n",
+		   priv->db_discard_count, priv->odb_err_count,
+		   priv->pw_discard_count);
+	return 0;
+}
+
+static int tsi721_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tsi721_stats_show, inode->i_private);
+}
+
+static const struct file_operations tsi721_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= tsi721_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void tsi721_debugfs_init(struct tsi721_device *priv)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "tsi721_%s", pci_name(priv->pdev));
+	priv->dbg_dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(priv->dbg_dir)) {
+		priv->dbg_dir = NULL;
+		return;
+	}
+
+	debugfs_create_file("stats", S_IRUGO, priv->dbg_dir, priv,
+			    &tsi721_stats_fops);
+}
+
 static int tsi721_probe(struct pci_dev *pdev,
 				  const struct pci_device_id *id)
 {
@@ -2781,7 +4041,9 @@ static int tsi721_probe(struct pci_dev *pdev,
 	int err;
 	u32 rval;
 
-	priv = kzalloc(sizeof(struct tsi721_device), GFP_KERNEL);
+	/* Keep driver state on the node the device is attached to */
+	priv = kzalloc_node(sizeof(struct tsi721_device), GFP_KERNEL,
+			    dev_to_node(&pdev->dev));
 	if (!priv) {
 		err = -ENOMEM;
 		goto err_exit;
@@ -3077,6 +4339,7 @@ static int tsi721_probe(struct pci_dev *pdev,
 
 	pci_set_drvdata(pdev, priv);
 	tsi721_interrupts_init(priv);
+	tsi721_debugfs_init(priv);
 
 	return 0;
 
@@ -3107,6 +4370,7 @@ static void tsi721_remove(struct pci_dev *pdev)
 
 	tsi_debug(EXIT, &pdev->dev, "enter");
 
+	debugfs_remove_recursive(priv->dbg_dir);
 	tsi721_disable_ints(priv);
 	tsi721_free_irq(priv);
 	flush_scheduled_work();
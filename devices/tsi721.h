@@ -81,6 +81,8 @@ extern u32 dbg_level;
 #define TSI721_MAINT_WIN	0 /* Window for outbound maintenance requests */
 #define IDB_QUEUE		0 /* Inbound Doorbell Queue to use */
 #define IDB_QSIZE		512 /* Inbound Doorbell Queue size */
+#define ODB_QSIZE		256 /* Outbound Doorbell Queue size (sw) */
+#define ODB_RETRY		100 /* Outbound Doorbell retries on RETRY */
 
 /* Memory space sizes */
 #define TSI721_REG_SPACE_SIZE		(512 * 1024) /* 512K */
@@ -199,6 +201,8 @@ extern u32 dbg_level;
 #define TSI721_SR_CHINT_ODBRTRY	0x00000002
 #define TSI721_SR_CHINT_ODBERR	0x00000001
 #define TSI721_SR_CHINT_ALL	0x0000003f
+#define TSI721_SR_CHINT_ODB	(TSI721_SR_CHINT_ODBOK | TSI721_SR_CHINT_ODBTO | \
+				 TSI721_SR_CHINT_ODBRTRY | TSI721_SR_CHINT_ODBERR)
 
 #define TSI721_ODB_CNT(x)	(0x20100 + (x) * 0x1000)
 #define TSI721_ODB_CNT_TOT	0xffff0000
@@ -360,6 +364,10 @@ extern u32 dbg_level;
 #define TSI721_OMSGD_MIN_RING_SIZE	32
 #define TSI721_OMSGD_RING_SIZE		512
 
+/* Inbound message interrupt moderation limits (usec) */
+#define TSI721_IMSG_ITR_MIN		8
+#define TSI721_IMSG_ITR_MAX		1000
+
 /*
  * Outbound Messaging Engine Registers
  *   x = 0..7
@@ -692,6 +700,50 @@ enum tsi721_smsg_int_flag {
 
 /* Structures */
 
+#define TSI721_LAT_BUCKETS	16
+
+/**
+ * struct tsi721_qstats - messaging or DMA queue statistics
+ * @ops: number of completed messages or transfers
+ * @bytes: number of bytes transferred
+ * @errors: number of failed messages or transfers
+ * @busy: number of requests refused because the queue was full
+ * @lat_sum: sum of latencies in ns
+ * @lat_max: maximum latency in ns
+ * @lat: latency histogram, bucket N counts latencies below 2^N * 1024 ns,
+ *       the last bucket counts all longer ones
+ *
+ * Counters are updated by the context that services the queue and are
+ * read without locking.
+ */
+struct tsi721_qstats {
+	u64	ops;
+	u64	bytes;
+	u64	errors;
+	u64	busy;
+	u64	lat_sum;
+	u64	lat_max;
+	u64	lat[TSI721_LAT_BUCKETS];
+};
+
+static inline u64 tsi721_ts(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static inline void tsi721_qstats_add(struct tsi721_qstats *st, u32 bytes,
+				     u64 lat_ns)
+{
+	int b = fls64(lat_ns >> 10);
+
+	st->ops++;
+	st->bytes += bytes;
+	st->lat_sum += lat_ns;
+	if (lat_ns > st->lat_max)
+		st->lat_max = lat_ns;
+	st->lat[min(b, TSI721_LAT_BUCKETS - 1)]++;
+}
+
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
 
 #define TSI721_BDMA_MAX_BCOUNT	(TSI721_DMAD_BCOUNT1 + 1)
@@ -712,6 +764,14 @@ struct tsi721_tx_desc {
 	u16						sssize;
 	u16						dsdist;
 	u16						dssize;
+	/* vectored transfer elements (NULL for single target) */
+	struct rio_dma_seg		*segs;
+	unsigned int			nsegs;
+	unsigned int			seg_idx;	/* current element */
+	unsigned int			seg_left;	/* its SG entries left */
+	unsigned int			seg_done;	/* completed elements */
+	u32				len;	/* total transfer length */
+	u64				ts;	/* submission time, ns */
 };
 
 struct tsi721_bdma_chan {
@@ -733,12 +793,32 @@ struct tsi721_bdma_chan {
 	struct tsi721_tx_desc	*active_tx;
 	struct list_head	queue;
 	struct list_head	free_list;
+	struct list_head	err_list;	/* failed, callback pending */
 	struct tasklet_struct	tasklet;
 	bool			active;
+	spinlock_t		svc_lock;	/* serializes status processing */
+	u32			inte;		/* enabled channel interrupts */
+	spinlock_t		inte_lock;	/* protects @inte and INTE */
+	struct tsi721_qstats	stats;
 };
 
 #endif /* CONFIG_RAPIDIO_DMA_ENGINE */
 
+/*
+ * Batch of maintenance transactions placed into the maintenance BDMA
+ * channel. A batch of a requester that sleeps waiting for its completion
+ * is retired by whoever uses the channel next, if that happens first.
+ */
+struct tsi721_maint_req {
+	struct rio_maint_op *ops;
+	int		n;		/* transactions in the batch */
+	u32		pos[TSI721_DMACH_MAINT_NBD]; /* BD used by transaction */
+	u32		cnt[TSI721_DMACH_MAINT_NBD]; /* BD count when done */
+	bool		use_irq;	/* completion interrupt enabled */
+	bool		timeout;	/* channel did not stop */
+	u64		ts;
+};
+
 struct tsi721_bdma_maint {
 	int		ch_id;		/* BDMA channel number */
 	int		bd_num;		/* number of buffer descriptors */
@@ -747,6 +827,11 @@ struct tsi721_bdma_maint {
 	void		*sts_base;	/* start of DMA BD status FIFO */
 	dma_addr_t	sts_phys;
 	int		sts_size;
+	spinlock_t	lock;		/* serializes use of the channel */
+	struct tsi721_maint_req *req;	/* batch in flight or NULL */
+	struct completion done;		/* batch completion interrupt */
+	bool		irq;		/* completion interrupt available */
+	struct tsi721_qstats stats;	/* latency is per batch */
 };
 
 struct tsi721_imsg_ring {
@@ -762,12 +847,30 @@ struct tsi721_imsg_ring {
 	dma_addr_t	imd_phys;
 	 /* Inbound Queue buffer pointers */
 	void		*imq_base[TSI721_IMSGD_RING_SIZE];
+	/* Zero-copy mode: bus addresses of mapped client buffers */
+	dma_addr_t	imq_dma[TSI721_IMSGD_RING_SIZE];
+	bool		zc;
+	u32		fq_cnt; /* zero-copy buffers owned by HW or unread */
 
 	u32		rx_slot;
 	void		*dev_id;
 	u32		fq_wrptr;
 	u32		desc_rdptr;
 	spinlock_t	lock;
+
+	/* Receive interrupt moderation */
+	struct tsi721_device *priv;
+	struct hrtimer	itr_timer;	/* DQ_RCV hold-off timer */
+	spinlock_t	itr_lock;	/* protects DQ_RCV enable state */
+	u32		itr_usecs;	/* current hold-off interval */
+	u32		itr_wrptr;	/* DQ write pointer at last interrupt */
+	bool		itr_active;	/* DQ_RCV masked by hold-off timer */
+	bool		irq_off;	/* DQ_RCV masked by mailbox client */
+	struct rio_mbox_coalesce coal;
+
+	/* Latency is measured from the last DQ_RCV interrupt to delivery */
+	struct tsi721_qstats stats;
+	u64		irq_ts;
 };
 
 struct tsi721_omsg_ring {
@@ -778,6 +881,10 @@ struct tsi721_omsg_ring {
 	/* VA/PA of OB Msg data buffers */
 	void		*omq_base[TSI721_OMSGD_RING_SIZE];
 	dma_addr_t	omq_phys[TSI721_OMSGD_RING_SIZE];
+	/* Mappings of client buffers sent without copy (len = 0 if unused) */
+	dma_addr_t	omq_zc_phys[TSI721_OMSGD_RING_SIZE];
+	u32		omq_zc_len[TSI721_OMSGD_RING_SIZE];
+	u32		zc_rdptr; /* first slot that may hold a mapping */
 	/* VA/PA of OB Msg descriptor status FIFO */
 	void		*sts_base;
 	dma_addr_t	sts_phys;
@@ -788,6 +895,12 @@ struct tsi721_omsg_ring {
 	void		*dev_id;
 	u32		wr_count;
 	spinlock_t	lock;
+	u32		tx_frames; /* request IOF_DONE for each N-th frame */
+
+	/* Latency is measured from queueing to completion */
+	struct tsi721_qstats stats;
+	u64		omq_ts[TSI721_OMSGD_RING_SIZE];
+	u32		omq_len[TSI721_OMSGD_RING_SIZE];
 };
 
 enum tsi721_flags {
@@ -819,6 +932,7 @@ enum tsi721_flags {
 enum tsi721_msix_vect {
 	TSI721_VECT_IDB,
 	TSI721_VECT_PWRX, /* PW_RX is part of SRIO MAC Interrupt reporting */
+	TSI721_VECT_ODB, /* Outbound doorbell completion (SR2PC CH_INT) */
 	TSI721_VECT_OMB0_DONE,
 	TSI721_VECT_OMB1_DONE,
 	TSI721_VECT_OMB2_DONE,
@@ -893,6 +1007,18 @@ struct tsi721_ob_win {
 	struct tsi721_obw_bar *pbar;
 };
 
+/**
+ * struct tsi721_odb_req - Queued outbound doorbell
+ * @destid: Destination ID of target device
+ * @data: 16-bit info field of doorbell
+ * @status: Where to store completion status (optional)
+ */
+struct tsi721_odb_req {
+	u16		destid;
+	u16		data;
+	int		*status;
+};
+
 struct tsi721_device {
 	struct pci_dev	*pdev;
 	struct rio_mport mport;
@@ -906,6 +1032,14 @@ struct tsi721_device {
 	void		*idb_base;
 	dma_addr_t	idb_dma;
 	u32		db_discard_count;
+	struct tsi721_odb_req odb_queue[ODB_QSIZE];
+	spinlock_t	odb_lock;	/* protects outbound doorbell queue */
+	u32		odb_rd;		/* next doorbell to complete */
+	u32		odb_wr;		/* next free queue entry */
+	bool		odb_busy;	/* doorbell at odb_rd is in flight */
+	int		odb_rtry;	/* retries left for in-flight doorbell */
+	u32		odb_err_count;
+	wait_queue_head_t odb_wq;	/* sleeping doorbell requesters */
 
 	/* Inbound Port-Write */
 	struct work_struct pw_work;
@@ -936,8 +1070,29 @@ struct tsi721_device {
 	struct tsi721_obw_bar p2r_bar[2];
 	struct tsi721_ob_win  ob_win[TSI721_OBWIN_NUM];
 	int		obwin_cnt;
+
+	struct dentry	*dbg_dir;
 };
 
+#ifdef CONFIG_PCI_MSI
+/*
+ * Steers MSI-X vector to CPUs of the device's NUMA node, so that ring
+ * processing stays on the node the rings are allocated on. The hint is
+ * cleared with set == false before the vector is freed.
+ */
+static inline void tsi721_msix_affinity(struct tsi721_device *priv, int idx,
+					bool set)
+{
+	int node = dev_to_node(&priv->pdev->dev);
+
+	if (node == NUMA_NO_NODE)
+		return;
+
+	irq_set_affinity_hint(priv->msix[idx].vector,
+			      set ? cpumask_of_node(node) : NULL);
+}
+#endif /* CONFIG_PCI_MSI */
+
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
 extern void tsi721_bdma_handler(struct tsi721_bdma_chan *bdma_chan);
 extern int tsi721_register_dma(struct tsi721_device *priv);
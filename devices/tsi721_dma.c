@@ -32,12 +32,14 @@
 #include <linux/kfifo.h>
 #include <linux/sched.h>
 #include <linux/delay.h>
+#include <linux/completion.h>
 #include "../include/dmaengine.h"
 #include <linux/slab.h>
 #include <linux/dmaengine.h>
 #include <linux/version.h>
 
 #include "tsi721.h"
+#include "../include/rio_trace.h"
 
 #ifdef CONFIG_PCI_MSI
 static irqreturn_t tsi721_bdma_msix(int irq, void *ptr);
@@ -187,6 +189,11 @@ static int tsi721_bdma_ch_init(struct tsi721_bdma_chan *bdma_chan, int bd_num)
 				priv->msix[TSI721_VECT_DMA0_DONE +
 					    bdma_chan->id].vector,
 				(void *)bdma_chan);
+		} else {
+			tsi721_msix_affinity(priv, TSI721_VECT_DMA0_DONE +
+					     bdma_chan->id, true);
+			tsi721_msix_affinity(priv, TSI721_VECT_DMA0_INT +
+					     bdma_chan->id, true);
 		}
 
 err_out:
@@ -238,6 +245,10 @@ static int tsi721_bdma_ch_free(struct tsi721_bdma_chan *bdma_chan)
 
 #ifdef CONFIG_PCI_MSI
 	if (priv->flags & TSI721_USING_MSIX) {
+		tsi721_msix_affinity(priv, TSI721_VECT_DMA0_DONE +
+				     bdma_chan->id, false);
+		tsi721_msix_affinity(priv, TSI721_VECT_DMA0_INT +
+				     bdma_chan->id, false);
 		free_irq(priv->msix[TSI721_VECT_DMA0_DONE +
 				    bdma_chan->id].vector, (void *)bdma_chan);
 		free_irq(priv->msix[TSI721_VECT_DMA0_INT +
@@ -262,22 +273,27 @@ static int tsi721_bdma_ch_free(struct tsi721_bdma_chan *bdma_chan)
 static void
 tsi721_bdma_interrupt_enable(struct tsi721_bdma_chan *bdma_chan, int enable)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&bdma_chan->inte_lock, flags);
 	if (enable) {
 		/* Clear pending BDMA channel interrupts */
 		iowrite32(TSI721_DMAC_INT_ALL,
 			bdma_chan->regs + TSI721_DMAC_INT);
 		ioread32(bdma_chan->regs + TSI721_DMAC_INT);
 		/* Enable BDMA channel interrupts */
-		iowrite32(TSI721_DMAC_INT_ALL,
+		bdma_chan->inte = TSI721_DMAC_INT_ALL;
+		iowrite32(bdma_chan->inte,
 			bdma_chan->regs + TSI721_DMAC_INTE);
 	} else {
 		/* Disable BDMA channel interrupts */
+		bdma_chan->inte = 0;
 		iowrite32(0, bdma_chan->regs + TSI721_DMAC_INTE);
 		/* Clear pending BDMA channel interrupts */
 		iowrite32(TSI721_DMAC_INT_ALL,
 			bdma_chan->regs + TSI721_DMAC_INT);
 	}
-
+	spin_unlock_irqrestore(&bdma_chan->inte_lock, flags);
 }
 
 static bool tsi721_dma_is_idle(struct tsi721_bdma_chan *bdma_chan)
@@ -290,12 +306,15 @@ static bool tsi721_dma_is_idle(struct tsi721_bdma_chan *bdma_chan)
 
 void tsi721_bdma_handler(struct tsi721_bdma_chan *bdma_chan)
 {
+	/* Keep concurrent tsi721_dma_set_inte() from being overwritten */
+	spin_lock(&bdma_chan->inte_lock);
 	/* Disable BDMA channel interrupts */
 	iowrite32(0, bdma_chan->regs + TSI721_DMAC_INTE);
 	if (bdma_chan->active)
 		tasklet_hi_schedule(&bdma_chan->tasklet);
 	/* Re-Enable BDMA channel interrupts */
-	iowrite32(TSI721_DMAC_INT_ALL, bdma_chan->regs + TSI721_DMAC_INTE);
+	iowrite32(bdma_chan->inte, bdma_chan->regs + TSI721_DMAC_INTE);
+	spin_unlock(&bdma_chan->inte_lock);
 }
 
 #ifdef CONFIG_PCI_MSI
@@ -316,9 +335,28 @@ static irqreturn_t tsi721_bdma_msix(int irq, void *ptr)
 }
 #endif /* CONFIG_PCI_MSI */
 
+/*
+ * Must be called with the spinlock held. INTE is also rewritten by the
+ * interrupt handler, which cannot take the spinlock: both update it under
+ * inte_lock.
+ */
+static void tsi721_dma_set_inte(struct tsi721_bdma_chan *bdma_chan, u32 inte)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bdma_chan->inte_lock, flags);
+	if (inte != bdma_chan->inte) {
+		bdma_chan->inte = inte;
+		iowrite32(inte, bdma_chan->regs + TSI721_DMAC_INTE);
+	}
+	spin_unlock_irqrestore(&bdma_chan->inte_lock, flags);
+}
+
 /* Must be called with the spinlock held */
 static void tsi721_start_dma(struct tsi721_bdma_chan *bdma_chan)
 {
+	u32 inte;
+
 	if (!tsi721_dma_is_idle(bdma_chan)) {
 		tsi_err(&bdma_chan->dchan.dev->device,
 			"DMAC%d Attempt to start non-idle channel",
@@ -337,6 +375,17 @@ static void tsi721_start_dma(struct tsi721_bdma_chan *bdma_chan)
 		  bdma_chan->id, bdma_chan->wr_count_next,
 		  task_pid_nr(current));
 
+	/*
+	 * Descriptor prepared without DMA_PREP_INTERRUPT is completed by
+	 * polling its status: do not raise completion interrupts for it.
+	 * Error interrupts stay enabled.
+	 */
+	inte = TSI721_DMAC_INT_ALL;
+	if (bdma_chan->active_tx &&
+	    !(bdma_chan->active_tx->txd.flags & DMA_PREP_INTERRUPT))
+		inte &= ~(TSI721_DMAC_INT_DONE | TSI721_DMAC_INT_IOFDONE);
+	tsi721_dma_set_inte(bdma_chan, inte);
+
 	iowrite32(bdma_chan->wr_count_next,
 		bdma_chan->regs + TSI721_DMAC_DWRCNT);
 	ioread32(bdma_chan->regs + TSI721_DMAC_DWRCNT);
@@ -388,17 +437,66 @@ tsi721_desc_fill_end(struct tsi721_dma_desc *bd_ptr, u32 bcount, bool interrupt)
 	return 0;
 }
 
+/*
+ * Reports completion status of vectored transfer elements: elements fully
+ * processed by previous passes over the BD ring are completed, others fail
+ * together with the pass they belong to.
+ */
+static void tsi721_dma_seg_status(struct tsi721_tx_desc *desc, bool error)
+{
+	unsigned int i;
+
+	for (i = 0; i < desc->nsegs; i++)
+		desc->segs[i].status =
+			(error && i >= desc->seg_done) ? -EIO : 0;
+}
+
+/*
+ * Completes failed descriptor and queues it for its callback, which is
+ * called by tsi721_dma_flush_err() once bdma_chan->lock is released.
+ * Must be called with bdma_chan->lock held.
+ */
 static void tsi721_dma_tx_err(struct tsi721_bdma_chan *bdma_chan,
 			      struct tsi721_tx_desc *desc)
 {
 	struct dma_async_tx_descriptor *txd = &desc->txd;
-	dma_async_tx_callback callback = txd->callback;
-	void *param = txd->callback_param;
 
-	list_move(&desc->desc_node, &bdma_chan->free_list);
+	desc->status = DMA_ERROR;
+	tsi721_dma_seg_status(desc, true);
+	bdma_chan->stats.errors++;
+	trace_rio_dma_done(dma_to_mport(bdma_chan->dchan.device),
+			   bdma_chan->id, txd->cookie, -EIO,
+			   tsi721_ts() - desc->ts);
+	dma_cookie_complete(txd);
+	list_move_tail(&desc->desc_node, &bdma_chan->err_list);
+}
 
-	if (callback)
-		callback(param);
+/*
+ * Calls callbacks of failed descriptors and returns them to the free list.
+ * Must be called without bdma_chan->lock held.
+ */
+static void tsi721_dma_flush_err(struct tsi721_bdma_chan *bdma_chan)
+{
+	struct tsi721_tx_desc *desc;
+	dma_async_tx_callback callback;
+	void *param;
+
+	spin_lock_bh(&bdma_chan->lock);
+	while (!list_empty(&bdma_chan->err_list)) {
+		desc = list_first_entry(&bdma_chan->err_list,
+					struct tsi721_tx_desc, desc_node);
+		list_del_init(&desc->desc_node);
+		callback = desc->txd.callback;
+		param = desc->txd.callback_param;
+		spin_unlock_bh(&bdma_chan->lock);
+
+		if (callback)
+			callback(param);
+
+		spin_lock_bh(&bdma_chan->lock);
+		list_add(&desc->desc_node, &bdma_chan->free_list);
+	}
+	spin_unlock_bh(&bdma_chan->lock);
 }
 
 static void tsi721_clr_stat(struct tsi721_bdma_chan *bdma_chan)
@@ -482,6 +580,23 @@ static int tsi721_submit_sg(struct tsi721_tx_desc *desc)
 			break;
 		}
 
+		/*
+		 * Next element of vectored transfer has its own remote target:
+		 * close current descriptor and do not merge across elements.
+		 */
+		if (desc->nsegs && desc->seg_left == 0) {
+			struct rio_dma_seg *seg = &desc->segs[++desc->seg_idx];
+
+			if (next_addr != -1) {
+				tsi721_desc_fill_end(bd_ptr, bcount, 0);
+				next_addr = -1;
+			}
+			desc->destid = seg->destid;
+			desc->rio_addr_u = seg->rio_addr_u;
+			rio_addr = seg->rio_addr;
+			desc->seg_left = seg->sg_len;
+		}
+
 		/*
 		 * If this sg entry forms contiguous block with previous one,
 		 * try to merge it into existing DMA descriptor
@@ -530,6 +645,9 @@ static int tsi721_submit_sg(struct tsi721_tx_desc *desc)
 		}
 
 entry_done:
+		if (desc->nsegs)
+			desc->seg_left--;
+
 		if (sg_is_last(sg)) {
 			tsi721_desc_fill_end(bd_ptr, bcount, 0);
 			tsi_debug(DMAV, ch_dev,
@@ -576,23 +694,38 @@ static void tsi721_advance_work(struct tsi721_bdma_chan *bdma_chan,
 		if (!err)
 			tsi721_start_dma(bdma_chan);
 		else {
+			if (desc == bdma_chan->active_tx)
+				bdma_chan->active_tx = NULL;
 			tsi721_dma_tx_err(bdma_chan, desc);
+			/* Callers hold the channel lock, call back later */
+			tasklet_schedule(&bdma_chan->tasklet);
 			tsi_debug(DMA, &bdma_chan->dchan.dev->device,
 				"DMAC%d ERR: tsi721_submit_sg failed with err=%d",
 				bdma_chan->id, err);
 		}
 	}
 
+	/* Completion interrupts may be masked for polled descriptor done */
+	if (!bdma_chan->active_tx)
+		tsi721_dma_set_inte(bdma_chan, TSI721_DMAC_INT_ALL);
+
 	tsi_debug(DMA, &bdma_chan->dchan.dev->device, "DMAC%d Exit",
 		  bdma_chan->id);
 }
 
-static void tsi721_dma_tasklet(unsigned long data)
+/*
+ * tsi721_dma_service - processes BDMA channel status
+ * @bdma_chan: BDMA channel
+ * @dmac_int: pending channel interrupt bits
+ *
+ * Called from the channel tasklet or by a client polling for completion,
+ * must be called with bdma_chan->svc_lock held.
+ */
+static void tsi721_dma_service(struct tsi721_bdma_chan *bdma_chan,
+			       u32 dmac_int)
 {
-	struct tsi721_bdma_chan *bdma_chan = (struct tsi721_bdma_chan *)data;
-	u32 dmac_int, dmac_sts;
+	u32 dmac_sts;
 
-	dmac_int = ioread32(bdma_chan->regs + TSI721_DMAC_INT);
 	tsi_debug(DMA, &bdma_chan->dchan.dev->device, "DMAC%d_INT = 0x%x",
 		  bdma_chan->id, dmac_int);
 	/* Clear channel interrupts */
@@ -658,13 +791,12 @@ static void tsi721_dma_tasklet(unsigned long data)
 		udelay(10);
 
 		desc = bdma_chan->active_tx;
-		desc->status = DMA_ERROR;
-		dma_cookie_complete(&desc->txd);
-		list_add(&desc->desc_node, &bdma_chan->free_list);
 		bdma_chan->active_tx = NULL;
+		tsi721_dma_tx_err(bdma_chan, desc);
 		if (bdma_chan->active)
 			tsi721_advance_work(bdma_chan, NULL);
 		spin_unlock(&bdma_chan->lock);
+		tsi721_dma_flush_err(bdma_chan);
 	}
 
 	if (dmac_int & TSI721_DMAC_INT_STFULL) {
@@ -683,12 +815,18 @@ static void tsi721_dma_tasklet(unsigned long data)
 		if (desc->sg_len == 0) {
 			dma_async_tx_callback callback = NULL;
 			void *param = NULL;
+			u64 lat = tsi721_ts() - desc->ts;
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
 			desc->status = DMA_COMPLETE;
 #else
 			desc->status = DMA_SUCCESS;
 #endif
+			tsi721_dma_seg_status(desc, false);
+			tsi721_qstats_add(&bdma_chan->stats, desc->len, lat);
+			trace_rio_dma_done(dma_to_mport(bdma_chan->dchan.device),
+					   bdma_chan->id, desc->txd.cookie, 0,
+					   lat);
 			dma_cookie_complete(&desc->txd);
 			if (desc->txd.flags & DMA_PREP_INTERRUPT) {
 				callback = desc->txd.callback;
@@ -702,6 +840,8 @@ static void tsi721_dma_tasklet(unsigned long data)
 			if (callback)
 				callback(param);
 		} else {
+			/* Elements before the current one are done */
+			desc->seg_done = desc->seg_idx;
 			if (bdma_chan->active)
 				tsi721_advance_work(bdma_chan,
 						    bdma_chan->active_tx);
@@ -712,6 +852,40 @@ err_out:
 	return;
 }
 
+static void tsi721_dma_tasklet(unsigned long data)
+{
+	struct tsi721_bdma_chan *bdma_chan = (struct tsi721_bdma_chan *)data;
+
+	spin_lock(&bdma_chan->svc_lock);
+	tsi721_dma_service(bdma_chan,
+			   ioread32(bdma_chan->regs + TSI721_DMAC_INT));
+	spin_unlock(&bdma_chan->svc_lock);
+
+	/* Descriptors failed to start while the channel lock was held */
+	tsi721_dma_flush_err(bdma_chan);
+}
+
+/*
+ * tsi721_dma_poll - checks BDMA channel status without waiting for interrupt
+ * @bdma_chan: BDMA channel
+ *
+ * Processes completion of the active descriptor if the channel reports it.
+ * Gives up if status processing is already in progress in other context.
+ */
+static void tsi721_dma_poll(struct tsi721_bdma_chan *bdma_chan)
+{
+	u32 dmac_int;
+
+	if (!bdma_chan->active || !spin_trylock_bh(&bdma_chan->svc_lock))
+		return;
+
+	dmac_int = ioread32(bdma_chan->regs + TSI721_DMAC_INT);
+	if (dmac_int & (TSI721_DMAC_INT_DONE | TSI721_DMAC_INT_IOFDONE |
+			TSI721_DMAC_INT_ERR))
+		tsi721_dma_service(bdma_chan, dmac_int);
+	spin_unlock_bh(&bdma_chan->svc_lock);
+}
+
 static dma_cookie_t tsi721_tx_submit(struct dma_async_tx_descriptor *txd)
 {
 	struct tsi721_tx_desc *desc = to_tsi721_desc(txd);
@@ -735,7 +909,20 @@ static dma_cookie_t tsi721_tx_submit(struct dma_async_tx_descriptor *txd)
 
 	cookie = dma_cookie_assign(txd);
 	desc->status = DMA_IN_PROGRESS;
+	desc->ts = tsi721_ts();
+	trace_rio_dma_submit(dma_to_mport(txd->chan->device), bdma_chan->id,
+			     cookie, desc->destid, desc->rio_addr, desc->len,
+			     desc->sg_len);
 	list_add_tail(&desc->desc_node, &bdma_chan->queue);
+
+	/*
+	 * Polled descriptor in progress may have been abandoned by its
+	 * owner. Let its completion interrupt retire it, so that the
+	 * descriptor queued behind it does not wait for a poll.
+	 */
+	if (bdma_chan->active_tx && (txd->flags & DMA_PREP_INTERRUPT))
+		tsi721_dma_set_inte(bdma_chan, TSI721_DMAC_INT_ALL);
+
 	tsi721_advance_work(bdma_chan, NULL);
 
 	spin_unlock_bh(&bdma_chan->lock);
@@ -761,8 +948,8 @@ static int tsi721_alloc_chan_resources(struct dma_chan *dchan)
 	}
 
 	/* Allocate queue of transaction descriptors */
-	desc = kcalloc(dma_txqueue_sz, sizeof(struct tsi721_tx_desc),
-			GFP_ATOMIC);
+	desc = kzalloc_node(dma_txqueue_sz * sizeof(struct tsi721_tx_desc),
+			    GFP_ATOMIC, dev_to_node(dchan->device->dev));
 	if (!desc) {
 		tsi_err(&dchan->dev->device,
 			"DMAC%d Failed to allocate logical descriptors",
@@ -817,6 +1004,7 @@ static void tsi721_free_chan_resources(struct dma_chan *dchan)
 	tsi721_sync_dma_irq(bdma_chan);
 	tasklet_kill(&bdma_chan->tasklet);
 	INIT_LIST_HEAD(&bdma_chan->free_list);
+	INIT_LIST_HEAD(&bdma_chan->err_list);
 	kfree(bdma_chan->tx_desc);
 	tsi721_bdma_ch_free(bdma_chan);
 }
@@ -831,6 +1019,20 @@ enum dma_status tsi721_tx_status(struct dma_chan *dchan, dma_cookie_t cookie,
 	spin_lock_bh(&bdma_chan->lock);
 	status = dma_cookie_status(dchan, cookie, txstate);
 	spin_unlock_bh(&bdma_chan->lock);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
+	if (status == DMA_COMPLETE)
+#else
+	if (status == DMA_SUCCESS)
+#endif
+		return status;
+
+	/* Polling client: check hardware instead of waiting for tasklet */
+	tsi721_dma_poll(bdma_chan);
+
+	spin_lock_bh(&bdma_chan->lock);
+	status = dma_cookie_status(dchan, cookie, txstate);
+	spin_unlock_bh(&bdma_chan->lock);
 	return status;
 }
 
@@ -840,6 +1042,13 @@ static void tsi721_issue_pending(struct dma_chan *dchan)
 
 	tsi_debug(DMA, &dchan->dev->device, "DMAC%d", bdma_chan->id);
 
+	/*
+	 * Completion of polled descriptor is not signaled by interrupt,
+	 * retire it here if its owner did not.
+	 */
+	if (!(bdma_chan->inte & TSI721_DMAC_INT_DONE))
+		tsi721_dma_poll(bdma_chan);
+
 	spin_lock_bh(&bdma_chan->lock);
 	if (tsi721_dma_is_idle(bdma_chan) && bdma_chan->active) {
 		tsi721_advance_work(bdma_chan, NULL);
@@ -858,6 +1067,9 @@ struct dma_async_tx_descriptor *tsi721_prep_rio_sg(struct dma_chan *dchan,
 	struct rio_dma_ext *rext = tinfo;
 	enum dma_rtype rtype;
 	struct dma_async_tx_descriptor *txd = NULL;
+	struct scatterlist *sg;
+	unsigned int i, seg_sg = 0;
+	u32 len = 0;
 
 	if (!sgl || !sg_len) {
 		tsi_err(&dchan->dev->device, "DMAC%d No SG list",
@@ -865,6 +1077,23 @@ struct dma_async_tx_descriptor *tsi721_prep_rio_sg(struct dma_chan *dchan,
 		return ERR_PTR(-EINVAL);
 	}
 
+	/* Vectored transfer elements must cover the SG list exactly */
+	for (i = 0; i < rext->nsegs; i++) {
+		if (rext->segs[i].sg_len == 0)
+			return ERR_PTR(-EINVAL);
+		seg_sg += rext->segs[i].sg_len;
+	}
+
+	if (rext->nsegs && seg_sg != sg_len) {
+		tsi_err(&dchan->dev->device,
+			"DMAC%d SG list does not match transfer elements",
+			bdma_chan->id);
+		return ERR_PTR(-EINVAL);
+	}
+
+	for_each_sg(sgl, sg, sg_len, i)
+		len += sg_dma_len(sg);
+
 	tsi_debug(DMA, &dchan->dev->device, "DMAC%d %s", bdma_chan->id,
 		  (dir == DMA_DEV_TO_MEM)?"READ":"WRITE");
 
@@ -909,10 +1138,18 @@ struct dma_async_tx_descriptor *tsi721_prep_rio_sg(struct dma_chan *dchan,
 		desc->rtype = rtype;
 		desc->sg_len	= sg_len;
 		desc->sg	= sgl;
+		desc->len	= len;
 		desc->ssdist = rext->ssdist;
 		desc->sssize = rext->sssize;
 		desc->dsdist = rext->dsdist;
 		desc->dssize = rext->dssize;
+		desc->segs = rext->segs;
+		desc->nsegs = rext->nsegs;
+		desc->seg_idx = 0;
+		desc->seg_left = rext->nsegs ? rext->segs[0].sg_len : 0;
+		desc->seg_done = 0;
+		if (rext->nsegs)
+			desc->rio_addr_u = rext->segs[0].rio_addr_u;
 		txd		= &desc->txd;
 		txd->flags	= flags;
 	}
@@ -920,6 +1157,7 @@ struct dma_async_tx_descriptor *tsi721_prep_rio_sg(struct dma_chan *dchan,
 	spin_unlock_bh(&bdma_chan->lock);
 
 	if (!txd) {
+		bdma_chan->stats.busy++;
 		tsi_debug(DMA, &dchan->dev->device,
 			  "DMAC%d free TXD is not available", bdma_chan->id);
 		return ERR_PTR(-EBUSY);
@@ -967,6 +1205,7 @@ static int tsi721_device_control(struct dma_chan *dchan, enum dma_ctrl_cmd cmd,
 
 	if (bdma_chan->active_tx)
 		list_add(&bdma_chan->active_tx->desc_node, &list);
+	bdma_chan->active_tx = NULL;
 	list_splice_init(&bdma_chan->queue, &list);
 
 	list_for_each_entry_safe(desc, _d, &list, desc_node)
@@ -974,6 +1213,8 @@ static int tsi721_device_control(struct dma_chan *dchan, enum dma_ctrl_cmd cmd,
 
 	spin_unlock_bh(&bdma_chan->lock);
 
+	tsi721_dma_flush_err(bdma_chan);
+
 	return 0;
 }
 
@@ -1031,10 +1272,13 @@ int tsi721_register_dma(struct tsi721_device *priv)
 		bdma_chan->active = false;
 
 		spin_lock_init(&bdma_chan->lock);
+		spin_lock_init(&bdma_chan->svc_lock);
+		spin_lock_init(&bdma_chan->inte_lock);
 
 		bdma_chan->active_tx = NULL;
 		INIT_LIST_HEAD(&bdma_chan->queue);
 		INIT_LIST_HEAD(&bdma_chan->free_list);
+		INIT_LIST_HEAD(&bdma_chan->err_list);
 
 		tasklet_init(&bdma_chan->tasklet, tsi721_dma_tasklet,
 			     (unsigned long)bdma_chan);
@@ -1085,6 +1329,7 @@ void tsi721_unregister_dma(struct tsi721_device *priv)
 			tsi721_sync_dma_irq(bdma_chan);
 			tasklet_kill(&bdma_chan->tasklet);
 			INIT_LIST_HEAD(&bdma_chan->free_list);
+			INIT_LIST_HEAD(&bdma_chan->err_list);
 			kfree(bdma_chan->tx_desc);
 			tsi721_bdma_ch_free(bdma_chan);
 		}
@@ -17,10 +17,13 @@
 #include <linux/types.h>
 #include <linux/ioport.h>
 #include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
 #include <linux/errno.h>
 #include <linux/device.h>
 #include "./rio_regs.h"
 #include <linux/mod_devicetable.h>
+#include <linux/scatterlist.h>
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
 #include <linux/dmaengine.h>
 #endif
@@ -205,6 +208,9 @@ struct rio_dev {
 	u8 hopcount;
 	struct rio_dev *prev;
 	atomic_t state;
+	struct hlist_node ctag_node;	/* node in component tag index */
+	struct hlist_node destid_node;	/* node in destID index */
+	struct rcu_head rcu;
 	struct rio_switch rswitch[0];	/* RIO switch info */
 };
 
@@ -219,12 +225,37 @@ struct rio_dev {
  * struct rio_msg - RIO message event
  * @res: Mailbox resource
  * @mcback: Message event callback
+ * @flags: Mailbox mode flags (RIO_MSG_*)
  */
 struct rio_msg {
 	struct resource *res;
 	void (*mcback) (struct rio_mport * mport, void *dev_id, int mbox, int slot);
+	u32 flags;
 };
 
+/**
+ * struct rio_outb_msg - RIO outbound message for batched submission
+ * @rdev: Target of outbound message
+ * @dmbox: Destination mailbox (may differ from the outbound mailbox used
+ *         to send the message only if mport implements add_outb_messages)
+ * @buffer: Message data (if @sgl is NULL)
+ * @sgl: Scatterlist of message fragments (optional)
+ * @nents: Number of entries in @sgl
+ * @len: Length of message
+ */
+struct rio_outb_msg {
+	struct rio_dev *rdev;
+	int dmbox;
+	void *buffer;
+	struct scatterlist *sgl;
+	int nents;
+	size_t len;
+};
+
+/* Mailbox mode flags (struct rio_msg.flags) */
+#define RIO_MSG_ZEROCOPY	(1 << 0) /* HW receives directly into buffers
+					  * posted by mailbox client */
+
 /**
  * struct rio_dbell - RIO doorbell event
  * @node: Node in list of doorbell events
@@ -239,14 +270,39 @@ struct rio_dbell {
 	void *dev_id;
 };
 
+/**
+ * struct rio_dbell_msg - RIO outbound doorbell for batched submission
+ * @destid: Destination ID of target device
+ * @data: 16-bit info field of doorbell
+ */
+struct rio_dbell_msg {
+	u16 destid;
+	u16 data;
+};
+
+/* Doorbell info values are dispatched through two-level table */
+#define RIO_DBELL_MAP_SHIFT	8
+#define RIO_DBELL_MAP_SIZE	(1 << RIO_DBELL_MAP_SHIFT)
+
+/**
+ * struct rio_dbell_map - Second level of doorbell dispatch table
+ * @dbell: Doorbell events indexed by low byte of doorbell info
+ */
+struct rio_dbell_map {
+	struct rio_dbell __rcu *dbell[RIO_DBELL_MAP_SIZE];
+};
+
 /**
  * struct rio_mport - RIO master port info
  * @dbells: List of doorbell events
+ * @dbell_map: Doorbell events indexed by high byte of doorbell info
  * @pwrites: List of portwrite events
  * @node: Node in global list of master ports
  * @nnode: Node in network list of master ports
  * @net: RIO net this mport is attached to
  * @lock: lock to synchronize lists manipulations
+ * @config_lock: serializes config space accesses from atomic context
+ * @config_mutex: serializes config space accesses of callers that can sleep
  * @iores: I/O mem resource that this master port interface owns
  * @riores: RIO resources that this master port interfaces owns
  * @inb_msg: RIO inbound message event descriptors
@@ -265,14 +321,26 @@ struct rio_dbell {
  * @nscan: RapidIO network enumeration/discovery operations
  * @state: mport device state
  * @pwe_refcnt: port-write enable ref counter to track enable/disable requests
+ * @topo_snap: topology snapshot to be used by next enumeration
+ * @topo_size: size of @topo_snap in bytes
+ * @pw_wq: workqueue that dispatches coalesced port-write events
+ * @pw_work: port-write dispatch work
+ * @pw_lock: lock to protect port-write event list and dispatch schedule
+ * @pw_events: list of coalesced port-write events
+ * @pw_nevents: number of entries in @pw_events
+ * @pw_next: jiffies when @pw_work is due
+ * @pw_sched: @pw_work is scheduled for @pw_next
  */
 struct rio_mport {
 	struct list_head dbells;	/* list of doorbell events */
+	struct rio_dbell_map __rcu *dbell_map[RIO_DBELL_MAP_SIZE];
 	struct list_head pwrites;	/* list of portwrite events */
 	struct list_head node;	/* node in global list of ports */
 	struct list_head nnode;	/* node in net list of ports */
 	struct rio_net *net;	/* RIO net this mport is attached to */
 	struct mutex lock;
+	spinlock_t config_lock;
+	struct mutex config_mutex;
 	struct resource iores;
 	struct resource riores[RIO_MAX_MPORT_RESOURCES];
 	struct rio_msg inb_msg[RIO_MAX_MBOX];
@@ -297,6 +365,15 @@ struct rio_mport {
 	struct rio_scan *nscan;
 	atomic_t state;
 	unsigned int pwe_refcnt;
+	void *topo_snap;
+	size_t topo_size;
+	struct workqueue_struct *pw_wq;
+	struct delayed_work pw_work;
+	spinlock_t pw_lock;
+	struct list_head pw_events;
+	unsigned int pw_nevents;
+	unsigned long pw_next;
+	bool pw_sched;
 };
 
 static inline int rio_mport_is_running(struct rio_mport *mport)
@@ -309,6 +386,50 @@ static inline int rio_mport_is_running(struct rio_mport *mport)
  */
 #define RIO_SCAN_ENUM_NO_WAIT	0x00000001 /* Do not wait for enum completed */
 
+/*
+ * Topology snapshot. Snapshot starts with struct rio_topo_hdr followed by
+ * ndevs device records in enumeration order. Each device record is
+ * followed by nroutes route entries of the switch. All fields are
+ * little-endian.
+ */
+#define RIO_TOPO_MAGIC		0x544f4952	/* "RIOT" */
+#define RIO_TOPO_VERSION	1
+#define RIO_TOPO_MAX_SIZE	(16 * 1024 * 1024)
+
+struct rio_topo_hdr {
+	__le32	magic;
+	__le16	version;
+	__le16	host_did;	/* destID of enumerating host */
+	__le32	size;		/* snapshot size in bytes */
+	__le32	ndevs;		/* number of device records */
+	u8	sys_size;
+	u8	rsvd[3];
+};
+
+#define RIO_TOPO_SWITCH		(1 << 0)	/* device is a switch */
+#define RIO_TOPO_DESTID		(1 << 1)	/* device owns its destID */
+
+struct rio_topo_dev {
+	__le32	comp_tag;
+	__le32	dev_id;		/* RIO_DEV_ID_CAR value */
+	__le32	prev_ctag;	/* component tag of upstream switch, 0 - host */
+	__le32	phys_efptr;
+	__le32	em_efptr;
+	__le32	nroutes;	/* number of following route entries */
+	__le16	destid;
+	u8	hopcount;
+	u8	prev_port;	/* port of upstream switch */
+	u8	flags;		/* RIO_TOPO_* flags */
+	u8	phys_rmap;
+	u8	rsvd[2];
+};
+
+struct rio_topo_route {
+	__le16	destid;
+	u8	port;
+	u8	rsvd;
+};
+
 /**
  * struct rio_net - RIO network info
  * @node: Node in global list of RIO networks
@@ -355,6 +476,8 @@ enum rio_mport_flags {
 	RIO_MPORT_DMA	 = (1 << 0), /* supports DMA data transfers */
 	RIO_MPORT_DMA_SG = (1 << 1), /* DMA supports HW SG mode */
 	RIO_MPORT_IBSG	 = (1 << 2), /* inbound mapping supports SG */
+	RIO_MPORT_IBMSG_ZC = (1 << 3), /* zero-copy inbound messaging */
+	RIO_MPORT_DMA_VEC = (1 << 4), /* DMA supports vectored transfers */
 };
 
 /**
@@ -377,6 +500,51 @@ struct rio_mport_attr {
 	int dma_align;
 };
 
+/**
+ * struct rio_maint_op - maintenance transaction of a batch request
+ * @destid: destination ID of target device
+ * @hopcount: number of hops to target device
+ * @write: non-zero for maintenance write
+ * @offset: offset into configuration space (32-bit aligned)
+ * @data: value to be written or value read
+ * @status: returns completion status, 0 or negative error code
+ */
+struct rio_maint_op {
+	u16	destid;
+	u8	hopcount;
+	u8	write;
+	u32	offset;
+	u32	data;
+	int	status;
+};
+
+/**
+ * struct rio_mbox_coalesce - Mailbox interrupt moderation parameters
+ * @usecs: Minimum interval between message interrupts (usec, 0 = off)
+ * @frames: Number of messages per interrupt. In adaptive mode the number
+ *          of messages to be delivered by a single interrupt.
+ * @adaptive: Adjust @usecs at run time to keep the interrupt rate at
+ *            about @frames messages per interrupt. @usecs is the upper
+ *            limit of the interval in this mode.
+ */
+struct rio_mbox_coalesce {
+	u32	usecs;
+	u32	frames;
+	bool	adaptive;
+};
+
+/*
+ * Flags for rio_ops.cmaint_vec. Calls with RIO_MAINT_SLEEP are made without
+ * config_lock held, the mport driver serializes them with other accesses.
+ */
+#define RIO_MAINT_SLEEP		(1 << 0) /* caller can sleep */
+
+/*
+ * Flags for rio_ops.dsend_vec. With RIO_DBELL_SLEEP the mport driver sleeps
+ * until doorbells with status location complete instead of polling.
+ */
+#define RIO_DBELL_SLEEP		(1 << 0) /* caller can sleep */
+
 /* Low-level architecture-dependent routines */
 
 /**
@@ -385,13 +553,23 @@ struct rio_mport_attr {
  * @lcwrite: Callback to perform local (master port) write of config space.
  * @cread: Callback to perform network read of config space.
  * @cwrite: Callback to perform network write of config space.
+ * @cmaint_vec: Callback to perform batch of network config space accesses
+ *              with several of them in flight.
  * @dsend: Callback to send a doorbell message.
+ * @dsend_vec: Callback to queue doorbell messages for transmission without
+ *             waiting for their completion, unless a status array is given.
+ *             mport driver serializes access to its doorbell queue if this
+ *             callback is implemented.
  * @pwenable: Callback to enable/disable port-write message handling.
  * @open_outb_mbox: Callback to initialize outbound mailbox.
  * @close_outb_mbox: Callback to shut down outbound mailbox.
  * @open_inb_mbox: Callback to initialize inbound mailbox.
  * @close_inb_mbox: Callback to	shut down inbound mailbox.
  * @add_outb_message: Callback to add a message to an outbound mailbox queue.
+ * @add_outb_message_sg: Callback to add a message described by scatterlist
+ *                       to an outbound mailbox queue without bounce copy.
+ * @add_outb_messages: Callback to add multiple messages to an outbound mailbox
+ *                     queue with single notification of the HW engine.
  * @add_inb_buffer: Callback to	add a buffer to an inbound mailbox queue.
  * @get_inb_message: Callback to get a message from an inbound mailbox queue.
  * @map_inb: Callback to map RapidIO address region into local memory space.
@@ -399,6 +577,12 @@ struct rio_mport_attr {
  * @query_mport: Callback to query mport device attributes.
  * @map_outb: Callback to map outbound address region into local memory space.
  * @unmap_outb: Callback to unmap outbound RapidIO address region.
+ * @set_inb_mbox_irq: Callback to mask/unmask inbound message receive
+ *                    notifications for specified inbound mailbox.
+ * @get_mbox_coalesce: Callback to read interrupt moderation settings of
+ *                     inbound or outbound mailbox.
+ * @set_mbox_coalesce: Callback to change interrupt moderation settings of
+ *                     inbound or outbound mailbox.
  */
 struct rio_ops {
 	int (*lcread) (struct rio_mport *mport, int index, u32 offset, int len,
@@ -409,7 +593,12 @@ struct rio_ops {
 			u8 hopcount, u32 offset, int len, u32 *data);
 	int (*cwrite) (struct rio_mport *mport, int index, u16 destid,
 			u8 hopcount, u32 offset, int len, u32 data);
+	int (*cmaint_vec)(struct rio_mport *mport, int index,
+			  struct rio_maint_op *ops, int num, u32 flags);
 	int (*dsend) (struct rio_mport *mport, int index, u16 destid, u16 data);
+	int (*dsend_vec)(struct rio_mport *mport, int index,
+			 const struct rio_dbell_msg *db, int num, int *status,
+			 u32 flags);
 	int (*pwenable) (struct rio_mport *mport, int enable);
 	int (*open_outb_mbox)(struct rio_mport *mport, void *dev_id,
 			      int mbox, int entries);
@@ -419,6 +608,12 @@ struct rio_ops {
 	void (*close_inb_mbox)(struct rio_mport *mport, int mbox);
 	int  (*add_outb_message)(struct rio_mport *mport, struct rio_dev *rdev,
 				 int mbox, void *buffer, size_t len);
+	int (*add_outb_message_sg)(struct rio_mport *mport,
+				   struct rio_dev *rdev, int mbox,
+				   struct scatterlist *sgl, int nents,
+				   size_t len);
+	int (*add_outb_messages)(struct rio_mport *mport, int mbox,
+				 struct rio_outb_msg *msgs, int num);
 	int (*add_inb_buffer)(struct rio_mport *mport, int mbox, void *buf);
 	void *(*get_inb_message)(struct rio_mport *mport, int mbox, int *msize);
 	int (*map_inb)(struct rio_mport *mport, dma_addr_t lstart,
@@ -429,6 +624,11 @@ struct rio_ops {
 	int (*map_outb)(struct rio_mport *mport, u16 destid, u64 rstart,
 			u32 size, u32 flags, dma_addr_t *laddr);
 	void (*unmap_outb)(struct rio_mport *mport, u16 destid, u64 rstart);
+	int (*set_inb_mbox_irq)(struct rio_mport *mport, int mbox, int enable);
+	int (*get_mbox_coalesce)(struct rio_mport *mport, int mbox, bool inb,
+				 struct rio_mbox_coalesce *ec);
+	int (*set_mbox_coalesce)(struct rio_mport *mport, int mbox, bool inb,
+				 const struct rio_mbox_coalesce *ec);
 };
 
 #define RIO_RESOURCE_MEM	0x00000100
@@ -500,6 +700,22 @@ enum rio_write_type {
 	RDW_LAST_NWRITE_R,	/* last packet uses NWRITE_R, others - NWRITE */
 };
 
+/**
+ * struct rio_dma_seg - one element of a vectored DMA transfer
+ * @destid: target device destination ID
+ * @rio_addr: low 64-bits of 66-bit RapidIO address
+ * @rio_addr_u: upper 2-bits of 66-bit RapidIO address
+ * @sg_len: number of consecutive SG list entries that belong to this element
+ * @status: completion status set by mport driver (0 or negative error code)
+ */
+struct rio_dma_seg {
+	u16 destid;
+	u64 rio_addr;
+	u8  rio_addr_u;
+	unsigned int sg_len;
+	int status;
+};
+
 struct rio_dma_ext {
 	u16 destid;
 	u64 rio_addr;	/* low 64-bits of 66-bit RapidIO address */
@@ -509,6 +725,8 @@ struct rio_dma_ext {
 	u16 sssize;		/* source stride size */
 	u16 dsdist;		/* destination stride distance */
 	u16 dssize;		/* destination stride size */
+	struct rio_dma_seg *segs;	/* vectored transfer elements or NULL */
+	unsigned int nsegs;		/* number of elements in segs */
 };
 
 struct rio_dma_data {
@@ -525,6 +743,12 @@ struct rio_dma_data {
 	u16 dssize;		/* destination stride size */
 };
 
+/* Maximum number of DMA channels a transfer can be striped over */
+#define RIO_DMA_MAX_STRIPE	8
+
+/* Completion callback of striped DMA transfer */
+typedef void (*rio_dma_stripe_callback)(void *param, enum dma_status status);
+
 static inline struct rio_mport *dma_to_mport(struct dma_device *ddev)
 {
 	return container_of(ddev, struct rio_mport, dma);
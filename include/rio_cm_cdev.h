@@ -54,6 +54,76 @@ struct rio_cm_msg {
 	__u64 msg;
 };
 
+/* Single message entry of a batch request */
+struct rio_cm_msg_entry {
+	__u64 msg;	/* user buffer */
+	__u16 size;	/* buffer size, on receive set to message length */
+	__u16 pad0;
+	__u32 pad1;
+};
+
+#define RIO_CM_BATCH_MAX	64	/* max number of entries per batch */
+
+struct rio_cm_msg_batch {
+	__u16 ch_num;
+	__u16 num;	/* number of entries in msgs array */
+	__u32 rxto;	/* receive timeout for the first message in mSec.
+			 * 0 = blocking. Following messages are only
+			 * collected if already available.
+			 */
+	__u64 msgs;	/* array of struct rio_cm_msg_entry */
+	__u32 done;	/* number of completed entries (returned) */
+	__u32 pad0;
+};
+
+/*
+ * Shared memory rings of a channel (see RIO_CM_CHAN_RING_SETUP).
+ * Indexes are free-running and masked by (entries - 1). The producer
+ * advances head after filling an entry, the consumer advances tail after
+ * it is done with it. Buffer slot of entry N is located at
+ * rx_buf/tx_buf + (N & (entries - 1)) * buf_size.
+ * Closing the ring file descriptor detaches the rings, unread RX entries
+ * are dropped and further data is received with RIO_CM_CHAN_RECEIVE.
+ */
+struct rio_cm_ring {
+	__u32 head;
+	__u32 tail;
+};
+
+struct rio_cm_ring_desc {
+	__u32 len;	/* message length including CM header */
+	__u32 rsvd;
+};
+
+#define RIO_CM_RING_MAX_ENTRIES	128
+
+struct rio_cm_ring_setup {
+	__u16 ch_num;
+	__u16 entries;	/* entries per ring, power of two */
+	__s32 fd;	/* returned: ring file descriptor to mmap() */
+	__u32 map_size;	/* returned: size of the shared area */
+	__u32 buf_size;	/* returned: size of one buffer slot */
+	/* Returned offsets within the shared area */
+	__u32 rx_ring;	/* struct rio_cm_ring, kernel is producer */
+	__u32 tx_ring;	/* struct rio_cm_ring, user is producer */
+	__u32 rx_desc;	/* struct rio_cm_ring_desc[entries] */
+	__u32 tx_desc;	/* struct rio_cm_ring_desc[entries] */
+	__u32 rx_buf;
+	__u32 tx_buf;
+};
+
+/*
+ * Channel RX ring size (see RIO_CM_CHAN_SET_RX_RING). The ring size is
+ * advertised to the peer as a receive window: the peer does not send more
+ * messages than there are free RX buffers. Can be set only before the
+ * channel is connected or put into listen state.
+ */
+struct rio_cm_rx_ring {
+	__u16 ch_num;
+	__u16 pad0;
+	__u32 entries;	/* power of two */
+};
+
 struct rio_cm_accept {
 	__u16 ch_num;
 	__u16 pad0;
@@ -74,5 +144,11 @@ struct rio_cm_accept {
 #define RIO_CM_CHAN_SEND	_IOW(RIO_CM_IOC_MAGIC, 9, struct rio_cm_msg)
 #define RIO_CM_CHAN_RECEIVE	_IOWR(RIO_CM_IOC_MAGIC, 10, struct rio_cm_msg)
 #define RIO_CM_MPORT_GET_LIST	_IOWR(RIO_CM_IOC_MAGIC, 11, __u32)
+#define RIO_CM_CHAN_SEND_BATCH	_IOWR(RIO_CM_IOC_MAGIC, 12, struct rio_cm_msg_batch)
+#define RIO_CM_CHAN_RECEIVE_BATCH _IOWR(RIO_CM_IOC_MAGIC, 13, struct rio_cm_msg_batch)
+#define RIO_CM_CHAN_RING_SETUP	_IOWR(RIO_CM_IOC_MAGIC, 14, struct rio_cm_ring_setup)
+/* Issued on ring file descriptor: send pending TX ring entries */
+#define RIO_CM_RING_KICK	_IO(RIO_CM_IOC_MAGIC, 15)
+#define RIO_CM_CHAN_SET_RX_RING	_IOW(RIO_CM_IOC_MAGIC, 16, struct rio_cm_rx_ring)
 
 #endif /* _RIO_CM_CDEV_H_ */
@@ -67,6 +67,25 @@ extern int rio_mport_read_config_8(struct rio_mport *port, u16 destid,
 				   u8 hopcount, u32 offset, u8 * data);
 extern int rio_mport_write_config_8(struct rio_mport *port, u16 destid,
 				    u8 hopcount, u32 offset, u8 data);
+extern int rio_mport_read_config_32_cansleep(struct rio_mport *port,
+		u16 destid, u8 hopcount, u32 offset, u32 *data);
+extern int rio_mport_write_config_32_cansleep(struct rio_mport *port,
+		u16 destid, u8 hopcount, u32 offset, u32 data);
+extern int rio_mport_read_config_16_cansleep(struct rio_mport *port,
+		u16 destid, u8 hopcount, u32 offset, u16 *data);
+extern int rio_mport_write_config_16_cansleep(struct rio_mport *port,
+		u16 destid, u8 hopcount, u32 offset, u16 data);
+extern int rio_mport_read_config_8_cansleep(struct rio_mport *port,
+		u16 destid, u8 hopcount, u32 offset, u8 *data);
+extern int rio_mport_write_config_8_cansleep(struct rio_mport *port,
+		u16 destid, u8 hopcount, u32 offset, u8 data);
+extern int rio_mport_maint_vec(struct rio_mport *port,
+			       struct rio_maint_op *ops, int num);
+extern int rio_mport_maint_vec_cansleep(struct rio_mport *port,
+					struct rio_maint_op *ops, int num);
+extern int rio_mport_read_config_vec(struct rio_mport *port, u16 destid,
+				     u8 hopcount, const u32 *offset,
+				     u32 *data, unsigned int count);
 
 /**
  * rio_local_read_config_32 - Read 32 bits from local configuration space
@@ -253,8 +272,107 @@ static inline int rio_write_config_8(struct rio_dev *rdev, u32 offset, u8 data)
 					rdev->hopcount, offset, data);
 };
 
+/**
+ * rio_read_config_32_cansleep - Read 32 bits from configuration space
+ * @rdev: RIO device
+ * @offset: Offset into device configuration space
+ * @data: Pointer to read data into
+ *
+ * Reads 32 bits of data from the specified offset within the
+ * RIO device's configuration space. Caller must be able to sleep.
+ */
+static inline int rio_read_config_32_cansleep(struct rio_dev *rdev, u32 offset,
+		u32 *data)
+{
+	return rio_mport_read_config_32_cansleep(rdev->net->hport,
+			rdev->destid, rdev->hopcount, offset, data);
+}
+
+/**
+ * rio_write_config_32_cansleep - Write 32 bits to configuration space
+ * @rdev: RIO device
+ * @offset: Offset into device configuration space
+ * @data: Data to be written
+ *
+ * Writes 32 bits of data to the specified offset within the
+ * RIO device's configuration space. Caller must be able to sleep.
+ */
+static inline int rio_write_config_32_cansleep(struct rio_dev *rdev, u32 offset,
+		u32 data)
+{
+	return rio_mport_write_config_32_cansleep(rdev->net->hport,
+			rdev->destid, rdev->hopcount, offset, data);
+}
+
+/**
+ * rio_read_config_16_cansleep - Read 16 bits from configuration space
+ * @rdev: RIO device
+ * @offset: Offset into device configuration space
+ * @data: Pointer to read data into
+ *
+ * Reads 16 bits of data from the specified offset within the
+ * RIO device's configuration space. Caller must be able to sleep.
+ */
+static inline int rio_read_config_16_cansleep(struct rio_dev *rdev, u32 offset,
+		u16 *data)
+{
+	return rio_mport_read_config_16_cansleep(rdev->net->hport,
+			rdev->destid, rdev->hopcount, offset, data);
+}
+
+/**
+ * rio_write_config_16_cansleep - Write 16 bits to configuration space
+ * @rdev: RIO device
+ * @offset: Offset into device configuration space
+ * @data: Data to be written
+ *
+ * Writes 16 bits of data to the specified offset within the
+ * RIO device's configuration space. Caller must be able to sleep.
+ */
+static inline int rio_write_config_16_cansleep(struct rio_dev *rdev, u32 offset,
+		u16 data)
+{
+	return rio_mport_write_config_16_cansleep(rdev->net->hport,
+			rdev->destid, rdev->hopcount, offset, data);
+}
+
+/**
+ * rio_read_config_8_cansleep - Read 8 bits from configuration space
+ * @rdev: RIO device
+ * @offset: Offset into device configuration space
+ * @data: Pointer to read data into
+ *
+ * Reads 8 bits of data from the specified offset within the
+ * RIO device's configuration space. Caller must be able to sleep.
+ */
+static inline int rio_read_config_8_cansleep(struct rio_dev *rdev, u32 offset,
+		u8 *data)
+{
+	return rio_mport_read_config_8_cansleep(rdev->net->hport,
+			rdev->destid, rdev->hopcount, offset, data);
+}
+
+/**
+ * rio_write_config_8_cansleep - Write 8 bits to configuration space
+ * @rdev: RIO device
+ * @offset: Offset into device configuration space
+ * @data: Data to be written
+ *
+ * Writes 8 bits of data to the specified offset within the
+ * RIO device's configuration space. Caller must be able to sleep.
+ */
+static inline int rio_write_config_8_cansleep(struct rio_dev *rdev, u32 offset,
+		u8 data)
+{
+	return rio_mport_write_config_8_cansleep(rdev->net->hport,
+			rdev->destid, rdev->hopcount, offset, data);
+}
+
 extern int rio_mport_send_doorbell(struct rio_mport *mport, u16 destid,
 				   u16 data);
+extern int rio_send_doorbells(struct rio_mport *mport,
+			      const struct rio_dbell_msg *db, int num,
+			      int *status, u32 flags);
 
 /**
  * rio_send_doorbell - Send a doorbell message to a device
@@ -342,8 +460,78 @@ static inline int rio_add_outb_message(struct rio_mport *mport,
 						   buffer, len);
 }
 
+/**
+ * rio_add_outb_message_sg - Add RIO message described by scatterlist to an
+ *                           outbound mailbox queue
+ * @mport: RIO master port containing the outbound queue
+ * @rdev: RIO device the message is be sent to
+ * @mbox: The outbound mailbox queue
+ * @sgl: Scatterlist of message fragments
+ * @nents: Number of entries in @sgl
+ * @len: Total length of the message
+ *
+ * Adds a RIO message to an outbound mailbox queue for transmission without
+ * copying it into a linear buffer first. Message buffers must remain valid
+ * until the mailbox callback reports transmission of the message.
+ * Returns 0 on success or %-ENOSYS if operation is not supported by mport.
+ */
+static inline int rio_add_outb_message_sg(struct rio_mport *mport,
+					  struct rio_dev *rdev, int mbox,
+					  struct scatterlist *sgl, int nents,
+					  size_t len)
+{
+	if (!mport->ops->add_outb_message_sg)
+		return -ENOSYS;
+	return mport->ops->add_outb_message_sg(mport, rdev, mbox,
+					       sgl, nents, len);
+}
+
+/**
+ * rio_add_outb_messages - Add multiple RIO messages to an outbound mailbox
+ *                         queue
+ * @mport: RIO master port containing the outbound queue
+ * @mbox: The outbound mailbox queue
+ * @msgs: Array of messages to send
+ * @num: Number of messages in @msgs
+ *
+ * Adds @num messages to an outbound mailbox queue for transmission,
+ * notifying the mport hardware only once if supported. Messages are queued
+ * in order; queuing stops at the first failure. Destination mailbox of
+ * messages may differ from @mbox only if the mport implements batched
+ * submission.
+ * Returns number of queued messages or negative error code if none of
+ * messages was queued.
+ */
+static inline int rio_add_outb_messages(struct rio_mport *mport, int mbox,
+					struct rio_outb_msg *msgs, int num)
+{
+	int i, rc = 0;
+
+	if (mport->ops->add_outb_messages)
+		return mport->ops->add_outb_messages(mport, mbox, msgs, num);
+
+	for (i = 0; i < num; i++) {
+		if (msgs[i].dmbox != mbox)
+			rc = -EINVAL;
+		else if (msgs[i].sgl)
+			rc = rio_add_outb_message_sg(mport, msgs[i].rdev, mbox,
+						     msgs[i].sgl,
+						     msgs[i].nents,
+						     msgs[i].len);
+		else
+			rc = rio_add_outb_message(mport, msgs[i].rdev, mbox,
+						  msgs[i].buffer, msgs[i].len);
+		if (rc)
+			break;
+	}
+
+	return i ? i : rc;
+}
+
 extern int rio_request_inb_mbox(struct rio_mport *, void *, int, int,
 				void (*)(struct rio_mport *, void *, int, int));
+extern int rio_request_inb_mbox_zc(struct rio_mport *, void *, int, int,
+				void (*)(struct rio_mport *, void *, int, int));
 extern int rio_release_inb_mbox(struct rio_mport *, int);
 
 /**
@@ -375,10 +563,67 @@ static inline void *rio_get_inb_message(struct rio_mport *mport, int mbox,
 	return mport->ops->get_inb_message(mport, mbox, msize);
 }
 
+/**
+ * rio_set_inb_mbox_irq - Enable/disable inbound mailbox receive notifications
+ * @mport: Master port containing the inbound mailbox
+ * @mbox: The inbound mailbox number
+ * @enable: 1 = enable, 0 = disable message receive interrupt
+ *
+ * Allows a mailbox client to switch into polling mode (e.g. NAPI) by masking
+ * message receive interrupts while it drains the inbound queue. Returns %0 on
+ * success or %-ENOSYS if the master port does not support this operation.
+ */
+static inline int rio_set_inb_mbox_irq(struct rio_mport *mport, int mbox,
+				       int enable)
+{
+	if (!mport->ops->set_inb_mbox_irq)
+		return -ENOSYS;
+	return mport->ops->set_inb_mbox_irq(mport, mbox, enable);
+}
+
+/**
+ * rio_get_mbox_coalesce - Read mailbox interrupt moderation settings
+ * @mport: Master port containing the mailbox
+ * @mbox: The mailbox number
+ * @inb: true = inbound, false = outbound mailbox
+ * @ec: Pointer to structure to be filled with current settings
+ *
+ * Returns %0 on success or %-ENOSYS if the master port does not support
+ * interrupt moderation.
+ */
+static inline int rio_get_mbox_coalesce(struct rio_mport *mport, int mbox,
+					bool inb, struct rio_mbox_coalesce *ec)
+{
+	if (!mport->ops->get_mbox_coalesce)
+		return -ENOSYS;
+	return mport->ops->get_mbox_coalesce(mport, mbox, inb, ec);
+}
+
+/**
+ * rio_set_mbox_coalesce - Change mailbox interrupt moderation settings
+ * @mport: Master port containing the mailbox
+ * @mbox: The mailbox number
+ * @inb: true = inbound, false = outbound mailbox
+ * @ec: New interrupt moderation settings
+ *
+ * Settings persist across mailbox close/open. Returns %0 on success,
+ * %-EINVAL if the master port cannot apply requested settings or
+ * %-ENOSYS if it does not support interrupt moderation.
+ */
+static inline int rio_set_mbox_coalesce(struct rio_mport *mport, int mbox,
+					bool inb,
+					const struct rio_mbox_coalesce *ec)
+{
+	if (!mport->ops->set_mbox_coalesce)
+		return -ENOSYS;
+	return mport->ops->set_mbox_coalesce(mport, mbox, inb, ec);
+}
+
 /* Doorbell management */
 extern int rio_request_inb_dbell(struct rio_mport *, void *, u16, u16,
 				 void (*)(struct rio_mport *, void *, u16, u16, u16));
 extern int rio_release_inb_dbell(struct rio_mport *, u16, u16);
+extern int rio_dispatch_inb_dbell(struct rio_mport *, u16, u16, u16);
 extern struct resource *rio_request_outb_dbell(struct rio_dev *, u16, u16);
 extern int rio_release_outb_dbell(struct rio_dev *, struct resource *);
 
@@ -404,10 +649,10 @@ extern int rio_request_inb_pwrite(struct rio_dev *,
 extern int rio_release_inb_pwrite(struct rio_dev *);
 extern int rio_add_mport_pw_handler(struct rio_mport *mport, void *dev_id,
 			int (*pwcback)(struct rio_mport *mport, void *dev_id,
-			union rio_pw_msg *msg, int step));
+			union rio_pw_msg *msg, int count));
 extern int rio_del_mport_pw_handler(struct rio_mport *mport, void *dev_id,
 			int (*pwcback)(struct rio_mport *mport, void *dev_id,
-			union rio_pw_msg *msg, int step));
+			union rio_pw_msg *msg, int count));
 extern int rio_inb_pwrite_handler(struct rio_mport *mport,
 				  union rio_pw_msg *pw_msg);
 extern void rio_pw_enable(struct rio_mport *mport, int enable);
@@ -430,6 +675,21 @@ extern struct dma_async_tx_descriptor *rio_dma_prep_xfer(
 		struct dma_chan *dchan,	u16 destid,
 		struct rio_dma_data *data,
 		enum dma_transfer_direction direction, unsigned long flags);
+extern struct dma_async_tx_descriptor *rio_dma_prep_xfer_vec(
+		struct dma_chan *dchan, struct rio_dma_data *data,
+		struct rio_dma_seg *segs, unsigned int nsegs,
+		enum dma_transfer_direction direction, unsigned long flags);
+extern int rio_request_mport_dma_stripe(struct rio_mport *mport,
+		struct dma_chan **chans, unsigned int max);
+extern void rio_release_dma_stripe(struct dma_chan **chans,
+		unsigned int nchans);
+extern int rio_dma_sg_slice(struct sg_table *sgt, struct scatterlist *sgl,
+		unsigned int nents, u64 start, u64 len);
+extern int rio_dma_xfer_stripe(struct dma_chan **chans, unsigned int nchans,
+		u16 destid, struct rio_dma_data *data,
+		enum dma_transfer_direction direction,
+		rio_dma_stripe_callback callback, void *param,
+		dma_cookie_t *cookie);
 #endif
 
 /**
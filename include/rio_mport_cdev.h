@@ -123,9 +123,13 @@ struct rio_pw_filter {
 */
 #define RIO_MAP_ANY_ADDR	(__u64)(~((__u64) 0))
 
+/* rio_mmap flags */
+#define RIO_MAP_WC		(1 << 0) /* outbound: write-combining mmap */
+
 struct rio_mmap {
 	__u16 rioid;
-	__u16 pad0[3];
+	__u16 flags;	/* RIO_MAP_* */
+	__u16 pad0[2];
 	__u64 rio_addr;
 	__u64 length;
 	__u64 handle;
@@ -151,13 +155,14 @@ struct rio_event {
 		struct rio_doorbell doorbell;	/* header for RIO_DOORBELL */
 		struct rio_portwrite portwrite; /* header for RIO_PORTWRITE */
 	} u;
-	__u32 pad0;
+	__u32 count;	/* number of events coalesced into this one */
 };
 
 enum rio_transfer_sync {
 	RIO_TRANSFER_SYNC,	/* synchronous transfer */
 	RIO_TRANSFER_ASYNC,	/* asynchronous transfer */
 	RIO_TRANSFER_FAF,	/* fire-and-forget transfer */
+	RIO_TRANSFER_POLL,	/* synchronous transfer, completion is polled */
 };
 
 enum rio_transfer_dir {
@@ -218,6 +223,82 @@ struct rio_transaction {
 	__u32 pad0;
 };
 
+/*
+ * Registered user space buffer. Pages of the buffer are pinned and mapped
+ * for DMA once and stay so until the buffer is unregistered or the file is
+ * closed. A transfer refers to a registered buffer by setting loc_addr to 0,
+ * handle to the value returned by RIO_REGISTER_BUFFER and offset within the
+ * buffer. Registered buffer handles always have RIO_REG_BUF_HANDLE bit set.
+ */
+#define RIO_REG_BUF_HANDLE	((__u64)1 << 63)
+
+struct rio_reg_buf {
+	__u64 address;	/* user space buffer address */
+	__u64 length;	/* buffer length in bytes */
+	__u64 handle;	/* returned: buffer handle */
+};
+
+/*
+ * Topology snapshot of the network attached to an mport. RIO_MPORT_GET_TOPOLOGY
+ * copies the snapshot into the buffer and returns its size in length. If the
+ * buffer is too small it fails with ENOSPC and returns the required size.
+ * RIO_MPORT_SET_TOPOLOGY passes a snapshot back to be used by the next
+ * enumeration through the mport, zero address drops the one set before.
+ * The snapshot format is versioned and opaque to user space.
+ */
+struct rio_topo_buf {
+	__u64 address;	/* user space buffer address */
+	__u32 length;	/* buffer length, returned snapshot size */
+	__u32 pad0;
+};
+
+/*
+ * Event ring shared with user space. Once set up by RIO_EVENT_RING_SETUP,
+ * doorbell and port-write events of the file descriptor are placed into
+ * the ring instead of being returned by read(). Kernel is the producer
+ * (head), user space is the consumer (tail). Indexes are free-running and
+ * masked by (entries - 1) on access. The ring file descriptor becomes
+ * readable after wake_count events have been queued or wake_timeout has
+ * expired since the first of them.
+ */
+struct rio_event_ring {
+	__u32 head;	/* written by kernel */
+	__u32 tail;	/* written by user space */
+	__u32 dropped;	/* events dropped because the ring was full */
+	__u32 pad0;
+};
+
+#define RIO_EVENT_RING_MAX_ENTRIES	65536
+
+/*
+ * Allocation policy for inbound window and DMA buffers allocated by the
+ * driver (RIO_MAP_ANY_ADDR), applies to following requests on the file.
+ * In node-local mode a buffer is a physically contiguous block of pages
+ * aligned to its size (up to the page allocator limit) taken from the
+ * requested NUMA node, and it is mapped cacheable into user space. Larger
+ * buffers are allocated as in default mode. User space mappings of either
+ * kind use base pages, not huge pages. Node-local buffers are refused
+ * (EOPNOTSUPP) if DMA of the mport is not cache coherent or would be bounced.
+ */
+#define RIO_ALLOC_NODE_LOCAL	(1 << 0)
+
+struct rio_alloc_policy {
+	__u32 flags;	/* RIO_ALLOC_* */
+	__s32 node;	/* NUMA node, -1 - node of the mport device */
+};
+
+struct rio_event_ring_setup {
+	__u32 entries;	/* ring entries, power of two */
+	__s32 fd;	/* returned: ring file descriptor to mmap() */
+	__u32 wake_count;	/* events to wake up after, 0 - every event */
+	__u32 wake_timeout;	/* uSec to wake up after, 0 - no timeout */
+	/* returned layout of the area to mmap(), offsets from start */
+	__u32 map_size;
+	__u32 ring;	/* struct rio_event_ring */
+	__u32 events;	/* struct rio_event[entries] */
+	__u32 pad0;
+};
+
 struct rio_async_tx_wait {
 	__u32 token;	/* DMA transaction ID token */
 	__u32 timeout;	/* Wait timeout in msec, if 0 use default TO */
@@ -284,5 +365,17 @@ struct rio_rdev_info {
 	_IOW(RIO_MPORT_DRV_MAGIC, 23, struct rio_rdev_info)
 #define RIO_DEV_DEL \
 	_IOW(RIO_MPORT_DRV_MAGIC, 24, struct rio_rdev_info)
+#define RIO_REGISTER_BUFFER \
+	_IOWR(RIO_MPORT_DRV_MAGIC, 25, struct rio_reg_buf)
+#define RIO_UNREGISTER_BUFFER \
+	_IOW(RIO_MPORT_DRV_MAGIC, 26, __u64)
+#define RIO_MPORT_GET_TOPOLOGY \
+	_IOWR(RIO_MPORT_DRV_MAGIC, 27, struct rio_topo_buf)
+#define RIO_MPORT_SET_TOPOLOGY \
+	_IOW(RIO_MPORT_DRV_MAGIC, 28, struct rio_topo_buf)
+#define RIO_EVENT_RING_SETUP \
+	_IOWR(RIO_MPORT_DRV_MAGIC, 29, struct rio_event_ring_setup)
+#define RIO_SET_ALLOC_POLICY \
+	_IOW(RIO_MPORT_DRV_MAGIC, 30, struct rio_alloc_policy)
 
 #endif /* _RIO_MPORT_CDEV_H_ */
@@ -0,0 +1,216 @@
+/*
+ * RapidIO tracepoints
+ *
+ * Tracepoints are defined by the RapidIO core and exported for use by
+ * mport drivers.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rapidio
+
+#if !defined(_RIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RIO_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "rio.h"
+
+TRACE_EVENT(rio_omsg_enq,
+	TP_PROTO(struct rio_mport *mport, int mbox, u32 slot, u16 destid,
+		 u32 len),
+	TP_ARGS(mport, mbox, slot, destid, len),
+	TP_STRUCT__entry(
+		__field(u8, mport)
+		__field(u8, mbox)
+		__field(u16, destid)
+		__field(u32, slot)
+		__field(u32, len)
+	),
+	TP_fast_assign(
+		__entry->mport = mport->id;
+		__entry->mbox = mbox;
+		__entry->destid = destid;
+		__entry->slot = slot;
+		__entry->len = len;
+	),
+	TP_printk("mport%u mbox%u slot=%u destid=0x%x len=%u",
+		  __entry->mport, __entry->mbox, __entry->slot,
+		  __entry->destid, __entry->len)
+);
+
+TRACE_EVENT(rio_omsg_done,
+	TP_PROTO(struct rio_mport *mport, int mbox, u32 slot, int status,
+		 u64 lat_ns),
+	TP_ARGS(mport, mbox, slot, status, lat_ns),
+	TP_STRUCT__entry(
+		__field(u8, mport)
+		__field(u8, mbox)
+		__field(u32, slot)
+		__field(int, status)
+		__field(u64, lat_ns)
+	),
+	TP_fast_assign(
+		__entry->mport = mport->id;
+		__entry->mbox = mbox;
+		__entry->slot = slot;
+		__entry->status = status;
+		__entry->lat_ns = lat_ns;
+	),
+	TP_printk("mport%u mbox%u slot=%u status=%d lat=%llu ns",
+		  __entry->mport, __entry->mbox, __entry->slot,
+		  __entry->status, (unsigned long long)__entry->lat_ns)
+);
+
+TRACE_EVENT(rio_imsg_rx,
+	TP_PROTO(struct rio_mport *mport, int mbox, u32 slot, u32 len),
+	TP_ARGS(mport, mbox, slot, len),
+	TP_STRUCT__entry(
+		__field(u8, mport)
+		__field(u8, mbox)
+		__field(u32, slot)
+		__field(u32, len)
+	),
+	TP_fast_assign(
+		__entry->mport = mport->id;
+		__entry->mbox = mbox;
+		__entry->slot = slot;
+		__entry->len = len;
+	),
+	TP_printk("mport%u mbox%u slot=%u len=%u",
+		  __entry->mport, __entry->mbox, __entry->slot, __entry->len)
+);
+
+TRACE_EVENT(rio_dma_submit,
+	TP_PROTO(struct rio_mport *mport, int ch, int cookie, u16 destid,
+		 u64 rio_addr, u32 len, u32 sg_len),
+	TP_ARGS(mport, ch, cookie, destid, rio_addr, len, sg_len),
+	TP_STRUCT__entry(
+		__field(u8, mport)
+		__field(u8, ch)
+		__field(u16, destid)
+		__field(int, cookie)
+		__field(u64, rio_addr)
+		__field(u32, len)
+		__field(u32, sg_len)
+	),
+	TP_fast_assign(
+		__entry->mport = mport->id;
+		__entry->ch = ch;
+		__entry->destid = destid;
+		__entry->cookie = cookie;
+		__entry->rio_addr = rio_addr;
+		__entry->len = len;
+		__entry->sg_len = sg_len;
+	),
+	TP_printk("mport%u ch%u cookie=%d destid=0x%x raddr=0x%llx len=%u sg=%u",
+		  __entry->mport, __entry->ch, __entry->cookie,
+		  __entry->destid, (unsigned long long)__entry->rio_addr,
+		  __entry->len, __entry->sg_len)
+);
+
+TRACE_EVENT(rio_dma_done,
+	TP_PROTO(struct rio_mport *mport, int ch, int cookie, int status,
+		 u64 lat_ns),
+	TP_ARGS(mport, ch, cookie, status, lat_ns),
+	TP_STRUCT__entry(
+		__field(u8, mport)
+		__field(u8, ch)
+		__field(int, cookie)
+		__field(int, status)
+		__field(u64, lat_ns)
+	),
+	TP_fast_assign(
+		__entry->mport = mport->id;
+		__entry->ch = ch;
+		__entry->cookie = cookie;
+		__entry->status = status;
+		__entry->lat_ns = lat_ns;
+	),
+	TP_printk("mport%u ch%u cookie=%d status=%d lat=%llu ns",
+		  __entry->mport, __entry->ch, __entry->cookie,
+		  __entry->status, (unsigned long long)__entry->lat_ns)
+);
+
+TRACE_EVENT(rio_maint,
+	TP_PROTO(struct rio_mport *mport, u16 destid, u8 hopcount, u32 offset,
+		 int write, u32 data, int status),
+	TP_ARGS(mport, destid, hopcount, offset, write, data, status),
+	TP_STRUCT__entry(
+		__field(u8, mport)
+		__field(u8, hopcount)
+		__field(u16, destid)
+		__field(u32, offset)
+		__field(u32, data)
+		__field(int, write)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->mport = mport->id;
+		__entry->hopcount = hopcount;
+		__entry->destid = destid;
+		__entry->offset = offset;
+		__entry->data = data;
+		__entry->write = write;
+		__entry->status = status;
+	),
+	TP_printk("mport%u %s destid=0x%x hc=%u off=0x%x data=0x%08x status=%d",
+		  __entry->mport, __entry->write ? "WR" : "RD",
+		  __entry->destid, __entry->hopcount, __entry->offset,
+		  __entry->data, __entry->status)
+);
+
+TRACE_EVENT(rio_dbell_tx,
+	TP_PROTO(struct rio_mport *mport, u16 destid, u16 info, int status),
+	TP_ARGS(mport, destid, info, status),
+	TP_STRUCT__entry(
+		__field(u8, mport)
+		__field(u16, destid)
+		__field(u16, info)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->mport = mport->id;
+		__entry->destid = destid;
+		__entry->info = info;
+		__entry->status = status;
+	),
+	TP_printk("mport%u destid=0x%x info=0x%04x status=%d",
+		  __entry->mport, __entry->destid, __entry->info,
+		  __entry->status)
+);
+
+TRACE_EVENT(rio_dbell_rx,
+	TP_PROTO(struct rio_mport *mport, u16 src, u16 dst, u16 info,
+		 bool handled),
+	TP_ARGS(mport, src, dst, info, handled),
+	TP_STRUCT__entry(
+		__field(u8, mport)
+		__field(bool, handled)
+		__field(u16, src)
+		__field(u16, dst)
+		__field(u16, info)
+	),
+	TP_fast_assign(
+		__entry->mport = mport->id;
+		__entry->handled = handled;
+		__entry->src = src;
+		__entry->dst = dst;
+		__entry->info = info;
+	),
+	TP_printk("mport%u src=0x%x dst=0x%x info=0x%04x%s",
+		  __entry->mport, __entry->src, __entry->dst, __entry->info,
+		  __entry->handled ? "" : " (no handler)")
+);
+
+#endif /* _RIO_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH include
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rio_trace
+#include <trace/define_trace.h>
@@ -12,14 +12,44 @@
 
 #include "include/rio.h"
 #include <linux/module.h>
+#include "include/rio_trace.h"
 
 /*
- * These interrupt-safe spinlocks protect all accesses to RIO
- * configuration space and doorbell access.
+ * This interrupt-safe spinlock protects doorbell access.
+ * Configuration space accesses are serialized per mport.
  */
-static DEFINE_SPINLOCK(rio_config_lock);
 static DEFINE_SPINLOCK(rio_doorbell_lock);
 
+/*
+ * Config space accesses of an mport from atomic context are serialized by
+ * its interrupt-safe config_lock. Callers that can sleep are serialized by
+ * config_mutex only and pass RIO_MAINT_SLEEP to cmaint_vec, which then
+ * serializes their transactions with the atomic ones itself. Mports that
+ * do not implement cmaint_vec are accessed under config_lock in both cases.
+ */
+static inline void rio_config_lock(struct rio_mport *mport,
+				   unsigned long *flags)
+{
+	spin_lock_irqsave(&mport->config_lock, *flags);
+}
+
+static inline void rio_config_unlock(struct rio_mport *mport,
+				     unsigned long flags)
+{
+	spin_unlock_irqrestore(&mport->config_lock, flags);
+}
+
+static void rio_config_lock_cansleep(struct rio_mport *mport)
+{
+	might_sleep();
+	mutex_lock(&mport->config_mutex);
+}
+
+static void rio_config_unlock_cansleep(struct rio_mport *mport)
+{
+	mutex_unlock(&mport->config_mutex);
+}
+
 /*
  *  Wrappers for all RIO configuration access functions.  They just check
  *  alignment, do locking and call the low-level functions pointed to
@@ -47,10 +77,10 @@ int __rio_local_read_config_##size \
 	unsigned long flags;						\
 	u32 data = 0;							\
 	if (RIO_##size##_BAD) return RIO_BAD_SIZE;			\
-	spin_lock_irqsave(&rio_config_lock, flags);			\
+	rio_config_lock(mport, &flags);					\
 	res = mport->ops->lcread(mport, mport->id, offset, len, &data);	\
 	*value = (type)data;						\
-	spin_unlock_irqrestore(&rio_config_lock, flags);		\
+	rio_config_unlock(mport, flags);				\
 	return res;							\
 }
 
@@ -70,9 +100,9 @@ int __rio_local_write_config_##size \
 	int res;							\
 	unsigned long flags;						\
 	if (RIO_##size##_BAD) return RIO_BAD_SIZE;			\
-	spin_lock_irqsave(&rio_config_lock, flags);			\
+	rio_config_lock(mport, &flags);					\
 	res = mport->ops->lcwrite(mport, mport->id, offset, len, value);\
-	spin_unlock_irqrestore(&rio_config_lock, flags);		\
+	rio_config_unlock(mport, flags);				\
 	return res;							\
 }
 
@@ -107,10 +137,10 @@ int rio_mport_read_config_##size \
 	unsigned long flags;						\
 	u32 data = 0;							\
 	if (RIO_##size##_BAD) return RIO_BAD_SIZE;			\
-	spin_lock_irqsave(&rio_config_lock, flags);			\
+	rio_config_lock(mport, &flags);					\
 	res = mport->ops->cread(mport, mport->id, destid, hopcount, offset, len, &data); \
 	*value = (type)data;						\
-	spin_unlock_irqrestore(&rio_config_lock, flags);		\
+	rio_config_unlock(mport, flags);				\
 	return res;							\
 }
 
@@ -130,9 +160,9 @@ int rio_mport_write_config_##size \
 	int res;							\
 	unsigned long flags;						\
 	if (RIO_##size##_BAD) return RIO_BAD_SIZE;			\
-	spin_lock_irqsave(&rio_config_lock, flags);			\
+	rio_config_lock(mport, &flags);					\
 	res = mport->ops->cwrite(mport, mport->id, destid, hopcount, offset, len, value); \
-	spin_unlock_irqrestore(&rio_config_lock, flags);		\
+	rio_config_unlock(mport, flags);				\
 	return res;							\
 }
 
@@ -150,6 +180,276 @@ EXPORT_SYMBOL_GPL(rio_mport_write_config_8);
 EXPORT_SYMBOL_GPL(rio_mport_write_config_16);
 EXPORT_SYMBOL_GPL(rio_mport_write_config_32);
 
+/*
+ * Performs maintenance transactions of a batch, must be called with
+ * config_lock held unless @flags include RIO_MAINT_SLEEP.
+ */
+static int __rio_maint_vec(struct rio_mport *mport, struct rio_maint_op *ops,
+			   int num, u32 flags)
+{
+	struct rio_maint_op *op;
+	int i;
+
+	if (mport->ops->cmaint_vec)
+		return mport->ops->cmaint_vec(mport, mport->id, ops, num, flags);
+
+	for (i = 0; i < num; i++) {
+		op = &ops[i];
+		if (op->write)
+			op->status = mport->ops->cwrite(mport, mport->id,
+				op->destid, op->hopcount, op->offset, 4,
+				op->data);
+		else
+			op->status = mport->ops->cread(mport, mport->id,
+				op->destid, op->hopcount, op->offset, 4,
+				&op->data);
+	}
+
+	return 0;
+}
+
+/*
+ * Performs single access for caller that can sleep, must be called with
+ * config_mutex held. 32-bit accesses use maintenance batch interface, which
+ * mport drivers may implement more efficiently than single accesses and
+ * which lets them sleep waiting for completion.
+ */
+static int __rio_maint_cansleep(struct rio_mport *mport, u16 destid,
+				u8 hopcount, u32 offset, int len, u32 *data,
+				int write)
+{
+	struct rio_maint_op op;
+	unsigned long flags;
+	int res;
+
+	if (len != 4 || !mport->ops->cmaint_vec) {
+		rio_config_lock(mport, &flags);
+		if (write)
+			res = mport->ops->cwrite(mport, mport->id, destid,
+						 hopcount, offset, len, *data);
+		else
+			res = mport->ops->cread(mport, mport->id, destid,
+						hopcount, offset, len, data);
+		rio_config_unlock(mport, flags);
+		return res;
+	}
+
+	op.destid = destid;
+	op.hopcount = hopcount;
+	op.write = write;
+	op.offset = offset;
+	op.data = *data;
+	op.status = 0;
+
+	res = mport->ops->cmaint_vec(mport, mport->id, &op, 1,
+				     RIO_MAINT_SLEEP);
+	if (res)
+		return res;
+
+	*data = op.data;
+	return op.status;
+}
+
+/**
+ * RIO_OP_READ_CANSLEEP - Generate rio_mport_read_config_*_cansleep functions
+ * @size: Size of configuration space read (8, 16, 32 bits)
+ * @type: C type of value argument
+ * @len: Length of configuration space read (1, 2, 4 bytes)
+ *
+ * Generates rio_mport_read_config_*_cansleep functions used by callers
+ * that can sleep. The caller may sleep while waiting for other accesses
+ * or for completion of its own.
+ */
+#define RIO_OP_READ_CANSLEEP(size,type,len) \
+int rio_mport_read_config_##size##_cansleep \
+	(struct rio_mport *mport, u16 destid, u8 hopcount, u32 offset, type *value)	\
+{									\
+	int res;							\
+	u32 data = 0;							\
+	if (RIO_##size##_BAD) return RIO_BAD_SIZE;			\
+	rio_config_lock_cansleep(mport);				\
+	res = __rio_maint_cansleep(mport, destid, hopcount, offset, len, &data, 0); \
+	*value = (type)data;						\
+	rio_config_unlock_cansleep(mport);				\
+	return res;							\
+}
+
+/**
+ * RIO_OP_WRITE_CANSLEEP - Generate rio_mport_write_config_*_cansleep functions
+ * @size: Size of configuration space write (8, 16, 32 bits)
+ * @type: C type of value argument
+ * @len: Length of configuration space write (1, 2, 4 bytes)
+ *
+ * Generates rio_mport_write_config_*_cansleep functions used by callers
+ * that can sleep. The caller may sleep while waiting for other accesses
+ * or for completion of its own.
+ */
+#define RIO_OP_WRITE_CANSLEEP(size,type,len) \
+int rio_mport_write_config_##size##_cansleep \
+	(struct rio_mport *mport, u16 destid, u8 hopcount, u32 offset, type value)	\
+{									\
+	int res;							\
+	u32 data = value;						\
+	if (RIO_##size##_BAD) return RIO_BAD_SIZE;			\
+	rio_config_lock_cansleep(mport);				\
+	res = __rio_maint_cansleep(mport, destid, hopcount, offset, len, &data, 1); \
+	rio_config_unlock_cansleep(mport);				\
+	return res;							\
+}
+
+RIO_OP_READ_CANSLEEP(8, u8, 1)
+RIO_OP_READ_CANSLEEP(16, u16, 2)
+RIO_OP_READ_CANSLEEP(32, u32, 4)
+RIO_OP_WRITE_CANSLEEP(8, u8, 1)
+RIO_OP_WRITE_CANSLEEP(16, u16, 2)
+RIO_OP_WRITE_CANSLEEP(32, u32, 4)
+
+EXPORT_SYMBOL_GPL(rio_mport_read_config_8_cansleep);
+EXPORT_SYMBOL_GPL(rio_mport_read_config_16_cansleep);
+EXPORT_SYMBOL_GPL(rio_mport_read_config_32_cansleep);
+EXPORT_SYMBOL_GPL(rio_mport_write_config_8_cansleep);
+EXPORT_SYMBOL_GPL(rio_mport_write_config_16_cansleep);
+EXPORT_SYMBOL_GPL(rio_mport_write_config_32_cansleep);
+
+/* Number of transactions rio_mport_read_config_vec() batches at once */
+#define RIO_MAINT_VEC_BATCH	16
+
+static int rio_maint_vec_check(struct rio_maint_op *ops, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		if (ops[i].offset & 3)
+			return RIO_BAD_SIZE;
+	return 0;
+}
+
+static int rio_maint_vec_status(struct rio_maint_op *ops, int num, int res)
+{
+	int i;
+
+	for (i = 0; i < num && !res; i++)
+		res = ops[i].status;
+	return res;
+}
+
+/**
+ * rio_mport_maint_vec - Perform batch of maintenance transactions
+ * @mport: RIO master port
+ * @ops: array of 32-bit maintenance transactions
+ * @num: number of transactions in @ops
+ *
+ * Transactions are performed in order. Mport drivers that implement
+ * cmaint_vec keep several of them in flight, others perform them one
+ * by one. Completion status of every transaction is returned in its
+ * @status field, value of maintenance read in its @data field.
+ *
+ * Returns %0 if all transactions succeeded or status of the first
+ * failed one.
+ */
+int rio_mport_maint_vec(struct rio_mport *mport, struct rio_maint_op *ops,
+			int num)
+{
+	int res;
+	unsigned long flags;
+
+	res = rio_maint_vec_check(ops, num);
+	if (res)
+		return res;
+
+	rio_config_lock(mport, &flags);
+	res = __rio_maint_vec(mport, ops, num, 0);
+	rio_config_unlock(mport, flags);
+
+	return rio_maint_vec_status(ops, num, res);
+}
+EXPORT_SYMBOL_GPL(rio_mport_maint_vec);
+
+/**
+ * rio_mport_maint_vec_cansleep - Perform batch of maintenance transactions
+ * @mport: RIO master port
+ * @ops: array of 32-bit maintenance transactions
+ * @num: number of transactions in @ops
+ *
+ * Same as rio_mport_maint_vec() for callers that can sleep. The caller
+ * may sleep waiting for other accesses or for completion of its own
+ * transactions.
+ */
+int rio_mport_maint_vec_cansleep(struct rio_mport *mport,
+				 struct rio_maint_op *ops, int num)
+{
+	unsigned long flags;
+	int res;
+
+	res = rio_maint_vec_check(ops, num);
+	if (res)
+		return res;
+
+	rio_config_lock_cansleep(mport);
+	if (mport->ops->cmaint_vec) {
+		res = __rio_maint_vec(mport, ops, num, RIO_MAINT_SLEEP);
+	} else {
+		rio_config_lock(mport, &flags);
+		res = __rio_maint_vec(mport, ops, num, 0);
+		rio_config_unlock(mport, flags);
+	}
+	rio_config_unlock_cansleep(mport);
+
+	return rio_maint_vec_status(ops, num, res);
+}
+EXPORT_SYMBOL_GPL(rio_mport_maint_vec_cansleep);
+
+/**
+ * rio_mport_read_config_vec - Read set of 32-bit config space registers
+ * @mport: RIO master port
+ * @destid: destination ID of target device
+ * @hopcount: number of hops to target device
+ * @offset: array of register offsets
+ * @data: array to store register values
+ * @count: number of registers to read
+ *
+ * Reads are issued in batches, so that reading a block of registers costs
+ * one round-trip per batch on mports that support it. Registers that
+ * failed to be read are returned as 0xffffffff. May sleep.
+ *
+ * Returns %0 if all reads succeeded or error code of the first failed one.
+ */
+int rio_mport_read_config_vec(struct rio_mport *mport, u16 destid,
+			      u8 hopcount, const u32 *offset, u32 *data,
+			      unsigned int count)
+{
+	struct rio_maint_op ops[RIO_MAINT_VEC_BATCH];
+	unsigned int i, n;
+	int err, res = 0;
+
+	while (count) {
+		n = min_t(unsigned int, count, RIO_MAINT_VEC_BATCH);
+		for (i = 0; i < n; i++) {
+			ops[i].destid = destid;
+			ops[i].hopcount = hopcount;
+			ops[i].write = 0;
+			ops[i].offset = offset[i];
+			ops[i].data = 0xffffffff;
+			ops[i].status = 0;
+		}
+
+		err = rio_mport_maint_vec_cansleep(mport, ops, n);
+		if (err == RIO_BAD_SIZE)
+			return err;
+		for (i = 0; i < n; i++)
+			data[i] = ops[i].status ? 0xffffffff : ops[i].data;
+		if (!res)
+			res = err;
+
+		offset += n;
+		data += n;
+		count -= n;
+	}
+
+	return res;
+}
+EXPORT_SYMBOL_GPL(rio_mport_read_config_vec);
+
 /**
  * rio_mport_send_doorbell - Send a doorbell message
  *
@@ -165,11 +465,63 @@ int rio_mport_send_doorbell(struct rio_mport *mport, u16 destid, u16 data)
 	int res;
 	unsigned long flags;
 
-	spin_lock_irqsave(&rio_doorbell_lock, flags);
-	res = mport->ops->dsend(mport, mport->id, destid, data);
-	spin_unlock_irqrestore(&rio_doorbell_lock, flags);
+	/* mport with doorbell queue serializes doorbells on its own */
+	if (mport->ops->dsend_vec) {
+		res = mport->ops->dsend(mport, mport->id, destid, data);
+	} else {
+		spin_lock_irqsave(&rio_doorbell_lock, flags);
+		res = mport->ops->dsend(mport, mport->id, destid, data);
+		spin_unlock_irqrestore(&rio_doorbell_lock, flags);
+	}
 
+	trace_rio_dbell_tx(mport, destid, data, res);
 	return res;
 }
 
 EXPORT_SYMBOL_GPL(rio_mport_send_doorbell);
+
+/**
+ * rio_send_doorbells - Send multiple doorbell messages
+ *
+ * @mport: RIO master port
+ * @db: Doorbell messages to send
+ * @num: Number of doorbell messages in @db
+ * @status: Array of @num completion status values or %NULL
+ * @flags: RIO_DBELL_SLEEP if the caller can sleep
+ *
+ * Queues doorbell messages for transmission if @mport implements the
+ * doorbell queue, returning without waiting for their completion.
+ * Transmission errors are reported by the mport driver. Otherwise sends
+ * doorbells one by one with rio_mport_send_doorbell(). If @status is given,
+ * waits until queued doorbells are sent and stores their completion status.
+ * Can be called from atomic context without RIO_DBELL_SLEEP.
+ *
+ * Returns number of doorbells queued (may be less than @num if the queue
+ * becomes full) or negative error code if none could be queued.
+ */
+int rio_send_doorbells(struct rio_mport *mport,
+		       const struct rio_dbell_msg *db, int num, int *status,
+		       u32 flags)
+{
+	int i, res = 0;
+
+	if (mport->ops->dsend_vec) {
+		res = mport->ops->dsend_vec(mport, mport->id, db, num, status,
+					    flags);
+		for (i = 0; i < res; i++)
+			trace_rio_dbell_tx(mport, db[i].destid, db[i].data,
+					   status ? status[i] : 0);
+		return res;
+	}
+
+	for (i = 0; i < num; i++) {
+		res = rio_mport_send_doorbell(mport, db[i].destid, db[i].data);
+		if (status)
+			status[i] = res;
+		else if (res < 0)
+			break;
+	}
+
+	return i ? i : res;
+}
+EXPORT_SYMBOL_GPL(rio_send_doorbells);
@@ -34,6 +34,7 @@
 #include <linux/sched.h>
 #include <linux/jiffies.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include "rio.h"
 
@@ -54,6 +55,87 @@ module_param(disctimeout, uint, S_IWUSR | S_IRUGO);
 MODULE_PARM_DESC(disctimeout,
 		 "Discovery Timeout");
 
+/* Registers read to identify a device, indexes into rio_probe_offs[] */
+enum rio_probe_reg {
+	RIO_PROBE_PEF,
+	RIO_PROBE_SWP_INFO,
+	RIO_PROBE_DEV_ID,
+	RIO_PROBE_DEV_INFO,
+	RIO_PROBE_ASM_ID,
+	RIO_PROBE_ASM_INFO,
+	RIO_PROBE_SRC_OPS,
+	RIO_PROBE_DST_OPS,
+	RIO_PROBE_COMP_TAG,
+	RIO_PROBE_NREGS
+};
+
+static const u32 rio_probe_offs[RIO_PROBE_NREGS] = {
+	[RIO_PROBE_PEF]		= RIO_PEF_CAR,
+	[RIO_PROBE_SWP_INFO]	= RIO_SWP_INFO_CAR,
+	[RIO_PROBE_DEV_ID]	= RIO_DEV_ID_CAR,
+	[RIO_PROBE_DEV_INFO]	= RIO_DEV_INFO_CAR,
+	[RIO_PROBE_ASM_ID]	= RIO_ASM_ID_CAR,
+	[RIO_PROBE_ASM_INFO]	= RIO_ASM_INFO_CAR,
+	[RIO_PROBE_SRC_OPS]	= RIO_SRC_OPS_CAR,
+	[RIO_PROBE_DST_OPS]	= RIO_DST_OPS_CAR,
+	[RIO_PROBE_COMP_TAG]	= RIO_COMPONENT_TAG_CSR,
+};
+
+/* Max number of devices discovery probes in one batch */
+#define RIO_SCAN_BATCH		16
+/* Size of maintenance transaction buffer used by scan (one per port max) */
+#define RIO_SCAN_MAX_OPS	256
+
+/**
+ * struct rio_topo_rec - Device record of a topology snapshot
+ * @dev: Device record
+ * @routes: Route entries recorded for the switch
+ * @claimed: Device has been found at the recorded position
+ * @reserved: Recorded destID has been reserved for the device
+ * @used: Recorded destID has been assigned to the device
+ */
+struct rio_topo_rec {
+	const struct rio_topo_dev *dev;
+	const struct rio_topo_route *routes;
+	bool claimed;
+	bool reserved;
+	bool used;
+};
+
+/**
+ * struct rio_topo - Topology snapshot used by enumeration
+ * @snap: Snapshot data
+ * @ndevs: Number of device records
+ * @rec: Device records
+ */
+struct rio_topo {
+	void *snap;
+	u32 ndevs;
+	struct rio_topo_rec rec[0];
+};
+
+/**
+ * struct rio_scan_entry - Device queued for enumeration/discovery
+ * @node: Node in scan queue
+ * @prev: Switch the device is connected to (%NULL for host peer)
+ * @prev_port: Port of @prev the device is connected to
+ * @destid: Destination ID to access the device
+ * @hopcount: Hopcount to access the device
+ * @status: Completion status of device probe
+ * @regs: Identification registers read by probe
+ * @rec: Topology snapshot record matching the device
+ */
+struct rio_scan_entry {
+	struct list_head node;
+	struct rio_dev *prev;
+	int prev_port;
+	u16 destid;
+	u8 hopcount;
+	int status;
+	u32 regs[RIO_PROBE_NREGS];
+	struct rio_topo_rec *rec;
+};
+
 /**
  * rio_destid_alloc - Allocate next available destID for given network
  * @net: RIO network
@@ -156,6 +238,146 @@ static u16 rio_destid_next(struct rio_net *net, u16 from)
 	return (u16)destid;
 }
 
+/**
+ * rio_topo_load - Prepares topology snapshot for enumeration
+ * @net: RIO network being enumerated
+ * @mport: Master port to send transactions
+ *
+ * Takes topology snapshot set for @mport, if any, and reserves destIDs
+ * recorded in it so that new devices do not take them. Component tags
+ * of new devices are allocated above ones recorded in the snapshot.
+ * Returns %NULL if there is no usable snapshot.
+ */
+static struct rio_topo *rio_topo_load(struct rio_net *net,
+				      struct rio_mport *mport)
+{
+	const struct rio_topo_hdr *hdr;
+	struct rio_topo_rec *rec;
+	struct rio_topo *topo;
+	size_t size, len;
+	void *snap;
+	u32 i, ctag;
+	u16 destid;
+
+	snap = rio_mport_take_topology(mport, &size);
+	if (!snap)
+		return NULL;
+
+	hdr = snap;
+	if (le16_to_cpu(hdr->host_did) != mport->host_deviceid) {
+		pr_info("RIO: topology snapshot of another host ignored\n");
+		vfree(snap);
+		return NULL;
+	}
+
+	topo = vzalloc(sizeof(*topo) +
+		       le32_to_cpu(hdr->ndevs) * sizeof(topo->rec[0]));
+	if (!topo) {
+		vfree(snap);
+		return NULL;
+	}
+
+	topo->snap = snap;
+	topo->ndevs = le32_to_cpu(hdr->ndevs);
+	len = sizeof(*hdr);
+	for (i = 0; i < topo->ndevs; i++) {
+		rec = &topo->rec[i];
+		rec->dev = snap + len;
+		rec->routes = (const struct rio_topo_route *)(rec->dev + 1);
+		len += sizeof(*rec->dev) +
+		       le32_to_cpu(rec->dev->nroutes) * sizeof(*rec->routes);
+
+		/* Records without valid component tag can't be verified */
+		ctag = le32_to_cpu(rec->dev->comp_tag);
+		if (!ctag || ctag >= 0x10000) {
+			rec->claimed = true;
+			continue;
+		}
+		if (ctag >= next_comptag)
+			next_comptag = ctag + 1;
+
+		if (!(rec->dev->flags & RIO_TOPO_DESTID))
+			continue;
+		destid = le16_to_cpu(rec->dev->destid);
+		if (destid == mport->host_deviceid ||
+		    destid >= RIO_ANY_DESTID(mport->sys_size))
+			continue;
+		rec->reserved = !rio_destid_reserve(net, destid);
+	}
+
+	pr_debug("RIO: using topology snapshot of %u devices\n", topo->ndevs);
+	return topo;
+}
+
+static void rio_topo_free(struct rio_topo *topo)
+{
+	if (!topo)
+		return;
+
+	vfree(topo->snap);
+	vfree(topo);
+}
+
+/**
+ * rio_topo_match - Finds snapshot record of a probed device
+ * @topo: Topology snapshot
+ * @sn: Probed device
+ *
+ * A device matches its record if it is connected to the same port of the
+ * same upstream switch, has the same identity and still holds component
+ * tag assigned to it (i.e. it has not been reset since the snapshot was
+ * taken). Returns matching record or %NULL.
+ */
+static struct rio_topo_rec *rio_topo_match(struct rio_topo *topo,
+					   struct rio_scan_entry *sn)
+{
+	const struct rio_topo_dev *td;
+	u32 prev_ctag = sn->prev ? sn->prev->comp_tag : 0;
+	u8 prev_port = sn->prev ? sn->prev_port : 0;
+	bool sw = !!(sn->regs[RIO_PROBE_PEF] & RIO_PEF_SWITCH);
+	u32 i;
+
+	if (!topo)
+		return NULL;
+
+	for (i = 0; i < topo->ndevs; i++) {
+		td = topo->rec[i].dev;
+		if (topo->rec[i].claimed ||
+		    le32_to_cpu(td->prev_ctag) != prev_ctag ||
+		    td->prev_port != prev_port ||
+		    le32_to_cpu(td->dev_id) != sn->regs[RIO_PROBE_DEV_ID] ||
+		    le32_to_cpu(td->comp_tag) != sn->regs[RIO_PROBE_COMP_TAG] ||
+		    !!(td->flags & RIO_TOPO_SWITCH) != sw)
+			continue;
+
+		topo->rec[i].claimed = true;
+		return &topo->rec[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * rio_topo_find - Finds snapshot record of an enumerated device
+ * @topo: Topology snapshot
+ * @rdev: RIO device
+ */
+static struct rio_topo_rec *rio_topo_find(struct rio_topo *topo,
+					  struct rio_dev *rdev)
+{
+	u32 i;
+
+	if (!topo)
+		return NULL;
+
+	for (i = 0; i < topo->ndevs; i++)
+		if (topo->rec[i].claimed &&
+		    le32_to_cpu(topo->rec[i].dev->comp_tag) == rdev->comp_tag)
+			return &topo->rec[i];
+
+	return NULL;
+}
+
 /**
  * rio_get_device_id - Get the base/extended device id for a device
  * @port: RIO master port
@@ -169,7 +391,8 @@ static u16 rio_get_device_id(struct rio_mport *port, u16 destid, u8 hopcount)
 {
 	u32 result;
 
-	rio_mport_read_config_32(port, destid, hopcount, RIO_DID_CSR, &result);
+	rio_mport_read_config_32_cansleep(port, destid, hopcount, RIO_DID_CSR,
+					  &result);
 
 	return RIO_GET_DID(port->sys_size, result);
 }
@@ -185,8 +408,8 @@ static u16 rio_get_device_id(struct rio_mport *port, u16 destid, u8 hopcount)
  */
 static void rio_set_device_id(struct rio_mport *port, u16 destid, u8 hopcount, u16 did)
 {
-	rio_mport_write_config_32(port, destid, hopcount, RIO_DID_CSR,
-				  RIO_SET_DID(port->sys_size, did));
+	rio_mport_write_config_32_cansleep(port, destid, hopcount, RIO_DID_CSR,
+					   RIO_SET_DID(port->sys_size, did));
 }
 
 /**
@@ -215,9 +438,10 @@ static int rio_clear_locks(struct rio_net *net)
 		ret = -EINVAL;
 	}
 	list_for_each_entry(rdev, &net->devices, net_list) {
-		rio_write_config_32(rdev, RIO_HOST_DID_LOCK_CSR,
-				    port->host_deviceid);
-		rio_read_config_32(rdev, RIO_HOST_DID_LOCK_CSR, &result);
+		rio_write_config_32_cansleep(rdev, RIO_HOST_DID_LOCK_CSR,
+					     port->host_deviceid);
+		rio_read_config_32_cansleep(rdev, RIO_HOST_DID_LOCK_CSR,
+					    &result);
 		if ((result & 0xffff) != 0xffff) {
 			printk(KERN_INFO
 			       "RIO: badness when releasing host lock on vid %4.4x did %4.4x\n",
@@ -226,13 +450,13 @@ static int rio_clear_locks(struct rio_net *net)
 		}
 
 		/* Mark device as discovered and enable master */
-		rio_read_config_32(rdev,
-				   rdev->phys_efptr + RIO_PORT_GEN_CTL_CSR,
-				   &result);
+		rio_read_config_32_cansleep(rdev,
+				rdev->phys_efptr + RIO_PORT_GEN_CTL_CSR,
+				&result);
 		result |= RIO_PORT_GEN_DISCOVERED | RIO_PORT_GEN_MASTER;
-		rio_write_config_32(rdev,
-				    rdev->phys_efptr + RIO_PORT_GEN_CTL_CSR,
-				    result);
+		rio_write_config_32_cansleep(rdev,
+				rdev->phys_efptr + RIO_PORT_GEN_CTL_CSR,
+				result);
 	}
 
 	return ret;
@@ -286,14 +510,15 @@ static int rio_device_has_destid(struct rio_mport *port, int src_ops,
  * @dev: LDM device associated with a RIO device struct
  *
  * Gets the RIO device struct associated a RIO device struct.
- * The RIO device struct is freed.
+ * The RIO device struct is freed after RCU grace period because
+ * device lookups may still reference it.
  */
 static void rio_release_dev(struct device *dev)
 {
 	struct rio_dev *rdev;
 
 	rdev = to_rio_dev(dev);
-	kfree(rdev);
+	kfree_rcu(rdev, rcu);
 }
 
 /**
@@ -316,21 +541,20 @@ static int rio_is_switch(struct rio_dev *rdev)
  * rio_setup_device- Allocates and sets up a RIO device
  * @net: RIO network
  * @port: Master port to send transactions
- * @destid: Current destination ID
- * @hopcount: Current hopcount
+ * @sn: Probed device
  * @do_enum: Enumeration/Discovery mode flag
  *
  * Allocates a RIO device and configures fields based on configuration
- * space contents. If device has a destination ID register, a destination
- * ID is either assigned in enumeration mode or read from configuration
- * space in discovery mode.  If the device has switch capabilities, then
- * a switch is allocated and configured appropriately. Returns a pointer
- * to a RIO device on success or NULL on failure.
+ * space contents read by rio_probe_devices(). If device has a destination
+ * ID register, a destination ID is either assigned in enumeration mode or
+ * read from configuration space in discovery mode.  If the device has switch
+ * capabilities, then a switch is allocated and configured appropriately.
+ * Returns a pointer to a RIO device on success or NULL on failure.
  *
  */
 static struct rio_dev *rio_setup_device(struct rio_net *net,
-					struct rio_mport *port, u16 destid,
-					u8 hopcount, int do_enum)
+					struct rio_mport *port,
+					struct rio_scan_entry *sn, int do_enum)
 {
 	int ret = 0;
 	struct rio_dev *rdev;
@@ -338,15 +562,16 @@ static struct rio_dev *rio_setup_device(struct rio_net *net,
 	int result, rdid;
 	size_t size;
 	u32 swpinfo = 0;
+	u16 destid = sn->destid;
+	u8 hopcount = sn->hopcount;
 
 	size = sizeof(struct rio_dev);
-	if (rio_mport_read_config_32(port, destid, hopcount,
-				     RIO_PEF_CAR, &result))
+	if (sn->status)
 		return NULL;
 
+	result = sn->regs[RIO_PROBE_PEF];
 	if (result & (RIO_PEF_SWITCH | RIO_PEF_MULTIPORT)) {
-		rio_mport_read_config_32(port, destid, hopcount,
-					 RIO_SWP_INFO_CAR, &swpinfo);
+		swpinfo = sn->regs[RIO_PROBE_SWP_INFO];
 		if (result & RIO_PEF_SWITCH) {
 			size += (RIO_GET_TOTAL_PORTS(swpinfo) *
 				sizeof(rswitch->nextdev[0])) + sizeof(*rswitch);
@@ -360,20 +585,22 @@ static struct rio_dev *rio_setup_device(struct rio_net *net,
 	rdev->net = net;
 	rdev->pef = result;
 	rdev->swpinfo = swpinfo;
-	rio_mport_read_config_32(port, destid, hopcount, RIO_DEV_ID_CAR,
-				 &result);
+	result = sn->regs[RIO_PROBE_DEV_ID];
 	rdev->did = result >> 16;
 	rdev->vid = result & 0xffff;
-	rio_mport_read_config_32(port, destid, hopcount, RIO_DEV_INFO_CAR,
-				 &rdev->device_rev);
-	rio_mport_read_config_32(port, destid, hopcount, RIO_ASM_ID_CAR,
-				 &result);
+	rdev->device_rev = sn->regs[RIO_PROBE_DEV_INFO];
+	result = sn->regs[RIO_PROBE_ASM_ID];
 	rdev->asm_did = result >> 16;
 	rdev->asm_vid = result & 0xffff;
-	rio_mport_read_config_32(port, destid, hopcount, RIO_ASM_INFO_CAR,
-				 &result);
+	result = sn->regs[RIO_PROBE_ASM_INFO];
 	rdev->asm_rev = result >> 16;
-	if (rdev->pef & RIO_PEF_EXT_FEATURES) {
+	if ((rdev->pef & RIO_PEF_EXT_FEATURES) && sn->rec) {
+		/* Feature blocks are known from topology snapshot */
+		rdev->efptr = result & 0xffff;
+		rdev->phys_efptr = le32_to_cpu(sn->rec->dev->phys_efptr);
+		rdev->phys_rmap = sn->rec->dev->phys_rmap;
+		rdev->em_efptr = le32_to_cpu(sn->rec->dev->em_efptr);
+	} else if (rdev->pef & RIO_PEF_EXT_FEATURES) {
 		rdev->efptr = result & 0xffff;
 		rdev->phys_efptr = rio_mport_get_physefb(port, 0, destid,
 						hopcount, &rdev->phys_rmap);
@@ -387,29 +614,32 @@ static struct rio_dev *rio_setup_device(struct rio_net *net,
 						hopcount, RIO_EFB_ERR_MGMNT_HS);
 	}
 
-	rio_mport_read_config_32(port, destid, hopcount, RIO_SRC_OPS_CAR,
-				 &rdev->src_ops);
-	rio_mport_read_config_32(port, destid, hopcount, RIO_DST_OPS_CAR,
-				 &rdev->dst_ops);
+	rdev->src_ops = sn->regs[RIO_PROBE_SRC_OPS];
+	rdev->dst_ops = sn->regs[RIO_PROBE_DST_OPS];
 
-	if (do_enum) {
+	if (do_enum && sn->rec) {
+		/* Device still holds component tag from the snapshot */
+		rdev->comp_tag = sn->regs[RIO_PROBE_COMP_TAG];
+		rdev->do_enum = true;
+	} else if (do_enum) {
 		/* Assign component tag to device */
 		if (next_comptag >= 0x10000) {
 			pr_err("RIO: Component Tag Counter Overflow\n");
 			goto cleanup;
 		}
-		rio_mport_write_config_32(port, destid, hopcount,
-					  RIO_COMPONENT_TAG_CSR, next_comptag);
+		rio_mport_write_config_32_cansleep(port, destid, hopcount,
+				RIO_COMPONENT_TAG_CSR, next_comptag);
 		rdev->comp_tag = next_comptag++;
 		rdev->do_enum = true;
-	}  else {
-		rio_mport_read_config_32(port, destid, hopcount,
-					 RIO_COMPONENT_TAG_CSR,
-					 &rdev->comp_tag);
-	}
+	}  else
+		rdev->comp_tag = sn->regs[RIO_PROBE_COMP_TAG];
 
 	if (rio_device_has_destid(port, rdev->src_ops, rdev->dst_ops)) {
-		if (do_enum) {
+		if (do_enum && sn->rec && sn->rec->reserved) {
+			rdev->destid = le16_to_cpu(sn->rec->dev->destid);
+			rio_set_device_id(port, destid, hopcount, rdev->destid);
+			sn->rec->used = true;
+		} else if (do_enum) {
 			rio_set_device_id(port, destid, hopcount, next_destid);
 			rdev->destid = next_destid;
 			next_destid = rio_destid_alloc(net);
@@ -442,7 +672,11 @@ static struct rio_dev *rio_setup_device(struct rio_net *net,
 		dev_set_name(&rdev->dev, "%02x:s:%04x", rdev->net->id,
 			     rdev->comp_tag & RIO_CTAG_UDEVID);
 
-		if (do_enum)
+		/*
+		 * Route table of a switch found in topology snapshot is
+		 * updated with differences only, see rio_topo_update_routes()
+		 */
+		if (do_enum && !sn->rec)
 			rio_route_clr_table(rdev, RIO_GLOBAL_TABLE, 0);
 	} else {
 		if (do_enum)
@@ -481,24 +715,111 @@ cleanup:
 }
 
 /**
- * rio_sport_is_active- Tests if a switch port has an active connection.
- * @rdev: RapidIO device object
- * @sp: Switch port number
+ * rio_scan_entry_add - Queues a device for enumeration/discovery
+ * @queue: Scan queue
+ * @destid: Destination ID to access the device
+ * @hopcount: Hopcount to access the device
+ * @prev: Switch the device is connected to (%NULL for host peer)
+ * @prev_port: Port of @prev the device is connected to
  *
- * Reads the port error status CSR for a particular switch port to
- * determine if the port has an active link.  Returns
- * %RIO_PORT_N_ERR_STS_PORT_OK if the port is active or %0 if it is
- * inactive.
+ * Returns %0 on success or %-ENOMEM on failure.
  */
-static int
-rio_sport_is_active(struct rio_dev *rdev, int sp)
+static int rio_scan_entry_add(struct list_head *queue, u16 destid,
+			      u8 hopcount, struct rio_dev *prev, int prev_port)
 {
-	u32 result = 0;
+	struct rio_scan_entry *sn;
 
-	rio_read_config_32(rdev, RIO_DEV_PORT_N_ERR_STS_CSR(rdev, sp),
-			   &result);
+	sn = kzalloc(sizeof(*sn), GFP_KERNEL);
+	if (!sn)
+		return -ENOMEM;
 
-	return result & RIO_PORT_N_ERR_STS_PORT_OK;
+	sn->destid = destid;
+	sn->hopcount = hopcount;
+	sn->prev = prev;
+	sn->prev_port = prev_port;
+	list_add_tail(&sn->node, queue);
+	return 0;
+}
+
+static void rio_scan_queue_free(struct list_head *queue)
+{
+	struct rio_scan_entry *sn, *tmp;
+
+	list_for_each_entry_safe(sn, tmp, queue, node) {
+		list_del(&sn->node);
+		kfree(sn);
+	}
+}
+
+/**
+ * rio_probe_devices - Reads identification registers of devices
+ * @port: Master port to send transactions
+ * @sn: Array of devices to probe
+ * @num: Number of devices in @sn
+ * @ops: Buffer for @num * %RIO_PROBE_NREGS maintenance transactions
+ *
+ * Reads registers required by rio_setup_device() of all devices in one
+ * batch of maintenance transactions. Status of each device probe is
+ * returned in its @status field.
+ */
+static void rio_probe_devices(struct rio_mport *port,
+			      struct rio_scan_entry **sn, int num,
+			      struct rio_maint_op *ops)
+{
+	struct rio_maint_op *op;
+	int i, j;
+
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < RIO_PROBE_NREGS; j++) {
+			op = &ops[i * RIO_PROBE_NREGS + j];
+			op->destid = sn[i]->destid;
+			op->hopcount = sn[i]->hopcount;
+			op->write = 0;
+			op->offset = rio_probe_offs[j];
+			op->data = 0;
+			op->status = 0;
+		}
+	}
+
+	rio_mport_maint_vec_cansleep(port, ops, num * RIO_PROBE_NREGS);
+
+	for (i = 0; i < num; i++) {
+		op = &ops[i * RIO_PROBE_NREGS];
+		sn[i]->status = op[RIO_PROBE_PEF].status;
+		for (j = 0; j < RIO_PROBE_NREGS; j++)
+			sn[i]->regs[j] = op[j].status ? 0 : op[j].data;
+	}
+}
+
+/**
+ * rio_sport_get_active- Tests which switch ports have an active connection.
+ * @rdev: RapidIO switch device object
+ * @ops: Buffer for one maintenance transaction per switch port
+ *
+ * Reads the port error status CSRs of all switch ports in one batch to
+ * determine which ports have an active link. On return @data field of
+ * ops[n] is %RIO_PORT_N_ERR_STS_PORT_OK if port n is active or %0 if it
+ * is inactive.
+ */
+static void rio_sport_get_active(struct rio_dev *rdev,
+				 struct rio_maint_op *ops)
+{
+	int i, nports = RIO_GET_TOTAL_PORTS(rdev->swpinfo);
+
+	for (i = 0; i < nports; i++) {
+		ops[i].destid = rdev->destid;
+		ops[i].hopcount = rdev->hopcount;
+		ops[i].write = 0;
+		ops[i].offset = RIO_DEV_PORT_N_ERR_STS_CSR(rdev, i);
+		ops[i].data = 0;
+		ops[i].status = 0;
+	}
+
+	rio_mport_maint_vec_cansleep(rdev->net->hport, ops, nports);
+
+	for (i = 0; i < nports; i++)
+		ops[i].data = ops[i].status ?
+				0 : ops[i].data & RIO_PORT_N_ERR_STS_PORT_OK;
 }
 
 /**
@@ -513,30 +834,84 @@ static u16 rio_get_host_deviceid_lock(struct rio_mport *port, u8 hopcount)
 {
 	u32 result;
 
-	rio_mport_read_config_32(port, RIO_ANY_DESTID(port->sys_size), hopcount,
-				 RIO_HOST_DID_LOCK_CSR, &result);
+	rio_mport_read_config_32_cansleep(port, RIO_ANY_DESTID(port->sys_size),
+					  hopcount, RIO_HOST_DID_LOCK_CSR,
+					  &result);
 
 	return (u16) (result & 0xffff);
 }
 
 /**
- * rio_enum_peer- Recursively enumerate a RIO network through a master port
+ * rio_sw_port_to - Returns switch port a device is connected to
+ * @sw: RIO switch device
+ * @rdev: RIO device connected to @sw
+ */
+static int rio_sw_port_to(struct rio_dev *sw, struct rio_dev *rdev)
+{
+	int i;
+
+	for (i = 0; i < RIO_GET_TOTAL_PORTS(sw->swpinfo); i++)
+		if (sw->rswitch->nextdev[i] == rdev)
+			return i;
+
+	return RIO_INVALID_ROUTE;
+}
+
+/**
+ * rio_enum_route_path - Routes enumeration probes to a switch port
+ * @port: Master port to send transactions
+ * @sw: RIO switch device
+ * @sw_port: Port of @sw
+ *
+ * Points %RIO_ANY_DESTID route of every switch on the path from the host
+ * to @sw to the next hop towards @sw_port. Switches are updated starting
+ * from the host, and only entries that differ from ones set for a previous
+ * probe are written, so probing ports of the same switch in a row costs
+ * a single route update.
+ */
+static void rio_enum_route_path(struct rio_mport *port, struct rio_dev *sw,
+				int sw_port)
+{
+	u16 any = RIO_ANY_DESTID(port->sys_size);
+
+	if (sw->prev)
+		rio_enum_route_path(port, sw->prev,
+				    rio_sw_port_to(sw->prev, sw));
+
+	if (sw->rswitch->route_table[any] == sw_port)
+		return;
+
+	rio_route_add_entry(sw, RIO_GLOBAL_TABLE, any, sw_port, 0);
+	sw->rswitch->route_table[any] = sw_port;
+}
+
+/**
+ * rio_enum_peer- Enumerate a device queued for enumeration
  * @net: RIO network being enumerated
  * @port: Master port to send transactions
- * @hopcount: Number of hops into the network
- * @prev: Previous RIO device connected to the enumerated one
- * @prev_port: Port on previous RIO device
+ * @sn: Device to enumerate
+ * @queue: Scan queue to add devices connected to switch ports to
+ * @ops: Buffer for maintenance transactions
+ * @topo: Topology snapshot or %NULL
  *
- * Recursively enumerates a RIO network.  Transactions are sent via the
+ * Acquires the device and sets it up. If the device is a switch, queues
+ * devices connected to its active ports.  Transactions are sent via the
  * master port passed in @port.
  */
 static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
-			 u8 hopcount, struct rio_dev *prev, int prev_port)
+			 struct rio_scan_entry *sn, struct list_head *queue,
+			 struct rio_maint_op *ops, struct rio_topo *topo)
 {
 	struct rio_dev *rdev;
+	struct rio_dev *prev = sn->prev;
+	int prev_port = sn->prev_port;
+	u8 hopcount = sn->hopcount;
 	u32 regval;
 	int tmp;
 
+	if (prev)
+		rio_enum_route_path(port, prev, prev_port);
+
 	if (rio_mport_chk_dev_access(port,
 			RIO_ANY_DESTID(port->sys_size), hopcount)) {
 		pr_debug("RIO: device access check failed\n");
@@ -549,7 +924,8 @@ static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
 		 * Already discovered by this host. Add it as another
 		 * link to the existing device.
 		 */
-		rio_mport_read_config_32(port, RIO_ANY_DESTID(port->sys_size),
+		rio_mport_read_config_32_cansleep(port,
+				RIO_ANY_DESTID(port->sys_size),
 				hopcount, RIO_COMPONENT_TAG_CSR, &regval);
 
 		if (regval) {
@@ -566,18 +942,18 @@ static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
 	}
 
 	/* Attempt to acquire device lock */
-	rio_mport_write_config_32(port, RIO_ANY_DESTID(port->sys_size),
-				  hopcount,
-				  RIO_HOST_DID_LOCK_CSR, port->host_deviceid);
+	rio_mport_write_config_32_cansleep(port, RIO_ANY_DESTID(port->sys_size),
+					   hopcount, RIO_HOST_DID_LOCK_CSR,
+					   port->host_deviceid);
 	while ((tmp = rio_get_host_deviceid_lock(port, hopcount))
 	       < port->host_deviceid) {
 		/* Delay a bit */
-		mdelay(1);
+		usleep_range(1000, 2000);
 		/* Attempt to acquire device lock again */
-		rio_mport_write_config_32(port, RIO_ANY_DESTID(port->sys_size),
-					  hopcount,
-					  RIO_HOST_DID_LOCK_CSR,
-					  port->host_deviceid);
+		rio_mport_write_config_32_cansleep(port,
+					RIO_ANY_DESTID(port->sys_size),
+					hopcount, RIO_HOST_DID_LOCK_CSR,
+					port->host_deviceid);
 	}
 
 	if (rio_get_host_deviceid_lock(port, hopcount) > port->host_deviceid) {
@@ -587,8 +963,10 @@ static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
 	}
 
 	/* Setup new RIO device */
-	rdev = rio_setup_device(net, port, RIO_ANY_DESTID(port->sys_size),
-					hopcount, 1);
+	rio_probe_devices(port, &sn, 1, ops);
+	if (!sn->status)
+		sn->rec = rio_topo_match(topo, sn);
+	rdev = rio_setup_device(net, port, sn, 1);
 	if (rdev) {
 		rdev->prev = prev;
 		if (prev && rio_is_switch(prev))
@@ -597,10 +975,7 @@ static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
 		return -1;
 
 	if (rio_is_switch(rdev)) {
-		int sw_destid;
-		int cur_destid;
 		int sw_inport;
-		u16 destid;
 		int port_num;
 
 		sw_inport = RIO_GET_PORT_NUM(rdev->swpinfo);
@@ -608,20 +983,12 @@ static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
 				    port->host_deviceid, sw_inport, 0);
 		rdev->rswitch->route_table[port->host_deviceid] = sw_inport;
 
-		destid = rio_destid_first(net);
-		while (destid != RIO_INVALID_DESTID && destid < next_destid) {
-			if (destid != port->host_deviceid) {
-				rio_route_add_entry(rdev, RIO_GLOBAL_TABLE,
-						    destid, sw_inport, 0);
-				rdev->rswitch->route_table[destid] = sw_inport;
-			}
-			destid = rio_destid_next(net, destid + 1);
-		}
 		pr_debug(
 		    "RIO: found %s (vid %4.4x did %4.4x) with %d ports\n",
 		    rio_name(rdev), rdev->vid, rdev->did,
 		    RIO_GET_TOTAL_PORTS(rdev->swpinfo));
-		sw_destid = next_destid;
+
+		rio_sport_get_active(rdev, ops);
 		for (port_num = 0;
 		     port_num < RIO_GET_TOTAL_PORTS(rdev->swpinfo);
 		     port_num++) {
@@ -633,43 +1000,19 @@ static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
 				continue;
 			}
 
-			cur_destid = next_destid;
-
-			if (rio_sport_is_active(rdev, port_num)) {
+			if (ops[port_num].data) {
 				pr_debug(
-				    "RIO: scanning device on port %d\n",
+				    "RIO: queue device on port %d\n",
 				    port_num);
 				rio_enable_rx_tx_port(port, 0,
 					      RIO_ANY_DESTID(port->sys_size),
 					      hopcount, port_num);
 				rdev->rswitch->port_ok |= (1 << port_num);
-				rio_route_add_entry(rdev, RIO_GLOBAL_TABLE,
-						RIO_ANY_DESTID(port->sys_size),
-						port_num, 0);
-
-				if (rio_enum_peer(net, port, hopcount + 1,
-						  rdev, port_num) < 0)
-					return -1;
-
-				/* Update routing tables */
-				destid = rio_destid_next(net, cur_destid + 1);
-				if (destid != RIO_INVALID_DESTID) {
-					for (destid = cur_destid;
-					     destid < next_destid;) {
-						if (destid != port->host_deviceid) {
-							rio_route_add_entry(rdev,
-								    RIO_GLOBAL_TABLE,
-								    destid,
-								    port_num,
-								    0);
-							rdev->rswitch->
-								route_table[destid] =
-								port_num;
-						}
-						destid = rio_destid_next(net,
-								destid + 1);
-					}
-				}
+
+				if (rio_scan_entry_add(queue,
+					RIO_ANY_DESTID(port->sys_size),
+					hopcount + 1, rdev, port_num))
+					return -ENOMEM;
 			} else {
 				/* If switch supports Error Management,
 				 * set PORT_LOCKOUT bit for unused port
@@ -684,19 +1027,13 @@ static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
 		/* Direct Port-write messages to the enumeratiing host */
 		if ((rdev->src_ops & RIO_SRC_OPS_PORT_WRITE) &&
 		    (rdev->em_efptr)) {
-			rio_write_config_32(rdev,
+			rio_write_config_32_cansleep(rdev,
 					rdev->em_efptr + RIO_EM_PW_TGT_DEVID,
 					(port->host_deviceid << 16) |
 					(port->sys_size << 15));
 		}
 
 		rio_init_em(rdev);
-
-		/* Check for empty switch */
-		if (next_destid == sw_destid)
-			next_destid = rio_destid_alloc(net);
-
-		rdev->destid = sw_destid;
 	} else
 		pr_debug("RIO: found %s (vid %4.4x did %4.4x)\n",
 		    rio_name(rdev), rdev->vid, rdev->did);
@@ -704,6 +1041,87 @@ static int rio_enum_peer(struct rio_net *net, struct rio_mport *port,
 	return 0;
 }
 
+/**
+ * rio_sw_child_destid - Returns destID of a device below a switch
+ * @sw: RIO switch device
+ *
+ * Returns destID of the first device enumerated through @sw or
+ * %RIO_INVALID_DESTID if there is no such device (empty switch).
+ */
+static u16 rio_sw_child_destid(struct rio_dev *sw)
+{
+	struct rio_dev *rdev;
+	int i;
+
+	for (i = 0; i < RIO_GET_TOTAL_PORTS(sw->swpinfo); i++) {
+		rdev = sw->rswitch->nextdev[i];
+		if (!rdev || rdev->prev != sw)
+			continue;
+		if (rio_is_switch(rdev) || rdev->hopcount == 0xff)
+			return rdev->destid;
+	}
+
+	return RIO_INVALID_DESTID;
+}
+
+/**
+ * rio_enum_net - Enumerates a RIO network breadth-first
+ * @net: RIO network being enumerated
+ * @port: Master port to send transactions
+ * @ops: Buffer for maintenance transactions
+ * @topo: Topology snapshot or %NULL
+ *
+ * Enumerates devices level by level starting from the master port peer.
+ * When done, assigns every switch destID of a device below it so the
+ * switch can be accessed through that destID. Empty switches get a destID
+ * of their own, the recorded one if the switch is found in @topo.
+ */
+static int rio_enum_net(struct rio_net *net, struct rio_mport *port,
+			struct rio_maint_op *ops, struct rio_topo *topo)
+{
+	LIST_HEAD(queue);
+	struct rio_scan_entry *sn;
+	struct rio_switch *rswitch;
+	struct rio_topo_rec *rec;
+	struct rio_dev *rdev;
+	u16 destid;
+	u32 i;
+	int rc;
+
+	rc = rio_scan_entry_add(&queue, RIO_ANY_DESTID(port->sys_size), 0,
+				NULL, 0);
+	while (!rc && !list_empty(&queue)) {
+		sn = list_first_entry(&queue, struct rio_scan_entry, node);
+		list_del(&sn->node);
+		rc = rio_enum_peer(net, port, sn, &queue, ops, topo);
+		kfree(sn);
+	}
+	rio_scan_queue_free(&queue);
+
+	/* Switches are listed in enumeration order, start from the deepest */
+	list_for_each_entry_reverse(rswitch, &net->switches, node) {
+		rdev = sw_to_rio_dev(rswitch);
+		destid = rio_sw_child_destid(rdev);
+		rec = rio_topo_find(topo, rdev);
+		if (destid == RIO_INVALID_DESTID && rec && rec->reserved) {
+			destid = le16_to_cpu(rec->dev->destid);
+			rec->used = true;
+		} else if (destid == RIO_INVALID_DESTID) {
+			destid = next_destid;
+			next_destid = rio_destid_alloc(net);
+		}
+		rio_dev_set_destid(rdev, destid);
+	}
+
+	/* Release recorded destIDs of devices that are gone */
+	for (i = 0; topo && i < topo->ndevs; i++)
+		if (topo->rec[i].reserved && !topo->rec[i].used)
+			rio_destid_free(net,
+					le16_to_cpu(topo->rec[i].dev->destid));
+
+	return rc;
+}
+
 /**
  * rio_enum_complete- Tests if enumeration of a network is complete
  * @port: Master port to send transaction
@@ -722,30 +1140,33 @@ static int rio_enum_complete(struct rio_mport *port)
 }
 
 /**
- * rio_disc_peer- Recursively discovers a RIO network through a master port
+ * rio_disc_peer- Discovers a device queued for discovery
  * @net: RIO network being discovered
  * @port: Master port to send transactions
- * @destid: Current destination ID in network
- * @hopcount: Number of hops into the network
- * @prev: previous rio_dev
- * @prev_port: previous port number
+ * @sn: Probed device
+ * @queue: Scan queue to add devices connected to switch ports to
+ * @ops: Buffer for maintenance transactions
  *
- * Recursively discovers a RIO network.  Transactions are sent via the
- * master port passed in @port.
+ * Sets up a device probed by rio_probe_devices(). If the device is a switch,
+ * reads its route table and queues devices connected to its active ports.
+ * Transactions are sent via the master port passed in @port.
  */
 static int
-rio_disc_peer(struct rio_net *net, struct rio_mport *port, u16 destid,
-	      u8 hopcount, struct rio_dev *prev, int prev_port)
+rio_disc_peer(struct rio_net *net, struct rio_mport *port,
+	      struct rio_scan_entry *sn, struct list_head *queue,
+	      struct rio_maint_op *ops)
 {
 	u8 port_num, route_port;
 	struct rio_dev *rdev;
-	u16 ndestid;
+	u16 destid = sn->destid;
+	u8 hopcount = sn->hopcount;
+	u32 ndestid;
 
 	/* Setup new RIO device */
-	if ((rdev = rio_setup_device(net, port, destid, hopcount, 0))) {
-		rdev->prev = prev;
-		if (prev && rio_is_switch(prev))
-			prev->rswitch->nextdev[prev_port] = rdev;
+	if ((rdev = rio_setup_device(net, port, sn, 0))) {
+		rdev->prev = sn->prev;
+		if (sn->prev && rio_is_switch(sn->prev))
+			sn->prev->rswitch->nextdev[sn->prev_port] = rdev;
 	} else
 		return -1;
 
@@ -757,37 +1178,44 @@ rio_disc_peer(struct rio_net *net, struct rio_mport *port, u16 destid,
 		    "RIO: found %s (vid %4.4x did %4.4x) with %d ports\n",
 		    rio_name(rdev), rdev->vid, rdev->did,
 		    RIO_GET_TOTAL_PORTS(rdev->swpinfo));
+
+		/* Read route table set by enumerator */
+		rio_lock_device(port, destid, hopcount, 1000);
+		for (ndestid = 0;
+		     ndestid < RIO_MAX_ROUTE_ENTRIES(port->sys_size);
+		     ndestid++) {
+			if (rio_route_get_entry(rdev, RIO_GLOBAL_TABLE,
+						ndestid, &route_port, 0) < 0)
+				continue;
+			rdev->rswitch->route_table[ndestid] = route_port;
+		}
+		rio_unlock_device(port, destid, hopcount);
+
+		rio_sport_get_active(rdev, ops);
 		for (port_num = 0;
 		     port_num < RIO_GET_TOTAL_PORTS(rdev->swpinfo);
 		     port_num++) {
 			if (RIO_GET_PORT_NUM(rdev->swpinfo) == port_num)
 				continue;
 
-			if (rio_sport_is_active(rdev, port_num)) {
-				pr_debug(
-				    "RIO: scanning device on port %d\n",
-				    port_num);
+			if (!ops[port_num].data)
+				continue;
 
-				rio_lock_device(port, destid, hopcount, 1000);
-
-				for (ndestid = 0;
-				     ndestid < RIO_ANY_DESTID(port->sys_size);
-				     ndestid++) {
-					rio_route_get_entry(rdev,
-							    RIO_GLOBAL_TABLE,
-							    ndestid,
-							    &route_port, 0);
-					if (route_port == port_num)
-						break;
-				}
-
-				if (ndestid == RIO_ANY_DESTID(port->sys_size))
-					continue;
-				rio_unlock_device(port, destid, hopcount);
-				if (rio_disc_peer(net, port, ndestid,
-					hopcount + 1, rdev, port_num) < 0)
-					return -1;
+			for (ndestid = 0;
+			     ndestid < RIO_ANY_DESTID(port->sys_size);
+			     ndestid++) {
+				if (rdev->rswitch->route_table[ndestid] ==
+								port_num)
+					break;
 			}
+
+			if (ndestid == RIO_ANY_DESTID(port->sys_size))
+				continue;
+
+			pr_debug("RIO: queue device on port %d\n", port_num);
+			if (rio_scan_entry_add(queue, ndestid, hopcount + 1,
+					       rdev, port_num))
+				return -ENOMEM;
 		}
 	} else
 		pr_debug("RIO: found %s (vid %4.4x did %4.4x)\n",
@@ -796,6 +1224,48 @@ rio_disc_peer(struct rio_net *net, struct rio_mport *port, u16 destid,
 	return 0;
 }
 
+/**
+ * rio_disc_net - Discovers a RIO network breadth-first
+ * @net: RIO network being discovered
+ * @port: Master port to send transactions
+ * @ops: Buffer for maintenance transactions
+ *
+ * Discovers devices level by level starting from the master port peer.
+ * Devices already have destIDs and routes assigned by the enumerator, so
+ * up to %RIO_SCAN_BATCH queued devices are probed in one batch.
+ */
+static int rio_disc_net(struct rio_net *net, struct rio_mport *port,
+			struct rio_maint_op *ops)
+{
+	LIST_HEAD(queue);
+	struct rio_scan_entry *batch[RIO_SCAN_BATCH];
+	struct rio_scan_entry *sn, *tmp;
+	int i, n, rc;
+
+	rc = rio_scan_entry_add(&queue, RIO_ANY_DESTID(port->sys_size), 0,
+				NULL, 0);
+	while (!rc && !list_empty(&queue)) {
+		n = 0;
+		list_for_each_entry_safe(sn, tmp, &queue, node) {
+			list_del(&sn->node);
+			batch[n++] = sn;
+			if (n == RIO_SCAN_BATCH)
+				break;
+		}
+
+		rio_probe_devices(port, batch, n, ops);
+		for (i = 0; i < n; i++) {
+			if (!rc)
+				rc = rio_disc_peer(net, port, batch[i],
+						   &queue, ops);
+			kfree(batch[i]);
+		}
+	}
+	rio_scan_queue_free(&queue);
+
+	return rc;
+}
+
 /**
  * rio_mport_is_active- Tests if master port link is active
  * @port: Master port to test
@@ -884,45 +1354,128 @@ static struct rio_net *rio_scan_alloc_net(struct rio_mport *mport,
 	return net;
 }
 
+/**
+ * rio_route_to_dev - Sets route entries for a destID owned by a device
+ * @rdev: RIO device that owns @destid
+ * @destid: Destination ID to route
+ *
+ * Walks from @rdev towards the host once, setting @destid entry of every
+ * switch on the way to the port leading to @rdev. Only switch route table
+ * copies are updated.
+ */
+static void rio_route_to_dev(struct rio_dev *rdev, u16 destid)
+{
+	struct rio_dev *sw;
+
+	for (sw = rdev->prev; sw; rdev = sw, sw = sw->prev)
+		sw->rswitch->route_table[destid] = rio_sw_port_to(sw, rdev);
+}
+
+/**
+ * rio_topo_update_routes - Writes route table of a switch found in snapshot
+ * @rdev: RIO switch device
+ * @rec: Topology snapshot record of the switch
+ * @diff: Buffer for route table of the switch
+ *
+ * Route table of the switch has not been cleared by enumeration, so only
+ * entries that differ from ones recorded in the snapshot are written. If
+ * the snapshot has routes for destIDs that are not in use anymore, the
+ * table is cleared and written as a whole.
+ */
+static void rio_topo_update_routes(struct rio_dev *rdev,
+				   struct rio_topo_rec *rec, u8 *diff)
+{
+	u8 *rt = rdev->rswitch->route_table;
+	u32 num = RIO_MAX_ROUTE_ENTRIES(rdev->net->hport->sys_size);
+	u32 i;
+	u16 destid;
+
+	memcpy(diff, rt, num);
+	for (i = 0; i < le32_to_cpu(rec->dev->nroutes); i++) {
+		destid = le16_to_cpu(rec->routes[i].destid);
+		if (rt[destid] == RIO_INVALID_ROUTE) {
+			pr_debug("RIO: %s route table changed\n",
+				 rio_name(rdev));
+			rio_route_clr_table(rdev, RIO_GLOBAL_TABLE, 0);
+			rio_route_add_entries(rdev, RIO_GLOBAL_TABLE, rt,
+					      num, 0);
+			return;
+		}
+		if (rt[destid] == rec->routes[i].port)
+			diff[destid] = RIO_INVALID_ROUTE;
+	}
+
+	rio_route_add_entries(rdev, RIO_GLOBAL_TABLE, diff, num, 0);
+}
+
 /**
  * rio_update_route_tables- Updates route tables in switches
  * @net: RIO network to run update on
+ * @topo: Topology snapshot or %NULL
  *
- * For each enumerated device, ensure that each switch in a system
- * has correct routing entries. Add routes for devices that where
- * unknown dirung the first enumeration pass through the switch.
+ * Computes complete route tables of all switches: each destID is routed
+ * towards its device by one pass up the enumeration tree, all remaining
+ * destIDs in use are routed to the switch port leading to the host.
+ * The tables are then written into switches in batches, in enumeration
+ * order so that a switch is reachable through its destID before its own
+ * table is written. Switches found in @topo get only changed entries.
  */
-static void rio_update_route_tables(struct rio_net *net)
+static void rio_update_route_tables(struct rio_net *net,
+				    struct rio_topo *topo)
 {
+	struct rio_mport *port = net->hport;
 	struct rio_dev *rdev, *swrdev;
 	struct rio_switch *rswitch;
+	struct rio_topo_rec *rec;
+	u8 *diff = NULL;
 	u8 sport;
 	u16 destid;
 
-	list_for_each_entry(rdev, &net->devices, net_list) {
-
-		destid = rdev->destid;
+	if (topo)
+		diff = kmalloc(RIO_MAX_ROUTE_ENTRIES(port->sys_size),
+			       GFP_KERNEL);
 
-		list_for_each_entry(rswitch, &net->switches, node) {
+	/* Drop routes used by enumeration probes */
+	list_for_each_entry(rswitch, &net->switches, node)
+		rswitch->route_table[RIO_ANY_DESTID(port->sys_size)] =
+							RIO_INVALID_ROUTE;
 
-			if (rio_is_switch(rdev)	&& (rdev->rswitch == rswitch))
+	list_for_each_entry(rdev, &net->devices, net_list) {
+		if (rio_is_switch(rdev)) {
+			/* Skip switch accessed through a device below it */
+			if (rio_sw_child_destid(rdev) == rdev->destid)
 				continue;
+		} else if (rdev->hopcount != 0xff)
+			continue;
 
-			if (RIO_INVALID_ROUTE == rswitch->route_table[destid]) {
-				swrdev = sw_to_rio_dev(rswitch);
-
-				/* Skip if destid ends in empty switch*/
-				if (swrdev->destid == destid)
-					continue;
+		rio_route_to_dev(rdev, rdev->destid);
+	}
 
-				sport = RIO_GET_PORT_NUM(swrdev->swpinfo);
+	list_for_each_entry(rswitch, &net->switches, node) {
+		swrdev = sw_to_rio_dev(rswitch);
+		sport = RIO_GET_PORT_NUM(swrdev->swpinfo);
 
-				rio_route_add_entry(swrdev, RIO_GLOBAL_TABLE,
-						    destid, sport, 0);
+		destid = rio_destid_first(net);
+		while (destid != RIO_INVALID_DESTID) {
+			/* Skip if destid ends in empty switch*/
+			if (swrdev->destid != destid &&
+			    rswitch->route_table[destid] == RIO_INVALID_ROUTE)
 				rswitch->route_table[destid] = sport;
-			}
+			destid = rio_destid_next(net, destid + 1);
+		}
+
+		rec = rio_topo_find(topo, swrdev);
+		if (rec && diff) {
+			rio_topo_update_routes(swrdev, rec, diff);
+			continue;
 		}
+
+		rio_route_add_entries(swrdev, RIO_GLOBAL_TABLE,
+				      rswitch->route_table,
+				      RIO_MAX_ROUTE_ENTRIES(port->sys_size), 0);
 	}
+
+	kfree(diff);
 }
 
 /**
@@ -947,12 +1500,14 @@ static void rio_init_em(struct rio_dev *rdev)
  *
  * Starts the enumeration process. If somebody has enumerated our
  * master port device, then give up. If not and we have an active
- * link, then start recursive peer enumeration. Returns %0 if
+ * link, then start breadth-first peer enumeration. Returns %0 if
  * enumeration succeeds or %-EBUSY if enumeration fails.
  */
 static int rio_enum_mport(struct rio_mport *mport, u32 flags)
 {
 	struct rio_net *net = NULL;
+	struct rio_maint_op *ops = NULL;
+	struct rio_topo *topo = NULL;
 	int rc = 0;
 
 	printk(KERN_INFO "RIO: enumerate master port %d, %s\n", mport->id,
@@ -988,6 +1543,9 @@ static int rio_enum_mport(struct rio_mport *mport, u32 flags)
 		/* reserve mport destID in new net */
 		rio_destid_reserve(net, mport->host_deviceid);
 
+		/* Reuse topology of previous enumeration if provided */
+		topo = rio_topo_load(net, mport);
+
 		/* Enable Input Output Port (transmitter reviever) */
 		rio_enable_rx_tx_port(mport, 1, 0, 0, 0);
 
@@ -997,19 +1555,34 @@ static int rio_enum_mport(struct rio_mport *mport, u32 flags)
 
 		next_destid = rio_destid_alloc(net);
 
-		if (rio_enum_peer(net, mport, 0, NULL, 0) < 0) {
+		ops = kcalloc(RIO_SCAN_MAX_OPS, sizeof(*ops), GFP_KERNEL);
+		if (!ops) {
+			rc = -ENOMEM;
+			goto out;
+		}
+
+		rc = rio_enum_net(net, mport, ops, topo);
+
+		/* free the last allocated destID (unused) */
+		rio_destid_free(net, next_destid);
+
+		/*
+		 * Routes to enumerated devices are set even if enumeration
+		 * has been lost, so that their locks can be released.
+		 */
+		rio_update_route_tables(net, topo);
+		rio_clear_locks(net);
+
+		if (rc == -ENOMEM)
+			goto out;
+		if (rc < 0) {
 			/* A higher priority host won enumeration, bail. */
 			printk(KERN_INFO
 			       "RIO: master port %d device has lost enumeration to a remote host\n",
 			       mport->id);
-			rio_clear_locks(net);
 			rc = -EBUSY;
 			goto out;
 		}
-		/* free the last allocated destID (unused) */
-		rio_destid_free(net, next_destid);
-		rio_update_route_tables(net);
-		rio_clear_locks(net);
 		rio_pw_enable(mport, 1);
 	} else {
 		printk(KERN_INFO "RIO: master port %d link inactive\n",
@@ -1018,41 +1591,11 @@ static int rio_enum_mport(struct rio_mport *mport, u32 flags)
 	}
 
       out:
+	rio_topo_free(topo);
+	kfree(ops);
 	return rc;
 }
 
-/**
- * rio_build_route_tables- Generate route tables from switch route entries
- * @net: RIO network to run route tables scan on
- *
- * For each switch device, generate a route table by copying existing
- * route entries from the switch.
- */
-static void rio_build_route_tables(struct rio_net *net)
-{
-	struct rio_switch *rswitch;
-	struct rio_dev *rdev;
-	int i;
-	u8 sport;
-
-	list_for_each_entry(rswitch, &net->switches, node) {
-		rdev = sw_to_rio_dev(rswitch);
-
-		rio_lock_device(net->hport, rdev->destid,
-				rdev->hopcount, 1000);
-		for (i = 0;
-		     i < RIO_MAX_ROUTE_ENTRIES(net->hport->sys_size);
-		     i++) {
-			if (rio_route_get_entry(rdev, RIO_GLOBAL_TABLE,
-						i, &sport, 0) < 0)
-				continue;
-			rswitch->route_table[i] = sport;
-		}
-
-		rio_unlock_device(net->hport, rdev->destid, rdev->hopcount);
-	}
-}
-
 /**
  * rio_disc_mport- Start discovery through a master port
  * @mport: Master port to send transactions
@@ -1061,14 +1604,16 @@ static void rio_build_route_tables(struct rio_net *net)
  * Starts the discovery process. If we have an active link,
  * then wait for the signal that enumeration is complete (if wait
  * is allowed).
- * When enumeration completion is signaled, start recursive
+ * When enumeration completion is signaled, start breadth-first
  * peer discovery. Returns %0 if discovery succeeds or %-EBUSY
  * on failure.
  */
 static int rio_disc_mport(struct rio_mport *mport, u32 flags)
 {
 	struct rio_net *net = NULL;
+	struct rio_maint_op *ops;
 	unsigned long to_end;
+	int rc;
 
 	printk(KERN_INFO "RIO: discover master port %d, %s\n", mport->id,
 	       mport->name);
@@ -1107,15 +1652,18 @@ enum_done:
 		mport->host_deviceid = RIO_GET_DID(mport->sys_size,
 						   mport->host_deviceid);
 
-		if (rio_disc_peer(net, mport, RIO_ANY_DESTID(mport->sys_size),
-					0, NULL, 0) < 0) {
+		ops = kcalloc(RIO_SCAN_MAX_OPS, sizeof(*ops), GFP_KERNEL);
+		if (!ops)
+			goto bail;
+
+		rc = rio_disc_net(net, mport, ops);
+		kfree(ops);
+		if (rc < 0) {
 			printk(KERN_INFO
 			       "RIO: master port %d device has failed discovery\n",
 			       mport->id);
 			goto bail;
 		}
-
-		rio_build_route_tables(net);
 	}
 
 	return 0;
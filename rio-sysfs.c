@@ -190,7 +190,7 @@ rio_read_config(struct file *filp, struct kobject *kobj,
 
 	if ((off & 1) && size) {
 		u8 val;
-		rio_read_config_8(dev, off, &val);
+		rio_read_config_8_cansleep(dev, off, &val);
 		data[off - init_off] = val;
 		off++;
 		size--;
@@ -198,7 +198,7 @@ rio_read_config(struct file *filp, struct kobject *kobj,
 
 	if ((off & 3) && size > 2) {
 		u16 val;
-		rio_read_config_16(dev, off, &val);
+		rio_read_config_16_cansleep(dev, off, &val);
 		data[off - init_off] = (val >> 8) & 0xff;
 		data[off - init_off + 1] = val & 0xff;
 		off += 2;
@@ -206,19 +206,28 @@ rio_read_config(struct file *filp, struct kobject *kobj,
 	}
 
 	while (size > 3) {
-		u32 val;
-		rio_read_config_32(dev, off, &val);
-		data[off - init_off] = (val >> 24) & 0xff;
-		data[off - init_off + 1] = (val >> 16) & 0xff;
-		data[off - init_off + 2] = (val >> 8) & 0xff;
-		data[off - init_off + 3] = val & 0xff;
-		off += 4;
-		size -= 4;
+		u32 offs[16], val[16];
+		unsigned int i, n;
+
+		/* Read registers in batches to reduce round-trips */
+		n = min_t(unsigned int, size / 4, ARRAY_SIZE(val));
+		for (i = 0; i < n; i++)
+			offs[i] = off + i * 4;
+		rio_mport_read_config_vec(dev->net->hport, dev->destid,
+					  dev->hopcount, offs, val, n);
+		for (i = 0; i < n; i++) {
+			data[off - init_off] = (val[i] >> 24) & 0xff;
+			data[off - init_off + 1] = (val[i] >> 16) & 0xff;
+			data[off - init_off + 2] = (val[i] >> 8) & 0xff;
+			data[off - init_off + 3] = val[i] & 0xff;
+			off += 4;
+			size -= 4;
+		}
 	}
 
 	if (size >= 2) {
 		u16 val;
-		rio_read_config_16(dev, off, &val);
+		rio_read_config_16_cansleep(dev, off, &val);
 		data[off - init_off] = (val >> 8) & 0xff;
 		data[off - init_off + 1] = val & 0xff;
 		off += 2;
@@ -227,7 +236,7 @@ rio_read_config(struct file *filp, struct kobject *kobj,
 
 	if (size > 0) {
 		u8 val;
-		rio_read_config_8(dev, off, &val);
+		rio_read_config_8_cansleep(dev, off, &val);
 		data[off - init_off] = val;
 		off++;
 		--size;
@@ -254,7 +263,7 @@ rio_write_config(struct file *filp, struct kobject *kobj,
 	}
 
 	if ((off & 1) && size) {
-		rio_write_config_8(dev, off, data[off - init_off]);
+		rio_write_config_8_cansleep(dev, off, data[off - init_off]);
 		off++;
 		size--;
 	}
@@ -262,7 +271,7 @@ rio_write_config(struct file *filp, struct kobject *kobj,
 	if ((off & 3) && (size > 2)) {
 		u16 val = data[off - init_off + 1];
 		val |= (u16) data[off - init_off] << 8;
-		rio_write_config_16(dev, off, val);
+		rio_write_config_16_cansleep(dev, off, val);
 		off += 2;
 		size -= 2;
 	}
@@ -272,7 +281,7 @@ rio_write_config(struct file *filp, struct kobject *kobj,
 		val |= (u32) data[off - init_off + 2] << 8;
 		val |= (u32) data[off - init_off + 1] << 16;
 		val |= (u32) data[off - init_off] << 24;
-		rio_write_config_32(dev, off, val);
+		rio_write_config_32_cansleep(dev, off, val);
 		off += 4;
 		size -= 4;
 	}
@@ -280,13 +289,13 @@ rio_write_config(struct file *filp, struct kobject *kobj,
 	if (size >= 2) {
 		u16 val = data[off - init_off + 1];
 		val |= (u16) data[off - init_off] << 8;
-		rio_write_config_16(dev, off, val);
+		rio_write_config_16_cansleep(dev, off, val);
 		off += 2;
 		size -= 2;
 	}
 
 	if (size) {
-		rio_write_config_8(dev, off, data[off - init_off]);
+		rio_write_config_8_cansleep(dev, off, data[off - init_off]);
 		off++;
 		--size;
 	}
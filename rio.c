@@ -30,9 +30,22 @@
 #include <linux/dma-contiguous.h>
 #include <linux/sizes.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/hashtable.h>
+#include <linux/version.h>
 
 #include "rio.h"
 
+#define CREATE_TRACE_POINTS
+#include "include/rio_trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(rio_omsg_enq);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rio_omsg_done);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rio_imsg_rx);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rio_dma_submit);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rio_dma_done);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rio_maint);
+
 /*
  * struct rio_pwrite - RIO portwrite event
  * @node:    Node in list of doorbell events
@@ -43,10 +56,34 @@ struct rio_pwrite {
 	struct list_head node;
 
 	int (*pwcback)(struct rio_mport *mport, void *context,
-		       union rio_pw_msg *msg, int step);
+		       union rio_pw_msg *msg, int count);
 	void *context;
 };
 
+/*
+ * struct rio_pw_event - coalesced port-write event
+ * @node:    Node in mport list of port-write events
+ * @comptag: Component tag of the device that sent port-writes
+ * @port:    Port number reported by port-writes
+ * @msg:     Most recent port-write message
+ * @count:   Number of port-writes received since last dispatch
+ * @due:     Time (in jiffies) when the event has to be dispatched
+ * @last:    Time (in jiffies) of the last dispatch
+ * @pending: Event is waiting for dispatch
+ */
+struct rio_pw_event {
+	struct list_head node;
+	u32 comptag;
+	u8 port;
+	union rio_pw_msg msg;
+	u32 count;
+	unsigned long due;
+	unsigned long last;
+	bool pending;
+};
+
+#define RIO_PW_EVENTS_MAX	64
+
 MODULE_DESCRIPTION("RapidIO Subsystem Core");
 MODULE_AUTHOR("Matt Porter <mporter@kernel.crashing.org>");
 MODULE_AUTHOR("Alexandre Bounine <alexandre.bounine@idt.com>");
@@ -58,10 +95,33 @@ module_param_array(hdid, int, &ids_num, 0);
 MODULE_PARM_DESC(hdid,
 	"Destination ID assignment to local RapidIO controllers");
 
+static unsigned int pw_coalesce_ms = 10;
+module_param(pw_coalesce_ms, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(pw_coalesce_ms,
+	"Port-write coalescing window in ms, 0 = off (default: 10)");
+
+static unsigned int pw_recovery_ms = 100;
+module_param(pw_recovery_ms, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(pw_recovery_ms,
+	"Min interval between error recoveries of the same port in ms (default: 100)");
+
 static LIST_HEAD(rio_devices);
 static LIST_HEAD(rio_nets);
 static DEFINE_SPINLOCK(rio_global_list_lock);
 
+/*
+ * Indexes of RIO devices by component tag and by (net, destID). Updated
+ * under rio_global_list_lock, looked up under RCU.
+ */
+#define RIO_DEV_HASH_BITS	8
+static DEFINE_HASHTABLE(rio_ctag_hash, RIO_DEV_HASH_BITS);
+static DEFINE_HASHTABLE(rio_destid_hash, RIO_DEV_HASH_BITS);
+
+static inline u32 rio_destid_key(struct rio_net *net, u16 destid)
+{
+	return ((u32)net->id << 16) | destid;
+}
+
 static LIST_HEAD(rio_mports);
 static LIST_HEAD(rio_scans);
 static DEFINE_MUTEX(rio_mport_list_lock);
@@ -187,7 +247,10 @@ int rio_add_device(struct rio_dev *rdev)
 
 	spin_lock(&rio_global_list_lock);
 	list_add_tail(&rdev->global_list, &rio_devices);
+	hash_add_rcu(rio_ctag_hash, &rdev->ctag_node, rdev->comp_tag);
 	if (rdev->net) {
+		hash_add_rcu(rio_destid_hash, &rdev->destid_node,
+			     rio_destid_key(rdev->net, rdev->destid));
 		list_add_tail(&rdev->net_list, &rdev->net->devices);
 		if (rdev->pef & RIO_PEF_SWITCH)
 			list_add_tail(&rdev->rswitch->node,
@@ -215,7 +278,9 @@ void rio_del_device(struct rio_dev *rdev, enum rio_device_state state)
 	atomic_set(&rdev->state, state);
 	spin_lock(&rio_global_list_lock);
 	list_del(&rdev->global_list);
+	hash_del_rcu(&rdev->ctag_node);
 	if (rdev->net) {
+		hash_del_rcu(&rdev->destid_node);
 		list_del(&rdev->net_list);
 		if (rdev->pef & RIO_PEF_SWITCH) {
 			list_del(&rdev->rswitch->node);
@@ -229,22 +294,41 @@ void rio_del_device(struct rio_dev *rdev, enum rio_device_state state)
 EXPORT_SYMBOL_GPL(rio_del_device);
 
 /**
- * rio_request_inb_mbox - request inbound mailbox service
- * @mport: RIO master port from which to allocate the mailbox resource
- * @dev_id: Device specific pointer to pass on event
- * @mbox: Mailbox number to claim
- * @entries: Number of entries in inbound mailbox queue
- * @minb: Callback to execute when inbound message is received
+ * rio_dev_set_destid - Changes destID of a registered RIO device
+ * @rdev: RIO device
+ * @destid: New destID of the device
  *
- * Requests ownership of an inbound mailbox resource and binds
- * a callback function to the resource. Returns %0 on success.
+ * Updates @rdev->destid and re-indexes the device for rio_get_destid().
+ * Used for switches that get their destID after all devices below them
+ * have been registered. The device is not found by destID while it is
+ * re-indexed: its index node can be moved to another hash chain only after
+ * lookups that may walk the old chain through it are done. May sleep.
  */
-int rio_request_inb_mbox(struct rio_mport *mport,
-			 void *dev_id,
-			 int mbox,
-			 int entries,
-			 void (*minb) (struct rio_mport * mport, void *dev_id, int mbox,
-				       int slot))
+void rio_dev_set_destid(struct rio_dev *rdev, u16 destid)
+{
+	if (!rdev->net || rdev->destid == destid) {
+		rdev->destid = destid;
+		return;
+	}
+
+	spin_lock(&rio_global_list_lock);
+	hash_del_rcu(&rdev->destid_node);
+	spin_unlock(&rio_global_list_lock);
+
+	synchronize_rcu();
+
+	spin_lock(&rio_global_list_lock);
+	rdev->destid = destid;
+	hash_add_rcu(rio_destid_hash, &rdev->destid_node,
+		     rio_destid_key(rdev->net, destid));
+	spin_unlock(&rio_global_list_lock);
+}
+EXPORT_SYMBOL_GPL(rio_dev_set_destid);
+
+static int __rio_request_inb_mbox(struct rio_mport *mport, void *dev_id,
+			int mbox, int entries, u32 flags,
+			void (*minb) (struct rio_mport *mport, void *dev_id,
+				      int mbox, int slot))
 {
 	int rc = -ENOSYS;
 	struct resource *res;
@@ -269,10 +353,12 @@ int rio_request_inb_mbox(struct rio_mport *mport,
 
 		/* Hook the inbound message callback */
 		mport->inb_msg[mbox].mcback = minb;
+		mport->inb_msg[mbox].flags = flags;
 
 		rc = mport->ops->open_inb_mbox(mport, dev_id, mbox, entries);
 		if (rc) {
 			mport->inb_msg[mbox].mcback = NULL;
+			mport->inb_msg[mbox].flags = 0;
 			mport->inb_msg[mbox].res = NULL;
 			release_resource(res);
 			kfree(res);
@@ -284,6 +370,59 @@ int rio_request_inb_mbox(struct rio_mport *mport,
 	return rc;
 }
 
+/**
+ * rio_request_inb_mbox - request inbound mailbox service
+ * @mport: RIO master port from which to allocate the mailbox resource
+ * @dev_id: Device specific pointer to pass on event
+ * @mbox: Mailbox number to claim
+ * @entries: Number of entries in inbound mailbox queue
+ * @minb: Callback to execute when inbound message is received
+ *
+ * Requests ownership of an inbound mailbox resource and binds
+ * a callback function to the resource. Returns %0 on success.
+ */
+int rio_request_inb_mbox(struct rio_mport *mport,
+			 void *dev_id,
+			 int mbox,
+			 int entries,
+			 void (*minb) (struct rio_mport * mport, void *dev_id, int mbox,
+				       int slot))
+{
+	return __rio_request_inb_mbox(mport, dev_id, mbox, entries, 0, minb);
+}
+
+/**
+ * rio_request_inb_mbox_zc - request zero-copy inbound mailbox service
+ * @mport: RIO master port from which to allocate the mailbox resource
+ * @dev_id: Device specific pointer to pass on event
+ * @mbox: Mailbox number to claim
+ * @entries: Number of entries in inbound mailbox queue
+ * @minb: Callback to execute when inbound message is received
+ *
+ * Same as rio_request_inb_mbox() but asks mport to receive messages directly
+ * into buffers posted with rio_add_inb_buffer() instead of copying them from
+ * mport's own buffers. Posted buffers must be DMA-able, at least
+ * %RIO_MAX_MSG_SIZE bytes long and 8-byte aligned. rio_get_inb_message()
+ * returns the posted buffer itself. Returns %0 on success or %-EOPNOTSUPP
+ * if mport does not support zero-copy inbound messaging.
+ */
+int rio_request_inb_mbox_zc(struct rio_mport *mport,
+			    void *dev_id,
+			    int mbox,
+			    int entries,
+			    void (*minb) (struct rio_mport *mport, void *dev_id,
+					  int mbox, int slot))
+{
+	struct rio_mport_attr attr;
+
+	if (rio_query_mport(mport, &attr) ||
+	    !(attr.flags & RIO_MPORT_IBMSG_ZC))
+		return -EOPNOTSUPP;
+
+	return __rio_request_inb_mbox(mport, dev_id, mbox, entries,
+				      RIO_MSG_ZEROCOPY, minb);
+}
+
 /**
  * rio_release_inb_mbox - release inbound mailbox message service
  * @mport: RIO master port from which to release the mailbox resource
@@ -301,6 +440,7 @@ int rio_release_inb_mbox(struct rio_mport *mport, int mbox)
 
 	mport->ops->close_inb_mbox(mport, mbox);
 	mport->inb_msg[mbox].mcback = NULL;
+	mport->inb_msg[mbox].flags = 0;
 
 	rc = release_resource(mport->inb_msg[mbox].res);
 	if (rc)
@@ -395,6 +535,62 @@ int rio_release_outb_mbox(struct rio_mport *mport, int mbox)
 	return 0;
 }
 
+/**
+ * rio_dbell_map_set - Updates doorbell dispatch table
+ * @mport: RIO master port
+ * @start: Doorbell info range start
+ * @end: Doorbell info range end
+ * @dbell: Doorbell event to dispatch @start to @end to, or %NULL to clear
+ *
+ * Must be called with @mport->lock held. Clearing the table never fails,
+ * setting it may fail with %-ENOMEM if a second level table can not be
+ * allocated.
+ */
+static int rio_dbell_map_set(struct rio_mport *mport, u16 start, u16 end,
+			     struct rio_dbell *dbell)
+{
+	struct rio_dbell_map *map;
+	u32 info;
+
+	for (info = start; info <= end; info++) {
+		map = rcu_dereference_protected(
+				mport->dbell_map[info >> RIO_DBELL_MAP_SHIFT],
+				lockdep_is_held(&mport->lock));
+		if (!map) {
+			if (!dbell) {
+				info |= RIO_DBELL_MAP_SIZE - 1;
+				continue;
+			}
+			map = kzalloc(sizeof(*map), GFP_KERNEL);
+			if (!map)
+				return -ENOMEM;
+			rcu_assign_pointer(
+				mport->dbell_map[info >> RIO_DBELL_MAP_SHIFT],
+				map);
+		}
+		rcu_assign_pointer(
+			map->dbell[info & (RIO_DBELL_MAP_SIZE - 1)], dbell);
+	}
+
+	return 0;
+}
+
+/**
+ * rio_dbell_map_free - Frees doorbell dispatch table
+ * @mport: RIO master port
+ *
+ * Called when no doorbell events can be dispatched through @mport anymore.
+ */
+static void rio_dbell_map_free(struct rio_mport *mport)
+{
+	int i;
+
+	for (i = 0; i < RIO_DBELL_MAP_SIZE; i++) {
+		kfree(rcu_dereference_protected(mport->dbell_map[i], 1));
+		RCU_INIT_POINTER(mport->dbell_map[i], NULL);
+	}
+}
+
 /**
  * rio_setup_inb_dbell - bind inbound doorbell callback
  * @mport: RIO master port to bind the doorbell callback
@@ -403,8 +599,8 @@ int rio_release_outb_mbox(struct rio_mport *mport, int mbox)
  * @dinb: Callback to execute when doorbell is received
  *
  * Adds a doorbell resource/callback pair into a port's
- * doorbell event list. Returns 0 if the request has been
- * satisfied.
+ * doorbell event list and dispatch table. Returns 0 if the request
+ * has been satisfied.
  */
 static int
 rio_setup_inb_dbell(struct rio_mport *mport, void *dev_id, struct resource *res,
@@ -424,6 +620,14 @@ rio_setup_inb_dbell(struct rio_mport *mport, void *dev_id, struct resource *res,
 	dbell->dev_id = dev_id;
 
 	mutex_lock(&mport->lock);
+	rc = rio_dbell_map_set(mport, res->start, res->end, dbell);
+	if (rc) {
+		rio_dbell_map_set(mport, res->start, res->end, NULL);
+		mutex_unlock(&mport->lock);
+		synchronize_rcu();
+		kfree(dbell);
+		goto out;
+	}
 	list_add_tail(&dbell->node, &mport->dbells);
 	mutex_unlock(&mport->lock);
 
@@ -467,6 +671,10 @@ int rio_request_inb_dbell(struct rio_mport *mport,
 
 		/* Hook the doorbell callback */
 		rc = rio_setup_inb_dbell(mport, dev_id, res, dinb);
+		if (rc) {
+			release_resource(res);
+			kfree(res);
+		}
 	} else
 		rc = -ENOMEM;
 
@@ -493,6 +701,7 @@ int rio_release_inb_dbell(struct rio_mport *mport, u16 start, u16 end)
 	list_for_each_entry(dbell, &mport->dbells, node) {
 		if ((dbell->res->start == start) && (dbell->res->end == end)) {
 			list_del(&dbell->node);
+			rio_dbell_map_set(mport, start, end, NULL);
 			found = 1;
 			break;
 		}
@@ -505,6 +714,9 @@ int rio_release_inb_dbell(struct rio_mport *mport, u16 start, u16 end)
 		goto out;
 	}
 
+	/* Wait for doorbell callbacks that may still use the event */
+	synchronize_rcu();
+
 	/* Release the doorbell resource */
 	rc = release_resource(dbell->res);
 
@@ -515,6 +727,38 @@ int rio_release_inb_dbell(struct rio_mport *mport, u16 start, u16 end)
 	return rc;
 }
 
+/**
+ * rio_dispatch_inb_dbell - dispatch inbound doorbell to its callback
+ * @mport: RIO master port that received the doorbell
+ * @src: Doorbell source destID
+ * @dst: Doorbell target destID
+ * @info: Doorbell info
+ *
+ * Looks up the callback bound to @info by rio_request_inb_dbell() and
+ * executes it. Intended to be called by mport drivers for every received
+ * doorbell, can be called from interrupt context. Returns 0 if the
+ * doorbell has been handled or %-ENOENT if no callback is bound to @info.
+ */
+int rio_dispatch_inb_dbell(struct rio_mport *mport, u16 src, u16 dst,
+			   u16 info)
+{
+	struct rio_dbell_map *map;
+	struct rio_dbell *dbell = NULL;
+
+	rcu_read_lock();
+	map = rcu_dereference(mport->dbell_map[info >> RIO_DBELL_MAP_SHIFT]);
+	if (map)
+		dbell = rcu_dereference(
+				map->dbell[info & (RIO_DBELL_MAP_SIZE - 1)]);
+	trace_rio_dbell_rx(mport, src, dst, info, dbell != NULL);
+	if (dbell)
+		dbell->dinb(mport, dbell->dev_id, src, dst, info);
+	rcu_read_unlock();
+
+	return dbell ? 0 : -ENOENT;
+}
+EXPORT_SYMBOL_GPL(rio_dispatch_inb_dbell);
+
 /**
  * rio_request_outb_dbell - request outbound doorbell message range
  * @rdev: RIO device from which to allocate the doorbell resource
@@ -567,11 +811,15 @@ int rio_release_outb_dbell(struct rio_dev *rdev, struct resource *res)
  * @context: Handler specific context to pass on event
  * @pwcback: Callback to execute when portwrite is received
  *
+ * Port-writes that report the same component tag and port are coalesced,
+ * @pwcback receives the most recent message and the number of port-writes
+ * it stands for in @count.
+ *
  * Returns 0 if the request has been satisfied.
  */
 int rio_add_mport_pw_handler(struct rio_mport *mport, void *context,
 			     int (*pwcback)(struct rio_mport *mport,
-			     void *context, union rio_pw_msg *msg, int step))
+			     void *context, union rio_pw_msg *msg, int count))
 {
 	int rc = 0;
 	struct rio_pwrite *pwrite;
@@ -603,7 +851,7 @@ EXPORT_SYMBOL_GPL(rio_add_mport_pw_handler);
  */
 int rio_del_mport_pw_handler(struct rio_mport *mport, void *context,
 			     int (*pwcback)(struct rio_mport *mport,
-			     void *context, union rio_pw_msg *msg, int step))
+			     void *context, union rio_pw_msg *msg, int count))
 {
 	int rc = -EINVAL;
 	struct rio_pwrite *pwrite;
@@ -845,34 +1093,69 @@ EXPORT_SYMBOL_GPL(rio_mport_get_physefb);
  * @comp_tag: RIO component tag to match
  * @from: Previous RIO device found in search, or %NULL for new search
  *
- * Iterates through the list of known RIO devices. If a RIO device is
- * found with a matching @comp_tag, a pointer to its device
+ * Looks up the component tag index of known RIO devices. If a RIO device
+ * is found with a matching @comp_tag, a pointer to its device
  * structure is returned. Otherwise, %NULL is returned. A new search
  * is initiated by passing %NULL to the @from argument. Otherwise, if
- * @from is not %NULL, searches continue from next device on the global
- * list.
+ * @from is not %NULL, searches continue from next device with the same
+ * index key. Does not sleep and may be called from atomic context.
  */
 struct rio_dev *rio_get_comptag(u32 comp_tag, struct rio_dev *from)
 {
-	struct list_head *n;
-	struct rio_dev *rdev;
+	struct rio_dev *rdev = from;
 
-	spin_lock(&rio_global_list_lock);
-	n = from ? from->global_list.next : rio_devices.next;
-
-	while (n && (n != &rio_devices)) {
-		rdev = rio_dev_g(n);
-		if (rdev->comp_tag == comp_tag)
-			goto exit;
-		n = n->next;
+	rcu_read_lock();
+	if (from) {
+		hlist_for_each_entry_continue_rcu(rdev, ctag_node)
+			if (rdev->comp_tag == comp_tag)
+				goto exit;
+	} else {
+		hash_for_each_possible_rcu(rio_ctag_hash, rdev, ctag_node,
+					   comp_tag)
+			if (rdev->comp_tag == comp_tag)
+				goto exit;
 	}
 	rdev = NULL;
 exit:
-	spin_unlock(&rio_global_list_lock);
+	rcu_read_unlock();
 	return rdev;
 }
 EXPORT_SYMBOL_GPL(rio_get_comptag);
 
+/**
+ * rio_get_destid - Begin or continue searching for a RIO device by destID
+ * @net: RIO network to search in
+ * @destid: RIO destID to match
+ * @from: Previous RIO device found in search, or %NULL for new search
+ *
+ * Same as rio_get_comptag() but looks up devices of @net by destID. Note
+ * that a switch shares destID with a device connected to it, so more than
+ * one device can be found for the same @destid.
+ */
+struct rio_dev *rio_get_destid(struct rio_net *net, u16 destid,
+			       struct rio_dev *from)
+{
+	u32 key = rio_destid_key(net, destid);
+	struct rio_dev *rdev = from;
+
+	rcu_read_lock();
+	if (from) {
+		hlist_for_each_entry_continue_rcu(rdev, destid_node)
+			if (rdev->net == net && rdev->destid == destid)
+				goto exit;
+	} else {
+		hash_for_each_possible_rcu(rio_destid_hash, rdev, destid_node,
+					   key)
+			if (rdev->net == net && rdev->destid == destid)
+				goto exit;
+	}
+	rdev = NULL;
+exit:
+	rcu_read_unlock();
+	return rdev;
+}
+EXPORT_SYMBOL_GPL(rio_get_destid);
+
 /**
  * rio_set_port_lockout - Sets/clears LOCKOUT bit (RIO EM 1.3) for a switch port.
  * @rdev: Pointer to RIO device control structure
@@ -1174,15 +1457,18 @@ rd_err:
 			      RIO_PORT_N_ERR_STS_INP_ES)) ? 1 : 0;
 }
 
-/**
- * rio_inb_pwrite_handler - inbound port-write message handler
+/*
+ * rio_pw_process - processes a (coalesced) port-write message
  * @mport:  mport device associated with port-write
- * @pw_msg: pointer to inbound port-write message
+ * @pw_msg: pointer to port-write message
+ * @count:  number of port-writes coalesced into @pw_msg
  *
- * Processes an inbound port-write message. Returns 0 if the request
- * has been satisfied.
+ * Passes the port-write message to registered handlers and performs
+ * standard error recovery for port-writes sent by switches.
+ * Shall be called from a context that can sleep.
  */
-int rio_inb_pwrite_handler(struct rio_mport *mport, union rio_pw_msg *pw_msg)
+static int rio_pw_process(struct rio_mport *mport, union rio_pw_msg *pw_msg,
+			  u32 count)
 {
 	struct rio_dev *rdev;
 	u32 err_status, em_perrdet, em_ltlerrdet;
@@ -1224,7 +1510,7 @@ int rio_inb_pwrite_handler(struct rio_mport *mport, union rio_pw_msg *pw_msg)
 
 	mutex_lock(&mport->lock);
 	list_for_each_entry(pwrite, &mport->pwrites, node)
-		pwrite->pwcback(mport, pwrite->context, pw_msg, 0);
+		pwrite->pwcback(mport, pwrite->context, pw_msg, count);
 	mutex_unlock(&mport->lock);
 
 	if (!rdev)
@@ -1345,8 +1631,210 @@ int rio_inb_pwrite_handler(struct rio_mport *mport, union rio_pw_msg *pw_msg)
 
 	return 0;
 }
+
+static struct rio_pw_event *rio_pw_event_find(struct rio_mport *mport,
+					      u32 comptag, u8 port)
+{
+	struct rio_pw_event *ev;
+
+	list_for_each_entry(ev, &mport->pw_events, node) {
+		if (ev->comptag == comptag && ev->port == port)
+			return ev;
+	}
+
+	return NULL;
+}
+
+/*
+ * rio_pw_schedule - schedules port-write dispatch work
+ *
+ * NOTE: Shall be called while holding mport->pw_lock.
+ */
+static void rio_pw_schedule(struct rio_mport *mport, unsigned long due)
+{
+	unsigned long now = jiffies;
+
+	if (!mport->pw_wq)
+		return;
+	if (mport->pw_sched && !time_before(due, mport->pw_next))
+		return;
+
+	mport->pw_next = due;
+	mport->pw_sched = true;
+	mod_delayed_work(mport->pw_wq, &mport->pw_work,
+			 time_after(due, now) ? due - now : 0);
+}
+
+/*
+ * rio_pw_work - dispatches coalesced port-write events
+ *
+ * Each pending event is dispatched once when it becomes due, with the
+ * number of port-writes received since its previous dispatch. Events that
+ * stay idle are released.
+ */
+static void rio_pw_work(struct work_struct *work)
+{
+	struct rio_mport *mport = container_of(to_delayed_work(work),
+					       struct rio_mport, pw_work);
+	struct rio_pw_event *ev, *tmp;
+	union rio_pw_msg msg;
+	unsigned long flags, now, next = 0, idle_tmo;
+	bool resched = false;
+	u32 count;
+
+	idle_tmo = msecs_to_jiffies(pw_recovery_ms) + HZ;
+
+	spin_lock_irqsave(&mport->pw_lock, flags);
+	mport->pw_sched = false;
+
+	/* Only this work removes events, tmp stays valid while unlocked */
+	list_for_each_entry_safe(ev, tmp, &mport->pw_events, node) {
+		now = jiffies;
+
+		if (!ev->pending) {
+			if (time_after(now, ev->last + idle_tmo)) {
+				list_del(&ev->node);
+				mport->pw_nevents--;
+				kfree(ev);
+			}
+			continue;
+		}
+
+		if (time_before(now, ev->due)) {
+			if (!resched || time_before(ev->due, next))
+				next = ev->due;
+			resched = true;
+			continue;
+		}
+
+		msg = ev->msg;
+		count = ev->count;
+		ev->count = 0;
+		ev->pending = false;
+		ev->last = now;
+		spin_unlock_irqrestore(&mport->pw_lock, flags);
+
+		if (count > 1)
+			pr_debug("RIO_PW: %u port-writes from CTag 0x%08x P%d\n",
+				 count, ev->comptag, ev->port);
+		rio_pw_process(mport, &msg, count);
+
+		spin_lock_irqsave(&mport->pw_lock, flags);
+	}
+
+	if (resched)
+		rio_pw_schedule(mport, next);
+	spin_unlock_irqrestore(&mport->pw_lock, flags);
+}
+
+/**
+ * rio_inb_pwrite_handler - inbound port-write message handler
+ * @mport:  mport device associated with port-write
+ * @pw_msg: pointer to inbound port-write message
+ *
+ * Queues an inbound port-write message for processing. Port-writes from
+ * the same component tag and port received within pw_coalesce_ms are
+ * coalesced into a single event, and error recovery of the same port is
+ * performed at most once per pw_recovery_ms. Coalesced events are processed
+ * by the mport port-write workqueue. Returns 0 if the request has been
+ * satisfied.
+ */
+int rio_inb_pwrite_handler(struct rio_mport *mport, union rio_pw_msg *pw_msg)
+{
+	struct rio_pw_event *ev, *new = NULL;
+	u32 comptag = pw_msg->em.comptag & RIO_CTAG_UDEVID;
+	u8 port = pw_msg->em.is_port & 0xFF;
+	unsigned long flags, now;
+
+	if (!pw_coalesce_ms)
+		return rio_pw_process(mport, pw_msg, 1);
+
+	spin_lock_irqsave(&mport->pw_lock, flags);
+	while (1) {
+		if (!mport->pw_wq) {
+			ev = NULL;
+			break;
+		}
+
+		ev = rio_pw_event_find(mport, comptag, port);
+		if (ev || new || mport->pw_nevents >= RIO_PW_EVENTS_MAX)
+			break;
+
+		spin_unlock_irqrestore(&mport->pw_lock, flags);
+		new = kzalloc(sizeof(*new), GFP_ATOMIC);
+		spin_lock_irqsave(&mport->pw_lock, flags);
+		if (!new) {
+			ev = NULL;
+			break;
+		}
+	}
+
+	if (!ev && new && mport->pw_wq &&
+	    mport->pw_nevents < RIO_PW_EVENTS_MAX) {
+		new->comptag = comptag;
+		new->port = port;
+		new->last = jiffies - msecs_to_jiffies(pw_recovery_ms);
+		list_add_tail(&new->node, &mport->pw_events);
+		mport->pw_nevents++;
+		ev = new;
+		new = NULL;
+	}
+
+	if (ev) {
+		ev->msg = *pw_msg;
+		ev->count++;
+		if (!ev->pending) {
+			/* Rate limit recovery of the same port */
+			now = jiffies;
+			ev->due = now + msecs_to_jiffies(pw_coalesce_ms);
+			if (time_before(ev->due,
+				ev->last + msecs_to_jiffies(pw_recovery_ms)))
+				ev->due = ev->last +
+					  msecs_to_jiffies(pw_recovery_ms);
+			ev->pending = true;
+			rio_pw_schedule(mport, ev->due);
+		}
+	}
+	spin_unlock_irqrestore(&mport->pw_lock, flags);
+
+	kfree(new);
+
+	/* No room to coalesce, process the port-write right away */
+	if (!ev)
+		return rio_pw_process(mport, pw_msg, 1);
+
+	return 0;
+}
 EXPORT_SYMBOL_GPL(rio_inb_pwrite_handler);
 
+/*
+ * rio_pw_events_free - stops port-write dispatch and releases pending events
+ */
+static void rio_pw_events_free(struct rio_mport *mport)
+{
+	struct workqueue_struct *wq;
+	struct rio_pw_event *ev, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mport->pw_lock, flags);
+	wq = mport->pw_wq;
+	mport->pw_wq = NULL;
+	spin_unlock_irqrestore(&mport->pw_lock, flags);
+
+	if (!wq)
+		return;
+
+	cancel_delayed_work_sync(&mport->pw_work);
+	destroy_workqueue(wq);
+
+	list_for_each_entry_safe(ev, tmp, &mport->pw_events, node) {
+		list_del(&ev->node);
+		kfree(ev);
+	}
+	mport->pw_nevents = 0;
+	mport->pw_sched = false;
+}
+
 /**
  * rio_mport_get_efb - get pointer to next extended features block
  * @port: Master port to issue transaction
@@ -1515,6 +2003,69 @@ rio_std_route_add_entry(struct rio_mport *mport, u16 destid, u8 hopcount,
 	return 0;
 }
 
+/* Number of route entries rio_std_route_add_entries() updates at once */
+#define RIO_RT_UPDATE_BATCH	8
+
+/**
+ * rio_std_route_add_entries - Add set of switch route table entries using
+ *   standard registers defined in RIO specification rev.1.3
+ * @mport: Master port to issue transaction
+ * @destid: Destination ID of the device
+ * @hopcount: Number of switch hops to the device
+ * @table: routing table ID (global or port-specific)
+ * @route_table: destination ports indexed by destID
+ * @num: number of entries in @route_table
+ *
+ * Entries set to %RIO_INVALID_ROUTE are skipped. Updates are issued in
+ * batches of maintenance transactions.
+ */
+static int
+rio_std_route_add_entries(struct rio_mport *mport, u16 destid, u8 hopcount,
+			  u16 table, const u8 *route_table, u32 num)
+{
+	struct rio_maint_op ops[RIO_RT_UPDATE_BATCH * 2];
+	u32 i;
+	int n = 0, rc = 0, err;
+
+	if (table != RIO_GLOBAL_TABLE)
+		goto out;
+
+	for (i = 0; i < num; i++) {
+		if (route_table[i] == RIO_INVALID_ROUTE)
+			continue;
+
+		ops[n].destid = destid;
+		ops[n].hopcount = hopcount;
+		ops[n].write = 1;
+		ops[n].offset = RIO_STD_RTE_CONF_DESTID_SEL_CSR;
+		ops[n].data = i;
+		n++;
+		ops[n].destid = destid;
+		ops[n].hopcount = hopcount;
+		ops[n].write = 1;
+		ops[n].offset = RIO_STD_RTE_CONF_PORT_SEL_CSR;
+		ops[n].data = route_table[i];
+		n++;
+
+		if (n == ARRAY_SIZE(ops)) {
+			err = rio_mport_maint_vec(mport, ops, n);
+			if (!rc)
+				rc = err;
+			n = 0;
+		}
+	}
+
+	if (n) {
+		err = rio_mport_maint_vec(mport, ops, n);
+		if (!rc)
+			rc = err;
+	}
+
+out:
+	udelay(10);
+	return rc;
+}
+
 /**
  * rio_std_route_get_entry - Read switch route table entry (port number)
  *   associated with specified destID using standard registers defined in RIO
@@ -1723,6 +2274,62 @@ int rio_route_add_entry(struct rio_dev *rdev,
 }
 EXPORT_SYMBOL_GPL(rio_route_add_entry);
 
+/**
+ * rio_route_add_entries - Add set of route entries to a switch routing table
+ * @rdev: RIO device
+ * @table: Routing table ID
+ * @route_table: Port numbers indexed by destination ID
+ * @num: Number of entries in @route_table
+ * @lock: apply a hardware lock on switch device flag (1=lock, 0=no_lock)
+ *
+ * Same as rio_route_add_entry() for every entry of @route_table that is not
+ * set to %RIO_INVALID_ROUTE. The switch is locked once for the whole update
+ * and the standard RT update method batches maintenance transactions.
+ *
+ * Returns %0 on success or %-EINVAL on failure.
+ */
+int rio_route_add_entries(struct rio_dev *rdev, u16 table,
+			  const u8 *route_table, u32 num, int lock)
+{
+	int rc = -EINVAL;
+	struct rio_switch_ops *ops = rdev->rswitch->ops;
+	u32 i;
+
+	if (lock) {
+		rc = rio_lock_device(rdev->net->hport, rdev->destid,
+				     rdev->hopcount, 1000);
+		if (rc)
+			return rc;
+	}
+
+	spin_lock(&rdev->rswitch->lock);
+
+	if (ops == NULL || ops->add_entry == NULL) {
+		rc = rio_std_route_add_entries(rdev->net->hport, rdev->destid,
+					       rdev->hopcount, table,
+					       route_table, num);
+	} else if (try_module_get(ops->owner)) {
+		rc = 0;
+		for (i = 0; i < num && !rc; i++) {
+			if (route_table[i] == RIO_INVALID_ROUTE)
+				continue;
+			rc = ops->add_entry(rdev->net->hport, rdev->destid,
+					    rdev->hopcount, table, i,
+					    route_table[i]);
+		}
+		module_put(ops->owner);
+	}
+
+	spin_unlock(&rdev->rswitch->lock);
+
+	if (lock)
+		rio_unlock_device(rdev->net->hport, rdev->destid,
+				  rdev->hopcount);
+
+	return rc;
+}
+EXPORT_SYMBOL_GPL(rio_route_add_entries);
+
 /**
  * rio_route_get_entry- Read an entry from a switch routing table
  * @rdev: RIO device
@@ -1823,6 +2430,239 @@ int rio_route_clr_table(struct rio_dev *rdev, u16 table, int lock)
 }
 EXPORT_SYMBOL_GPL(rio_route_clr_table);
 
+/**
+ * rio_topo_port - Returns port of a switch a device is connected to
+ * @sw: RIO switch device
+ * @rdev: RIO device connected to @sw
+ */
+static u8 rio_topo_port(struct rio_dev *sw, struct rio_dev *rdev)
+{
+	int i;
+
+	for (i = 0; i < RIO_GET_TOTAL_PORTS(sw->swpinfo); i++)
+		if (sw->rswitch->nextdev[i] == rdev)
+			return i;
+
+	return RIO_INVALID_ROUTE;
+}
+
+/**
+ * rio_topo_owns_destid - Tests if a device owns its destination ID
+ * @rdev: RIO device
+ *
+ * Endpoints own destID assigned to them. A switch owns its destID only
+ * if the destID does not belong to a device below the switch.
+ */
+static bool rio_topo_owns_destid(struct rio_dev *rdev)
+{
+	struct rio_dev *next;
+	int i;
+
+	if (!(rdev->pef & RIO_PEF_SWITCH))
+		return rdev->hopcount == 0xff;
+
+	for (i = 0; i < RIO_GET_TOTAL_PORTS(rdev->swpinfo); i++) {
+		next = rdev->rswitch->nextdev[i];
+		if (next && next->prev == rdev && next->destid == rdev->destid)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * rio_mport_get_topology - Creates snapshot of network topology
+ * @mport: Master port the network is attached to
+ * @buf: Buffer for the snapshot or %NULL to get snapshot size
+ * @size: Size of @buf
+ *
+ * Records every device of the network with its position, identity,
+ * destID, component tag and feature pointers, as well as route tables of
+ * switches. The snapshot can be passed back by rio_mport_set_topology() to
+ * speed up next enumeration through the same master port.
+ *
+ * Returns snapshot size on success, %-ENOSPC if @size is too small or
+ * %-ENODEV if there is no network attached to @mport.
+ */
+ssize_t rio_mport_get_topology(struct rio_mport *mport, void *buf,
+			       size_t size)
+{
+	struct rio_net *net = mport->net;
+	struct rio_topo_hdr *hdr = buf;
+	struct rio_topo_dev *td;
+	struct rio_topo_route *tr;
+	struct rio_dev *rdev;
+	u32 any = RIO_ANY_DESTID(mport->sys_size);
+	u32 i, nroutes, ndevs = 0;
+	ssize_t len = sizeof(*hdr);
+	u8 *rt;
+
+	if (!net)
+		return -ENODEV;
+
+	if (buf && size < len)
+		return -ENOSPC;
+
+	spin_lock(&rio_global_list_lock);
+	list_for_each_entry(rdev, &net->devices, net_list) {
+		rt = NULL;
+		nroutes = 0;
+		if (rdev->pef & RIO_PEF_SWITCH)
+			rt = rdev->rswitch->route_table;
+		for (i = 0; rt && i < RIO_MAX_ROUTE_ENTRIES(mport->sys_size);
+		     i++)
+			if (i != any && rt[i] != RIO_INVALID_ROUTE)
+				nroutes++;
+
+		if (buf) {
+			if (len + sizeof(*td) + nroutes * sizeof(*tr) > size) {
+				len = -ENOSPC;
+				break;
+			}
+
+			td = buf + len;
+			memset(td, 0, sizeof(*td));
+			td->comp_tag = cpu_to_le32(rdev->comp_tag);
+			td->dev_id = cpu_to_le32(((u32)rdev->did << 16) |
+						 rdev->vid);
+			td->phys_efptr = cpu_to_le32(rdev->phys_efptr);
+			td->em_efptr = cpu_to_le32(rdev->em_efptr);
+			td->nroutes = cpu_to_le32(nroutes);
+			td->destid = cpu_to_le16(rdev->destid);
+			td->hopcount = rdev->hopcount;
+			td->phys_rmap = rdev->phys_rmap;
+			if (rdev->prev) {
+				td->prev_ctag = cpu_to_le32(rdev->prev->comp_tag);
+				td->prev_port = rio_topo_port(rdev->prev, rdev);
+			}
+			if (rdev->pef & RIO_PEF_SWITCH)
+				td->flags |= RIO_TOPO_SWITCH;
+			if (rio_topo_owns_destid(rdev))
+				td->flags |= RIO_TOPO_DESTID;
+
+			tr = (struct rio_topo_route *)(td + 1);
+			for (i = 0; nroutes &&
+			     i < RIO_MAX_ROUTE_ENTRIES(mport->sys_size); i++) {
+				if (i == any || rt[i] == RIO_INVALID_ROUTE)
+					continue;
+				tr->destid = cpu_to_le16(i);
+				tr->port = rt[i];
+				tr->rsvd = 0;
+				tr++;
+			}
+		}
+
+		len += sizeof(*td) + nroutes * sizeof(*tr);
+		ndevs++;
+	}
+	spin_unlock(&rio_global_list_lock);
+
+	if (buf && len > 0) {
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->magic = cpu_to_le32(RIO_TOPO_MAGIC);
+		hdr->version = cpu_to_le16(RIO_TOPO_VERSION);
+		hdr->host_did = cpu_to_le16(mport->host_deviceid);
+		hdr->size = cpu_to_le32(len);
+		hdr->ndevs = cpu_to_le32(ndevs);
+		hdr->sys_size = mport->sys_size;
+	}
+
+	return len;
+}
+EXPORT_SYMBOL_GPL(rio_mport_get_topology);
+
+/**
+ * rio_mport_set_topology - Sets topology snapshot for next enumeration
+ * @mport: Master port
+ * @snap: Snapshot created by rio_mport_get_topology() or %NULL to drop
+ *        previously set one
+ * @size: Size of @snap
+ *
+ * Validates the snapshot and keeps a copy of it. Next enumeration through
+ * @mport verifies devices against the snapshot and reuses their settings
+ * where the network has not changed.
+ *
+ * Returns %0 on success, %-EINVAL if the snapshot is malformed or
+ * %-ENOMEM if out of memory.
+ */
+int rio_mport_set_topology(struct rio_mport *mport, const void *snap,
+			   size_t size)
+{
+	const struct rio_topo_hdr *hdr = snap;
+	const struct rio_topo_dev *td;
+	const struct rio_topo_route *tr;
+	size_t len = sizeof(*hdr);
+	u32 i, j, nroutes;
+	void *copy = NULL;
+
+	if (!snap)
+		goto set;
+
+	if (size < sizeof(*hdr) || size > RIO_TOPO_MAX_SIZE ||
+	    le32_to_cpu(hdr->magic) != RIO_TOPO_MAGIC ||
+	    le16_to_cpu(hdr->version) != RIO_TOPO_VERSION ||
+	    le32_to_cpu(hdr->size) != size ||
+	    hdr->sys_size != mport->sys_size)
+		return -EINVAL;
+
+	for (i = 0; i < le32_to_cpu(hdr->ndevs); i++) {
+		if (len + sizeof(*td) > size)
+			return -EINVAL;
+		td = snap + len;
+		len += sizeof(*td);
+		nroutes = le32_to_cpu(td->nroutes);
+		if (nroutes > (size - len) / sizeof(*tr))
+			return -EINVAL;
+		tr = snap + len;
+		for (j = 0; j < nroutes; j++)
+			if (le16_to_cpu(tr[j].destid) >=
+			    RIO_MAX_ROUTE_ENTRIES(mport->sys_size))
+				return -EINVAL;
+		len += nroutes * sizeof(*tr);
+	}
+
+	if (len != size)
+		return -EINVAL;
+
+	copy = vmalloc(size);
+	if (!copy)
+		return -ENOMEM;
+	memcpy(copy, snap, size);
+
+set:
+	mutex_lock(&mport->lock);
+	swap(copy, mport->topo_snap);
+	mport->topo_size = mport->topo_snap ? size : 0;
+	mutex_unlock(&mport->lock);
+
+	vfree(copy);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(rio_mport_set_topology);
+
+/**
+ * rio_mport_take_topology - Takes topology snapshot set for enumeration
+ * @mport: Master port
+ * @size: Returns size of the snapshot
+ *
+ * Returns snapshot set by rio_mport_set_topology() or %NULL if none is
+ * set. The caller owns the snapshot and frees it with vfree().
+ */
+void *rio_mport_take_topology(struct rio_mport *mport, size_t *size)
+{
+	void *snap;
+
+	mutex_lock(&mport->lock);
+	snap = mport->topo_snap;
+	*size = mport->topo_size;
+	mport->topo_snap = NULL;
+	mport->topo_size = 0;
+	mutex_unlock(&mport->lock);
+
+	return snap;
+}
+EXPORT_SYMBOL_GPL(rio_mport_take_topology);
+
 #ifdef CONFIG_RAPIDIO_DMA_ENGINE
 
 static bool rio_chan_filter(struct dma_chan *chan, void *arg)
@@ -1908,12 +2748,62 @@ struct dma_async_tx_descriptor *rio_dma_prep_xfer(struct dma_chan *dchan,
 	rio_ext.sssize  = data->sssize;
 	rio_ext.dsdist  = data->dsdist;
 	rio_ext.dssize  = data->dssize;
+	rio_ext.segs = NULL;
+	rio_ext.nsegs = 0;
 
 	return dmaengine_prep_rio_sg(dchan, data->sg, data->sg_len,
 				     direction, flags, &rio_ext);
 }
 EXPORT_SYMBOL_GPL(rio_dma_prep_xfer);
 
+/**
+ * rio_dma_prep_xfer_vec - prepares vectored RapidIO DMA transfer
+ * @dchan: DMA channel to configure
+ * @data: RIO specific data descriptor, remote address fields are ignored
+ * @segs: array of transfer elements
+ * @nsegs: number of elements in @segs
+ * @direction: DMA data transfer direction (TO or FROM the device)
+ * @flags: dmaengine defined flags
+ *
+ * Prepares a single DMA transaction that covers several remote targets.
+ * The SG list in @data is split between elements in order, according to
+ * their @sg_len fields. Completion status of every element is reported in
+ * its @status field. Requires mport to report RIO_MPORT_DMA_VEC capability.
+ *
+ * Returns: pointer to DMA transaction descriptor if successful,
+ *          error-valued pointer or NULL if failed.
+ */
+struct dma_async_tx_descriptor *rio_dma_prep_xfer_vec(struct dma_chan *dchan,
+	struct rio_dma_data *data, struct rio_dma_seg *segs,
+	unsigned int nsegs, enum dma_transfer_direction direction,
+	unsigned long flags)
+{
+	struct rio_dma_ext rio_ext;
+
+	if (dchan->device->device_prep_slave_sg == NULL) {
+		pr_err("%s: prep_rio_sg == NULL\n", __func__);
+		return NULL;
+	}
+
+	if (!segs || !nsegs)
+		return ERR_PTR(-EINVAL);
+
+	rio_ext.destid = segs[0].destid;
+	rio_ext.rio_addr_u = segs[0].rio_addr_u;
+	rio_ext.rio_addr = segs[0].rio_addr;
+	rio_ext.wr_type = data->wr_type;
+	rio_ext.ssdist  = data->ssdist;
+	rio_ext.sssize  = data->sssize;
+	rio_ext.dsdist  = data->dsdist;
+	rio_ext.dssize  = data->dssize;
+	rio_ext.segs = segs;
+	rio_ext.nsegs = nsegs;
+
+	return dmaengine_prep_rio_sg(dchan, data->sg, data->sg_len,
+				     direction, flags, &rio_ext);
+}
+EXPORT_SYMBOL_GPL(rio_dma_prep_xfer_vec);
+
 /**
  * rio_dma_prep_slave_sg - RapidIO specific wrapper
  *   for device_prep_slave_sg callback defined by DMAENGINE.
@@ -1938,6 +2828,289 @@ struct dma_async_tx_descriptor *rio_dma_prep_slave_sg(struct rio_dev *rdev,
 }
 EXPORT_SYMBOL_GPL(rio_dma_prep_slave_sg);
 
+/**
+ * rio_request_mport_dma_stripe - request set of DMA channels of mport
+ * @mport: RIO mport to perform DMA data transfers
+ * @chans: array to store allocated channels
+ * @max: maximum number of channels to request
+ *
+ * Requests as many RapidIO capable DMA channels of @mport as available,
+ * up to @max. Channels are released using rio_release_dma_stripe().
+ *
+ * Returns number of allocated channels.
+ */
+int rio_request_mport_dma_stripe(struct rio_mport *mport,
+				 struct dma_chan **chans, unsigned int max)
+{
+	unsigned int i;
+
+	for (i = 0; i < max; i++) {
+		chans[i] = rio_request_mport_dma(mport);
+		if (!chans[i])
+			break;
+	}
+
+	return i;
+}
+EXPORT_SYMBOL_GPL(rio_request_mport_dma_stripe);
+
+/**
+ * rio_release_dma_stripe - release set of DMA channels
+ * @chans: array of DMA channels
+ * @nchans: number of channels in @chans
+ */
+void rio_release_dma_stripe(struct dma_chan **chans, unsigned int nchans)
+{
+	while (nchans--)
+		rio_release_dma(chans[nchans]);
+}
+EXPORT_SYMBOL_GPL(rio_release_dma_stripe);
+
+struct rio_dma_stripe;
+
+struct rio_dma_stripe_part {
+	struct rio_dma_stripe	*stripe;
+	struct dma_chan		*dchan;
+	dma_cookie_t		cookie;
+	struct sg_table		sgt;
+	struct rio_dma_seg	seg;	/* status is set before callback */
+};
+
+/*
+ * struct rio_dma_stripe - state of DMA transfer striped over channels
+ * @pending: number of parts in progress (plus one while submitting)
+ * @error: set if any of parts failed
+ * @callback: completion callback of the whole transfer
+ * @param: callback parameter
+ * @nparts: number of parts
+ * @part: parts of the transfer, one per channel
+ */
+struct rio_dma_stripe {
+	atomic_t		pending;
+	bool			error;
+	rio_dma_stripe_callback	callback;
+	void			*param;
+	unsigned int		nparts;
+	struct rio_dma_stripe_part part[RIO_DMA_MAX_STRIPE];
+};
+
+static void rio_dma_stripe_put(struct rio_dma_stripe *stripe)
+{
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&stripe->pending))
+		return;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
+	stripe->callback(stripe->param,
+			 stripe->error ? DMA_ERROR : DMA_COMPLETE);
+#else
+	stripe->callback(stripe->param,
+			 stripe->error ? DMA_ERROR : DMA_SUCCESS);
+#endif
+
+	for (i = 0; i < stripe->nparts; i++)
+		sg_free_table(&stripe->part[i].sgt);
+	kfree(stripe);
+}
+
+/*
+ * Called by DMA driver, possibly with channel locks held: must not query
+ * channel status. Part status comes from its single vectored element.
+ */
+static void rio_dma_stripe_done(void *param)
+{
+	struct rio_dma_stripe_part *part = param;
+
+	if (part->seg.status)
+		part->stripe->error = true;
+
+	rio_dma_stripe_put(part->stripe);
+}
+
+/**
+ * rio_dma_sg_slice - builds SG table for part of DMA mapped SG list
+ * @sgt: SG table to allocate and fill
+ * @sgl: DMA mapped SG list
+ * @nents: number of DMA mapped entries in @sgl
+ * @start: offset of the part in bytes
+ * @len: length of the part in bytes
+ *
+ * Entries of the new table carry DMA addresses only, nothing is mapped.
+ * Caller releases @sgt with sg_free_table(). May sleep.
+ *
+ * Returns 0 on success or error code if the table cannot be allocated.
+ */
+int rio_dma_sg_slice(struct sg_table *sgt, struct scatterlist *sgl,
+		     unsigned int nents, u64 start, u64 len)
+{
+	struct scatterlist *sg, *dsg;
+	u64 end = start + len, pos, s, e;
+	unsigned int i, cnt = 0;
+	int ret;
+
+	pos = 0;
+	for_each_sg(sgl, sg, nents, i) {
+		if (pos + sg_dma_len(sg) > start && pos < end)
+			cnt++;
+		pos += sg_dma_len(sg);
+	}
+
+	ret = sg_alloc_table(sgt, cnt, GFP_KERNEL);
+	if (ret)
+		return ret;
+
+	pos = 0;
+	dsg = sgt->sgl;
+	for_each_sg(sgl, sg, nents, i) {
+		if (pos + sg_dma_len(sg) > start && pos < end) {
+			s = max(start, pos);
+			e = min(end, pos + sg_dma_len(sg));
+			dsg->dma_address = sg_dma_address(sg) + (s - pos);
+			sg_dma_len(dsg) = e - s;
+			dsg = sg_next(dsg);
+		}
+		pos += sg_dma_len(sg);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(rio_dma_sg_slice);
+
+/**
+ * rio_dma_xfer_stripe - submits DMA transfer striped over several channels
+ * @chans: DMA channels of the same mport
+ * @nchans: number of channels in @chans
+ * @destid: target RapidIO device destination ID
+ * @data: RIO specific data descriptor, SG list must be DMA mapped
+ * @direction: DMA data transfer direction (TO or FROM the device)
+ * @callback: called once when all parts of the transfer are complete
+ * @param: parameter passed to @callback
+ * @cookie: returns cookie of the part submitted to @chans[0]
+ *
+ * Splits the transfer into contiguous parts of equal size and submits
+ * one part to every channel. Completion of all parts is reported by single
+ * @callback invocation, with DMA_ERROR status if any part failed.
+ * Strided transfers cannot be split. Parts are submitted as vectored
+ * transfers of one element, mport must report RIO_MPORT_DMA_VEC. May sleep.
+ *
+ * Returns 0 if transfer was submitted, error code otherwise. If any part
+ * was submitted, 0 is returned and the failure is reported by @callback.
+ */
+int rio_dma_xfer_stripe(struct dma_chan **chans, unsigned int nchans,
+			u16 destid, struct rio_dma_data *data,
+			enum dma_transfer_direction direction,
+			rio_dma_stripe_callback callback, void *param,
+			dma_cookie_t *cookie)
+{
+	struct rio_dma_stripe *stripe;
+	struct rio_dma_stripe_part *part;
+	struct dma_async_tx_descriptor *tx;
+	struct rio_mport_attr attr;
+	struct rio_dma_data pdata;
+	struct scatterlist *sg;
+	u64 total = 0, chunk, off;
+	unsigned int i;
+	int ret = 0;
+
+	if (!nchans || nchans > RIO_DMA_MAX_STRIPE || !callback)
+		return -EINVAL;
+
+	if (data->ssdist || data->sssize || data->dsdist || data->dssize)
+		return -EINVAL;
+
+	if (rio_query_mport(dma_to_mport(chans[0]->device), &attr) ||
+	    !(attr.flags & RIO_MPORT_DMA_VEC))
+		return -EOPNOTSUPP;
+
+	for_each_sg(data->sg, sg, data->sg_len, i)
+		total += sg_dma_len(sg);
+
+	if (!total)
+		return -EINVAL;
+
+	/* Keep parts page aligned, do not split small transfers too much */
+	chunk = ALIGN(DIV_ROUND_UP_ULL(total, nchans), PAGE_SIZE);
+
+	stripe = kzalloc(sizeof(*stripe), GFP_KERNEL);
+	if (!stripe)
+		return -ENOMEM;
+
+	stripe->callback = callback;
+	stripe->param = param;
+
+	for (off = 0; off < total; off += chunk) {
+		part = &stripe->part[stripe->nparts];
+		ret = rio_dma_sg_slice(&part->sgt, data->sg, data->sg_len,
+				       off, min(chunk, total - off));
+		if (ret)
+			goto err_free;
+		part->stripe = stripe;
+		part->dchan = chans[stripe->nparts];
+		stripe->nparts++;
+	}
+
+	/* Bias prevents completion before all parts are submitted */
+	atomic_set(&stripe->pending, stripe->nparts + 1);
+
+	for (i = 0; i < stripe->nparts; i++) {
+		part = &stripe->part[i];
+		off = chunk * i;
+
+		pdata = *data;
+		pdata.sg = part->sgt.sgl;
+		pdata.sg_len = part->sgt.nents;
+
+		part->seg.destid = destid;
+		part->seg.rio_addr = data->rio_addr + off;
+		part->seg.rio_addr_u = data->rio_addr_u +
+				       (part->seg.rio_addr < data->rio_addr);
+		part->seg.sg_len = part->sgt.nents;
+		part->seg.status = 0;
+
+		tx = rio_dma_prep_xfer_vec(part->dchan, &pdata, &part->seg, 1,
+					   direction,
+					   DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
+		if (IS_ERR_OR_NULL(tx)) {
+			ret = tx ? PTR_ERR(tx) : -EIO;
+			break;
+		}
+
+		tx->callback = rio_dma_stripe_done;
+		tx->callback_param = part;
+		part->cookie = dmaengine_submit(tx);
+		if (dma_submit_error(part->cookie)) {
+			ret = -EIO;
+			break;
+		}
+	}
+
+	if (i == 0)
+		goto err_free;
+
+	if (i < stripe->nparts) {
+		pr_debug("RIO: striped DMA submitted %u of %u parts, err=%d\n",
+			 i, stripe->nparts, ret);
+		stripe->error = true;
+		atomic_sub(stripe->nparts - i, &stripe->pending);
+	}
+
+	*cookie = stripe->part[0].cookie;
+
+	while (i--)
+		dma_async_issue_pending(stripe->part[i].dchan);
+
+	rio_dma_stripe_put(stripe);
+	return 0;
+
+err_free:
+	for (i = 0; i < stripe->nparts; i++)
+		sg_free_table(&stripe->part[i].sgt);
+	kfree(stripe);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(rio_dma_xfer_stripe);
+
 #endif /* CONFIG_RAPIDIO_DMA_ENGINE */
 
 /**
@@ -2247,8 +3420,18 @@ int rio_mport_initialize(struct rio_mport *mport)
 	mport->host_deviceid = rio_get_hdid(mport->id);
 	mport->nscan = NULL;
 	mutex_init(&mport->lock);
+	spin_lock_init(&mport->config_lock);
+	mutex_init(&mport->config_mutex);
 	mport->pwe_refcnt = 0;
+	mport->topo_snap = NULL;
+	mport->topo_size = 0;
 	INIT_LIST_HEAD(&mport->pwrites);
+	mport->pw_wq = NULL;
+	INIT_DELAYED_WORK(&mport->pw_work, rio_pw_work);
+	spin_lock_init(&mport->pw_lock);
+	INIT_LIST_HEAD(&mport->pw_events);
+	mport->pw_nevents = 0;
+	mport->pw_sched = false;
 
 	return 0;
 }
@@ -2257,8 +3440,20 @@ EXPORT_SYMBOL_GPL(rio_mport_initialize);
 int rio_register_mport(struct rio_mport *port)
 {
 	struct rio_scan_node *scan = NULL;
+	struct workqueue_struct *pw_wq;
+	unsigned long flags;
 	int res = 0;
 
+	/* Port-writes of an mport are dispatched in order of arrival */
+	pw_wq = alloc_ordered_workqueue("rio_pw%d", WQ_MEM_RECLAIM, port->id);
+	if (!pw_wq) {
+		pr_err("RIO: unable allocate pw_wq for mport%d\n", port->id);
+		return -ENOMEM;
+	}
+	spin_lock_irqsave(&port->pw_lock, flags);
+	port->pw_wq = pw_wq;
+	spin_unlock_irqrestore(&port->pw_lock, flags);
+
 	mutex_lock(&rio_mport_list_lock);
 
 	/*
@@ -2282,10 +3477,14 @@ int rio_register_mport(struct rio_mport *port)
 	atomic_set(&port->state, RIO_DEVICE_RUNNING);
 
 	res = device_register(&port->dev);
-	if (res)
+	if (res) {
 		dev_err(&port->dev, "RIO: mport%d registration failed ERR=%d\n",
 			port->id, res);
-	else
+		mutex_lock(&rio_mport_list_lock);
+		list_del(&port->node);
+		mutex_unlock(&rio_mport_list_lock);
+		rio_pw_events_free(port);
+	} else
 		dev_dbg(&port->dev, "RIO: registered mport%d\n", port->id);
 
 	return res;
@@ -2335,6 +3534,9 @@ int rio_unregister_mport(struct rio_mport *port)
 	mutex_lock(&rio_mport_list_lock);
 	list_del(&port->node);
 	mutex_unlock(&rio_mport_list_lock);
+	rio_pw_events_free(port);
+	rio_mport_set_topology(port, NULL, 0);
+	rio_dbell_map_free(port);
 	device_unregister(&port->dev);
 
 	return 0;
@@ -2349,6 +3551,7 @@ EXPORT_SYMBOL_GPL(rio_release_inb_dbell);
 EXPORT_SYMBOL_GPL(rio_request_outb_dbell);
 EXPORT_SYMBOL_GPL(rio_release_outb_dbell);
 EXPORT_SYMBOL_GPL(rio_request_inb_mbox);
+EXPORT_SYMBOL_GPL(rio_request_inb_mbox_zc);
 EXPORT_SYMBOL_GPL(rio_release_inb_mbox);
 EXPORT_SYMBOL_GPL(rio_request_outb_mbox);
 EXPORT_SYMBOL_GPL(rio_release_outb_mbox);
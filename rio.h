@@ -35,16 +35,21 @@ extern int rio_lock_device(struct rio_mport *port, u16 destid,
 extern int rio_unlock_device(struct rio_mport *port, u16 destid, u8 hopcount);
 extern int rio_route_add_entry(struct rio_dev *rdev,
 			u16 table, u16 route_destid, u8 route_port, int lock);
+extern int rio_route_add_entries(struct rio_dev *rdev, u16 table,
+			const u8 *route_table, u32 num, int lock);
 extern int rio_route_get_entry(struct rio_dev *rdev, u16 table,
 			u16 route_destid, u8 *route_port, int lock);
 extern int rio_route_clr_table(struct rio_dev *rdev, u16 table, int lock);
 extern int rio_set_port_lockout(struct rio_dev *rdev, u32 pnum, int lock);
 extern struct rio_dev *rio_get_comptag(u32 comp_tag, struct rio_dev *from);
+extern struct rio_dev *rio_get_destid(struct rio_net *net, u16 destid,
+				      struct rio_dev *from);
 extern struct rio_net *rio_alloc_net(struct rio_mport *mport);
 extern int rio_add_net(struct rio_net *net);
 extern void rio_free_net(struct rio_net *net);
 extern int rio_add_device(struct rio_dev *rdev);
 extern void rio_del_device(struct rio_dev *rdev, enum rio_device_state state);
+extern void rio_dev_set_destid(struct rio_dev *rdev, u16 destid);
 extern int rio_enable_rx_tx_port(struct rio_mport *port, int local, u16 destid,
 				 u8 hopcount, u8 port_num);
 extern int rio_register_scan(int mport_id, struct rio_scan *scan_ops);
@@ -52,6 +57,11 @@ extern int rio_unregister_scan(int mport_id, struct rio_scan *scan_ops);
 extern void rio_attach_device(struct rio_dev *rdev);
 extern struct rio_mport *rio_find_mport(int mport_id);
 extern int rio_mport_scan(int mport_id);
+extern ssize_t rio_mport_get_topology(struct rio_mport *mport, void *buf,
+				      size_t size);
+extern int rio_mport_set_topology(struct rio_mport *mport, const void *snap,
+				  size_t size);
+extern void *rio_mport_take_topology(struct rio_mport *mport, size_t *size);
 
 /* Structures internal to the RIO core code */
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
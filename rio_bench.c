@@ -0,0 +1,850 @@
+/*
+ * rio_bench - RapidIO benchmark driver
+ *
+ * Measures hot path performance of a local mport against a remote RapidIO
+ * endpoint (or itself, in loopback): mailbox message rate and round-trip
+ * latency, doorbell round-trip time and BDMA bandwidth, per channel and
+ * striped over all channels of the mport.
+ *
+ * The driver is loaded on both endpoints. Each instance answers mailbox
+ * and doorbell PINGs of its peer, so the same module is both the echo
+ * responder and the test initiator. Tests are started by writing a command
+ * into debugfs file rio_bench/run, the result of the last test is reported
+ * as single JSON line in rio_bench/result:
+ *
+ *   mbox <destid> <size> <count> <depth>
+ *   dbell <destid> <count>
+ *   dma <destid> <rio_addr> <size> <count> <chan|-1> <r|w>
+ *
+ * Maintenance read latency and rio_cm channel RTT are measured from user
+ * space over rio_mport_cdev and rio_cm interfaces by tools/rio_bench, which
+ * also drives the tests above.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmaengine.h>
+#include <linux/scatterlist.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include "include/rio.h"
+#include "include/rio_drv.h"
+
+#define DRV_NAME	"rio_bench"
+#define DRV_VERSION	"1.0.0"
+#define DRV_DESC	"RapidIO Benchmark Driver"
+
+#define RIO_BENCH_RING		128	/* mailbox ring size, power of 2 */
+#define RIO_BENCH_HIST		16	/* latency histogram buckets */
+#define RIO_BENCH_RESULT_LEN	1024
+#define RIO_BENCH_CMD_LEN	128
+
+#define RIO_BENCH_PING		1
+#define RIO_BENCH_PONG		2
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0))
+#define RIO_BENCH_DMA_OK	DMA_COMPLETE
+#else
+#define RIO_BENCH_DMA_OK	DMA_SUCCESS
+#define reinit_completion(x)	INIT_COMPLETION(*(x))
+#endif
+
+static int mport_id;
+module_param(mport_id, int, S_IRUGO);
+MODULE_PARM_DESC(mport_id, "ID of local mport to benchmark (default 0)");
+
+static int mbox = 3;
+module_param(mbox, int, S_IRUGO);
+MODULE_PARM_DESC(mbox, "RapidIO mailbox used by message tests (default 3)");
+
+static unsigned short dbell = 0xbe00;
+module_param(dbell, ushort, S_IRUGO);
+MODULE_PARM_DESC(dbell,
+	"Doorbell info of PING, PONG uses the next value (default 0xbe00)");
+
+static unsigned int ibw_size;
+module_param(ibw_size, uint, S_IRUGO);
+MODULE_PARM_DESC(ibw_size,
+	"Size of inbound window used as DMA test target (default 0 = none)");
+
+static unsigned long long ibw_addr;
+module_param(ibw_addr, ullong, S_IRUGO);
+MODULE_PARM_DESC(ibw_addr, "RapidIO address of inbound window (default 0)");
+
+static unsigned int timeout_ms = 1000;
+module_param(timeout_ms, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(timeout_ms,
+	"Time to wait for a response before it is counted lost (default 1000)");
+
+MODULE_DESCRIPTION(DRV_DESC);
+MODULE_LICENSE("GPL");
+MODULE_VERSION(DRV_VERSION);
+
+/*
+ * Mailbox message header. PING is returned by the peer as PONG with
+ * unchanged seq and ts fields, padded to the size of PING.
+ */
+struct rio_bench_hdr {
+	u8	type;
+	u8	rsvd;
+	__le16	src;	/* destID of PING sender */
+	__le32	seq;
+	__le64	ts;	/* PING send time, ns */
+} __attribute__((__packed__));
+
+/*
+ * struct rio_bench_stats - results of a test
+ * @ops: number of completed operations
+ * @bytes: payload transferred by completed operations
+ * @errors: number of failed or lost operations
+ * @lat_min: minimum operation latency, ns
+ * @lat_max: maximum operation latency, ns
+ * @lat_sum: sum of operation latencies, ns
+ * @hist: latency histogram, bucket N counts latencies below 2^N us
+ */
+struct rio_bench_stats {
+	u64	ops;
+	u64	bytes;
+	u64	errors;
+	u64	lat_min;
+	u64	lat_max;
+	u64	lat_sum;
+	u64	hist[RIO_BENCH_HIST];
+};
+
+struct rio_bench {
+	struct rio_mport	*mport;
+	struct dentry		*dbg_dir;
+	struct mutex		run_lock;	/* serializes tests */
+
+	/*
+	 * Mailbox and doorbell state, accessed from mport callbacks.
+	 * Outbound messages are sent to the destID of @tx_rdev or @echo_rdev.
+	 * These are not registered devices: messaging and doorbell paths of
+	 * the mport use @destid only, which lets the peer be any endpoint,
+	 * including the local one.
+	 */
+	spinlock_t		lock;
+	struct rio_dev		tx_rdev;
+	struct rio_dev		echo_rdev;
+	void			*ib_buf[RIO_BENCH_RING];
+	void			*tx_buf[RIO_BENCH_RING];
+	int			tx_slot;
+	int			ack_slot;
+	int			tx_cnt;
+	u64			echoed;
+	wait_queue_head_t	wq;
+
+	/* State of the running test, protected by @lock */
+	bool			active;
+	u16			destid;
+	u64			rx_cnt;
+	struct rio_bench_stats	st;
+
+	struct completion	done;
+	u64			db_tx_ts;
+	u64			db_rx_ts;
+	enum dma_status		dma_status;
+
+	/* Inbound window (DMA test target) */
+	void			*ibw_buf;
+	dma_addr_t		ibw_phys;
+
+	char			result[RIO_BENCH_RESULT_LEN];
+	size_t			result_len;
+};
+
+static struct rio_bench *bench;
+
+static inline u64 rio_bench_ts(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void rio_bench_account(struct rio_bench_stats *st, u64 ns, u64 bytes)
+{
+	st->ops++;
+	st->bytes += bytes;
+	st->lat_sum += ns;
+	if (st->ops == 1 || ns < st->lat_min)
+		st->lat_min = ns;
+	if (ns > st->lat_max)
+		st->lat_max = ns;
+	st->hist[min_t(int, fls64(ns >> 10), RIO_BENCH_HIST - 1)]++;
+}
+
+/* Rate per second of @n events in @ns, avoiding overflow of n * 10^9 */
+static u64 rio_bench_rate(u64 n, u64 ns)
+{
+	if (n <= ULLONG_MAX / NSEC_PER_SEC)
+		return div64_u64(n * NSEC_PER_SEC, ns);
+	return div64_u64(n, max_t(u64, div64_u64(ns, NSEC_PER_USEC), 1)) *
+	       USEC_PER_SEC;
+}
+
+static void rio_bench_reset(struct rio_bench *b, u16 destid)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&b->lock, flags);
+	memset(&b->st, 0, sizeof(b->st));
+	b->rx_cnt = 0;
+	b->destid = destid;
+	b->tx_rdev.destid = destid;
+	b->active = true;
+	spin_unlock_irqrestore(&b->lock, flags);
+}
+
+/*
+ * rio_bench_report - format result of completed test
+ * @b: benchmark instance
+ * @test: test name
+ * @params: test specific JSON members, without trailing comma
+ * @ns: test duration
+ */
+static void rio_bench_report(struct rio_bench *b, const char *test,
+			     const char *params, u64 ns)
+{
+	struct rio_bench_stats *st = &b->st;
+	char *p = b->result;
+	char *end = b->result + sizeof(b->result);
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&b->lock, flags);
+	b->active = false;
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	if (!ns)
+		ns = 1;
+
+	p += scnprintf(p, end - p,
+		"{\"test\":\"%s\",\"mport\":%d,\"destid\":%u,%s,"
+		"\"ops\":%llu,\"errors\":%llu,\"usecs\":%llu,"
+		"\"ops_per_sec\":%llu,\"bytes_per_sec\":%llu,"
+		"\"lat_ns\":{\"min\":%llu,\"avg\":%llu,\"max\":%llu},"
+		"\"lat_hist_log2_us\":[",
+		test, b->mport->id, b->destid, params,
+		st->ops, st->errors, div64_u64(ns, NSEC_PER_USEC),
+		rio_bench_rate(st->ops, ns), rio_bench_rate(st->bytes, ns),
+		st->lat_min, st->ops ? div64_u64(st->lat_sum, st->ops) : 0,
+		st->lat_max);
+
+	for (i = 0; i < RIO_BENCH_HIST; i++)
+		p += scnprintf(p, end - p, "%s%llu", i ? "," : "",
+			       st->hist[i]);
+
+	p += scnprintf(p, end - p, "]}\n");
+	b->result_len = p - b->result;
+}
+
+/*
+ * rio_bench_send - queue message into outbound mailbox
+ * @b: benchmark instance
+ * @rdev: target of message
+ * @hdr: message header
+ * @size: message size
+ *
+ * Must be called with b->lock held. The message is dropped if the ring
+ * is full, mport drivers are not required to check it.
+ */
+static int rio_bench_send(struct rio_bench *b, struct rio_dev *rdev,
+			  struct rio_bench_hdr *hdr, int size)
+{
+	void *buf = b->tx_buf[b->tx_slot];
+	int rc;
+
+	if (b->tx_cnt >= RIO_BENCH_RING - 1)
+		return -EBUSY;
+
+	memcpy(buf, hdr, sizeof(*hdr));
+	rc = rio_add_outb_message(b->mport, rdev, mbox, buf, size);
+	if (rc)
+		return rc;
+
+	b->tx_slot = (b->tx_slot + 1) & (RIO_BENCH_RING - 1);
+	b->tx_cnt++;
+	return 0;
+}
+
+static void rio_bench_outb_msg_event(struct rio_mport *mport, void *dev_id,
+				     int mbox, int slot)
+{
+	struct rio_bench *b = dev_id;
+	unsigned long flags;
+
+	spin_lock_irqsave(&b->lock, flags);
+	while (b->tx_cnt && b->ack_slot != slot) {
+		b->ack_slot = (b->ack_slot + 1) & (RIO_BENCH_RING - 1);
+		b->tx_cnt--;
+	}
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	wake_up(&b->wq);
+}
+
+static void rio_bench_inb_msg_event(struct rio_mport *mport, void *dev_id,
+				    int mbox, int slot)
+{
+	struct rio_bench *b = dev_id;
+	struct rio_bench_hdr *hdr;
+	unsigned long flags;
+	bool wake = false;
+	int size;
+	u64 now;
+
+	while ((hdr = rio_get_inb_message(mport, mbox, &size))) {
+		now = rio_bench_ts();
+
+		spin_lock_irqsave(&b->lock, flags);
+		if (size < sizeof(*hdr)) {
+			/* Not a benchmark message, drop it */
+		} else if (hdr->type == RIO_BENCH_PING) {
+			b->echo_rdev.destid = le16_to_cpu(hdr->src);
+			hdr->type = RIO_BENCH_PONG;
+			if (!rio_bench_send(b, &b->echo_rdev, hdr, size))
+				b->echoed++;
+		} else if (hdr->type == RIO_BENCH_PONG && b->active &&
+			   le16_to_cpu(hdr->src) == mport->host_deviceid) {
+			rio_bench_account(&b->st, now - le64_to_cpu(hdr->ts),
+					  size);
+			b->rx_cnt++;
+			wake = true;
+		}
+		spin_unlock_irqrestore(&b->lock, flags);
+
+		rio_add_inb_buffer(mport, mbox, hdr);
+	}
+
+	if (wake)
+		wake_up(&b->wq);
+}
+
+static void rio_bench_dbell_event(struct rio_mport *mport, void *dev_id,
+				  u16 src, u16 dst, u16 info)
+{
+	struct rio_bench *b = dev_id;
+
+	if (info == dbell) {
+		rio_mport_send_doorbell(mport, src, dbell + 1);
+	} else if (b->active && src == b->destid) {
+		b->db_rx_ts = rio_bench_ts();
+		complete(&b->done);
+	}
+}
+
+/*
+ * rio_bench_mbox_run - mailbox message rate and round-trip latency test
+ *
+ * Keeps up to @depth PINGs outstanding until @count PINGs are sent, then
+ * waits for remaining PONGs. PINGs not answered within timeout_ms are
+ * counted as errors.
+ */
+static int rio_bench_mbox_run(struct rio_bench *b, u16 destid, int size,
+			      u64 count, int depth)
+{
+	struct rio_bench_hdr hdr = {
+		.type = RIO_BENCH_PING,
+		.src = cpu_to_le16(b->mport->host_deviceid),
+	};
+	unsigned long flags;
+	char params[64];
+	u64 sent = 0, start;
+	long ret = 0;
+	int rc;
+
+	if (size < sizeof(hdr) || size > RIO_MAX_MSG_SIZE ||
+	    depth < 1 || depth >= RIO_BENCH_RING || !count)
+		return -EINVAL;
+
+	rio_bench_reset(b, destid);
+	start = rio_bench_ts();
+
+	while (sent < count) {
+		ret = wait_event_interruptible_timeout(b->wq,
+				sent - b->rx_cnt < depth &&
+				b->tx_cnt < RIO_BENCH_RING - 1,
+				msecs_to_jiffies(timeout_ms));
+		if (ret <= 0)
+			break;
+
+		hdr.seq = cpu_to_le32(sent);
+		hdr.ts = cpu_to_le64(rio_bench_ts());
+
+		spin_lock_irqsave(&b->lock, flags);
+		rc = rio_bench_send(b, &b->tx_rdev, &hdr, size);
+		if (rc && rc != -EBUSY)
+			b->st.errors++;
+		spin_unlock_irqrestore(&b->lock, flags);
+
+		if (rc != -EBUSY)
+			sent++;
+	}
+
+	if (ret > 0)
+		ret = wait_event_interruptible_timeout(b->wq,
+				b->rx_cnt + b->st.errors >= sent,
+				msecs_to_jiffies(timeout_ms));
+
+	spin_lock_irqsave(&b->lock, flags);
+	b->active = false;
+	b->st.errors = sent - b->rx_cnt;
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	snprintf(params, sizeof(params),
+		 "\"size\":%d,\"count\":%llu,\"depth\":%d", size, count, depth);
+	rio_bench_report(b, "mbox", params, rio_bench_ts() - start);
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * rio_bench_dbell_run - doorbell round-trip time test
+ *
+ * Doorbells are not sequenced, so PINGs are sent one at a time.
+ */
+static int rio_bench_dbell_run(struct rio_bench *b, u16 destid, u64 count)
+{
+	char params[32];
+	u64 i, start;
+	long ret = 0;
+
+	if (!count)
+		return -EINVAL;
+
+	rio_bench_reset(b, destid);
+	start = rio_bench_ts();
+
+	for (i = 0; i < count; i++) {
+		reinit_completion(&b->done);
+		b->db_tx_ts = rio_bench_ts();
+		if (rio_mport_send_doorbell(b->mport, destid, dbell)) {
+			b->st.errors++;
+			continue;
+		}
+
+		ret = wait_for_completion_interruptible_timeout(&b->done,
+				msecs_to_jiffies(timeout_ms));
+		if (ret < 0)
+			break;
+		if (ret == 0)
+			b->st.errors++;
+		else
+			rio_bench_account(&b->st, b->db_rx_ts - b->db_tx_ts, 0);
+	}
+
+	snprintf(params, sizeof(params), "\"count\":%llu", count);
+	rio_bench_report(b, "dbell", params, rio_bench_ts() - start);
+
+	return ret < 0 ? ret : 0;
+}
+
+#ifdef CONFIG_RAPIDIO_DMA_ENGINE
+
+static void rio_bench_dma_done(void *param)
+{
+	struct rio_bench *b = param;
+
+	complete(&b->done);
+}
+
+static void rio_bench_stripe_done(void *param, enum dma_status status)
+{
+	struct rio_bench *b = param;
+
+	b->dma_status = status;
+	complete(&b->done);
+}
+
+/*
+ * rio_bench_dma_xfer - perform one DMA transfer and wait for completion
+ *
+ * Transfer is submitted to channel @ch, or striped over all @nch channels
+ * if @ch is negative.
+ */
+static int rio_bench_dma_xfer(struct rio_bench *b, struct dma_chan **chans,
+			      int nch, int ch, u16 destid,
+			      struct rio_dma_data *data,
+			      enum dma_transfer_direction dir)
+{
+	struct dma_async_tx_descriptor *tx;
+	dma_cookie_t cookie;
+	unsigned long tmo;
+	int i, rc;
+
+	reinit_completion(&b->done);
+
+	if (ch < 0) {
+		rc = rio_dma_xfer_stripe(chans, nch, destid, data, dir,
+					 rio_bench_stripe_done, b, &cookie);
+		if (rc)
+			return rc;
+	} else {
+		tx = rio_dma_prep_xfer(chans[ch], destid, data, dir,
+				       DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
+		if (IS_ERR_OR_NULL(tx))
+			return tx ? PTR_ERR(tx) : -EIO;
+
+		tx->callback = rio_bench_dma_done;
+		tx->callback_param = b;
+		cookie = dmaengine_submit(tx);
+		if (dma_submit_error(cookie))
+			return -EIO;
+
+		dma_async_issue_pending(chans[ch]);
+	}
+
+	tmo = wait_for_completion_timeout(&b->done,
+					  msecs_to_jiffies(timeout_ms));
+	if (!tmo) {
+		for (i = 0; i < nch; i++)
+			if (ch < 0 || i == ch)
+				dmaengine_terminate_all(chans[i]);
+		return -ETIMEDOUT;
+	}
+
+	if (ch >= 0)
+		b->dma_status = dma_async_is_tx_complete(chans[ch], cookie,
+							 NULL, NULL);
+
+	return b->dma_status == RIO_BENCH_DMA_OK ? 0 : -EIO;
+}
+
+/*
+ * rio_bench_dma_run - BDMA bandwidth test
+ *
+ * Performs @count sequential transfers of @size bytes between local buffer
+ * and RapidIO address @rio_addr of @destid. The test stops at the first
+ * transfer that does not complete within timeout_ms.
+ */
+static int rio_bench_dma_run(struct rio_bench *b, u16 destid, u64 rio_addr,
+			     u32 size, u64 count, int ch, bool rd)
+{
+	struct device *dev = b->mport->dev.parent;
+	struct dma_chan *chans[RIO_DMA_MAX_STRIPE];
+	enum dma_transfer_direction dir = rd ? DMA_DEV_TO_MEM : DMA_MEM_TO_DEV;
+	struct rio_dma_data data;
+	struct scatterlist sg;
+	dma_addr_t phys;
+	char params[128];
+	u64 i, start, t;
+	void *buf;
+	int nch, rc = 0;
+
+	if (!size || !count)
+		return -EINVAL;
+
+	nch = rio_request_mport_dma_stripe(b->mport, chans,
+					   RIO_DMA_MAX_STRIPE);
+	if (!nch)
+		return -ENODEV;
+
+	if (ch >= nch) {
+		rc = -EINVAL;
+		goto out_rel;
+	}
+
+	buf = dma_alloc_coherent(dev, size, &phys, GFP_KERNEL);
+	if (!buf) {
+		rc = -ENOMEM;
+		goto out_rel;
+	}
+
+	sg_init_table(&sg, 1);
+	sg_dma_address(&sg) = phys;
+	sg_dma_len(&sg) = size;
+
+	memset(&data, 0, sizeof(data));
+	data.sg = &sg;
+	data.sg_len = 1;
+	data.rio_addr = rio_addr;
+	data.wr_type = RDW_LAST_NWRITE_R;
+
+	rio_bench_reset(b, destid);
+	start = rio_bench_ts();
+
+	for (i = 0; i < count; i++) {
+		t = rio_bench_ts();
+		rc = rio_bench_dma_xfer(b, chans, nch, ch, destid, &data, dir);
+		if (rc) {
+			b->st.errors++;
+			if (rc == -ETIMEDOUT)
+				break;
+			continue;
+		}
+		rio_bench_account(&b->st, rio_bench_ts() - t, size);
+	}
+
+	snprintf(params, sizeof(params),
+		 "\"rio_addr\":\"0x%llx\",\"size\":%u,\"count\":%llu,"
+		 "\"chan\":%d,\"nchans\":%d,\"dir\":\"%s\"",
+		 rio_addr, size, count, ch, ch < 0 ? nch : 1,
+		 rd ? "read" : "write");
+	rio_bench_report(b, "dma", params, rio_bench_ts() - start);
+
+	dma_free_coherent(dev, size, buf, phys);
+	rc = 0;
+out_rel:
+	rio_release_dma_stripe(chans, nch);
+	return rc;
+}
+
+#else
+
+static int rio_bench_dma_run(struct rio_bench *b, u16 destid, u64 rio_addr,
+			     u32 size, u64 count, int ch, bool rd)
+{
+	return -ENOSYS;
+}
+
+#endif /* CONFIG_RAPIDIO_DMA_ENGINE */
+
+static ssize_t rio_bench_run_write(struct file *filp, const char __user *ubuf,
+				   size_t len, loff_t *ppos)
+{
+	struct rio_bench *b = filp->private_data;
+	char cmd[RIO_BENCH_CMD_LEN];
+	unsigned int destid, size, depth;
+	unsigned long long count, rio_addr;
+	char dir;
+	int ch, rc;
+
+	if (len >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, ubuf, len))
+		return -EFAULT;
+	cmd[len] = 0;
+
+	if (mutex_lock_interruptible(&b->run_lock))
+		return -ERESTARTSYS;
+
+	if (sscanf(cmd, "mbox %u %u %llu %u",
+		   &destid, &size, &count, &depth) == 4)
+		rc = rio_bench_mbox_run(b, destid, size, count, depth);
+	else if (sscanf(cmd, "dbell %u %llu", &destid, &count) == 2)
+		rc = rio_bench_dbell_run(b, destid, count);
+	else if (sscanf(cmd, "dma %u %llx %u %llu %d %c", &destid, &rio_addr,
+			&size, &count, &ch, &dir) == 6 &&
+		 (dir == 'r' || dir == 'w'))
+		rc = rio_bench_dma_run(b, destid, rio_addr, size, count, ch,
+				       dir == 'r');
+	else
+		rc = -EINVAL;
+
+	mutex_unlock(&b->run_lock);
+
+	return rc ? rc : len;
+}
+
+static ssize_t rio_bench_result_read(struct file *filp, char __user *ubuf,
+				     size_t len, loff_t *ppos)
+{
+	struct rio_bench *b = filp->private_data;
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&b->run_lock))
+		return -ERESTARTSYS;
+	ret = simple_read_from_buffer(ubuf, len, ppos, b->result,
+				      b->result_len);
+	mutex_unlock(&b->run_lock);
+
+	return ret;
+}
+
+static const struct file_operations rio_bench_run_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.write	= rio_bench_run_write,
+	.llseek	= noop_llseek,
+};
+
+static const struct file_operations rio_bench_result_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.read	= rio_bench_result_read,
+	.llseek	= default_llseek,
+};
+
+static void rio_bench_free_bufs(struct rio_bench *b)
+{
+	int i;
+
+	for (i = 0; i < RIO_BENCH_RING; i++) {
+		kfree(b->ib_buf[i]);
+		kfree(b->tx_buf[i]);
+	}
+}
+
+/*
+ * rio_bench_add_mport - attach benchmark to local mport selected by mport_id
+ * @dev: device object associated with mport
+ * @class_intf: class interface
+ */
+static int rio_bench_add_mport(struct device *dev,
+			       struct class_interface *class_intf)
+{
+	struct rio_mport *mport = to_rio_mport(dev);
+	struct rio_bench *b;
+	int i, rc;
+
+	if (mport->id != mport_id || bench)
+		return 0;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+
+	b->mport = mport;
+	mutex_init(&b->run_lock);
+	spin_lock_init(&b->lock);
+	init_waitqueue_head(&b->wq);
+	init_completion(&b->done);
+
+	for (i = 0; i < RIO_BENCH_RING; i++) {
+		b->ib_buf[i] = kmalloc(RIO_MAX_MSG_SIZE, GFP_KERNEL);
+		b->tx_buf[i] = kzalloc(RIO_MAX_MSG_SIZE, GFP_KERNEL);
+		if (!b->ib_buf[i] || !b->tx_buf[i]) {
+			rc = -ENOMEM;
+			goto err_buf;
+		}
+	}
+
+	rc = rio_request_outb_mbox(mport, b, mbox, RIO_BENCH_RING,
+				   rio_bench_outb_msg_event);
+	if (rc) {
+		pr_err(DRV_NAME ": failed to allocate OBMBOX_%d on %s\n",
+		       mbox, mport->name);
+		goto err_buf;
+	}
+
+	rc = rio_request_inb_mbox(mport, b, mbox, RIO_BENCH_RING,
+				  rio_bench_inb_msg_event);
+	if (rc) {
+		pr_err(DRV_NAME ": failed to allocate IBMBOX_%d on %s\n",
+		       mbox, mport->name);
+		goto err_ob;
+	}
+
+	for (i = 0; i < RIO_BENCH_RING; i++) {
+		rc = rio_add_inb_buffer(mport, mbox, b->ib_buf[i]);
+		if (rc)
+			goto err_ib;
+	}
+
+	rc = rio_request_inb_dbell(mport, b, dbell, dbell + 1,
+				   rio_bench_dbell_event);
+	if (rc) {
+		pr_err(DRV_NAME ": failed to request doorbells 0x%x on %s\n",
+		       dbell, mport->name);
+		goto err_ib;
+	}
+
+	if (ibw_size) {
+		b->ibw_buf = dma_alloc_coherent(mport->dev.parent, ibw_size,
+						&b->ibw_phys, GFP_KERNEL);
+		if (!b->ibw_buf) {
+			rc = -ENOMEM;
+			goto err_db;
+		}
+
+		rc = rio_map_inb_region(mport, b->ibw_phys, ibw_addr,
+					ibw_size, 0);
+		if (rc) {
+			pr_err(DRV_NAME ": failed to map inbound window 0x%llx on %s (err=%d)\n",
+			       ibw_addr, mport->name, rc);
+			goto err_ibw;
+		}
+	}
+
+	b->dbg_dir = debugfs_create_dir(DRV_NAME, NULL);
+	if (!IS_ERR_OR_NULL(b->dbg_dir)) {
+		debugfs_create_file("run", S_IWUSR, b->dbg_dir, b,
+				    &rio_bench_run_fops);
+		debugfs_create_file("result", S_IRUGO, b->dbg_dir, b,
+				    &rio_bench_result_fops);
+		debugfs_create_u64("echoed", S_IRUGO, b->dbg_dir, &b->echoed);
+	} else {
+		b->dbg_dir = NULL;
+	}
+
+	pr_info(DRV_NAME ": %s destid 0x%x mbox %d dbell 0x%x\n",
+		mport->name, mport->host_deviceid, mbox, dbell);
+	bench = b;
+	return 0;
+
+err_ibw:
+	dma_free_coherent(mport->dev.parent, ibw_size, b->ibw_buf,
+			  b->ibw_phys);
+err_db:
+	rio_release_inb_dbell(mport, dbell, dbell + 1);
+err_ib:
+	rio_release_inb_mbox(mport, mbox);
+err_ob:
+	rio_release_outb_mbox(mport, mbox);
+err_buf:
+	rio_bench_free_bufs(b);
+	kfree(b);
+	return rc;
+}
+
+static void rio_bench_remove_mport(struct device *dev,
+				   struct class_interface *class_intf)
+{
+	struct rio_mport *mport = to_rio_mport(dev);
+	struct rio_bench *b = bench;
+
+	if (!b || b->mport != mport)
+		return;
+
+	debugfs_remove_recursive(b->dbg_dir);
+
+	/* Wait for running test */
+	mutex_lock(&b->run_lock);
+	bench = NULL;
+	mutex_unlock(&b->run_lock);
+
+	if (b->ibw_buf) {
+		rio_unmap_inb_region(mport, b->ibw_phys);
+		dma_free_coherent(mport->dev.parent, ibw_size, b->ibw_buf,
+				  b->ibw_phys);
+	}
+
+	rio_release_inb_dbell(mport, dbell, dbell + 1);
+	rio_release_inb_mbox(mport, mbox);
+	rio_release_outb_mbox(mport, mbox);
+	rio_bench_free_bufs(b);
+	kfree(b);
+}
+
+static struct class_interface rio_bench_interface __refdata = {
+	.class = &rio_mport_class,
+	.add_dev = rio_bench_add_mport,
+	.remove_dev = rio_bench_remove_mport,
+};
+
+static int __init rio_bench_init(void)
+{
+	return class_interface_register(&rio_bench_interface);
+}
+
+static void __exit rio_bench_exit(void)
+{
+	class_interface_unregister(&rio_bench_interface);
+}
+
+module_init(rio_bench_init);
+module_exit(rio_bench_exit);
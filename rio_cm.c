@@ -26,6 +26,7 @@
 #include "include/rio_drv.h"
 #include <linux/slab.h>
 #include <linux/idr.h>
+#include <linux/rcupdate.h>
 #include <linux/interrupt.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>
@@ -33,6 +34,10 @@
 #include <linux/reboot.h>
 #include <linux/bitops.h>
 #include <linux/printk.h>
+#include <linux/vmalloc.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/mm.h>
 #include "include/rio_cm_cdev.h"
 
 #define DRV_NAME        "rio_cm"
@@ -80,6 +85,11 @@ static int cmbox = 1;
 module_param(cmbox, int, S_IRUGO);
 MODULE_PARM_DESC(cmbox, "RapidIO Mailbox number (default 1)");
 
+static int rx_mbox_num = 1;
+module_param(rx_mbox_num, int, S_IRUGO);
+MODULE_PARM_DESC(rx_mbox_num,
+		 "Number of inbound mailboxes starting from cmbox, channels are steered by ID (default 1)");
+
 static int chstart = 256;
 module_param(chstart, int, S_IRUGO);
 MODULE_PARM_DESC(chstart,
@@ -97,7 +107,11 @@ MODULE_LICENSE("GPL");
 MODULE_VERSION(DRV_VERSION);
 
 #define RIOCM_TX_RING_SIZE	128
-#define RIOCM_RX_RING_SIZE	128
+#define RIOCM_TX_BATCH		8	/* max pending requests per submission */
+#define RIOCM_RX_RING_SIZE	128	/* mbox and default channel RX ring */
+#define RIOCM_RX_RING_MIN	2
+#define RIOCM_RX_RING_MAX	4096
+#define RIOCM_TX_POOL_SIZE	4	/* cached TX buffers per channel */
 #define RIOCM_CONNECT_TO	3 /* connect response TO (in sec) */
 
 #define RIOCM_MAX_CHNUM		0xffff /* Use full range of u16 field */
@@ -125,6 +139,7 @@ enum rio_cm_chop {
 	CM_CONN_CLOSE,
 	CM_DATA_MSG,
 	CM_CONN_NACK,
+	CM_CREDIT,
 };
 
 struct rio_ch_base_bhdr {
@@ -143,7 +158,12 @@ struct rio_ch_chan_hdr {
 	u16 dst_ch;
 	u16 src_ch;
 	u16 msg_len;
-	u16 rsrvd;
+	/*
+	 * Flow control: receive window of the sender in CONN_REQ/CONN_ACK,
+	 * number of returned credits in CM_CREDIT. Peers that do not support
+	 * flow control leave it zero.
+	 */
+	u16 credits;
 } __attribute__((__packed__));
 
 struct tx_req {
@@ -153,14 +173,26 @@ struct tx_req {
 	size_t		 len;
 };
 
-struct cm_dev {
-	struct list_head	list;
-	struct rio_mport	*mport;
+/*
+ * Inbound mailbox context. Each mailbox has its own buffer ring and work
+ * item, so mailboxes are served in parallel while messages received through
+ * one mailbox are always processed in order.
+ */
+struct cm_rx_mbox {
+	struct cm_dev		*cm;
+	int			mbox;
 	void			*rx_buf[RIOCM_RX_RING_SIZE];
 	int			rx_slots;
 	struct mutex		rx_lock;
+	struct work_struct	rx_work;
+};
+
+struct cm_dev {
+	struct list_head	list;
+	struct rio_mport	*mport;
+	struct cm_rx_mbox	rx[RIO_MAX_MBOX];
+	int			rx_mbox_num;
 
-	void			*tx_buf[RIOCM_TX_RING_SIZE];
 	int			tx_slot;
 	int			tx_cnt;
 	int			tx_ack_slot;
@@ -172,17 +204,49 @@ struct cm_dev {
 	struct workqueue_struct *rx_wq;
 };
 
+/*
+ * Channel RX ring is a single-producer/single-consumer queue:
+ * head is advanced only by the RX worker, tail only by the receiver
+ * (receivers are serialized by the channel lock). Indexes are
+ * free-running and masked on access.
+ */
 struct chan_rx_ring {
-	void	*buf[RIOCM_RX_RING_SIZE];
-	int	head;
-	int	tail;
-	int	count;
+	void		**buf;
+	unsigned int	size;	/* power of two, also the receive window */
+	unsigned int	head;
+	unsigned int	tail;
 
 	/* Tracking RX buffers reported to upper level */
-	void	*inuse[RIOCM_RX_RING_SIZE];
+	void	**inuse;
 	int	inuse_cnt;
 };
 
+/*
+ * Channel rings shared with user space. The object is referenced by the
+ * channel and by the ring file, the shared area is released with the last
+ * reference.
+ */
+struct riocm_uring {
+	struct kref		ref;
+	u16			ch_id;
+	u32			entries;
+	void			*area;	/* vmalloc_user() shared area */
+	size_t			size;
+	struct rio_cm_ring	*rx;
+	struct rio_cm_ring	*tx;
+	struct rio_cm_ring_desc	*rx_desc;
+	struct rio_cm_ring_desc	*tx_desc;
+	void			*rx_buf;
+	void			*tx_buf;
+	u32			rx_head; /* RX producer index, kernel copy */
+	u32			tx_tail; /* TX consumer index, kernel copy */
+	u32			rx_credited; /* RX tail already credited */
+	u32			rx_debt; /* credits withheld to fit the ring */
+	struct mutex		tx_lock;
+	wait_queue_head_t	wq;
+	bool			dead;	/* channel has been released */
+};
+
 struct rio_channel {
 	u16			id;	/* local channel ID */
 	struct kref		ref;	/* channel refcount */
@@ -196,11 +260,20 @@ struct rio_channel {
 	u32			loc_destid;	/* local destID */
 	u32			rem_destid;	/* remote destID */
 	u16			rem_channel;	/* remote channel ID */
+	u8			rem_mbox;	/* remote channel RX mailbox */
 	struct list_head	accept_queue;
 	struct list_head	ch_node;
 	struct completion	comp;
 	struct completion	comp_close;
 	struct chan_rx_ring	rx_ring;
+	unsigned int		rx_credits;	/* freed, not yet returned */
+	u16			tx_window;	/* peer window, 0 = no FC */
+	atomic_t		tx_credits;
+	wait_queue_head_t	tx_wq;
+	void			*tx_pool[RIOCM_TX_POOL_SIZE];
+	int			tx_pool_cnt;
+	struct riocm_uring __rcu *uring;
+	struct rcu_head		rcu;
 };
 
 struct cm_peer {
@@ -208,16 +281,12 @@ struct cm_peer {
 	struct rio_dev *rdev;
 };
 
-struct rio_cm_work {
-	struct work_struct work;
-	struct cm_dev *cm;
-	void *data;
-};
-
 struct conn_req {
 	struct list_head node;
 	u32 destid;	/* requester destID */
 	u16 chan;	/* requester channel ID */
+	u16 window;	/* requester receive window */
+	u8 mbox;	/* requester channel RX mailbox */
 	struct cm_dev *cmdev;
 };
 
@@ -231,13 +300,14 @@ struct channel_dev {
 	struct device	*dev;
 };
 
-static struct rio_channel *riocm_ch_alloc(u16 ch_num);
+static struct rio_channel *riocm_ch_alloc(u16 ch_num, unsigned int rx_size);
 static void riocm_ch_free(struct kref *ref);
 static int riocm_post_send(struct cm_dev *cm, struct rio_dev *rdev,
 			   void *buffer, size_t len);
 static int riocm_ch_close(struct rio_channel *ch);
 static int riocm_queue_req(struct cm_dev *cm, struct rio_dev *rdev,
 			   void *buffer, size_t len);
+static int riocm_uring_tx(struct riocm_uring *ur);
 
 static DEFINE_SPINLOCK(idr_lock);
 static DEFINE_IDR(ch_idr);
@@ -296,11 +366,11 @@ static struct rio_channel *riocm_get_channel(u16 nr)
 {
 	struct rio_channel *ch;
 
-	spin_lock_bh(&idr_lock);
+	rcu_read_lock();
 	ch = idr_find(&ch_idr, nr);
-	if (ch)
-		kref_get(&ch->ref);
-	spin_unlock_bh(&idr_lock);
+	if (ch && !kref_get_unless_zero(&ch->ref))
+		ch = NULL;
+	rcu_read_unlock();
 	return ch;
 }
 
@@ -309,18 +379,18 @@ static void riocm_put_channel(struct rio_channel *ch)
 	kref_put(&ch->ref, riocm_ch_free);
 }
 
-static void *riocm_rx_get_msg(struct cm_dev *cm)
+static void *riocm_rx_get_msg(struct cm_rx_mbox *rx)
 {
 	void *msg;
 	int i;
 	int msg_sz;
 
-	msg = rio_get_inb_message(cm->mport, cmbox, &msg_sz);
+	msg = rio_get_inb_message(rx->cm->mport, rx->mbox, &msg_sz);
 	if (msg) {
 		for (i = 0; i < RIOCM_RX_RING_SIZE; i++) {
-			if (cm->rx_buf[i] == msg) {
-				cm->rx_buf[i] = NULL;
-				cm->rx_slots++;
+			if (rx->rx_buf[i] == msg) {
+				rx->rx_buf[i] = NULL;
+				rx->rx_slots++;
 				break;
 			}
 		}
@@ -333,49 +403,84 @@ static void *riocm_rx_get_msg(struct cm_dev *cm)
 }
 
 /*
- * riocm_rx_fill - fills a ring of receive buffers for given cm device
- * @cm: cm_dev object
+ * riocm_rx_fill - fills a ring of receive buffers for given inbound mailbox
+ * @rx: inbound mailbox context
  * @nent: max number of entries to fill
  *
  * Returns: none
  */
-static void riocm_rx_fill(struct cm_dev *cm, int nent)
+static void riocm_rx_fill(struct cm_rx_mbox *rx, int nent)
 {
 	int i;
 
-	if (cm->rx_slots == 0)
+	if (rx->rx_slots == 0)
 		return;
 
-	for (i = 0; i < RIOCM_RX_RING_SIZE && cm->rx_slots && nent; i++) {
-		if (cm->rx_buf[i] == NULL) {
-			cm->rx_buf[i] = kmalloc(RIO_MAX_MSG_SIZE, GFP_KERNEL);
-			if (cm->rx_buf[i] == NULL)
+	for (i = 0; i < RIOCM_RX_RING_SIZE && rx->rx_slots && nent; i++) {
+		if (rx->rx_buf[i] == NULL) {
+			rx->rx_buf[i] = kmalloc(RIO_MAX_MSG_SIZE, GFP_KERNEL);
+			if (rx->rx_buf[i] == NULL)
+				break;
+			if (rio_add_inb_buffer(rx->cm->mport, rx->mbox,
+					       rx->rx_buf[i])) {
+				kfree(rx->rx_buf[i]);
+				rx->rx_buf[i] = NULL;
 				break;
-			rio_add_inb_buffer(cm->mport, cmbox, cm->rx_buf[i]);
-			cm->rx_slots--;
+			}
+			rx->rx_slots--;
 			nent--;
 		}
 	}
 }
 
 /*
- * riocm_rx_free - frees all receive buffers associated with given cm device
- * @cm: cm_dev object
+ * riocm_rx_free - frees all receive buffers associated with given mailbox
+ * @rx: inbound mailbox context
  *
  * Returns: none
  */
-static void riocm_rx_free(struct cm_dev *cm)
+static void riocm_rx_free(struct cm_rx_mbox *rx)
 {
 	int i;
 
 	for (i = 0; i < RIOCM_RX_RING_SIZE; i++) {
-		if (cm->rx_buf[i] != NULL) {
-			kfree(cm->rx_buf[i]);
-			cm->rx_buf[i] = NULL;
+		if (rx->rx_buf[i] != NULL) {
+			kfree(rx->rx_buf[i]);
+			rx->rx_buf[i] = NULL;
 		}
 	}
 }
 
+/*
+ * riocm_ch_mbox - returns inbound mailbox serving the specified channel
+ * @cm: cm_dev object
+ * @ch_id: local channel ID
+ *
+ * All messages addressed to a channel are steered into the same mailbox
+ * to preserve their order. The mailbox is announced to the remote side in
+ * src_mbox of CONN_REQ/CONN_ACK, so nodes may use different numbers of
+ * inbound mailboxes. Packets that do not belong to a connected channel
+ * are sent to cmbox.
+ */
+static inline int riocm_ch_mbox(struct cm_dev *cm, u16 ch_id)
+{
+	return cmbox + ch_id % cm->rx_mbox_num;
+}
+
+/* Remote channel RX mailbox announced in CONN_REQ/CONN_ACK header */
+static inline u8 riocm_rem_mbox(struct rio_ch_chan_hdr *hdr)
+{
+	return hdr->bhdr.src_mbox < RIO_MAX_MBOX ? hdr->bhdr.src_mbox : cmbox;
+}
+
+/* Destination mailbox for an outbound packet, based on its channel header */
+static inline int riocm_dst_mbox(void *buffer)
+{
+	struct rio_ch_chan_hdr *hdr = buffer;
+
+	return hdr->bhdr.dst_mbox;
+}
+
 static int riocm_send_nack(struct cm_dev *cm, u32 rdestid, u16 rchan, u16 lchan)
 {
 	struct rio_ch_chan_hdr *hdr;
@@ -431,6 +536,117 @@ static int riocm_send_nack(struct cm_dev *cm, u32 rdestid, u16 rchan, u16 lchan)
 	return ret;
 }
 
+static int riocm_send_credit(struct rio_channel *ch, unsigned int credits)
+{
+	struct rio_ch_chan_hdr *hdr;
+	int ret;
+
+	if (!riocm_cmp(ch, RIO_CM_CONNECTED))
+		return 0;
+
+	hdr = kzalloc(sizeof(*hdr), GFP_KERNEL);
+	if (hdr == NULL)
+		return -ENOMEM;
+
+	hdr->bhdr.src_id = htonl(ch->loc_destid);
+	hdr->bhdr.dst_id = htonl(ch->rem_destid);
+	hdr->dst_ch = htons(ch->rem_channel);
+	hdr->src_ch = htons(ch->id);
+	hdr->bhdr.src_mbox = riocm_ch_mbox(ch->cmdev, ch->id);
+	hdr->bhdr.dst_mbox = ch->rem_mbox;
+	hdr->bhdr.type = RIO_CM_CHAN;
+	hdr->ch_op = CM_CREDIT;
+	hdr->credits = htons((u16)credits);
+	riocm_debug(TX, "ch_%d returning %u credits to did_%d(%d)",
+		    ch->id, credits, ch->rem_destid, ch->rem_channel);
+
+	/* ATTN: relies on add_outb_message() copying the TX data */
+	ret = riocm_post_send(ch->cmdev, ch->rdev, hdr, sizeof(*hdr));
+
+	if (ret == -EBUSY && !riocm_queue_req(ch->cmdev,
+					      ch->rdev, hdr, sizeof(*hdr)))
+		return 0;
+	kfree(hdr);
+
+	if (ret)
+		riocm_debug(TX, "ch_%d send CREDIT failed (ret=%d)",
+			    ch->id, ret);
+	return ret;
+}
+
+/*
+ * riocm_ch_ret_credits - returns credits for freed RX buffers to the sender
+ * @ch: channel object
+ * @force: return all pending credits, otherwise they are batched until
+ *         a quarter of the receive window is available
+ *
+ * Credits which could not be sent are kept and returned with the next batch.
+ */
+static void riocm_ch_ret_credits(struct rio_channel *ch, bool force)
+{
+	unsigned int credits = 0;
+
+	if (!ch->tx_window)
+		return;
+
+	spin_lock_bh(&ch->lock);
+	if (ch->rx_credits &&
+	    (force || ch->rx_credits >= ch->rx_ring.size / 4)) {
+		credits = ch->rx_credits;
+		ch->rx_credits = 0;
+	}
+	spin_unlock_bh(&ch->lock);
+
+	if (credits && riocm_send_credit(ch, credits)) {
+		spin_lock_bh(&ch->lock);
+		ch->rx_credits += credits;
+		spin_unlock_bh(&ch->lock);
+	}
+}
+
+/*
+ * riocm_uring_consumed - credits entries released from the shared RX ring
+ * @ch: channel object
+ * @ur: channel rings object
+ *
+ * Must be called with channel lock held.
+ * Returns: true if user space has emptied the ring.
+ */
+static bool riocm_uring_consumed(struct rio_channel *ch,
+				 struct riocm_uring *ur)
+{
+	u32 tail = ur->rx->tail;
+	u32 head = ur->rx_head;
+	u32 credits, held;
+
+	credits = tail - ur->rx_credited;
+	/* Tail is controlled by user space, ignore bogus values */
+	if (credits > head - ur->rx_credited)
+		return false;
+
+	ur->rx_credited = tail;
+	held = min(credits, ur->rx_debt);
+	ur->rx_debt -= held;
+	ch->rx_credits += credits - held;
+
+	return tail == head;
+}
+
+static void riocm_uring_ret_credits(struct rio_channel *ch,
+				    struct riocm_uring *ur)
+{
+	bool empty;
+
+	if (!ch->tx_window)
+		return;
+
+	spin_lock_bh(&ch->lock);
+	empty = riocm_uring_consumed(ch, ur);
+	spin_unlock_bh(&ch->lock);
+
+	riocm_ch_ret_credits(ch, empty);
+}
+
 /*
  * riocm_req_handler - connection request handler
  * @cm: cm_dev object
@@ -475,6 +691,8 @@ static int riocm_req_handler(struct cm_dev *cm, void *req_data)
 
 	req->destid = ntohl(hh->bhdr.src_id);
 	req->chan = ntohs(hh->src_ch);
+	req->window = ntohs(hh->credits);
+	req->mbox = riocm_rem_mbox(hh);
 	req->cmdev = cm;
 
 	spin_lock_bh(&ch->lock);
@@ -516,8 +734,12 @@ static int riocm_resp_handler(void *resp_data)
 	}
 
 	if (hh->ch_op == CM_CONN_ACK) {
-		riocm_exch(ch, RIO_CM_CONNECTED);
+		/* Peer's window must be known before data can be sent */
+		ch->tx_window = ntohs(hh->credits);
+		atomic_set(&ch->tx_credits, ch->tx_window);
 		ch->rem_channel = ntohs(hh->src_ch);
+		ch->rem_mbox = riocm_rem_mbox(hh);
+		riocm_exch(ch, RIO_CM_CONNECTED);
 	}
 	complete(&ch->comp);
 	riocm_put_channel(ch);
@@ -559,6 +781,50 @@ static int riocm_close_handler(void *data)
 	return 0;
 }
 
+/*
+ * riocm_credit_handler - credit return handler
+ * @data: pointer to the credit packet
+ *
+ * Returns: 0 if success, or
+ *          -ENODEV if cannot find a channel with specified ID,
+ *          -EINVAL if channel is not connected or does not use flow control.
+ */
+static int riocm_credit_handler(void *data)
+{
+	struct rio_channel *ch;
+	struct rio_ch_chan_hdr *hh = data;
+	struct riocm_uring *ur;
+
+	ch = riocm_get_channel(ntohs(hh->dst_ch));
+	if (!ch)
+		return -ENODEV;
+
+	if (!ch->tx_window || !riocm_cmp(ch, RIO_CM_CONNECTED) ||
+	    ntohs(hh->src_ch) != ch->rem_channel) {
+		riocm_put_channel(ch);
+		return -EINVAL;
+	}
+
+	riocm_debug(RX_CMD, "ch_%d got %d credits", ch->id, ntohs(hh->credits));
+	atomic_add(ntohs(hh->credits), &ch->tx_credits);
+	wake_up_all(&ch->tx_wq);
+
+	/* Resume sending entries left in the shared TX ring */
+	rcu_read_lock();
+	ur = rcu_dereference(ch->uring);
+	if (ur)
+		kref_get(&ur->ref);
+	rcu_read_unlock();
+	if (ur) {
+		if (ur->tx->head != ur->tx_tail)
+			riocm_uring_tx(ur);
+		riocm_uring_put(ur);
+	}
+
+	riocm_put_channel(ch);
+	return 0;
+}
+
 /*
  * rio_cm_handler - function that services request (non-data) packets
  * @cm: cm_dev object
@@ -588,6 +854,9 @@ static void rio_cm_handler(struct cm_dev *cm, void *data)
 	case CM_CONN_CLOSE:
 		riocm_close_handler(data);
 		break;
+	case CM_CREDIT:
+		riocm_credit_handler(data);
+		break;
 	default:
 		riocm_error("Invalid packet header");
 		break;
@@ -596,9 +865,54 @@ out:
 	kfree(data);
 }
 
+static void riocm_uring_release(struct kref *ref)
+{
+	struct riocm_uring *ur = container_of(ref, struct riocm_uring, ref);
+
+	vfree(ur->area);
+	kfree(ur);
+}
+
+static void riocm_uring_put(struct riocm_uring *ur)
+{
+	kref_put(&ur->ref, riocm_uring_release);
+}
+
+/*
+ * riocm_uring_rx - places received data packet into channel's shared RX ring
+ * @ur: channel rings object
+ * @buf: packet buffer
+ * @len: packet length
+ *
+ * Called only from the channel's RX mailbox worker (single producer).
+ * Returns: true if the packet has been queued, false if the ring is full.
+ */
+static bool riocm_uring_rx(struct riocm_uring *ur, void *buf, u32 len)
+{
+	u32 head = ur->rx_head;
+	u32 tail = ur->rx->tail;
+	u32 slot;
+
+	smp_rmb(); /* read consumer index before reusing its slot */
+
+	/* Tail is controlled by user space, treat bogus values as full */
+	if (head - tail >= ur->entries)
+		return false;
+
+	slot = head & (ur->entries - 1);
+	memcpy(ur->rx_buf + slot * RIO_MAX_MSG_SIZE, buf, len);
+	ur->rx_desc[slot].len = len;
+	smp_wmb(); /* publish entry before moving head */
+	ur->rx_head = head + 1;
+	ur->rx->head = ur->rx_head;
+
+	wake_up_interruptible(&ur->wq);
+	return true;
+}
+
 /*
  * rio_rx_data_handler - received data packet handler
- * @cm: cm_dev object
+ * @rx: RX mailbox object the packet came from
  * @buf: data packet
  *
  * Returns: 0 if success, or
@@ -606,15 +920,31 @@ out:
  *          -EIO if channel is not in CONNECTED state,
  *          -ENOMEM if channel RX queue is full (packet discarded)
  */
-static int rio_rx_data_handler(struct cm_dev *cm, void *buf)
+static int rio_rx_data_handler(struct cm_rx_mbox *rx, void *buf)
 {
 	struct rio_ch_chan_hdr *hdr;
 	struct rio_channel *ch;
+	struct riocm_uring *ur;
+	unsigned int head, tail;
+	bool queued = false;
 
 	hdr = buf;
 
 	riocm_debug(RX_DATA, "for ch=%d", ntohs(hdr->dst_ch));
 
+	if (riocm_ch_mbox(rx->cm, ntohs(hdr->dst_ch)) != rx->mbox) {
+		/*
+		 * Channel RX ring accepts data from its own mailbox only,
+		 * this keeps a single producer per ring. The sender has not
+		 * used the mailbox announced in CONN_REQ/CONN_ACK.
+		 */
+		pr_warn_ratelimited(DRV_NAME
+			": ch=%d data from did_%d on wrong mbox %d dropped\n",
+			ntohs(hdr->dst_ch), ntohl(hdr->bhdr.src_id), rx->mbox);
+		kfree(buf);
+		return -EINVAL;
+	}
+
 	ch = riocm_get_channel(ntohs(hdr->dst_ch));
 	if (!ch) {
 		/* Discard data message for non-existing channel */
@@ -622,39 +952,77 @@ static int rio_rx_data_handler(struct cm_dev *cm, void *buf)
 		return -ENODEV;
 	}
 
-	/* Place pointer to the buffer into channel's RX queue */
-	spin_lock(&ch->lock);
-
+	/*
+	 * Place pointer to the buffer into channel's RX queue.
+	 * This is the only producer for the ring, so no lock is taken here.
+	 * Held reference keeps the ring alive until we are done with it.
+	 */
 	if (ch->state != RIO_CM_CONNECTED) {
 		/* Channel is not ready to receive data, discard a packet */
 		riocm_debug(RX_DATA, "ch=%d is in wrong state=%d",
 			    ch->id, ch->state);
-		spin_unlock(&ch->lock);
 		kfree(buf);
 		riocm_put_channel(ch);
 		return -EIO;
 	}
 
-	if (ch->rx_ring.count == RIOCM_RX_RING_SIZE) {
+	/* If RX ring is mapped by user space, copy the packet into it */
+	rcu_read_lock();
+	ur = rcu_dereference(ch->uring);
+	if (ur) {
+		queued = riocm_uring_rx(ur, buf,
+				min_t(u32, ntohs(hdr->msg_len),
+				      RIO_MAX_MSG_SIZE));
+		/* Ring may be detached once we leave the read section */
+		kref_get(&ur->ref);
+	}
+	rcu_read_unlock();
+
+	if (ur) {
+		kfree(buf);
+		if (queued)
+			riocm_uring_ret_credits(ch, ur);
+		riocm_uring_put(ur);
+		if (!queued) {
+			riocm_debug(RX_DATA, "ch=%d shared ring is full",
+				    ch->id);
+			goto drop_credit;
+		}
+		riocm_put_channel(ch);
+		return 0;
+	}
+
+	head = ch->rx_ring.head;
+	tail = ch->rx_ring.tail;
+	smp_rmb(); /* read tail before checking the slot it released */
+
+	if (head - tail >= ch->rx_ring.size) {
 		/* If RX ring is full, discard a packet */
 		riocm_debug(RX_DATA, "ch=%d is full", ch->id);
-		spin_unlock(&ch->lock);
 		kfree(buf);
-		riocm_put_channel(ch);
-		return -ENOMEM;
+		goto drop_credit;
 	}
 
-	ch->rx_ring.buf[ch->rx_ring.head] = buf;
-	ch->rx_ring.head++;
-	ch->rx_ring.count++;
-	ch->rx_ring.head %= RIOCM_RX_RING_SIZE;
+	ch->rx_ring.buf[head & (ch->rx_ring.size - 1)] = buf;
+	smp_wmb(); /* publish buffer pointer before moving head */
+	ch->rx_ring.head = head + 1;
 
 	complete(&ch->comp);
 
-	spin_unlock(&ch->lock);
 	riocm_put_channel(ch);
 
 	return 0;
+
+drop_credit:
+	/* Sender has used a credit for the dropped packet, give it back */
+	if (ch->tx_window) {
+		spin_lock_bh(&ch->lock);
+		ch->rx_credits++;
+		spin_unlock_bh(&ch->lock);
+		riocm_ch_ret_credits(ch, false);
+	}
+	riocm_put_channel(ch);
+	return -ENOMEM;
 }
 
 /*
@@ -662,24 +1030,20 @@ static int rio_rx_data_handler(struct cm_dev *cm, void *buf)
  */
 static void rio_ibmsg_handler(struct work_struct *work)
 {
-	struct rio_cm_work *rx_work;
-	struct cm_dev *cm;
+	struct cm_rx_mbox *rx = container_of(work, struct cm_rx_mbox, rx_work);
+	struct cm_dev *cm = rx->cm;
 	void *data;
 	struct rio_ch_chan_hdr *hdr;
 
-	rx_work = container_of(work, struct rio_cm_work, work);
-	cm = rx_work->cm;
-	kfree(rx_work);
-
 	if (!rio_mport_is_running(cm->mport))
 		return;
 
 	while (1) {
-		mutex_lock(&cm->rx_lock);
-		data = riocm_rx_get_msg(cm);
+		mutex_lock(&rx->rx_lock);
+		data = riocm_rx_get_msg(rx);
 		if (data)
-			riocm_rx_fill(cm, 1);
-		mutex_unlock(&cm->rx_lock);
+			riocm_rx_fill(rx, 1);
+		mutex_unlock(&rx->rx_lock);
 
 		if (data == NULL)
 			break;
@@ -696,7 +1060,7 @@ static void rio_ibmsg_handler(struct work_struct *work)
 
 		/* Process a channel message */
 		if (hdr->ch_op == CM_DATA_MSG)
-			rio_rx_data_handler(cm, data);
+			rio_rx_data_handler(rx, data);
 		else
 			rio_cm_handler(cm, data);
 	}
@@ -705,17 +1069,65 @@ static void rio_ibmsg_handler(struct work_struct *work)
 static void riocm_inb_msg_event(struct rio_mport *mport, void *dev_id,
 				int mbox, int slot)
 {
-	struct cm_dev *cm = dev_id;
-	struct rio_cm_work *rx_work;
+	struct cm_rx_mbox *rx = dev_id;
 
-	if (!rio_mport_is_running(cm->mport))
+	if (!rio_mport_is_running(mport))
 		return;
-	rx_work = kmalloc(sizeof(*rx_work), GFP_ATOMIC);
-	if (!rx_work)
-		return;
-	INIT_WORK(&rx_work->work, rio_ibmsg_handler);
-	rx_work->cm = cm;
-	queue_work(cm->rx_wq, &rx_work->work);
+
+	/*
+	 * The handler drains the whole inbound queue, so a single
+	 * preallocated work item is enough: if it is already pending
+	 * this event will be served by that run. A work item never runs
+	 * concurrently with itself, which keeps per-mailbox ordering.
+	 */
+	queue_work(rx->cm->rx_wq, &rx->rx_work);
+}
+
+/*
+ * riocm_tx_submit - passes pending requests to the mport in one submission
+ * @cm: cm_dev object
+ * @reqs: array of pending requests removed from tx_reqs list
+ * @num: number of requests in @reqs
+ *
+ * TX ring slots of all @reqs must be taken by the caller. Message data is
+ * copied by the mport, requests it has taken are freed here. Slots of the
+ * others are released and the requests are put back to the head of
+ * tx_reqs list in their original order.
+ * Must be called with cm->tx_lock held.
+ * Returns: number of requests taken by the mport.
+ */
+static int riocm_tx_submit(struct cm_dev *cm, struct tx_req **reqs, int num)
+{
+	struct rio_outb_msg msgs[RIOCM_TX_BATCH];
+	int i, rc;
+
+	for (i = 0; i < num; i++) {
+		msgs[i].rdev = reqs[i]->rdev;
+		msgs[i].dmbox = riocm_dst_mbox(reqs[i]->buffer);
+		msgs[i].buffer = reqs[i]->buffer;
+		msgs[i].sgl = NULL;
+		msgs[i].nents = 0;
+		msgs[i].len = reqs[i]->len;
+	}
+
+	rc = rio_add_outb_messages(cm->mport, cmbox, msgs, num);
+	if (rc < 0)
+		rc = 0;
+
+	for (i = 0; i < rc; i++) {
+		kfree(reqs[i]->buffer);
+		kfree(reqs[i]);
+	}
+
+	for (i = num - 1; i >= rc; i--) {
+		list_add(&reqs[i]->node, &cm->tx_reqs);
+		cm->tx_cnt--;
+		cm->tx_slot = (cm->tx_slot - 1) & (RIOCM_TX_RING_SIZE - 1);
+	}
+
+	if (rc < num)
+		riocm_debug(TX, "mport took %d of %d requests", rc, num);
+	return rc;
 }
 
 /*
@@ -746,8 +1158,6 @@ static void rio_txcq_handler(struct cm_dev *cm, int slot)
 
 	while (cm->tx_cnt && ((ack_slot != slot) ||
 	       (cm->tx_cnt == RIOCM_TX_RING_SIZE))) {
-
-		cm->tx_buf[ack_slot] = NULL;
 		++ack_slot;
 		ack_slot &= (RIOCM_TX_RING_SIZE - 1);
 		cm->tx_cnt--;
@@ -763,24 +1173,27 @@ static void rio_txcq_handler(struct cm_dev *cm, int slot)
 	/*
 	 * If there are pending requests, insert them into transmit queue
 	 */
-	if (!list_empty(&cm->tx_reqs) && (cm->tx_cnt < RIOCM_TX_RING_SIZE)) {
+	while (!list_empty(&cm->tx_reqs) && (cm->tx_cnt < RIOCM_TX_RING_SIZE)) {
 		struct tx_req *req, *_req;
-		int rc;
+		struct tx_req *batch[RIOCM_TX_BATCH];
+		int n = 0;
 
 		list_for_each_entry_safe(req, _req, &cm->tx_reqs, node) {
 			list_del(&req->node);
-			cm->tx_buf[cm->tx_slot] = req->buffer;
-			rc = rio_add_outb_message(cm->mport, req->rdev, cmbox,
-						  req->buffer, req->len);
-			kfree(req->buffer);
-			kfree(req);
+			batch[n++] = req;
 
 			++cm->tx_cnt;
 			++cm->tx_slot;
 			cm->tx_slot &= (RIOCM_TX_RING_SIZE - 1);
-			if (cm->tx_cnt == RIOCM_TX_RING_SIZE)
+
+			if (n == RIOCM_TX_BATCH ||
+			    cm->tx_cnt == RIOCM_TX_RING_SIZE)
 				break;
 		}
+
+		/* Retry requests the mport did not take on next completion */
+		if (riocm_tx_submit(cm, batch, n) < n)
+			break;
 	}
 
 	spin_unlock(&cm->tx_lock);
@@ -828,9 +1241,17 @@ static int riocm_queue_req(struct cm_dev *cm, struct rio_dev *rdev,
 static int riocm_post_send(struct cm_dev *cm, struct rio_dev *rdev,
 			   void *buffer, size_t len)
 {
+	struct rio_outb_msg msg;
 	int rc;
 	unsigned long flags;
 
+	msg.rdev = rdev;
+	msg.dmbox = riocm_dst_mbox(buffer);
+	msg.buffer = buffer;
+	msg.sgl = NULL;
+	msg.nents = 0;
+	msg.len = len;
+
 	spin_lock_irqsave(&cm->tx_lock, flags);
 
 	if (cm->mport == NULL) {
@@ -844,8 +1265,13 @@ static int riocm_post_send(struct cm_dev *cm, struct rio_dev *rdev,
 		goto err_out;
 	}
 
-	cm->tx_buf[cm->tx_slot] = buffer;
-	rc = rio_add_outb_message(cm->mport, rdev, cmbox, buffer, len);
+	rc = rio_add_outb_messages(cm->mport, cmbox, &msg, 1);
+	if (rc <= 0) {
+		/* Message not taken by the mport can be queued by caller */
+		rc = rc ? rc : -EBUSY;
+		goto err_out;
+	}
+	rc = 0;
 
 	riocm_debug(TX, "Add buf@%p destid=%x tx_slot=%d tx_cnt=%d",
 		 buffer, rdev->destid, cm->tx_slot, cm->tx_cnt);
@@ -860,39 +1286,61 @@ err_out:
 }
 
 /*
- * riocm_ch_send - sends a data packet to a remote device
- * @ch_id: local channel ID
+ * riocm_ch_get_credit - takes a TX credit of a flow controlled channel
+ * @ch: channel object
+ * @timeout: time to wait for a credit (in jiffies), 0 = do not wait
+ *
+ * Returns: 0 if success, or
+ *          -EAGAIN if no credit is available and timeout is 0,
+ *          -ETIME if wait timeout expired,
+ *          -EINTR if wait was interrupted,
+ *          -ECONNRESET if the channel has been disconnected.
+ */
+static int riocm_ch_get_credit(struct rio_channel *ch, long timeout)
+{
+	long wret;
+
+	if (!ch->tx_window || atomic_dec_if_positive(&ch->tx_credits) >= 0)
+		return 0;
+	if (!timeout)
+		return -EAGAIN;
+
+	wret = wait_event_interruptible_timeout(ch->tx_wq,
+			atomic_dec_if_positive(&ch->tx_credits) >= 0 ||
+			!riocm_cmp(ch, RIO_CM_CONNECTED), timeout);
+
+	riocm_debug(WAIT, "credit wait on %d returned %ld", ch->id, wret);
+
+	if (!wret)
+		return -ETIME;
+	if (wret == -ERESTARTSYS)
+		return -EINTR;
+	return riocm_cmp(ch, RIO_CM_CONNECTED) ? 0 : -ECONNRESET;
+}
+
+/*
+ * __riocm_ch_send - sends a data packet through referenced channel
+ * @ch: channel object (caller holds a reference)
  * @buf: pointer to a data buffer to send (including CM header)
  * @len: length of data to transfer (including CM header)
+ * @timeout: time to wait for a TX credit (in jiffies), 0 = do not wait
  *
- * ATTN: ASSUMES THAT THE HEADER SPACE IS RESERVED PART OF THE DATA PACKET
- *
- * Returns: 0 if success, or
- *          -EINVAL if one or more input parameters is/are not valid,
- *          -ENODEV if cannot find a channel with specified ID,
- *          -EAGAIN if a channel is not in CONNECTED state,
- *	    + error codes returned by HW send routine.
+ * Returns: 0 if success, -EAGAIN if a channel is not in CONNECTED state
+ *          or is out of credits, error code of riocm_ch_get_credit(),
+ *          or error code returned by HW send routine.
  */
-static int riocm_ch_send(u16 ch_id, void *buf, int len)
+static int __riocm_ch_send(struct rio_channel *ch, void *buf, int len,
+			   long timeout)
 {
-	struct rio_channel *ch;
 	struct rio_ch_chan_hdr *hdr;
 	int ret;
 
-	if (buf == NULL || ch_id == 0 || len == 0 || len > RIO_MAX_MSG_SIZE)
-		return -EINVAL;
-
-	ch = riocm_get_channel(ch_id);
-	if (!ch) {
-		riocm_error("%s(%d) ch_%d not found", current->comm,
-			    task_pid_nr(current), ch_id);
-		return -ENODEV;
-	}
+	if (!riocm_cmp(ch, RIO_CM_CONNECTED))
+		return -EAGAIN;
 
-	if (!riocm_cmp(ch, RIO_CM_CONNECTED)) {
-		ret = -EAGAIN;
-		goto err_out;
-	}
+	ret = riocm_ch_get_credit(ch, timeout);
+	if (ret)
+		return ret;
 
 	/*
 	 * Fill buffer header section with corresponding channel data
@@ -901,13 +1349,14 @@ static int riocm_ch_send(u16 ch_id, void *buf, int len)
 
 	hdr->bhdr.src_id = htonl(ch->loc_destid);
 	hdr->bhdr.dst_id = htonl(ch->rem_destid);
-	hdr->bhdr.src_mbox = cmbox;
-	hdr->bhdr.dst_mbox = cmbox;
+	hdr->bhdr.src_mbox = riocm_ch_mbox(ch->cmdev, ch->id);
+	hdr->bhdr.dst_mbox = ch->rem_mbox;
 	hdr->bhdr.type = RIO_CM_CHAN;
 	hdr->ch_op = CM_DATA_MSG;
 	hdr->dst_ch = htons(ch->rem_channel);
 	hdr->src_ch = htons(ch->id);
 	hdr->msg_len = htons((u16)len);
+	hdr->credits = 0;
 
 	/* ATTN: the function call below relies on the fact that underlying
 	 * HW-specific add_outb_message() routine copies TX data into its own
@@ -916,23 +1365,106 @@ static int riocm_ch_send(u16 ch_id, void *buf, int len)
 	 */
 
 	ret = riocm_post_send(ch->cmdev, ch->rdev, buf, len);
-	if (ret)
+	if (ret) {
 		riocm_debug(TX, "ch %d send_err=%d", ch->id, ret);
-err_out:
-	riocm_put_channel(ch);
+		if (ch->tx_window)
+			atomic_inc(&ch->tx_credits);
+	}
 	return ret;
 }
 
-static int riocm_ch_free_rxbuf(struct rio_channel *ch, void *buf)
-{
-	int i, ret = -EINVAL;
-
-	spin_lock_bh(&ch->lock);
-
-	for (i = 0; i < RIOCM_RX_RING_SIZE; i++) {
+/*
+ * riocm_ch_send - sends a data packet to a remote device
+ * @ch_id: local channel ID
+ * @buf: pointer to a data buffer to send (including CM header)
+ * @len: length of data to transfer (including CM header)
+ * @timeout: time to wait for a TX credit (in jiffies), 0 = do not wait
+ *
+ * ATTN: ASSUMES THAT THE HEADER SPACE IS RESERVED PART OF THE DATA PACKET
+ *
+ * Returns: 0 if success, or
+ *          -EINVAL if one or more input parameters is/are not valid,
+ *          -ENODEV if cannot find a channel with specified ID,
+ *          -EAGAIN if a channel is not in CONNECTED state or has no credits,
+ *	    + error codes returned by __riocm_ch_send().
+ */
+static int riocm_ch_send(u16 ch_id, void *buf, int len, long timeout)
+{
+	struct rio_channel *ch;
+	int ret;
+
+	if (buf == NULL || ch_id == 0 || len == 0 || len > RIO_MAX_MSG_SIZE)
+		return -EINVAL;
+
+	ch = riocm_get_channel(ch_id);
+	if (!ch) {
+		riocm_error("%s(%d) ch_%d not found", current->comm,
+			    task_pid_nr(current), ch_id);
+		return -ENODEV;
+	}
+
+	ret = __riocm_ch_send(ch, buf, len, timeout);
+	riocm_put_channel(ch);
+	return ret;
+}
+
+/*
+ * riocm_ch_get_txbuf - takes a TX buffer from channel's pool
+ * @ch: channel object
+ *
+ * Allocates a new buffer if the pool is empty.
+ */
+static void *riocm_ch_get_txbuf(struct rio_channel *ch)
+{
+	void *buf = NULL;
+
+	spin_lock_bh(&ch->lock);
+	if (ch->tx_pool_cnt)
+		buf = ch->tx_pool[--ch->tx_pool_cnt];
+	spin_unlock_bh(&ch->lock);
+
+	if (!buf)
+		buf = kmalloc(RIO_MAX_MSG_SIZE, GFP_KERNEL);
+	return buf;
+}
+
+/*
+ * riocm_ch_put_txbuf - returns a TX buffer into channel's pool
+ * @ch: channel object
+ * @buf: buffer obtained by riocm_ch_get_txbuf()
+ */
+static void riocm_ch_put_txbuf(struct rio_channel *ch, void *buf)
+{
+	spin_lock_bh(&ch->lock);
+	if (ch->tx_pool_cnt < RIOCM_TX_POOL_SIZE) {
+		ch->tx_pool[ch->tx_pool_cnt++] = buf;
+		buf = NULL;
+	}
+	spin_unlock_bh(&ch->lock);
+
+	kfree(buf);
+}
+
+/*
+ * riocm_ch_free_rxbuf - releases a buffer returned by riocm_ch_receive()
+ * @ch: channel object
+ * @buf: buffer to release
+ *
+ * The freed buffer is credited back to the sender of a flow controlled
+ * channel.
+ */
+static int riocm_ch_free_rxbuf(struct rio_channel *ch, void *buf)
+{
+	int i, ret = -EINVAL;
+
+	spin_lock_bh(&ch->lock);
+
+	for (i = 0; i < ch->rx_ring.size; i++) {
 		if (ch->rx_ring.inuse[i] == buf) {
 			ch->rx_ring.inuse[i] = NULL;
 			ch->rx_ring.inuse_cnt--;
+			if (ch->tx_window)
+				ch->rx_credits++;
 			ret = 0;
 			break;
 		}
@@ -940,8 +1472,10 @@ static int riocm_ch_free_rxbuf(struct rio_channel *ch, void *buf)
 
 	spin_unlock_bh(&ch->lock);
 
-	if (!ret)
+	if (!ret) {
 		kfree(buf);
+		riocm_ch_ret_credits(ch, false);
+	}
 
 	return ret;
 }
@@ -961,6 +1495,7 @@ static int riocm_ch_free_rxbuf(struct rio_channel *ch, void *buf)
 static int riocm_ch_receive(struct rio_channel *ch, void **buf, long timeout)
 {
 	void *rxmsg = NULL;
+	unsigned int tail;
 	int i, ret = 0;
 	long wret;
 
@@ -969,7 +1504,7 @@ static int riocm_ch_receive(struct rio_channel *ch, void **buf, long timeout)
 		goto out;
 	}
 
-	if (ch->rx_ring.inuse_cnt == RIOCM_RX_RING_SIZE) {
+	if (ch->rx_ring.inuse_cnt == ch->rx_ring.size) {
 		/* If we do not have entries to track buffers given to upper
 		 * layer, reject request.
 		 */
@@ -977,6 +1512,13 @@ static int riocm_ch_receive(struct rio_channel *ch, void **buf, long timeout)
 		goto out;
 	}
 
+	/*
+	 * Sender may be waiting for credits held back for batching,
+	 * return them before going to sleep.
+	 */
+	if (ch->rx_ring.head == ch->rx_ring.tail)
+		riocm_ch_ret_credits(ch, true);
+
 	wret = wait_for_completion_interruptible_timeout(&ch->comp, timeout);
 
 	riocm_debug(RX_DATA, "wait on %d returned %ld", ch->id, wret);
@@ -991,16 +1533,18 @@ static int riocm_ch_receive(struct rio_channel *ch, void **buf, long timeout)
 	if (ret)
 		goto out;
 
+	/* Channel lock serializes consumers, producer runs lockless */
 	spin_lock_bh(&ch->lock);
 
-	rxmsg = ch->rx_ring.buf[ch->rx_ring.tail];
-	ch->rx_ring.buf[ch->rx_ring.tail] = NULL;
-	ch->rx_ring.count--;
-	ch->rx_ring.tail++;
-	ch->rx_ring.tail %= RIOCM_RX_RING_SIZE;
+	tail = ch->rx_ring.tail;
+	smp_rmb(); /* completion implies head moved, read slot after it */
+	rxmsg = ch->rx_ring.buf[tail & (ch->rx_ring.size - 1)];
+	ch->rx_ring.buf[tail & (ch->rx_ring.size - 1)] = NULL;
+	smp_mb(); /* finish with the slot before releasing it to producer */
+	ch->rx_ring.tail = tail + 1;
 	ret = -ENOMEM;
 
-	for (i = 0; i < RIOCM_RX_RING_SIZE; i++) {
+	for (i = 0; i < ch->rx_ring.size; i++) {
 		if (ch->rx_ring.inuse[i] == NULL) {
 			ch->rx_ring.inuse[i] = rxmsg;
 			ch->rx_ring.inuse_cnt++;
@@ -1013,9 +1557,14 @@ static int riocm_ch_receive(struct rio_channel *ch, void **buf, long timeout)
 		/* We have no entry to store pending message: drop it */
 		kfree(rxmsg);
 		rxmsg = NULL;
+		if (ch->tx_window)
+			ch->rx_credits++;
 	}
 
 	spin_unlock_bh(&ch->lock);
+
+	if (ret)
+		riocm_ch_ret_credits(ch, false);
 out:
 	*buf = rxmsg;
 	return ret;
@@ -1069,12 +1618,13 @@ static int riocm_ch_connect(u16 loc_ch, struct cm_dev *cm,
 
 	hdr->bhdr.src_id = htonl(ch->loc_destid);
 	hdr->bhdr.dst_id = htonl(peer->rdev->destid);
-	hdr->bhdr.src_mbox = cmbox;
+	hdr->bhdr.src_mbox = riocm_ch_mbox(cm, loc_ch);
 	hdr->bhdr.dst_mbox = cmbox;
 	hdr->bhdr.type = RIO_CM_CHAN;
 	hdr->ch_op = CM_CONN_REQ;
 	hdr->dst_ch = htons(rem_ch);
 	hdr->src_ch = htons(loc_ch);
+	hdr->credits = htons((u16)ch->rx_ring.size);
 	riocm_debug(CHOP, "ch_%d sending CONN_REQ to did_%d(%d)",
 		    loc_ch, peer->rdev->destid, rem_ch);
 
@@ -1128,10 +1678,11 @@ static int riocm_send_ack(struct rio_channel *ch)
 	hdr->bhdr.dst_id = htonl(ch->rem_destid);
 	hdr->dst_ch = htons(ch->rem_channel);
 	hdr->src_ch = htons(ch->id);
-	hdr->bhdr.src_mbox = cmbox;
-	hdr->bhdr.dst_mbox = cmbox;
+	hdr->bhdr.src_mbox = riocm_ch_mbox(ch->cmdev, ch->id);
+	hdr->bhdr.dst_mbox = ch->rem_mbox;
 	hdr->bhdr.type = RIO_CM_CHAN;
 	hdr->ch_op = CM_CONN_ACK;
+	hdr->credits = htons((u16)ch->rx_ring.size);
 	riocm_debug(CHOP, "ch_%d sending CONN_ACK to did_%d(%d)",
 		    ch->id, ch->rem_destid, ch->rem_channel);
 
@@ -1225,7 +1776,8 @@ static struct rio_channel *riocm_ch_accept(u16 ch_id, u16 *new_ch_id,
 	}
 
 	/* Create new channel for this connection */
-	new_ch = riocm_ch_alloc(RIOCM_CHNUM_AUTO);
+	/* Accepted channel inherits receive window of the listener */
+	new_ch = riocm_ch_alloc(RIOCM_CHNUM_AUTO, ch->rx_ring.size);
 
 	if (IS_ERR(new_ch)) {
 		riocm_error("failed to get channel for new req (%ld)",
@@ -1242,6 +1794,9 @@ static struct rio_channel *riocm_ch_accept(u16 ch_id, u16 *new_ch_id,
 	new_ch->loc_destid = ch->loc_destid;
 	new_ch->rem_destid = req->destid;
 	new_ch->rem_channel = req->chan;
+	new_ch->rem_mbox = req->mbox;
+	new_ch->tx_window = req->window;
+	atomic_set(&new_ch->tx_credits, req->window);
 
 	spin_unlock_bh(&ch->lock);
 	riocm_put_channel(ch);
@@ -1266,9 +1821,10 @@ static struct rio_channel *riocm_ch_accept(u16 ch_id, u16 *new_ch_id,
 		goto err_put_new_ch;
 	}
 
+	spin_lock_bh(&new_ch->lock);
 	new_ch->rdev = peer->rdev;
 	new_ch->state = RIO_CM_CONNECTED;
-	spin_lock_init(&new_ch->lock);
+	spin_unlock_bh(&new_ch->lock);
 
 	/* Acknowledge the connection request. */
 	riocm_send_ack(new_ch);
@@ -1368,23 +1924,97 @@ exit:
 	return rc;
 }
 
+/*
+ * riocm_ch_set_rx_ring - changes size of a channel RX ring
+ * @ch_id: channel ID
+ * @entries: number of RX ring entries (power of two)
+ *
+ * The ring size is advertised to the peer as a receive window when
+ * connection is established, so it can be changed only before that.
+ * Channels accepted on a listening channel inherit its ring size.
+ *
+ * Returns: 0 if success, or
+ *          -EINVAL if the size is not valid or the specified channel does
+ *                  not exist or is not in IDLE or CHAN_BOUND state,
+ *          -ENOMEM if unable to allocate the ring.
+ */
+static int riocm_ch_set_rx_ring(u16 ch_id, u32 entries)
+{
+	struct rio_channel *ch;
+	void **buf;
+	int ret = 0;
+
+	if (entries < RIOCM_RX_RING_MIN || entries > RIOCM_RX_RING_MAX ||
+	    (entries & (entries - 1)))
+		return -EINVAL;
+
+	ch = riocm_get_channel(ch_id);
+	if (!ch)
+		return -EINVAL;
+
+	buf = kcalloc(2 * entries, sizeof(void *), GFP_KERNEL);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Ring is not used in these states, so it is empty */
+	spin_lock_bh(&ch->lock);
+	if (ch->state == RIO_CM_IDLE || ch->state == RIO_CM_CHAN_BOUND) {
+		swap(ch->rx_ring.buf, buf);
+		ch->rx_ring.inuse = ch->rx_ring.buf + entries;
+		ch->rx_ring.size = entries;
+	} else {
+		ret = -EINVAL;
+	}
+	spin_unlock_bh(&ch->lock);
+
+	kfree(buf);
+out:
+	riocm_put_channel(ch);
+	return ret;
+}
+
 /*
  * riocm_ch_alloc - channel object allocation helper routine
  * @ch_num: channel ID (1 ... RIOCM_MAX_CHNUM, 0 = automatic)
+ * @rx_size: number of RX ring entries (power of two)
  *
  * Return value: pointer to newly created channel object,
  *               or error-valued pointer
  */
-static struct rio_channel *riocm_ch_alloc(u16 ch_num)
+static struct rio_channel *riocm_ch_alloc(u16 ch_num, unsigned int rx_size)
 {
 	int id;
 	int start, end;
 	struct rio_channel *ch;
 
+	/* RX ring indexes are masked, ring size must be a power of two */
+	BUILD_BUG_ON(RIOCM_RX_RING_SIZE & (RIOCM_RX_RING_SIZE - 1));
+
 	ch = kzalloc(sizeof(*ch), GFP_KERNEL);
 	if (!ch)
 		return ERR_PTR(-ENOMEM);
 
+	/* Ring slots and in-use tracking entries share one allocation */
+	ch->rx_ring.buf = kcalloc(2 * rx_size, sizeof(void *), GFP_KERNEL);
+	if (!ch->rx_ring.buf) {
+		kfree(ch);
+		return ERR_PTR(-ENOMEM);
+	}
+	ch->rx_ring.inuse = ch->rx_ring.buf + rx_size;
+	ch->rx_ring.size = rx_size;
+
+	ch->state = RIO_CM_IDLE;
+	spin_lock_init(&ch->lock);
+	INIT_LIST_HEAD(&ch->accept_queue);
+	INIT_LIST_HEAD(&ch->ch_node);
+	init_completion(&ch->comp);
+	init_completion(&ch->comp_close);
+	init_waitqueue_head(&ch->tx_wq);
+	atomic_set(&ch->tx_credits, 0);
+	kref_init(&ch->ref);
+
 	if (ch_num) {
 		/* If requested, try to obtain the specified channel ID */
 		start = ch_num;
@@ -1395,30 +2025,26 @@ static struct rio_channel *riocm_ch_alloc(u16 ch_num)
 		end = RIOCM_MAX_CHNUM + 1;
 	}
 
+	/*
+	 * Reserve the ID first and publish the channel only once it is fully
+	 * initialized, lookups may find it as soon as it is in the IDR.
+	 */
 	idr_preload(GFP_KERNEL);
 	spin_lock_bh(&idr_lock);
-	id = idr_alloc_cyclic(&ch_idr, ch, start, end, GFP_NOWAIT);
+	id = idr_alloc_cyclic(&ch_idr, NULL, start, end, GFP_NOWAIT);
+	if (id >= 0) {
+		ch->id = (u16)id;
+		idr_replace(&ch_idr, ch, id);
+	}
 	spin_unlock_bh(&idr_lock);
 	idr_preload_end();
 
 	if (id < 0) {
+		kfree(ch->rx_ring.buf);
 		kfree(ch);
 		return ERR_PTR(id == -ENOSPC ? -EBUSY : id);
 	}
 
-	ch->id = (u16)id;
-	ch->state = RIO_CM_IDLE;
-	spin_lock_init(&ch->lock);
-	INIT_LIST_HEAD(&ch->accept_queue);
-	INIT_LIST_HEAD(&ch->ch_node);
-	init_completion(&ch->comp);
-	init_completion(&ch->comp_close);
-	kref_init(&ch->ref);
-	ch->rx_ring.head = 0;
-	ch->rx_ring.tail = 0;
-	ch->rx_ring.count = 0;
-	ch->rx_ring.inuse_cnt = 0;
-
 	return ch;
 }
 
@@ -1442,7 +2068,7 @@ static struct rio_channel *riocm_ch_create(u16 *ch_num)
 {
 	struct rio_channel *ch = NULL;
 
-	ch = riocm_ch_alloc(*ch_num);
+	ch = riocm_ch_alloc(*ch_num, RIOCM_RX_RING_SIZE);
 
 	if (IS_ERR(ch))
 		riocm_debug(CHOP, "Failed to allocate channel %d (err=%ld)",
@@ -1460,13 +2086,14 @@ static struct rio_channel *riocm_ch_create(u16 *ch_num)
 static void riocm_ch_free(struct kref *ref)
 {
 	struct rio_channel *ch = container_of(ref, struct rio_channel, ref);
+	struct riocm_uring *ur;
 	int i;
 
 	riocm_debug(CHOP, "(ch_%d)", ch->id);
 
 	if (ch->rx_ring.inuse_cnt) {
 		for (i = 0;
-		     i < RIOCM_RX_RING_SIZE && ch->rx_ring.inuse_cnt; i++) {
+		     i < ch->rx_ring.size && ch->rx_ring.inuse_cnt; i++) {
 			if (ch->rx_ring.inuse[i] != NULL) {
 				kfree(ch->rx_ring.inuse[i]);
 				ch->rx_ring.inuse_cnt--;
@@ -1474,13 +2101,23 @@ static void riocm_ch_free(struct kref *ref)
 		}
 	}
 
-	if (ch->rx_ring.count)
-		for (i = 0; i < RIOCM_RX_RING_SIZE && ch->rx_ring.count; i++) {
-			if (ch->rx_ring.buf[i] != NULL) {
-				kfree(ch->rx_ring.buf[i]);
-				ch->rx_ring.count--;
-			}
-		}
+	while (ch->tx_pool_cnt)
+		kfree(ch->tx_pool[--ch->tx_pool_cnt]);
+
+	ur = rcu_dereference_protected(ch->uring, 1);
+	if (ur) {
+		ur->dead = true;
+		wake_up_interruptible(&ur->wq);
+		riocm_uring_put(ur);
+	}
+
+	/* No producer can reach the ring once the last reference is gone */
+	while (ch->rx_ring.tail != ch->rx_ring.head) {
+		kfree(ch->rx_ring.buf[ch->rx_ring.tail &
+				     (ch->rx_ring.size - 1)]);
+		ch->rx_ring.tail++;
+	}
+	kfree(ch->rx_ring.buf);
 
 	complete(&ch->comp_close);
 }
@@ -1500,8 +2137,8 @@ static int riocm_send_close(struct rio_channel *ch)
 
 	hdr->bhdr.src_id = htonl(ch->loc_destid);
 	hdr->bhdr.dst_id = htonl(ch->rem_destid);
-	hdr->bhdr.src_mbox = cmbox;
-	hdr->bhdr.dst_mbox = cmbox;
+	hdr->bhdr.src_mbox = riocm_ch_mbox(ch->cmdev, ch->id);
+	hdr->bhdr.dst_mbox = ch->rem_mbox;
 	hdr->bhdr.type = RIO_CM_CHAN;
 	hdr->ch_op = CM_CONN_CLOSE;
 	hdr->dst_ch = htons(ch->rem_channel);
@@ -1543,6 +2180,7 @@ static int riocm_ch_close(struct rio_channel *ch)
 		riocm_send_close(ch);
 
 	complete_all(&ch->comp);
+	wake_up_all(&ch->tx_wq);
 
 	riocm_put_channel(ch);
 	wret = wait_for_completion_interruptible_timeout(&ch->comp_close, tmo);
@@ -1563,7 +2201,8 @@ static int riocm_ch_close(struct rio_channel *ch)
 
 	if (!ret) {
 		riocm_debug(CHOP, "ch_%d resources released", ch->id);
-		kfree(ch);
+		/* Lockless lookups may still be looking at this object */
+		kfree_rcu(ch, rcu);
 	} else {
 		riocm_debug(CHOP, "failed to release ch_%d resources", ch->id);
 	}
@@ -1925,9 +2564,13 @@ err_out:
 
 /*
  * cm_chan_msg_send() - Send a message through channel
+ * @filp:	Pointer to file object
  * @arg:	Outbound message information
+ *
+ * Waits for a TX credit of a flow controlled channel unless the device is
+ * opened in non-blocking mode.
  */
-static int cm_chan_msg_send(void __user *arg)
+static int cm_chan_msg_send(struct file *filp, void __user *arg)
 {
 	struct rio_cm_msg msg;
 	void *buf;
@@ -1942,12 +2585,88 @@ static int cm_chan_msg_send(void __user *arg)
 	if (IS_ERR(buf))
 		return PTR_ERR(buf);
 
-	ret = riocm_ch_send(msg.ch_num, buf, msg.size);
+	ret = riocm_ch_send(msg.ch_num, buf, msg.size,
+			    (filp->f_flags & O_NONBLOCK) ?
+			    0 : MAX_SCHEDULE_TIMEOUT);
 
 	kfree(buf);
 	return ret;
 }
 
+/*
+ * cm_chan_msg_send_batch() - Send multiple messages through channel
+ * @arg:	Outbound message batch information
+ *
+ * Messages are sent in order until the first failure. The number of sent
+ * messages is returned in the done field. An error is returned only if
+ * no message was sent. Only the first message waits for a TX credit of
+ * a flow controlled channel, the batch stops when credits run out.
+ */
+static int cm_chan_msg_send_batch(struct file *filp, void __user *arg)
+{
+	struct rio_cm_msg_batch batch;
+	struct rio_cm_msg_entry entry;
+	struct rio_cm_msg_entry __user *uentry;
+	struct rio_channel *ch;
+	void *buf;
+	long txto;
+	u32 i;
+	int ret = 0;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+	if (batch.ch_num == 0 || batch.num == 0 ||
+	    batch.num > RIO_CM_BATCH_MAX)
+		return -EINVAL;
+
+	ch = riocm_get_channel(batch.ch_num);
+	if (!ch)
+		return -ENODEV;
+
+	buf = riocm_ch_get_txbuf(ch);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	uentry = (struct rio_cm_msg_entry __user *)(uintptr_t)batch.msgs;
+	txto = (filp->f_flags & O_NONBLOCK) ? 0 : MAX_SCHEDULE_TIMEOUT;
+
+	for (i = 0; i < batch.num; i++) {
+		if (copy_from_user(&entry, &uentry[i], sizeof(entry))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (entry.size == 0 || entry.size > RIO_MAX_MSG_SIZE) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (copy_from_user(buf, (void __user *)(uintptr_t)entry.msg,
+				   entry.size)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		/* Message data is copied by mport, buffer can be reused */
+		ret = __riocm_ch_send(ch, buf, entry.size, i ? 0 : txto);
+		if (ret)
+			break;
+	}
+
+	riocm_ch_put_txbuf(ch, buf);
+
+	batch.done = i;
+	if (i)
+		ret = 0;
+	if (copy_to_user(arg, &batch, sizeof(batch)))
+		ret = -EFAULT;
+out:
+	riocm_put_channel(ch);
+	return ret;
+}
+
 /*
  * cm_chan_msg_rcv() - Receive a message through channel
  * @arg:	Inbound message information
@@ -1987,6 +2706,426 @@ out:
 	return ret;
 }
 
+/*
+ * cm_chan_msg_rcv_batch() - Receive multiple messages through channel
+ * @arg:	Inbound message batch information
+ *
+ * Waits for the first message up to the specified timeout, then collects
+ * messages that are already queued until the array is full. The number of
+ * received messages is returned in the done field and each entry's size is
+ * set to the length of received message. An error is returned only if no
+ * message was received.
+ */
+static int cm_chan_msg_rcv_batch(void __user *arg)
+{
+	struct rio_cm_msg_batch batch;
+	struct rio_cm_msg_entry entry;
+	struct rio_cm_msg_entry __user *uentry;
+	struct rio_ch_chan_hdr *hdr;
+	struct rio_channel *ch;
+	void *buf;
+	long rxto;
+	u32 i;
+	u16 len;
+	int ret = 0;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+	if (batch.ch_num == 0 || batch.num == 0 ||
+	    batch.num > RIO_CM_BATCH_MAX)
+		return -EINVAL;
+
+	ch = riocm_get_channel(batch.ch_num);
+	if (!ch)
+		return -ENODEV;
+
+	rxto = batch.rxto ? msecs_to_jiffies(batch.rxto) : MAX_SCHEDULE_TIMEOUT;
+	uentry = (struct rio_cm_msg_entry __user *)(uintptr_t)batch.msgs;
+
+	for (i = 0; i < batch.num; i++) {
+		if (copy_from_user(&entry, &uentry[i], sizeof(entry))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (entry.size == 0) {
+			ret = -EINVAL;
+			break;
+		}
+
+		/* Only the first message is waited for */
+		ret = riocm_ch_receive(ch, &buf, i ? 0 : rxto);
+		if (ret)
+			break;
+
+		hdr = buf;
+		len = min_t(u16, ntohs(hdr->msg_len), RIO_MAX_MSG_SIZE);
+		len = min(len, entry.size);
+
+		if (copy_to_user((void __user *)(uintptr_t)entry.msg,
+				 buf, len))
+			ret = -EFAULT;
+
+		riocm_ch_free_rxbuf(ch, buf);
+
+		entry.size = len;
+		if (!ret && copy_to_user(&uentry[i], &entry, sizeof(entry)))
+			ret = -EFAULT;
+		if (ret)
+			break;
+	}
+
+	batch.done = i;
+	if (i)
+		ret = 0;
+	if (copy_to_user(arg, &batch, sizeof(batch)))
+		ret = -EFAULT;
+
+	riocm_put_channel(ch);
+	return ret;
+}
+
+/*
+ * riocm_uring_tx - sends messages queued into channel's shared TX ring
+ * @ur: channel rings object
+ *
+ * Sending stops when a flow controlled channel runs out of TX credits,
+ * remaining entries are sent once the peer returns credits.
+ * Returns: number of sent messages, or error code if none was sent.
+ */
+static int riocm_uring_tx(struct riocm_uring *ur)
+{
+	struct rio_channel *ch;
+	void *buf;
+	u32 head, slot, len;
+	int sent = 0;
+	int ret = 0;
+
+	ch = riocm_get_channel(ur->ch_id);
+	if (!ch)
+		return -ENODEV;
+	if (rcu_access_pointer(ch->uring) != ur) {
+		/* Channel ID has been reused by another channel */
+		ret = -ENODEV;
+		goto out;
+	}
+
+	buf = riocm_ch_get_txbuf(ch);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	mutex_lock(&ur->tx_lock);
+
+	head = ur->tx->head;
+	smp_rmb(); /* read producer index before its entries */
+
+	if (head - ur->tx_tail > ur->entries) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	while (ur->tx_tail != head) {
+		slot = ur->tx_tail & (ur->entries - 1);
+		len = ur->tx_desc[slot].len;
+		if (len == 0 || len > RIO_MAX_MSG_SIZE) {
+			ret = -EINVAL;
+			break;
+		}
+
+		/*
+		 * Copy message out of the shared area first, so user space
+		 * cannot change its header while it is being sent.
+		 */
+		memcpy(buf, ur->tx_buf + slot * RIO_MAX_MSG_SIZE, len);
+		ret = __riocm_ch_send(ch, buf, len, 0);
+		if (ret)
+			break;
+
+		ur->tx_tail++;
+		sent++;
+	}
+
+	smp_mb(); /* done with slots before releasing them to user space */
+	ur->tx->tail = ur->tx_tail;
+
+out_unlock:
+	mutex_unlock(&ur->tx_lock);
+	riocm_ch_put_txbuf(ch, buf);
+out:
+	riocm_put_channel(ch);
+	return sent ? sent : ret;
+}
+
+/*
+ * riocm_uring_credit - returns credits for consumed shared RX ring entries
+ * @ur: channel rings object
+ */
+static void riocm_uring_credit(struct riocm_uring *ur)
+{
+	struct rio_channel *ch;
+
+	ch = riocm_get_channel(ur->ch_id);
+	if (!ch)
+		return;
+	if (rcu_access_pointer(ch->uring) == ur)
+		riocm_uring_ret_credits(ch, ur);
+	riocm_put_channel(ch);
+}
+
+/*
+ * riocm_uring_detach - detaches shared rings from the channel
+ * @ur: channel rings object
+ *
+ * Data received afterwards is queued into the channel's internal RX ring
+ * and read with RIO_CM_CHAN_RECEIVE again. Entries left unread in the
+ * shared RX ring are discarded, their credits and the credits withheld
+ * to fit the ring are returned to the peer.
+ */
+static void riocm_uring_detach(struct riocm_uring *ur)
+{
+	struct rio_channel *ch;
+	u32 credits;
+
+	ch = riocm_get_channel(ur->ch_id);
+	if (!ch)
+		return;
+
+	spin_lock_bh(&ch->lock);
+	if (rcu_access_pointer(ch->uring) != ur) {
+		/* Channel ID has been reused by another channel */
+		spin_unlock_bh(&ch->lock);
+		riocm_put_channel(ch);
+		return;
+	}
+	RCU_INIT_POINTER(ch->uring, NULL);
+	spin_unlock_bh(&ch->lock);
+
+	/* Wait for the RX worker to stop producing into the ring */
+	synchronize_rcu();
+
+	spin_lock_bh(&ch->lock);
+	credits = ur->rx_head - ur->rx_credited;
+	if (ch->rx_ring.size > ur->entries)
+		credits += ch->rx_ring.size - ur->entries - ur->rx_debt;
+	ur->rx_credited = ur->rx_head;
+	ur->rx_debt = 0;
+	if (ch->tx_window)
+		ch->rx_credits += credits;
+	spin_unlock_bh(&ch->lock);
+
+	riocm_ch_ret_credits(ch, true);
+
+	/* Reference held by the channel */
+	riocm_uring_put(ur);
+	riocm_put_channel(ch);
+}
+
+static int riocm_ring_release(struct inode *inode, struct file *filp)
+{
+	struct riocm_uring *ur = filp->private_data;
+
+	if (!ur->dead)
+		riocm_uring_detach(ur);
+	riocm_uring_put(ur);
+	return 0;
+}
+
+static int riocm_ring_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct riocm_uring *ur = filp->private_data;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > ur->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ur->area, 0);
+}
+
+static unsigned int riocm_ring_poll(struct file *filp, poll_table *wait)
+{
+	struct riocm_uring *ur = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &ur->wq, wait);
+
+	/* Consumed RX entries are credited when user space waits for more */
+	if (!ur->dead)
+		riocm_uring_credit(ur);
+
+	if (ur->rx_head != ur->rx->tail)
+		mask |= POLLIN | POLLRDNORM;
+	if (ur->tx->head - ur->tx_tail < ur->entries)
+		mask |= POLLOUT | POLLWRNORM;
+	if (ur->dead)
+		mask |= POLLHUP;
+
+	return mask;
+}
+
+static long
+riocm_ring_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct riocm_uring *ur = filp->private_data;
+
+	if (cmd == RIO_CM_RING_KICK) {
+		riocm_uring_credit(ur);
+		return riocm_uring_tx(ur);
+	}
+
+	return -EINVAL;
+}
+
+static const struct file_operations riocm_ring_fops = {
+	.owner		= THIS_MODULE,
+	.release	= riocm_ring_release,
+	.mmap		= riocm_ring_mmap,
+	.poll		= riocm_ring_poll,
+	.unlocked_ioctl = riocm_ring_ioctl,
+};
+
+/*
+ * cm_chan_ring_setup() - Attach user space mapped rings to a channel
+ * @filp:	Pointer to file object
+ * @arg:	Ring setup parameters
+ *
+ * Allocates a shared area holding RX and TX rings and their buffers and
+ * returns a new file descriptor used to mmap() it. Once attached, data
+ * received by the channel is placed into the shared RX ring instead of the
+ * internal queue. Entries of the shared TX ring are sent on RIO_CM_RING_KICK.
+ * Credits for RX ring entries released by user space are returned to the
+ * peer of a flow controlled channel on poll() and RIO_CM_RING_KICK.
+ */
+static int cm_chan_ring_setup(struct file *filp, void __user *arg)
+{
+	struct rio_cm_ring_setup setup;
+	struct riocm_uring *ur;
+	struct rio_channel *ch;
+	struct file *file;
+	size_t desc_sz, buf_sz;
+	int fd, ret;
+
+	if (copy_from_user(&setup, arg, sizeof(setup)))
+		return -EFAULT;
+	if (setup.entries == 0 || setup.entries > RIO_CM_RING_MAX_ENTRIES ||
+	    (setup.entries & (setup.entries - 1)))
+		return -EINVAL;
+
+	ch = riocm_get_channel(setup.ch_num);
+	if (!ch)
+		return -ENODEV;
+
+	if (ch->filp != filp) {
+		ret = -EINVAL;
+		goto err_put;
+	}
+
+	ur = kzalloc(sizeof(*ur), GFP_KERNEL);
+	if (!ur) {
+		ret = -ENOMEM;
+		goto err_put;
+	}
+
+	/* Ring indexes on separate cache lines, descriptors, then buffers */
+	desc_sz = setup.entries * sizeof(struct rio_cm_ring_desc);
+	buf_sz = setup.entries * RIO_MAX_MSG_SIZE;
+	setup.rx_ring = 0;
+	setup.tx_ring = L1_CACHE_BYTES;
+	setup.rx_desc = 2 * L1_CACHE_BYTES;
+	setup.tx_desc = setup.rx_desc + desc_sz;
+	setup.rx_buf = PAGE_ALIGN(setup.tx_desc + desc_sz);
+	setup.tx_buf = setup.rx_buf + buf_sz;
+	setup.map_size = PAGE_ALIGN(setup.tx_buf + buf_sz);
+	setup.buf_size = RIO_MAX_MSG_SIZE;
+
+	ur->area = vmalloc_user(setup.map_size);
+	if (!ur->area) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	kref_init(&ur->ref);
+	ur->ch_id = ch->id;
+	ur->entries = setup.entries;
+	ur->size = setup.map_size;
+	ur->rx = ur->area + setup.rx_ring;
+	ur->tx = ur->area + setup.tx_ring;
+	ur->rx_desc = ur->area + setup.rx_desc;
+	ur->tx_desc = ur->area + setup.tx_desc;
+	ur->rx_buf = ur->area + setup.rx_buf;
+	ur->tx_buf = ur->area + setup.tx_buf;
+	mutex_init(&ur->tx_lock);
+	init_waitqueue_head(&ur->wq);
+
+	fd = get_unused_fd_flags(O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto err_free;
+	}
+
+	/* File owns the initial reference from now on */
+	file = anon_inode_getfile("[rio_cm_ring]", &riocm_ring_fops, ur,
+				  O_RDWR);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		put_unused_fd(fd);
+		goto err_free;
+	}
+
+	setup.fd = fd;
+	if (copy_to_user(arg, &setup, sizeof(setup))) {
+		ret = -EFAULT;
+		goto err_file;
+	}
+
+	spin_lock_bh(&ch->lock);
+	if (rcu_access_pointer(ch->uring) || ch->state == RIO_CM_DESTROYING) {
+		spin_unlock_bh(&ch->lock);
+		ret = -EBUSY;
+		goto err_file;
+	}
+	/*
+	 * Keep credits of the receive window that does not fit into the
+	 * shared ring, so the peer cannot overrun it.
+	 */
+	if (ch->rx_ring.size > ur->entries)
+		ur->rx_debt = ch->rx_ring.size - ur->entries;
+	/* Reference held by the channel */
+	kref_get(&ur->ref);
+	rcu_assign_pointer(ch->uring, ur);
+	spin_unlock_bh(&ch->lock);
+
+	fd_install(fd, file);
+	riocm_put_channel(ch);
+	return 0;
+
+err_file:
+	fput(file);
+	put_unused_fd(fd);
+	riocm_put_channel(ch);
+	return ret;
+err_free:
+	vfree(ur->area);
+	kfree(ur);
+err_put:
+	riocm_put_channel(ch);
+	return ret;
+}
+
+/*
+ * cm_chan_set_rx_ring() - Set RX ring size of a channel
+ * @arg:	RX ring parameters
+ */
+static int cm_chan_set_rx_ring(void __user *arg)
+{
+	struct rio_cm_rx_ring ring;
+
+	if (copy_from_user(&ring, arg, sizeof(ring)))
+		return -EFAULT;
+
+	return riocm_ch_set_rx_ring(ring.ch_num, ring.entries);
+}
+
 /*
  * riocm_cdev_ioctl() - IOCTL requests handler
  */
@@ -2011,11 +3150,19 @@ riocm_cdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case RIO_CM_CHAN_CONNECT:
 		return cm_chan_connect((void __user *)arg);
 	case RIO_CM_CHAN_SEND:
-		return cm_chan_msg_send((void __user *)arg);
+		return cm_chan_msg_send(filp, (void __user *)arg);
 	case RIO_CM_CHAN_RECEIVE:
 		return cm_chan_msg_rcv((void __user *)arg);
 	case RIO_CM_MPORT_GET_LIST:
 		return cm_mport_get_list((void __user *)arg);
+	case RIO_CM_CHAN_SEND_BATCH:
+		return cm_chan_msg_send_batch(filp, (void __user *)arg);
+	case RIO_CM_CHAN_RECEIVE_BATCH:
+		return cm_chan_msg_rcv_batch((void __user *)arg);
+	case RIO_CM_CHAN_RING_SETUP:
+		return cm_chan_ring_setup(filp, (void __user *)arg);
+	case RIO_CM_CHAN_SET_RX_RING:
+		return cm_chan_set_rx_ring((void __user *)arg);
 	default:
 		break;
 	}
@@ -2201,6 +3348,64 @@ static int riocm_cdev_add(dev_t devno)
 	return 0;
 }
 
+/*
+ * riocm_rx_mbox_init - reserves an inbound mailbox and fills its buffer ring
+ * @cm: cm_dev object
+ * @rx: inbound mailbox context to initialize
+ * @mbox: mailbox number
+ *
+ * Returns: 0 if success, or error code otherwise.
+ */
+static int riocm_rx_mbox_init(struct cm_dev *cm, struct cm_rx_mbox *rx,
+			      int mbox)
+{
+	struct rio_mport *mport = cm->mport;
+	bool rx_zc;
+	int rc;
+
+	rx->cm = cm;
+	rx->mbox = mbox;
+
+	/* Receive directly into posted buffers if supported by mport */
+	rc = rio_request_inb_mbox_zc(mport, rx, mbox,
+				     RIOCM_RX_RING_SIZE, riocm_inb_msg_event);
+	rx_zc = !rc;
+	if (rc == -EOPNOTSUPP)
+		rc = rio_request_inb_mbox(mport, rx, mbox,
+					  RIOCM_RX_RING_SIZE,
+					  riocm_inb_msg_event);
+	if (rc) {
+		riocm_error("failed to allocate IBMBOX_%d on %s",
+			    mbox, mport->name);
+		return rc;
+	}
+
+	/*
+	 * Allocate and register inbound messaging buffers to be ready
+	 * to receive channel and system management requests
+	 */
+	memset(rx->rx_buf, 0, sizeof(rx->rx_buf));
+
+	/* Zero-copy mailbox can hold one buffer less than its size */
+	rx->rx_slots = RIOCM_RX_RING_SIZE - (rx_zc ? 1 : 0);
+	mutex_init(&rx->rx_lock);
+	INIT_WORK(&rx->rx_work, rio_ibmsg_handler);
+	riocm_rx_fill(rx, RIOCM_RX_RING_SIZE);
+
+	return 0;
+}
+
+/*
+ * riocm_rx_mbox_fini - releases an inbound mailbox and its buffers
+ * @rx: inbound mailbox context
+ */
+static void riocm_rx_mbox_fini(struct cm_rx_mbox *rx)
+{
+	rio_release_inb_mbox(rx->cm->mport, rx->mbox);
+	cancel_work_sync(&rx->rx_work);
+	riocm_rx_free(rx);
+}
+
 /*
  * riocm_add_mport - add new local mport device into channel management core
  * @dev: device object associated with mport
@@ -2234,27 +3439,31 @@ static int riocm_add_mport(struct device *dev,
 		return -ENODEV;
 	}
 
-	rc = rio_request_inb_mbox(mport, cm, cmbox,
-				  RIOCM_RX_RING_SIZE, riocm_inb_msg_event);
-	if (rc) {
-		riocm_error("failed to allocate IBMBOX_%d on %s",
-			    cmbox, mport->name);
+	/*
+	 * Steering packets into different mailboxes requires the mport to
+	 * send to a destination mailbox other than its outbound one.
+	 */
+	cm->rx_mbox_num = max(1, min(rx_mbox_num, RIO_MAX_MBOX - cmbox));
+	if (cm->rx_mbox_num > 1 && !mport->ops->add_outb_messages) {
+		riocm_warn("%s cannot steer messages, using single IBMBOX",
+			   mport->name);
+		cm->rx_mbox_num = 1;
+	}
+
+	/* Workers are per-CPU, mailboxes are processed in parallel */
+	cm->rx_wq = alloc_workqueue(DRV_NAME "/rxq",
+				    WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!cm->rx_wq) {
 		rio_release_outb_mbox(mport, cmbox);
 		kfree(cm);
-		return -ENODEV;
+		return -ENOMEM;
 	}
 
-	/*
-	 * Allocate and register inbound messaging buffers to be ready
-	 * to receive channel and system management requests
-	 */
-	for (i = 0; i < RIOCM_RX_RING_SIZE; i++)
-		cm->rx_buf[i] = NULL;
-
-	cm->rx_slots = RIOCM_RX_RING_SIZE;
-	mutex_init(&cm->rx_lock);
-	riocm_rx_fill(cm, RIOCM_RX_RING_SIZE);
-	cm->rx_wq = create_singlethread_workqueue(DRV_NAME "/rxq");
+	for (i = 0; i < cm->rx_mbox_num; i++) {
+		rc = riocm_rx_mbox_init(cm, &cm->rx[i], cmbox + i);
+		if (rc)
+			goto err_rx;
+	}
 
 	cm->tx_slot = 0;
 	cm->tx_cnt = 0;
@@ -2270,6 +3479,14 @@ static int riocm_add_mport(struct device *dev,
 	up_write(&rdev_sem);
 
 	return 0;
+
+err_rx:
+	while (i--)
+		riocm_rx_mbox_fini(&cm->rx[i]);
+	destroy_workqueue(cm->rx_wq);
+	rio_release_outb_mbox(mport, cmbox);
+	kfree(cm);
+	return -ENODEV;
 }
 
 /*
@@ -2329,7 +3546,8 @@ static void riocm_remove_mport(struct device *dev,
 		}
 	}
 
-	rio_release_inb_mbox(mport, cmbox);
+	for (i = 0; i < cm->rx_mbox_num; i++)
+		rio_release_inb_mbox(mport, cm->rx[i].mbox);
 	rio_release_outb_mbox(mport, cmbox);
 
 	/* Remove and free peer entries */
@@ -2341,7 +3559,8 @@ static void riocm_remove_mport(struct device *dev,
 		kfree(peer);
 	}
 
-	riocm_rx_free(cm);
+	for (i = 0; i < cm->rx_mbox_num; i++)
+		riocm_rx_free(&cm->rx[i]);
 	kfree(cm);
 	riocm_debug(MPORT, "%s done", mport->name);
 }
@@ -27,7 +27,12 @@
 #include <linux/crc32.h>
 #include <linux/ethtool.h>
 #include <linux/reboot.h>
+#include <linux/math64.h>
+#include <linux/rcupdate.h>
 #include <linux/version.h>
+#include <linux/icmpv6.h>
+#include <net/icmp.h>
+#include <net/ip.h>
 
 #define DRV_NAME        "rionet"
 #define DRV_VERSION     "0.3"
@@ -51,22 +56,131 @@ MODULE_LICENSE("GPL");
 
 #define RIONET_TX_RING_SIZE	512
 #define RIONET_RX_RING_SIZE	512
+#define RIONET_NAPI_WEIGHT	64
+#define RIONET_RX_REFILL_BATCH	32	/* min number of free slots to refill */
+#define RIONET_TX_BATCH		16	/* max messages per TX submission */
+#define RIONET_DB_BATCH		16	/* max doorbells per submission */
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0))
+#define napi_alloc_skb(napi, len)	netdev_alloc_skb((napi)->dev, len)
+#define napi_complete_done(napi, work)	napi_complete(napi)
+#endif
+
 #define RIONET_MAX_NETS		8
 #define RIONET_MSG_SIZE         RIO_MAX_MSG_SIZE
 #define RIONET_MAX_MTU          (RIONET_MSG_SIZE - ETH_HLEN)
 
+/*
+ * Frames larger than one message are sent to peers that reassemble them as
+ * a sequence of messages, each starting with struct rionet_seg_hdr. The
+ * first header byte is never the first byte of a destination MAC address
+ * used by rionet (unicast 00:01:00:01:xx:xx or multicast) which
+ * distinguishes segments from single-message frames. A peer announces that
+ * it reassembles frames by sending a header with zero frame length in reply
+ * to JOIN. Older peers pass it up as a frame for another host, which the
+ * network stack drops.
+ */
+#define RIONET_SEG_MAGIC	0xfe
+#define RIONET_SEG_MAX_FRAME	(64 * 1024)
+#define RIONET_SEG_MAX_MTU	(RIONET_SEG_MAX_FRAME - ETH_HLEN)
+#define RIONET_SEG_DATA		(RIONET_MSG_SIZE - sizeof(struct rionet_seg_hdr))
+#define RIONET_SEG_NENTS	2	/* header + range of linear skb data */
+#define RIONET_SEG_CTX		8	/* frames reassembled concurrently */
+
+struct rionet_seg_hdr {
+	u8	magic;		/* RIONET_SEG_MAGIC */
+	u8	index;		/* segment index within frame */
+	u8	stream;		/* sender TX queue */
+	u8	rsvd;
+	__be16	src;		/* sender destID */
+	__be16	seq;		/* frame sequence number within stream */
+	__be32	len;		/* frame length */
+	__be32	rsvd2;		/* keeps segment data 8-byte aligned */
+};
+
+/* Reassembly state of a segmented frame */
+struct rionet_seg_ctx {
+	struct sk_buff *head;	/* first segment, NULL if context is free */
+	struct sk_buff *last;	/* last segment on head's frag_list */
+	unsigned long stamp;	/* jiffies of last received segment */
+	u32 len;		/* frame length */
+	u16 src;
+	u16 seq;
+	u8 stream;
+	u8 index;		/* next expected segment index */
+};
+
+/*
+ * Outbound mailboxes are claimed first come, first served, and other
+ * drivers (rio_cm, rio_bench) rely on the remaining ones. Claiming them
+ * for TX queues at ifup would break those drivers loaded later, so this
+ * is left to the user.
+ */
+static int txq_mbox_mask = 1 << RIONET_MAILBOX;
+module_param(txq_mbox_mask, int, S_IRUGO);
+MODULE_PARM_DESC(txq_mbox_mask,
+		 "Outbound mailboxes to use as TX queues (default 0x1). "
+		 "Mailboxes that cannot be claimed are skipped.");
+
+/* RX path counters exported through ethtool statistics */
+struct rionet_rx_stats {
+	u64 irq_events;		/* inbound message notifications */
+	u64 irq_masked;		/* notifications masked to switch into polling */
+	u64 polls;		/* NAPI poll invocations */
+	u64 poll_pkts;		/* packets received in NAPI poll */
+	u64 poll_budget_hit;	/* polls that consumed entire budget */
+	u64 refills;		/* RX ring refill batches */
+	u64 alloc_fail;		/* RX buffer allocation failures */
+	u64 seg_frames;		/* frames reassembled from segments */
+	u64 seg_dropped;	/* incomplete segmented frames dropped */
+};
+
+/*
+ * TX queue served by a dedicated outbound mailbox. All messages are sent
+ * to RIONET_MAILBOX of the remote peer.
+ */
+struct rionet_txq {
+	struct net_device *ndev;
+	int index;		/* netdev TX queue index */
+	int mbox;		/* outbound mailbox */
+	spinlock_t lock;
+	struct sk_buff *skb[RIONET_TX_RING_SIZE];
+	int slot;
+	int cnt;
+	int ack_slot;
+	/* TX submission batch */
+	struct scatterlist sg;	/* aligned data of frame being queued */
+	bool zc;		/* frame is sent from @sg without copy */
+	struct rio_outb_msg batch[RIONET_TX_BATCH];
+	int batch_cnt;
+	int unsent;		/* messages of current frame not taken by mport */
+	int wake_msgs;		/* free slots the requeued frame needs */
+	/* Segmented frames (allocated only if mport supports SG messages) */
+	struct rionet_seg_hdr *seg_hdr;	/* one per TX ring slot */
+	struct scatterlist *seg_sg;	/* one table per batch entry */
+	u16 seg_seq;
+	unsigned long tx_packets;
+	unsigned long tx_bytes;
+} ____cacheline_aligned_in_smp;
+
 struct rionet_private {
 	struct rio_mport *mport;
+	struct napi_struct napi;
 	struct sk_buff *rx_skb[RIONET_RX_RING_SIZE];
-	struct sk_buff *tx_skb[RIONET_TX_RING_SIZE];
-	int rx_slot;
-	int tx_slot;
-	int tx_cnt;
-	int ack_slot;
-	spinlock_t lock;
-	spinlock_t tx_lock;
+	int rx_slot;		/* next RX slot to receive into */
+	int rx_fill_slot;	/* next RX slot to post a buffer into */
+	int rx_free;		/* number of RX slots without posted buffer */
+	struct rionet_txq *txq;	/* one per mailbox in rionet_txq_mboxes() */
+	int num_txq;		/* number of TX queues in use */
 	u32 msg_enable;
 	bool open;
+	bool rx_zc;		/* inbound mailbox in zero-copy mode */
+	struct rionet_rx_stats rx_stats;
+	struct rio_mbox_coalesce tx_coal; /* applied to all TX mailboxes */
+	struct rionet_seg_ctx rx_seg[RIONET_SEG_CTX];
+	int tx_frame_msgs;	/* TX ring slots used by MTU-sized frame */
+	u16 destid;		/* local destID put into segment headers */
+	struct rionet_seg_hdr seg_caps;	/* reassembly announcement */
 };
 
 struct rionet_peer {
@@ -75,11 +189,24 @@ struct rionet_peer {
 	struct resource *res;
 };
 
+/* Compact list of active peers used for multicast/broadcast fan-out */
+struct rionet_fanout {
+	struct rcu_head rcu;
+	int num;
+	struct rio_dev *rdev[0];
+};
+
+/*
+ * Active peer tables are updated under @lock and read under RCU in TX path.
+ * Direct-indexed @active table provides unicast lookup by destID.
+ */
 struct rionet_net {
 	struct net_device *ndev;
 	struct list_head peers;
 	spinlock_t lock;	/* net info access lock */
-	struct rio_dev **active;
+	struct rio_dev __rcu **active;
+	struct rionet_fanout __rcu *fanout;
+	unsigned long *seg_peers;	/* peers accepting segmented frames */
 	int nact;	/* number of active peers */
 };
 
@@ -93,192 +220,873 @@ static struct rionet_net nets[RIONET_MAX_NETS];
 #define dev_rionet_capable(dev) \
 	is_rionet_capable(dev->src_ops, dev->dst_ops)
 
+/*
+ * rionet_update_fanout - rebuild fan-out table after change of active peers
+ * @net: network the peer belongs to
+ * @rdev: peer that has been added to or removed from the active peers
+ * @active: true if @rdev has been added
+ *
+ * If a new table cannot be allocated the current one is kept. A removed
+ * peer is then cleared from it in place, so the table never refers to a
+ * device that may go away. An added peer is left out of fan-out until the
+ * next successful rebuild.
+ *
+ * Must be called with net->lock held. May be called from interrupt context.
+ */
+static void rionet_update_fanout(struct rionet_net *net, struct rio_dev *rdev,
+				 bool active)
+{
+	struct rionet_fanout *new, *old;
+	struct rionet_peer *peer;
+	int n = 0;
+
+	old = rcu_dereference_protected(net->fanout,
+					lockdep_is_held(&net->lock));
+
+	new = kmalloc(sizeof(*new) + net->nact * sizeof(new->rdev[0]),
+		      GFP_ATOMIC);
+	if (!new) {
+		pr_err("%s: failed to update active peers table\n", DRV_NAME);
+		for (; old && !active && n < old->num; n++) {
+			if (old->rdev[n] == rdev)
+				WRITE_ONCE(old->rdev[n], NULL);
+		}
+		return;
+	}
+
+	list_for_each_entry(peer, &net->peers, node) {
+		if (n == net->nact)
+			break;
+		if (rcu_access_pointer(net->active[peer->rdev->destid])
+		    == peer->rdev)
+			new->rdev[n++] = peer->rdev;
+	}
+	new->num = n;
+
+	rcu_assign_pointer(net->fanout, new);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/*
+ * rionet_set_active - add peer to or remove it from the active peer tables
+ *
+ * Must be called with net->lock held.
+ */
+static void rionet_set_active(struct rionet_net *net, struct rio_dev *rdev,
+			      bool active)
+{
+	struct rio_dev *cur;
+
+	cur = rcu_dereference_protected(net->active[rdev->destid],
+					lockdep_is_held(&net->lock));
+	if (active == !!cur)
+		return;
+
+	if (active) {
+		rcu_assign_pointer(net->active[rdev->destid], rdev);
+		net->nact++;
+	} else {
+		RCU_INIT_POINTER(net->active[rdev->destid], NULL);
+		net->nact--;
+	}
+
+	rionet_update_fanout(net, rdev, active);
+}
+
+static bool rionet_is_active(struct rionet_net *net, u16 destid)
+{
+	return rcu_access_pointer(net->active[destid]) != NULL;
+}
+
+static void rionet_set_seg_peer(struct rionet_net *net, u16 destid, bool seg)
+{
+	if (seg)
+		set_bit(destid, net->seg_peers);
+	else
+		clear_bit(destid, net->seg_peers);
+}
+
 #define RIONET_MAC_MATCH(x)	(!memcmp((x), "\00\01\00\01", 4))
 #define RIONET_GET_DESTID(x)	((*((u8 *)x + 4) << 8) | *((u8 *)x + 5))
 
-static int rionet_rx_clean(struct net_device *ndev)
+static int rionet_frame_msgs(unsigned int len)
+{
+	return (len > RIONET_MSG_SIZE) ? DIV_ROUND_UP(len, RIONET_SEG_DATA) : 1;
+}
+
+/*
+ * rionet_tx_msgs - TX ring slots needed to send frame of @len bytes to @rdev
+ *
+ * Returns 0 if the frame has to be dropped for this peer.
+ */
+static int rionet_tx_msgs(struct rionet_txq *txq, struct rionet_net *net,
+			  struct rio_dev *rdev, unsigned int len)
+{
+	if (len <= RIONET_MSG_SIZE)
+		return 1;
+	if (txq->seg_hdr && test_bit(rdev->destid, net->seg_peers))
+		return rionet_frame_msgs(len);
+	return 0;
+}
+
+/*
+ * rionet_tx_stop_msgs - free TX ring slots below which the queue is stopped
+ *
+ * Sized for one unicast MTU-sized frame, so unicast TX is never held back
+ * by the number of peers. A multicast frame that does not fit stops the
+ * queue until the ring can take it, see txq->wake_msgs.
+ */
+static int rionet_tx_stop_msgs(struct rionet_private *rnet,
+			       struct rionet_txq *txq)
+{
+	return min(max(rnet->tx_frame_msgs, txq->wake_msgs),
+		   RIONET_TX_RING_SIZE);
+}
+
+/*
+ * Wakes the queue if the ring can take the frame it waits for.
+ * Must be called with txq->lock held.
+ */
+static void rionet_tx_wake(struct rionet_private *rnet,
+			   struct rionet_txq *txq)
+{
+	if (RIONET_TX_RING_SIZE - txq->cnt >= rionet_tx_stop_msgs(rnet, txq)) {
+		txq->wake_msgs = 0;
+		netif_wake_subqueue(txq->ndev, txq->index);
+	}
+}
+
+static void rionet_seg_drop(struct net_device *ndev,
+			    struct rionet_seg_ctx *ctx)
 {
+	struct rionet_private *rnet = netdev_priv(ndev);
+
+	if (!ctx->head)
+		return;
+
+	kfree_skb(ctx->head);
+	ctx->head = NULL;
+	ctx->last = NULL;
+	rnet->rx_stats.seg_dropped++;
+	ndev->stats.rx_dropped++;
+}
+
+/*
+ * rionet_seg_ctx_get - find reassembly context of a segment stream
+ *
+ * Returns context that holds partial frame of the stream. If there is none
+ * and @alloc is set, returns a free context. The least recently used partial
+ * frame is dropped if all contexts are in use.
+ */
+static struct rionet_seg_ctx *rionet_seg_ctx_get(struct net_device *ndev,
+						 u16 src, u8 stream,
+						 bool alloc)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rionet_seg_ctx *ctx, *lru = NULL;
 	int i;
-	int error = 0;
+
+	for (i = 0; i < RIONET_SEG_CTX; i++) {
+		ctx = &rnet->rx_seg[i];
+		if (ctx->head && ctx->src == src && ctx->stream == stream)
+			return ctx;
+	}
+
+	if (!alloc)
+		return NULL;
+
+	for (i = 0; i < RIONET_SEG_CTX; i++) {
+		ctx = &rnet->rx_seg[i];
+		if (!ctx->head) {
+			lru = ctx;
+			break;
+		}
+		if (!lru || time_before(ctx->stamp, lru->stamp))
+			lru = ctx;
+	}
+
+	rionet_seg_drop(ndev, lru);
+	lru->src = src;
+	lru->stream = stream;
+	return lru;
+}
+
+/*
+ * rionet_rx_seg - add received segment to its frame
+ *
+ * Consumes @skb. Returns the reassembled frame once its last segment has
+ * been received, NULL otherwise. Segments are chained on frag_list of the
+ * first one, so no data is copied.
+ */
+static struct sk_buff *rionet_rx_seg(struct net_device *ndev,
+				     struct sk_buff *skb)
+{
 	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rionet_seg_hdr *hdr = (struct rionet_seg_hdr *)skb->data;
+	u16 src = be16_to_cpu(hdr->src);
+	u16 seq = be16_to_cpu(hdr->seq);
+	u32 len = be32_to_cpu(hdr->len);
+	struct rionet_seg_ctx *ctx;
+	struct sk_buff *head;
+	u32 expect;
+
+	if (!len && !hdr->index) {
+		/* Sender reassembles segmented frames too */
+		if (src < RIO_MAX_ROUTE_ENTRIES(rnet->mport->sys_size))
+			rionet_set_seg_peer(&nets[rnet->mport->id], src, true);
+		dev_kfree_skb_any(skb);
+		return NULL;
+	}
+
+	ctx = rionet_seg_ctx_get(ndev, src, hdr->stream, !hdr->index);
+	if (!ctx)
+		goto drop;
+
+	if (!hdr->index) {
+		/* Previous frame of the stream was not completed */
+		rionet_seg_drop(ndev, ctx);
+		if (len <= RIONET_MSG_SIZE || len > RIONET_SEG_MAX_FRAME)
+			goto drop;
+		ctx->len = len;
+		ctx->seq = seq;
+		ctx->index = 0;
+	} else if (seq != ctx->seq || hdr->index != ctx->index) {
+		rionet_seg_drop(ndev, ctx);
+		goto drop;
+	}
+
+	skb_pull(skb, sizeof(*hdr));
+
+	/* Only the last segment may be shorter, strip its message padding */
+	expect = min_t(u32, ctx->len - (ctx->head ? ctx->head->len : 0),
+		       RIONET_SEG_DATA);
+	if (skb->len < expect) {
+		rionet_seg_drop(ndev, ctx);
+		goto drop;
+	}
+	skb_trim(skb, expect);
+
+	if (!ctx->head) {
+		ctx->head = skb;
+	} else {
+		head = ctx->head;
+		if (!ctx->last)
+			skb_shinfo(head)->frag_list = skb;
+		else
+			ctx->last->next = skb;
+		ctx->last = skb;
+		head->len += skb->len;
+		head->data_len += skb->len;
+		head->truesize += skb->truesize;
+	}
+	ctx->index++;
+	ctx->stamp = jiffies;
+
+	if (ctx->head->len < ctx->len)
+		return NULL;
+
+	head = ctx->head;
+	ctx->head = NULL;
+	ctx->last = NULL;
+	rnet->rx_stats.seg_frames++;
+	return head;
+
+drop:
+	dev_kfree_skb_any(skb);
+	ndev->stats.rx_dropped++;
+	return NULL;
+}
+
+/*
+ * rionet_rx_clean - pass up to @budget received messages to the network stack
+ *
+ * Must be called from NAPI poll context only. Returns number of messages
+ * received. Segments are reassembled and passed up as a single frame.
+ */
+static int rionet_rx_clean(struct net_device *ndev, int budget)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	struct sk_buff *skb;
 	void *data;
 	int msg_sz;
+	int work = 0;
 
-	i = rnet->rx_slot;
-
-	do {
-		if (!rnet->rx_skb[i])
-			continue;
+	while (work < budget) {
+		skb = rnet->rx_skb[rnet->rx_slot];
+		if (!skb)
+			break;
 
 		data = rio_get_inb_message(rnet->mport,
 					   RIONET_MAILBOX, &msg_sz);
 		if (!data)
 			break;
 
-		rnet->rx_skb[i]->data = data;
-		skb_put(rnet->rx_skb[i], msg_sz);
-		rnet->rx_skb[i]->protocol =
-		    eth_type_trans(rnet->rx_skb[i], ndev);
-		error = netif_rx(rnet->rx_skb[i]);
+		rnet->rx_skb[rnet->rx_slot] = NULL;
+		rnet->rx_slot = (rnet->rx_slot + 1) % RIONET_RX_RING_SIZE;
+		rnet->rx_free++;
 
-		if (error == NET_RX_DROP) {
-			ndev->stats.rx_dropped++;
-		} else {
-			ndev->stats.rx_packets++;
-			ndev->stats.rx_bytes += msg_sz;
+		skb->data = data;
+		skb_put(skb, msg_sz);
+		work++;
+
+		if (msg_sz >= sizeof(struct rionet_seg_hdr) &&
+		    *(u8 *)data == RIONET_SEG_MAGIC) {
+			skb = rionet_rx_seg(ndev, skb);
+			if (!skb)
+				continue;
 		}
 
-	} while ((i = (i + 1) % RIONET_RX_RING_SIZE) != rnet->rx_slot);
+		ndev->stats.rx_packets++;
+		ndev->stats.rx_bytes += skb->len;
 
-	return i;
+		skb->protocol = eth_type_trans(skb, ndev);
+		napi_gro_receive(&rnet->napi, skb);
+	}
+
+	return work;
 }
 
-static void rionet_rx_fill(struct net_device *ndev, int end)
+/*
+ * rionet_rx_fill - post receive buffers into all free RX ring slots
+ *
+ * Called with NAPI disabled (open) or from NAPI poll context.
+ */
+static void rionet_rx_fill(struct net_device *ndev)
 {
-	int i;
 	struct rionet_private *rnet = netdev_priv(ndev);
+	struct sk_buff *skb;
+	int i = rnet->rx_fill_slot;
 
-	i = rnet->rx_slot;
-	do {
-		rnet->rx_skb[i] = dev_alloc_skb(RIO_MAX_MSG_SIZE);
+	if (!rnet->rx_free)
+		return;
 
-		if (!rnet->rx_skb[i])
+	while (rnet->rx_free) {
+		skb = napi_alloc_skb(&rnet->napi, RIO_MAX_MSG_SIZE + 8);
+		if (!skb) {
+			rnet->rx_stats.alloc_fail++;
 			break;
+		}
+
+		/*
+		 * Messaging engine writes into skb data directly in ZC mode.
+		 * Aligned frame start also lets frames forwarded to rionet
+		 * be sent without copy (see tsi721_omsg_queue()), so the
+		 * alignment is kept in copy mode too.
+		 */
+		skb_reserve(skb, PTR_ALIGN(skb->data, 8) - skb->data);
 
-		rio_add_inb_buffer(rnet->mport, RIONET_MAILBOX,
-				   rnet->rx_skb[i]->data);
-	} while ((i = (i + 1) % RIONET_RX_RING_SIZE) != end);
+		if (rio_add_inb_buffer(rnet->mport, RIONET_MAILBOX,
+				       skb->data)) {
+			dev_kfree_skb_any(skb);
+			break;
+		}
 
-	rnet->rx_slot = i;
+		rnet->rx_skb[i] = skb;
+		rnet->rx_free--;
+		i = (i + 1) % RIONET_RX_RING_SIZE;
+	}
+
+	rnet->rx_fill_slot = i;
+	rnet->rx_stats.refills++;
 }
 
-static int rionet_queue_tx_msg(struct sk_buff *skb, struct net_device *ndev,
-			       struct rio_dev *rdev)
+static int rionet_poll(struct napi_struct *napi, int budget)
+{
+	struct rionet_private *rnet =
+		container_of(napi, struct rionet_private, napi);
+	int work_done;
+
+	work_done = rionet_rx_clean(napi->dev, budget);
+
+	/*
+	 * Refill RX ring in batches to amortize buffer allocation cost.
+	 * Everything is posted back before leaving polling mode.
+	 */
+	if (rnet->rx_free >= RIONET_RX_REFILL_BATCH || work_done < budget)
+		rionet_rx_fill(napi->dev);
+
+	rnet->rx_stats.polls++;
+	rnet->rx_stats.poll_pkts += work_done;
+
+	if (work_done < budget) {
+		napi_complete_done(napi, work_done);
+		rio_set_inb_mbox_irq(rnet->mport, RIONET_MAILBOX, 1);
+	} else
+		rnet->rx_stats.poll_budget_hit++;
+
+	return work_done;
+}
+
+/*
+ * rionet_tx_flush - submit batched TX messages to the mport
+ *
+ * Batch entries occupy the last TX ring slots. Slots of messages the mport
+ * did not take are released and counted in txq->unsent, the caller drops
+ * their skb references. Must be called with txq->lock held.
+ */
+static void rionet_tx_flush(struct rionet_private *rnet,
+			    struct rionet_txq *txq)
+{
+	int rc;
+
+	if (!txq->batch_cnt)
+		return;
+
+	rc = rio_add_outb_messages(rnet->mport, txq->mbox, txq->batch,
+				   txq->batch_cnt);
+	if (rc < 0)
+		rc = 0;
+
+	if (rc < txq->batch_cnt) {
+		txq->ndev->stats.tx_errors += txq->batch_cnt - rc;
+		while (txq->batch_cnt > rc) {
+			txq->slot = (txq->slot - 1) & (RIONET_TX_RING_SIZE - 1);
+			txq->skb[txq->slot] = NULL;
+			txq->cnt--;
+			txq->batch_cnt--;
+			txq->unsent++;
+		}
+
+		/* No TX completion may come to wake the queue up */
+		rionet_tx_wake(rnet, txq);
+	}
+
+	txq->batch_cnt = 0;
+}
+
+/*
+ * rionet_tx_commit - account message built in the next batch entry
+ *
+ * The message occupies TX ring slot txq->slot, which holds a reference to
+ * @skb until TX completion. Must be called with txq->lock held.
+ */
+static void rionet_tx_commit(struct rionet_private *rnet,
+			     struct net_device *ndev, struct rionet_txq *txq,
+			     struct sk_buff *skb)
+{
+	txq->skb[txq->slot] = skb;
+	txq->cnt++;
+	++txq->slot;
+	txq->slot &= (RIONET_TX_RING_SIZE - 1);
+
+	if (++txq->batch_cnt == RIONET_TX_BATCH)
+		rionet_tx_flush(rnet, txq);
+
+	/* Stop before the ring cannot take a frame of MTU size */
+	if (RIONET_TX_RING_SIZE - txq->cnt < rnet->tx_frame_msgs)
+		netif_stop_subqueue(ndev, txq->index);
+}
+
+/*
+ * rionet_queue_tx_segs - queue frame as a sequence of segment messages
+ *
+ * Each segment is sent from a scatterlist made of its header and a range of
+ * skb data. Headers stay in per-slot storage until TX completion.
+ * Returns number of queued messages. Must be called with txq->lock held.
+ */
+static int rionet_queue_tx_segs(struct sk_buff *skb, struct net_device *ndev,
+				struct rionet_txq *txq, struct rio_dev *rdev)
 {
 	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rionet_seg_hdr *hdr;
+	struct rio_outb_msg *msg;
+	struct scatterlist *sg;
+	unsigned int offset, len;
+	u16 seq = txq->seg_seq++;
+	int index = 0;
+
+	for (offset = 0; offset < skb->len; offset += len, index++) {
+		len = min_t(unsigned int, skb->len - offset, RIONET_SEG_DATA);
+
+		hdr = &txq->seg_hdr[txq->slot];
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->magic = RIONET_SEG_MAGIC;
+		hdr->index = index;
+		hdr->stream = txq->index;
+		hdr->src = cpu_to_be16(rnet->destid);
+		hdr->seq = cpu_to_be16(seq);
+		hdr->len = cpu_to_be32(skb->len);
+
+		sg = &txq->seg_sg[txq->batch_cnt * RIONET_SEG_NENTS];
+		sg_init_table(sg, RIONET_SEG_NENTS);
+		sg_set_buf(&sg[0], hdr, sizeof(*hdr));
+		sg_set_buf(&sg[1], skb->data + offset, len);
+
+		msg = &txq->batch[txq->batch_cnt];
+		msg->rdev = rdev;
+		msg->dmbox = RIONET_MAILBOX;
+		msg->len = sizeof(*hdr) + len;
+		msg->buffer = NULL;
+		msg->sgl = sg;
+		msg->nents = RIONET_SEG_NENTS;
+
+		rionet_tx_commit(rnet, ndev, txq, skb);
+	}
 
-	rio_add_outb_message(rnet->mport, rdev, 0, skb->data, skb->len);
-	rnet->tx_skb[rnet->tx_slot] = skb;
+	if (netif_msg_tx_queued(rnet))
+		printk(KERN_INFO "%s: queued skb len %8.8x in %d segments\n",
+		       DRV_NAME, skb->len, index);
 
-	ndev->stats.tx_packets++;
-	ndev->stats.tx_bytes += skb->len;
+	return index;
+}
 
-	if (++rnet->tx_cnt == RIONET_TX_RING_SIZE)
-		netif_stop_queue(ndev);
+static int rionet_queue_tx_msg(struct sk_buff *skb, struct net_device *ndev,
+			       struct rionet_txq *txq, struct rio_dev *rdev)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rio_outb_msg *msg = &txq->batch[txq->batch_cnt];
 
-	++rnet->tx_slot;
-	rnet->tx_slot &= (RIONET_TX_RING_SIZE - 1);
+	/*
+	 * Aligned frame is sent by mport directly from skb data, which is
+	 * held until TX completion is reported. Others are copied by mport.
+	 */
+	msg->rdev = rdev;
+	msg->dmbox = RIONET_MAILBOX;
+	msg->len = skb->len;
+	if (txq->zc) {
+		msg->buffer = NULL;
+		msg->sgl = &txq->sg;
+		msg->nents = 1;
+	} else {
+		msg->buffer = skb->data;
+		msg->sgl = NULL;
+		msg->nents = 0;
+	}
+
+	rionet_tx_commit(rnet, ndev, txq, skb);
 
 	if (netif_msg_tx_queued(rnet))
 		printk(KERN_INFO "%s: queued skb len %8.8x\n", DRV_NAME,
 		       skb->len);
 
-	return 0;
+	return 1;
+}
+
+/*
+ * rionet_queue_tx_frame - queue frame for transmission to a single peer
+ *
+ * Frames that do not fit into one message are segmented if the peer can
+ * reassemble them and dropped otherwise (unicast senders are told so by
+ * rionet_tx_too_big()). Returns number of queued messages, each of them
+ * holds a reference to @skb.
+ */
+static int rionet_queue_tx_frame(struct sk_buff *skb, struct net_device *ndev,
+				 struct rionet_txq *txq, struct rio_dev *rdev)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rionet_net *net = &nets[rnet->mport->id];
+	int num;
+
+	if (skb->len <= RIONET_MSG_SIZE)
+		num = rionet_queue_tx_msg(skb, ndev, txq, rdev);
+	else if (txq->seg_hdr && test_bit(rdev->destid, net->seg_peers))
+		num = rionet_queue_tx_segs(skb, ndev, txq, rdev);
+	else
+		num = 0;
+
+	if (num) {
+		txq->tx_packets++;
+		txq->tx_bytes += skb->len;
+	} else
+		ndev->stats.tx_dropped++;
+
+	return num;
+}
+
+/*
+ * rionet_tx_too_big - report frame that does not fit into the peer's MTU
+ *
+ * Peers that do not reassemble segmented frames take frames of up to
+ * RIONET_MAX_MTU. IP senders lower their path MTU towards such a peer as
+ * they do for a router hop with smaller MTU, so only the first oversized
+ * frame is lost. Must be called with interrupts enabled.
+ */
+static void rionet_tx_too_big(struct sk_buff *skb)
+{
+	if (skb->protocol == htons(ETH_P_IP)) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0))
+		icmp_ndo_send(skb, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED,
+			      htonl(RIONET_MAX_MTU));
+#else
+		memset(IPCB(skb), 0, sizeof(*IPCB(skb)));
+		icmp_send(skb, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED,
+			  htonl(RIONET_MAX_MTU));
+#endif
+	}
+#if IS_ENABLED(CONFIG_IPV6)
+	else if (skb->protocol == htons(ETH_P_IPV6)) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0))
+		icmpv6_ndo_send(skb, ICMPV6_PKT_TOOBIG, 0, RIONET_MAX_MTU);
+#else
+		icmpv6_send(skb, ICMPV6_PKT_TOOBIG, 0, RIONET_MAX_MTU);
+#endif
+	}
+#endif
+}
+
+static void rionet_skb_get(struct sk_buff *skb, int num)
+{
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0))
+	atomic_add(num, &skb->users);
+#else
+	refcount_add(num, &skb->users);
+#endif
 }
 
 static int rionet_start_xmit(struct sk_buff *skb, struct net_device *ndev)
 {
 	int i;
 	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rionet_txq *txq = &rnet->txq[skb_get_queue_mapping(skb)];
+	struct rionet_net *net = &nets[rnet->mport->id];
 	struct ethhdr *eth = (struct ethhdr *)skb->data;
+	struct rionet_fanout *fanout = NULL;
+	struct rio_dev *rdev = NULL;
 	u16 destid;
 	unsigned long flags;
-	int add_num = 1;
+	int add_num = 0;
+	int need = 0, msgs;
+	int num = 0;
+	bool too_big = false;
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4,7,0))
 	local_irq_save(flags);
-	if (!spin_trylock(&rnet->tx_lock)) {
+	if (!spin_trylock(&txq->lock)) {
 		local_irq_restore(flags);
 		return NETDEV_TX_LOCKED;
 	}
 #else
-	spin_lock_irqsave(&rnet->tx_lock, flags);
+	spin_lock_irqsave(&txq->lock, flags);
 #endif
 
-	if (is_multicast_ether_addr(eth->h_dest))
-		add_num = nets[rnet->mport->id].nact;
+	rcu_read_lock();
 
-	if ((rnet->tx_cnt + add_num) > RIONET_TX_RING_SIZE) {
-		netif_stop_queue(ndev);
-		spin_unlock_irqrestore(&rnet->tx_lock, flags);
-		printk(KERN_ERR "%s: BUG! Tx Ring full when queue awake!\n",
-		       ndev->name);
-		return NETDEV_TX_BUSY;
+	if (is_multicast_ether_addr(eth->h_dest)) {
+		fanout = rcu_dereference(net->fanout);
+		/*
+		 * Count only messages peers can take. Frame that does not fit
+		 * into the empty ring is sent to as many peers as it can be.
+		 */
+		for (; fanout && add_num < fanout->num; add_num++) {
+			rdev = READ_ONCE(fanout->rdev[add_num]);
+			if (!rdev)
+				continue;
+			msgs = rionet_tx_msgs(txq, net, rdev, skb->len);
+			if (need + msgs > RIONET_TX_RING_SIZE)
+				break;
+			need += msgs;
+		}
+		if (fanout && add_num < fanout->num)
+			ndev->stats.tx_dropped += fanout->num - add_num;
+	} else if (RIONET_MAC_MATCH(eth->h_dest)) {
+		destid = RIONET_GET_DESTID(eth->h_dest);
+		rdev = rcu_dereference(net->active[destid]);
+		if (rdev) {
+			need = rionet_tx_msgs(txq, net, rdev, skb->len);
+			too_big = !need;
+		}
 	}
 
-	if (is_multicast_ether_addr(eth->h_dest)) {
-		int count = 0;
-
-		for (i = 0; i < RIO_MAX_ROUTE_ENTRIES(rnet->mport->sys_size);
-				i++)
-			if (nets[rnet->mport->id].active[i]) {
-				rionet_queue_tx_msg(skb, ndev,
-					nets[rnet->mport->id].active[i]);
-				if (count)
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0))
-					atomic_inc(&skb->users);
-#else
-					refcount_inc(&skb->users);
-#endif
-				count++;
-			}
+	if (txq->cnt + need > RIONET_TX_RING_SIZE) {
+		/*
+		 * Fan-out frame may need more slots than the stop threshold
+		 * keeps free. Requeue it and keep the queue stopped until
+		 * completions free enough of them.
+		 */
+		txq->wake_msgs = need;
+		netif_stop_subqueue(ndev, txq->index);
+		rcu_read_unlock();
+		spin_unlock_irqrestore(&txq->lock, flags);
+		if (netif_msg_tx_err(rnet))
+			printk(KERN_WARNING "%s: Tx Ring %d full\n",
+			       ndev->name, txq->index);
+		return NETDEV_TX_BUSY;
+	}
 
-		if (!count)
-			dev_kfree_skb_any(skb);
+	/*
+	 * Frames are linear (no NETIF_F_SG). mport sends a single-fragment
+	 * message without copy if it starts 8-byte aligned, describe such
+	 * frame once for all peers it is sent to.
+	 */
+	txq->zc = rnet->mport->ops->add_outb_message_sg &&
+		  skb->len <= RIONET_MSG_SIZE &&
+		  IS_ALIGNED((unsigned long)skb->data, 8);
+	if (txq->zc)
+		sg_init_one(&txq->sg, skb->data, skb->len);
 
+	/*
+	 * Every queued message holds a reference to skb. Slots are released
+	 * by TX completion only after txq->lock is dropped, so references
+	 * can be taken once all messages are queued.
+	 */
+	if (is_multicast_ether_addr(eth->h_dest)) {
+		for (i = 0; i < add_num; i++) {
+			/* Cleared entry belongs to a peer that has left */
+			rdev = READ_ONCE(fanout->rdev[i]);
+			if (rdev)
+				num += rionet_queue_tx_frame(skb, ndev, txq,
+							     rdev);
+		}
 	} else if (RIONET_MAC_MATCH(eth->h_dest)) {
-		destid = RIONET_GET_DESTID(eth->h_dest);
-		if (nets[rnet->mport->id].active[destid])
-			rionet_queue_tx_msg(skb, ndev,
-					nets[rnet->mport->id].active[destid]);
-		else {
+		if (too_big) {
+			/* Reported to the sender once txq->lock is dropped */
+			ndev->stats.tx_dropped++;
+		} else if (rdev) {
+			num = rionet_queue_tx_frame(skb, ndev, txq, rdev);
+		} else {
 			/*
 			 * If the target device was removed from the list of
 			 * active peers but we still have TX packets targeting
 			 * it just report sending a packet to the target
 			 * (without actual packet transfer).
 			 */
-			dev_kfree_skb_any(skb);
-			ndev->stats.tx_packets++;
-			ndev->stats.tx_bytes += skb->len;
+			txq->tx_packets++;
+			txq->tx_bytes += skb->len;
 		}
 	}
 
-	spin_unlock_irqrestore(&rnet->tx_lock, flags);
+	rionet_tx_flush(rnet, txq);
+	num -= txq->unsent;
+	txq->unsent = 0;
+
+	if (!num && !too_big)
+		dev_kfree_skb_any(skb);
+	else if (num > 1)
+		rionet_skb_get(skb, num - 1);
+
+	rcu_read_unlock();
+	spin_unlock_irqrestore(&txq->lock, flags);
+
+	if (too_big) {
+		rionet_tx_too_big(skb);
+		dev_kfree_skb_any(skb);
+	}
 
 	return NETDEV_TX_OK;
 }
 
+static struct net_device_stats *rionet_get_stats(struct net_device *ndev)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	unsigned long packets = 0, bytes = 0;
+	int i;
+
+	for (i = 0; i < ndev->num_tx_queues; i++) {
+		packets += rnet->txq[i].tx_packets;
+		bytes += rnet->txq[i].tx_bytes;
+	}
+
+	ndev->stats.tx_packets = packets;
+	ndev->stats.tx_bytes = bytes;
+	return &ndev->stats;
+}
+
+/*
+ * rionet_send_doorbells - send batch of doorbells to peers
+ *
+ * Doorbells not accepted by the mport doorbell queue are resubmitted, or
+ * sent one by one once the queue takes none of them. Can be called from
+ * atomic context.
+ */
+static void rionet_send_doorbells(struct rio_mport *mport,
+				  const struct rio_dbell_msg *db, int num)
+{
+	int rc;
+
+	while (num > 0) {
+		rc = rio_send_doorbells(mport, db, num, NULL, 0);
+		if (rc <= 0)
+			break;
+		db += rc;
+		num -= rc;
+	}
+
+	for (; num > 0; db++, num--) {
+		rc = rio_mport_send_doorbell(mport, db->destid, db->data);
+		if (rc < 0)
+			pr_err("%s: failed to send doorbell 0x%04x to destid %d, err=%d\n",
+			       DRV_NAME, db->data, db->destid, rc);
+	}
+}
+
+/*
+ * rionet_send_seg_caps - tell peer that segmented frames can be sent to us
+ *
+ * Sends segment header with zero frame length (see struct rionet_seg_hdr)
+ * through the first TX queue. The peer has joined, so its inbound mailbox
+ * is open. Can be called from atomic context.
+ */
+static void rionet_send_seg_caps(struct net_device *ndev, struct rio_dev *rdev)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rionet_txq *txq = &rnet->txq[0];
+	struct rio_outb_msg *msg;
+	unsigned long flags;
+
+	spin_lock_irqsave(&txq->lock, flags);
+	if (txq->cnt < RIONET_TX_RING_SIZE) {
+		msg = &txq->batch[txq->batch_cnt];
+		msg->rdev = rdev;
+		msg->dmbox = RIONET_MAILBOX;
+		msg->len = sizeof(rnet->seg_caps);
+		msg->buffer = &rnet->seg_caps;
+		msg->sgl = NULL;
+		msg->nents = 0;
+		rionet_tx_commit(rnet, ndev, txq, NULL);
+		rionet_tx_flush(rnet, txq);
+		txq->unsent = 0;
+	}
+	spin_unlock_irqrestore(&txq->lock, flags);
+}
+
 static void rionet_dbell_event(struct rio_mport *mport, void *dev_id, u16 sid, u16 tid,
 			       u16 info)
 {
 	struct net_device *ndev = dev_id;
 	struct rionet_private *rnet = netdev_priv(ndev);
 	struct rionet_peer *peer;
+	struct rio_dev *rdev;
 	unsigned char netid = rnet->mport->id;
 
 	if (netif_msg_intr(rnet))
 		printk(KERN_INFO "%s: doorbell sid %4.4x tid %4.4x info %4.4x",
 		       DRV_NAME, sid, tid, info);
 	if (info == RIONET_DOORBELL_JOIN) {
-		if (!nets[netid].active[sid]) {
+		if (!rionet_is_active(&nets[netid], sid)) {
 			spin_lock(&nets[netid].lock);
 			list_for_each_entry(peer, &nets[netid].peers, node) {
-				if (peer->rdev->destid == sid) {
-					nets[netid].active[sid] = peer->rdev;
-					nets[netid].nact++;
-				}
+				if (peer->rdev->destid == sid)
+					rionet_set_active(&nets[netid],
+							  peer->rdev, true);
 			}
 			spin_unlock(&nets[netid].lock);
 
 			rio_mport_send_doorbell(mport, sid,
 						RIONET_DOORBELL_JOIN);
 		}
+
+		/*
+		 * Announce reassembly on every JOIN, the peer may have been
+		 * restarted without sending LEAVE. Until then it is sent
+		 * single-message frames only. TX queues are set up once
+		 * the device is open, rionet_open() announces to peers that
+		 * joined before.
+		 */
+		if (rnet->open) {
+			rcu_read_lock();
+			rdev = rcu_dereference(nets[netid].active[sid]);
+			if (rdev)
+				rionet_send_seg_caps(ndev, rdev);
+			rcu_read_unlock();
+		}
 	} else if (info == RIONET_DOORBELL_LEAVE) {
+		rionet_set_seg_peer(&nets[netid], sid, false);
 		spin_lock(&nets[netid].lock);
-		if (nets[netid].active[sid]) {
-			nets[netid].active[sid] = NULL;
-			nets[netid].nact--;
+		list_for_each_entry(peer, &nets[netid].peers, node) {
+			if (peer->rdev->destid == sid)
+				rionet_set_active(&nets[netid],
+						  peer->rdev, false);
 		}
 		spin_unlock(&nets[netid].lock);
 	} else {
@@ -290,7 +1098,6 @@ static void rionet_dbell_event(struct rio_mport *mport, void *dev_id, u16 sid, u
 
 static void rionet_inb_msg_event(struct rio_mport *mport, void *dev_id, int mbox, int slot)
 {
-	int n;
 	struct net_device *ndev = dev_id;
 	struct rionet_private *rnet = netdev_priv(ndev);
 
@@ -298,45 +1105,158 @@ static void rionet_inb_msg_event(struct rio_mport *mport, void *dev_id, int mbox
 		printk(KERN_INFO "%s: inbound message event, mbox %d slot %d\n",
 		       DRV_NAME, mbox, slot);
 
-	spin_lock(&rnet->lock);
-	if ((n = rionet_rx_clean(ndev)) != rnet->rx_slot)
-		rionet_rx_fill(ndev, n);
-	spin_unlock(&rnet->lock);
+	rnet->rx_stats.irq_events++;
+
+	if (napi_schedule_prep(&rnet->napi)) {
+		/* Keep mailbox interrupt masked while NAPI polls the queue */
+		if (!rio_set_inb_mbox_irq(mport, mbox, 0))
+			rnet->rx_stats.irq_masked++;
+		__napi_schedule(&rnet->napi);
+	}
 }
 
 static void rionet_outb_msg_event(struct rio_mport *mport, void *dev_id, int mbox, int slot)
 {
-	struct net_device *ndev = dev_id;
+	struct rionet_txq *txq = dev_id;
+	struct net_device *ndev = txq->ndev;
 	struct rionet_private *rnet = netdev_priv(ndev);
 
-	spin_lock(&rnet->tx_lock);
+	spin_lock(&txq->lock);
 
 	if (netif_msg_intr(rnet))
 		printk(KERN_INFO
 		       "%s: outbound message event, mbox %d slot %d\n",
 		       DRV_NAME, mbox, slot);
 
-	while (rnet->tx_cnt && (rnet->ack_slot != slot)) {
+	while (txq->cnt && (txq->ack_slot != slot)) {
 		/* dma unmap single */
-		dev_consume_skb_irq(rnet->tx_skb[rnet->ack_slot]);
-		rnet->tx_skb[rnet->ack_slot] = NULL;
-		++rnet->ack_slot;
-		rnet->ack_slot &= (RIONET_TX_RING_SIZE - 1);
-		rnet->tx_cnt--;
+		dev_consume_skb_irq(txq->skb[txq->ack_slot]);
+		txq->skb[txq->ack_slot] = NULL;
+		++txq->ack_slot;
+		txq->ack_slot &= (RIONET_TX_RING_SIZE - 1);
+		txq->cnt--;
 	}
 
-	if (rnet->tx_cnt < RIONET_TX_RING_SIZE)
-		netif_wake_queue(ndev);
+	rionet_tx_wake(rnet, txq);
 
-	spin_unlock(&rnet->tx_lock);
+	spin_unlock(&txq->lock);
+}
+
+static void rionet_txq_free_seg(struct rionet_txq *txq)
+{
+	kfree(txq->seg_hdr);
+	txq->seg_hdr = NULL;
+	kfree(txq->seg_sg);
+	txq->seg_sg = NULL;
+}
+
+static int rionet_txq_alloc_seg(struct rionet_txq *txq)
+{
+	txq->seg_hdr = kcalloc(RIONET_TX_RING_SIZE, sizeof(*txq->seg_hdr),
+			       GFP_KERNEL);
+	txq->seg_sg = kcalloc(RIONET_TX_BATCH * RIONET_SEG_NENTS,
+			      sizeof(*txq->seg_sg), GFP_KERNEL);
+	if (!txq->seg_hdr || !txq->seg_sg) {
+		rionet_txq_free_seg(txq);
+		return -ENOMEM;
+	}
+
+	txq->seg_seq = 0;
+	return 0;
+}
+
+/* Outbound mailboxes that may be used as TX queues on the mport */
+static u32 rionet_txq_mboxes(struct rio_mport *mport)
+{
+	u32 mask = 1 << RIONET_MAILBOX;
+
+	/* Sending to a different destination mailbox needs batched TX */
+	if (mport->ops->add_outb_messages)
+		mask |= txq_mbox_mask & ((1 << RIO_MAX_MBOX) - 1);
+
+	return mask;
+}
+
+static void rionet_close_txqs(struct net_device *ndev)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	int i;
+
+	for (i = 0; i < rnet->num_txq; i++) {
+		rio_release_outb_mbox(rnet->mport, rnet->txq[i].mbox);
+		rionet_txq_free_seg(&rnet->txq[i]);
+	}
+	rnet->num_txq = 0;
+}
+
+/*
+ * rionet_open_txqs - claim outbound mailboxes and set up TX queues
+ *
+ * RIONET_MAILBOX is required. Additional mailboxes selected by txq_mbox_mask
+ * are used only if mport supports sending to a different destination
+ * mailbox, and are skipped if already in use (e.g. by rio_cm). Mailboxes
+ * claimed here are not available to drivers loaded later.
+ */
+static int rionet_open_txqs(struct net_device *ndev)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	u32 mboxes = rionet_txq_mboxes(rnet->mport);
+	struct rionet_txq *txq;
+	int mbox, rc;
+
+	rnet->num_txq = 0;
+
+	for (mbox = 0; mbox < RIO_MAX_MBOX; mbox++) {
+		if (!(mboxes & (1 << mbox)))
+			continue;
+
+		txq = &rnet->txq[rnet->num_txq];
+		txq->ndev = ndev;
+		txq->index = rnet->num_txq;
+		txq->mbox = mbox;
+		txq->slot = 0;
+		txq->cnt = 0;
+		txq->ack_slot = 0;
+		txq->batch_cnt = 0;
+		txq->unsent = 0;
+		txq->wake_msgs = 0;
+
+		rc = rio_request_outb_mbox(rnet->mport, (void *)txq, mbox,
+					   RIONET_TX_RING_SIZE,
+					   rionet_outb_msg_event);
+		if (rc < 0) {
+			if (mbox == RIONET_MAILBOX)
+				return rc;
+			continue;
+		}
+
+		/* Segmented frames are sent as scatterlist messages only */
+		if (rnet->mport->ops->add_outb_message_sg &&
+		    rionet_txq_alloc_seg(txq)) {
+			rio_release_outb_mbox(rnet->mport, mbox);
+			if (mbox == RIONET_MAILBOX)
+				return -ENOMEM;
+			continue;
+		}
+
+		rio_set_mbox_coalesce(rnet->mport, mbox, false, &rnet->tx_coal);
+		rnet->num_txq++;
+	}
+
+	rc = netif_set_real_num_tx_queues(ndev, rnet->num_txq);
+	if (rc)
+		rionet_close_txqs(ndev);
+
+	return rc;
 }
 
 static int rionet_open(struct net_device *ndev)
 {
-	int i, rc = 0;
+	int i, num = 0, rc = 0;
 	struct rionet_peer *peer;
 	struct rionet_private *rnet = netdev_priv(ndev);
 	unsigned char netid = rnet->mport->id;
+	struct rio_dbell_msg db[RIONET_DB_BATCH];
 	unsigned long flags;
 
 	if (netif_msg_ifup(rnet))
@@ -349,41 +1269,61 @@ static int rionet_open(struct net_device *ndev)
 					rionet_dbell_event)) < 0)
 		goto out;
 
-	if ((rc = rio_request_inb_mbox(rnet->mport,
-				       (void *)ndev,
-				       RIONET_MAILBOX,
-				       RIONET_RX_RING_SIZE,
-				       rionet_inb_msg_event)) < 0)
+	/* Prefer receiving messages directly into skbs if mport supports it */
+	rc = rio_request_inb_mbox_zc(rnet->mport, (void *)ndev, RIONET_MAILBOX,
+				     RIONET_RX_RING_SIZE, rionet_inb_msg_event);
+	rnet->rx_zc = !rc;
+	if (rc == -EOPNOTSUPP)
+		rc = rio_request_inb_mbox(rnet->mport,
+					  (void *)ndev,
+					  RIONET_MAILBOX,
+					  RIONET_RX_RING_SIZE,
+					  rionet_inb_msg_event);
+	if (rc < 0)
 		goto out;
 
-	if ((rc = rio_request_outb_mbox(rnet->mport,
-					(void *)ndev,
-					RIONET_MAILBOX,
-					RIONET_TX_RING_SIZE,
-					rionet_outb_msg_event)) < 0)
+	if ((rc = rionet_open_txqs(ndev)) < 0)
 		goto out;
 
 	/* Initialize inbound message ring */
 	for (i = 0; i < RIONET_RX_RING_SIZE; i++)
 		rnet->rx_skb[i] = NULL;
 	rnet->rx_slot = 0;
-	rionet_rx_fill(ndev, 0);
+	rnet->rx_fill_slot = 0;
+	/* Zero-copy mailbox can hold one buffer less than its size */
+	rnet->rx_free = RIONET_RX_RING_SIZE - (rnet->rx_zc ? 1 : 0);
+	local_bh_disable();
+	rionet_rx_fill(ndev);
+	local_bh_enable();
 
-	rnet->tx_slot = 0;
-	rnet->tx_cnt = 0;
-	rnet->ack_slot = 0;
+	/* Catch up with messages that may have arrived before NAPI enabled */
+	napi_enable(&rnet->napi);
+	napi_schedule(&rnet->napi);
 
 	netif_carrier_on(ndev);
-	netif_start_queue(ndev);
+	netif_tx_start_all_queues(ndev);
 
+	/* Send join messages to all peers in batches */
 	spin_lock_irqsave(&nets[netid].lock, flags);
 	list_for_each_entry(peer, &nets[netid].peers, node) {
-		/* Send a join message */
-		rio_send_doorbell(peer->rdev, RIONET_DOORBELL_JOIN);
+		db[num].destid = peer->rdev->destid;
+		db[num++].data = RIONET_DOORBELL_JOIN;
+		if (num == RIONET_DB_BATCH) {
+			rionet_send_doorbells(rnet->mport, db, num);
+			num = 0;
+		}
 	}
-	spin_unlock_irqrestore(&nets[netid].lock, flags);
+	if (num)
+		rionet_send_doorbells(rnet->mport, db, num);
 	rnet->open = true;
 
+	/* Peers that joined while TX queues were being set up */
+	list_for_each_entry(peer, &nets[netid].peers, node) {
+		if (rionet_is_active(&nets[netid], peer->rdev->destid))
+			rionet_send_seg_caps(ndev, peer->rdev);
+	}
+	spin_unlock_irqrestore(&nets[netid].lock, flags);
+
       out:
 	return rc;
 }
@@ -399,18 +1339,27 @@ static int rionet_close(struct net_device *ndev)
 	if (netif_msg_ifup(rnet))
 		printk(KERN_INFO "%s: close %s\n", DRV_NAME, ndev->name);
 
-	netif_stop_queue(ndev);
+	netif_tx_stop_all_queues(ndev);
 	netif_carrier_off(ndev);
+	napi_disable(&rnet->napi);
 	rnet->open = false;
 
-	for (i = 0; i < RIONET_RX_RING_SIZE; i++)
+	/* Stop inbound mailbox before freeing buffers it may write into */
+	rio_release_inb_mbox(rnet->mport, RIONET_MAILBOX);
+
+	for (i = 0; i < RIONET_RX_RING_SIZE; i++) {
 		kfree_skb(rnet->rx_skb[i]);
+		rnet->rx_skb[i] = NULL;
+	}
+
+	for (i = 0; i < RIONET_SEG_CTX; i++)
+		rionet_seg_drop(ndev, &rnet->rx_seg[i]);
 
 	spin_lock_irqsave(&nets[netid].lock, flags);
 	list_for_each_entry(peer, &nets[netid].peers, node) {
-		if (nets[netid].active[peer->rdev->destid]) {
+		if (rionet_is_active(&nets[netid], peer->rdev->destid)) {
 			rio_send_doorbell(peer->rdev, RIONET_DOORBELL_LEAVE);
-			nets[netid].active[peer->rdev->destid] = NULL;
+			rionet_set_active(&nets[netid], peer->rdev, false);
 		}
 		if (peer->res)
 			rio_release_outb_dbell(peer->rdev, peer->res);
@@ -419,8 +1368,9 @@ static int rionet_close(struct net_device *ndev)
 
 	rio_release_inb_dbell(rnet->mport, RIONET_DOORBELL_JOIN,
 			      RIONET_DOORBELL_LEAVE);
-	rio_release_inb_mbox(rnet->mport, RIONET_MAILBOX);
-	rio_release_outb_mbox(rnet->mport, RIONET_MAILBOX);
+	bitmap_zero(nets[netid].seg_peers,
+		    RIO_MAX_ROUTE_ENTRIES(rnet->mport->sys_size));
+	rionet_close_txqs(ndev);
 
 	return 0;
 }
@@ -448,16 +1398,16 @@ static int rionet_remove_dev(struct device *dev, struct subsys_interface *sif)
 	list_for_each_entry(peer, &nets[netid].peers, node) {
 		if (peer->rdev == rdev) {
 			list_del(&peer->node);
-			if (nets[netid].active[rdev->destid]) {
+			if (rionet_is_active(&nets[netid], rdev->destid)) {
 				state = atomic_read(&rdev->state);
 				if (state != RIO_DEVICE_GONE &&
 				    state != RIO_DEVICE_INITIALIZING) {
 					rio_send_doorbell(rdev,
 							RIONET_DOORBELL_LEAVE);
 				}
-				nets[netid].active[rdev->destid] = NULL;
-				nets[netid].nact--;
+				rionet_set_active(&nets[netid], rdev, false);
 			}
+			rionet_set_seg_peer(&nets[netid], rdev->destid, false);
 			found = 1;
 			break;
 		}
@@ -465,6 +1415,8 @@ static int rionet_remove_dev(struct device *dev, struct subsys_interface *sif)
 	spin_unlock_irqrestore(&nets[netid].lock, flags);
 
 	if (found) {
+		/* Wait for TX path to stop using removed device */
+		synchronize_rcu();
 		if (peer->res)
 			rio_release_outb_dbell(rdev, peer->res);
 		kfree(peer);
@@ -499,14 +1451,150 @@ static void rionet_set_msglevel(struct net_device *ndev, u32 value)
 	rnet->msg_enable = value;
 }
 
+static void rionet_get_channels(struct net_device *ndev,
+				struct ethtool_channels *ch)
+{
+	ch->max_rx = 1;
+	ch->max_tx = ndev->num_tx_queues;
+	ch->rx_count = 1;
+	ch->tx_count = ndev->real_num_tx_queues;
+}
+
+/*
+ * Interrupt moderation is implemented by the mport: RX settings apply to
+ * RIONET_MAILBOX, TX settings to every outbound mailbox used as TX queue.
+ */
+static int rionet_get_coalesce(struct net_device *ndev,
+			       struct ethtool_coalesce *ec)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rio_mbox_coalesce rx;
+	int rc;
+
+	rc = rio_get_mbox_coalesce(rnet->mport, RIONET_MAILBOX, true, &rx);
+	if (rc)
+		return (rc == -ENOSYS) ? -EOPNOTSUPP : rc;
+
+	ec->rx_coalesce_usecs = rx.usecs;
+	ec->rx_max_coalesced_frames = rx.frames;
+	ec->use_adaptive_rx_coalesce = rx.adaptive;
+	ec->tx_max_coalesced_frames = rnet->tx_coal.frames;
+	return 0;
+}
+
+static int rionet_set_coalesce(struct net_device *ndev,
+			       struct ethtool_coalesce *ec)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rio_mbox_coalesce rx, tx;
+	int i, rc;
+
+	if (!rnet->mport->ops->set_mbox_coalesce)
+		return -EOPNOTSUPP;
+
+	if (ec->tx_coalesce_usecs || ec->use_adaptive_tx_coalesce)
+		return -EINVAL;
+
+	rx.usecs = ec->rx_coalesce_usecs;
+	rx.frames = ec->rx_max_coalesced_frames;
+	rx.adaptive = !!ec->use_adaptive_rx_coalesce;
+	tx.usecs = 0;
+	tx.frames = ec->tx_max_coalesced_frames;
+	tx.adaptive = false;
+
+	rc = rio_set_mbox_coalesce(rnet->mport, RIONET_MAILBOX, true, &rx);
+	if (rc)
+		return rc;
+
+	/* RIONET_MAILBOX is always used for TX, validate settings with it */
+	rc = rio_set_mbox_coalesce(rnet->mport, RIONET_MAILBOX, false, &tx);
+	if (rc)
+		return rc;
+
+	rnet->tx_coal = tx;
+	for (i = 0; i < rnet->num_txq; i++)
+		if (rnet->txq[i].mbox != RIONET_MAILBOX)
+			rio_set_mbox_coalesce(rnet->mport, rnet->txq[i].mbox,
+					      false, &tx);
+
+	return 0;
+}
+
+static const char rionet_gstrings_stats[][ETH_GSTRING_LEN] = {
+	"rx_irq_events",
+	"rx_irq_masked",
+	"rx_napi_polls",
+	"rx_napi_pkts",
+	"rx_napi_budget_hit",
+	"rx_pkts_per_poll",
+	"rx_refill_batches",
+	"rx_alloc_fail",
+	"rx_seg_frames",
+	"rx_seg_dropped",
+};
+
+#define RIONET_NUM_STATS	ARRAY_SIZE(rionet_gstrings_stats)
+
+static int rionet_get_sset_count(struct net_device *ndev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return RIONET_NUM_STATS;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void rionet_get_strings(struct net_device *ndev, u32 stringset, u8 *data)
+{
+	if (stringset == ETH_SS_STATS)
+		memcpy(data, rionet_gstrings_stats,
+		       sizeof(rionet_gstrings_stats));
+}
+
+static void rionet_get_ethtool_stats(struct net_device *ndev,
+				     struct ethtool_stats *estats, u64 *data)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+	struct rionet_rx_stats *st = &rnet->rx_stats;
+	int i = 0;
+
+	data[i++] = st->irq_events;
+	data[i++] = st->irq_masked;
+	data[i++] = st->polls;
+	data[i++] = st->poll_pkts;
+	data[i++] = st->poll_budget_hit;
+	data[i++] = st->polls ? div64_u64(st->poll_pkts, st->polls) : 0;
+	data[i++] = st->refills;
+	data[i++] = st->alloc_fail;
+	data[i++] = st->seg_frames;
+	data[i++] = st->seg_dropped;
+}
+
+/*
+ * Frames larger than one message can be sent only as scatterlist messages.
+ * Peers that do not reassemble segmented frames are sent frames of up to
+ * RIONET_MAX_MTU, see rionet_tx_too_big().
+ */
+static int rionet_max_mtu(struct net_device *ndev)
+{
+	struct rionet_private *rnet = netdev_priv(ndev);
+
+	return rnet->mport->ops->add_outb_message_sg ? RIONET_SEG_MAX_MTU :
+						       RIONET_MAX_MTU;
+}
+
 static int rionet_change_mtu(struct net_device *ndev, int new_mtu)
 {
-	if ((new_mtu < 68) || (new_mtu > RIONET_MAX_MTU)) {
+	struct rionet_private *rnet = netdev_priv(ndev);
+
+	if ((new_mtu < 68) || (new_mtu > rionet_max_mtu(ndev))) {
 		printk(KERN_ERR "%s: Invalid MTU size %d\n",
 		       ndev->name, new_mtu);
 		return -EINVAL;
 	}
 	ndev->mtu = new_mtu;
+	rnet->tx_frame_msgs = rionet_frame_msgs(new_mtu + ETH_HLEN);
 	return 0;
 }
 
@@ -515,12 +1603,19 @@ static const struct ethtool_ops rionet_ethtool_ops = {
 	.get_msglevel = rionet_get_msglevel,
 	.set_msglevel = rionet_set_msglevel,
 	.get_link = ethtool_op_get_link,
+	.get_sset_count = rionet_get_sset_count,
+	.get_strings = rionet_get_strings,
+	.get_ethtool_stats = rionet_get_ethtool_stats,
+	.get_channels = rionet_get_channels,
+	.get_coalesce = rionet_get_coalesce,
+	.set_coalesce = rionet_set_coalesce,
 };
 
 static const struct net_device_ops rionet_netdev_ops = {
 	.ndo_open		= rionet_open,
 	.ndo_stop		= rionet_close,
 	.ndo_start_xmit		= rionet_start_xmit,
+	.ndo_get_stats		= rionet_get_stats,
 	.ndo_change_mtu		= rionet_change_mtu,
 	.ndo_validate_addr	= eth_validate_addr,
 	.ndo_set_mac_address	= eth_mac_addr,
@@ -528,13 +1623,13 @@ static const struct net_device_ops rionet_netdev_ops = {
 
 static int rionet_setup_netdev(struct rio_mport *mport, struct net_device *ndev)
 {
-	int rc = 0;
+	int i, rc = 0;
 	struct rionet_private *rnet;
 	u16 device_id;
 	const size_t rionet_active_bytes = sizeof(void *) *
 				RIO_MAX_ROUTE_ENTRIES(mport->sys_size);
 
-	nets[mport->id].active = (struct rio_dev **)__get_free_pages(GFP_KERNEL,
+	nets[mport->id].active = (struct rio_dev __rcu **)__get_free_pages(GFP_KERNEL,
 						get_order(rionet_active_bytes));
 	if (!nets[mport->id].active) {
 		rc = -ENOMEM;
@@ -542,11 +1637,33 @@ static int rionet_setup_netdev(struct rio_mport *mport, struct net_device *ndev)
 	}
 	memset((void *)nets[mport->id].active, 0, rionet_active_bytes);
 
+	nets[mport->id].seg_peers =
+		kcalloc(BITS_TO_LONGS(RIO_MAX_ROUTE_ENTRIES(mport->sys_size)),
+			sizeof(unsigned long), GFP_KERNEL);
+	if (!nets[mport->id].seg_peers) {
+		free_pages((unsigned long)nets[mport->id].active,
+			   get_order(rionet_active_bytes));
+		rc = -ENOMEM;
+		goto out;
+	}
+
 	/* Set up private area */
 	rnet = netdev_priv(ndev);
 	rnet->mport = mport;
 	rnet->open = false;
 
+	/* Statistics of TX queues are kept across close/open */
+	rnet->txq = kcalloc(ndev->num_tx_queues, sizeof(*rnet->txq),
+			    GFP_KERNEL);
+	if (!rnet->txq) {
+		kfree(nets[mport->id].seg_peers);
+		nets[mport->id].seg_peers = NULL;
+		free_pages((unsigned long)nets[mport->id].active,
+			   get_order(rionet_active_bytes));
+		rc = -ENOMEM;
+		goto out;
+	}
+
 	/* Set the default MAC address */
 	device_id = rio_local_get_device_id(mport);
 	ndev->dev_addr[0] = 0x00;
@@ -555,20 +1672,39 @@ static int rionet_setup_netdev(struct rio_mport *mport, struct net_device *ndev)
 	ndev->dev_addr[3] = 0x01;
 	ndev->dev_addr[4] = device_id >> 8;
 	ndev->dev_addr[5] = device_id & 0xff;
+	rnet->destid = device_id;
+	rnet->seg_caps.magic = RIONET_SEG_MAGIC;
+	rnet->seg_caps.src = cpu_to_be16(device_id);
 
 	ndev->netdev_ops = &rionet_netdev_ops;
 	ndev->mtu = RIONET_MAX_MTU;
+	/*
+	 * NETIF_F_SG is not advertised: without checksum offload the stack
+	 * would drop it anyway. Frames come in linear and mport sends them
+	 * without copy only if their data starts 8-byte aligned, as frames
+	 * received on rionet do (see rionet_rx_fill()).
+	 */
 	ndev->features = NETIF_F_LLTX;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0))
+	ndev->min_mtu = 68;
+	ndev->max_mtu = rionet_max_mtu(ndev);
+#endif
+	rnet->tx_frame_msgs = rionet_frame_msgs(ndev->mtu + ETH_HLEN);
 	SET_NETDEV_DEV(ndev, &mport->dev);
 	ndev->ethtool_ops = &rionet_ethtool_ops;
 
-	spin_lock_init(&rnet->lock);
-	spin_lock_init(&rnet->tx_lock);
+	for (i = 0; i < ndev->num_tx_queues; i++)
+		spin_lock_init(&rnet->txq[i].lock);
+	netif_napi_add(ndev, &rnet->napi, rionet_poll, RIONET_NAPI_WEIGHT);
 
 	rnet->msg_enable = RIONET_DEFAULT_MSGLEVEL;
 
 	rc = register_netdev(ndev);
 	if (rc != 0) {
+		netif_napi_del(&rnet->napi);
+		kfree(rnet->txq);
+		kfree(nets[mport->id].seg_peers);
+		nets[mport->id].seg_peers = NULL;
 		free_pages((unsigned long)nets[mport->id].active,
 			   get_order(rionet_active_bytes));
 		goto out;
@@ -616,7 +1752,8 @@ static int rionet_add_dev(struct device *dev, struct subsys_interface *sif)
 		}
 
 		/* Allocate our net_device structure */
-		ndev = alloc_etherdev(sizeof(struct rionet_private));
+		ndev = alloc_etherdev_mq(sizeof(struct rionet_private),
+				hweight32(rionet_txq_mboxes(rdev->net->hport)));
 		if (ndev == NULL) {
 			rc = -ENOMEM;
 			goto out;
@@ -633,6 +1770,7 @@ static int rionet_add_dev(struct device *dev, struct subsys_interface *sif)
 		INIT_LIST_HEAD(&nets[netid].peers);
 		spin_lock_init(&nets[netid].lock);
 		nets[netid].nact = 0;
+		RCU_INIT_POINTER(nets[netid].fanout, NULL);
 		nets[netid].ndev = ndev;
 	}
 
@@ -693,10 +1831,10 @@ static int rionet_shutdown(struct notifier_block *nb, unsigned long code,
 
 		spin_lock_irqsave(&nets[i].lock, flags);
 		list_for_each_entry(peer, &nets[i].peers, node) {
-			if (nets[i].active[peer->rdev->destid]) {
+			if (rionet_is_active(&nets[i], peer->rdev->destid)) {
 				rio_send_doorbell(peer->rdev,
 						  RIONET_DOORBELL_LEAVE);
-				nets[i].active[peer->rdev->destid] = NULL;
+				rionet_set_active(&nets[i], peer->rdev, false);
 			}
 		}
 		spin_unlock_irqrestore(&nets[i].lock, flags);
@@ -709,6 +1847,7 @@ static void rionet_remove_mport(struct device *dev,
 				struct class_interface *class_intf)
 {
 	struct rio_mport *mport = to_rio_mport(dev);
+	struct rionet_private *rnet;
 	struct net_device *ndev;
 	int id = mport->id;
 
@@ -721,13 +1860,19 @@ static void rionet_remove_mport(struct device *dev,
 
 	if (nets[id].ndev) {
 		ndev = nets[id].ndev;
-		netif_stop_queue(ndev);
+		netif_tx_stop_all_queues(ndev);
 		unregister_netdev(ndev);
 
 		free_pages((unsigned long)nets[id].active,
 			   get_order(sizeof(void *) *
 			   RIO_MAX_ROUTE_ENTRIES(mport->sys_size)));
 		nets[id].active = NULL;
+		kfree(nets[id].seg_peers);
+		nets[id].seg_peers = NULL;
+		kfree(rcu_dereference_protected(nets[id].fanout, 1));
+		RCU_INIT_POINTER(nets[id].fanout, NULL);
+		rnet = netdev_priv(ndev);
+		kfree(rnet->txq);
 		free_netdev(ndev);
 		nets[id].ndev = NULL;
 	}
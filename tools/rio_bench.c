@@ -0,0 +1,582 @@
+/*
+ * rio_bench - RapidIO benchmark tool
+ *
+ * Runs mailbox, doorbell and BDMA tests of the rio_bench driver through
+ * its debugfs interface and measures maintenance read latency and rio_cm
+ * channel round-trip time over rio_mport_cdev and rio_cm devices.
+ * Every result is printed to stdout as single JSON line.
+ *
+ * This program is free software; you can redistribute  it and/or modify it
+ * under  the terms of  the GNU General  Public License as published by the
+ * Free Software Foundation;  either version 2 of the  License, or (at your
+ * option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../include/rio_mport_cdev.h"
+#include "../include/rio_cm_cdev.h"
+
+#define DEFAULT_DEBUGFS	"/sys/kernel/debug/rio_bench"
+#define RIO_CM_DEV	"/dev/rio_cm"
+#define RIO_MSG_MAX	4096
+#define HIST_BUCKETS	16
+
+/* Channel header prepended to messages by rio_cm */
+#define CM_HDR_SIZE	20
+/* Payload of rio_cm message starts with its length for the echo side */
+#define CM_MIN_SIZE	(CM_HDR_SIZE + 4)
+
+struct opts {
+	int mport;
+	unsigned int destid;
+	const char *sizes;
+	unsigned long long count;
+	unsigned int depth;
+	int chan;
+	unsigned long long raddr;
+	unsigned int hopcount;
+	unsigned int offset;
+	unsigned int cm_chan;
+	unsigned int timeout;
+	int read;
+	const char *dbgfs;
+};
+
+struct stats {
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t lat_min;
+	uint64_t lat_max;
+	uint64_t lat_sum;
+	uint64_t hist[HIST_BUCKETS];
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account(struct stats *st, uint64_t ns, uint64_t bytes)
+{
+	uint64_t us = ns >> 10;
+	int b = 0;
+
+	while (us) {
+		b++;
+		us >>= 1;
+	}
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+
+	st->ops++;
+	st->bytes += bytes;
+	st->lat_sum += ns;
+	if (st->ops == 1 || ns < st->lat_min)
+		st->lat_min = ns;
+	if (ns > st->lat_max)
+		st->lat_max = ns;
+	st->hist[b]++;
+}
+
+/* Same format as results reported by the rio_bench driver */
+static void report(const char *test, const struct opts *o, const char *params,
+		   const struct stats *st, uint64_t ns)
+{
+	int i;
+
+	if (!ns)
+		ns = 1;
+
+	printf("{\"test\":\"%s\",\"mport\":%d,\"destid\":%u,%s,"
+	       "\"ops\":%llu,\"errors\":%llu,\"usecs\":%llu,"
+	       "\"ops_per_sec\":%llu,\"bytes_per_sec\":%llu,"
+	       "\"lat_ns\":{\"min\":%llu,\"avg\":%llu,\"max\":%llu},"
+	       "\"lat_hist_log2_us\":[",
+	       test, o->mport, o->destid, params,
+	       (unsigned long long)st->ops, (unsigned long long)st->errors,
+	       (unsigned long long)(ns / 1000),
+	       (unsigned long long)(st->ops * 1e9 / ns),
+	       (unsigned long long)(st->bytes * 1e9 / ns),
+	       (unsigned long long)st->lat_min,
+	       (unsigned long long)(st->ops ? st->lat_sum / st->ops : 0),
+	       (unsigned long long)st->lat_max);
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		printf("%s%llu", i ? "," : "", (unsigned long long)st->hist[i]);
+	printf("]}\n");
+	fflush(stdout);
+}
+
+/*
+ * Run a test of the rio_bench driver and copy its result to stdout.
+ * Returns 0 or negative errno reported by the driver.
+ */
+static int drv_run(const struct opts *o, const char *cmd)
+{
+	char path[256], buf[2048];
+	ssize_t len;
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/run", o->dbgfs);
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	if (write(fd, cmd, strlen(cmd)) < 0)
+		ret = -errno;
+	close(fd);
+	if (ret)
+		return ret;
+
+	snprintf(path, sizeof(path), "%s/result", o->dbgfs);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len < 0)
+		ret = -errno;
+	close(fd);
+	if (ret)
+		return ret;
+
+	fwrite(buf, 1, len, stdout);
+	fflush(stdout);
+	return 0;
+}
+
+/* Iterate over comma separated list of sizes */
+static int next_size(const char **p, unsigned int *size)
+{
+	char *end;
+
+	if (!**p)
+		return 0;
+
+	*size = strtoul(*p, &end, 0);
+	if (*end == 'k' || *end == 'K') {
+		*size <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		*size <<= 20;
+		end++;
+	}
+	*p = (*end == ',') ? end + 1 : end;
+	return 1;
+}
+
+static int test_mbox(const struct opts *o)
+{
+	const char *p = o->sizes ? o->sizes : "16,64,256,1024,4096";
+	unsigned int size;
+	char cmd[128];
+	int ret;
+
+	while (next_size(&p, &size)) {
+		snprintf(cmd, sizeof(cmd), "mbox %u %u %llu %u", o->destid,
+			 size, o->count, o->depth);
+		ret = drv_run(o, cmd);
+		if (ret) {
+			fprintf(stderr, "mbox size %u: %s\n", size,
+				strerror(-ret));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int test_dbell(const struct opts *o)
+{
+	char cmd[128];
+	int ret;
+
+	snprintf(cmd, sizeof(cmd), "dbell %u %llu", o->destid, o->count);
+	ret = drv_run(o, cmd);
+	if (ret)
+		fprintf(stderr, "dbell: %s\n", strerror(-ret));
+	return ret;
+}
+
+static int dma_run(const struct opts *o, unsigned int size, int ch)
+{
+	char cmd[128];
+
+	snprintf(cmd, sizeof(cmd), "dma %u 0x%llx %u %llu %d %c", o->destid,
+		 o->raddr, size, o->count, ch, o->read ? 'r' : 'w');
+	return drv_run(o, cmd);
+}
+
+/*
+ * Without -c every DMA channel of the mport is tested in turn, until the
+ * driver rejects channel index, followed by transfer striped over all
+ * channels.
+ */
+static int test_dma(const struct opts *o)
+{
+	const char *p = o->sizes ? o->sizes : "4k,64k,1m";
+	unsigned int size;
+	int ch, ret = 0;
+
+	while (next_size(&p, &size)) {
+		if (o->chan != -2) {
+			ret = dma_run(o, size, o->chan);
+		} else {
+			for (ch = 0; ; ch++) {
+				ret = dma_run(o, size, ch);
+				if (ret)
+					break;
+			}
+			if (ret == -EINVAL && ch > 0)
+				ret = dma_run(o, size, -1);
+		}
+
+		if (ret) {
+			fprintf(stderr, "dma size %u: %s\n", size,
+				strerror(-ret));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int test_maint(const struct opts *o)
+{
+	struct rio_mport_maint_io mt;
+	struct stats st;
+	char path[64], params[96];
+	uint64_t start, t;
+	unsigned long long i;
+	uint32_t val;
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/rio_mport%d", o->mport);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	memset(&st, 0, sizeof(st));
+	memset(&mt, 0, sizeof(mt));
+	mt.rioid = o->destid;
+	mt.hopcount = o->hopcount;
+	mt.offset = o->offset;
+	mt.length = sizeof(val);
+	mt.buffer = (uintptr_t)&val;
+
+	start = now_ns();
+	for (i = 0; i < o->count; i++) {
+		t = now_ns();
+		if (ioctl(fd, RIO_MPORT_MAINT_READ_REMOTE, &mt)) {
+			st.errors++;
+			continue;
+		}
+		account(&st, now_ns() - t, sizeof(val));
+	}
+	t = now_ns() - start;
+	close(fd);
+
+	snprintf(params, sizeof(params),
+		 "\"hopcount\":%u,\"offset\":%u,\"count\":%llu",
+		 o->hopcount, o->offset, o->count);
+	report("maint", o, params, &st, t);
+	return 0;
+}
+
+static int cm_create(int fd, uint16_t *ch)
+{
+	if (ioctl(fd, RIO_CM_CHAN_CREATE, ch)) {
+		fprintf(stderr, "create channel: %s\n", strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/* rio_cm channel round-trip time, the peer runs 'cm-echo' */
+static int test_cm(const struct opts *o)
+{
+	const char *p = o->sizes ? o->sizes : "24,64,256,1024,4096";
+	struct rio_cm_channel cc;
+	struct rio_cm_msg tx, rx;
+	struct stats st;
+	char tbuf[RIO_MSG_MAX], rbuf[RIO_MSG_MAX], params[96];
+	unsigned long long i;
+	unsigned int size;
+	uint64_t start, t;
+	uint16_t ch = 0;
+	uint32_t len;
+	int fd, ret;
+
+	fd = open(RIO_CM_DEV, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", RIO_CM_DEV, strerror(errno));
+		return -errno;
+	}
+
+	ret = cm_create(fd, &ch);
+	if (ret)
+		goto out;
+
+	memset(&cc, 0, sizeof(cc));
+	cc.id = ch;
+	cc.remote_channel = o->cm_chan;
+	cc.remote_destid = o->destid;
+	cc.mport_id = o->mport;
+	if (ioctl(fd, RIO_CM_CHAN_CONNECT, &cc)) {
+		ret = -errno;
+		fprintf(stderr, "connect to %u:%u: %s\n", o->destid,
+			o->cm_chan, strerror(errno));
+		goto out_close;
+	}
+
+	memset(tbuf, 0, sizeof(tbuf));
+	while (next_size(&p, &size)) {
+		if (size < CM_MIN_SIZE || size > RIO_MSG_MAX) {
+			fprintf(stderr, "cm size %u out of range\n", size);
+			ret = -EINVAL;
+			break;
+		}
+
+		memset(&st, 0, sizeof(st));
+		len = size;
+		memcpy(tbuf + CM_HDR_SIZE, &len, sizeof(len));
+
+		start = now_ns();
+		for (i = 0; i < o->count; i++) {
+			tx.ch_num = ch;
+			tx.size = size;
+			tx.rxto = 0;
+			tx.msg = (uintptr_t)tbuf;
+			rx.ch_num = ch;
+			rx.size = RIO_MSG_MAX;
+			rx.rxto = o->timeout;
+			rx.msg = (uintptr_t)rbuf;
+
+			t = now_ns();
+			if (ioctl(fd, RIO_CM_CHAN_SEND, &tx) ||
+			    ioctl(fd, RIO_CM_CHAN_RECEIVE, &rx)) {
+				st.errors++;
+				continue;
+			}
+			account(&st, now_ns() - t, size);
+		}
+		t = now_ns() - start;
+
+		snprintf(params, sizeof(params),
+			 "\"channel\":%u,\"size\":%u,\"count\":%llu",
+			 o->cm_chan, size, o->count);
+		report("cm", o, params, &st, t);
+	}
+
+out_close:
+	ioctl(fd, RIO_CM_CHAN_CLOSE, &ch);
+out:
+	close(fd);
+	return ret;
+}
+
+/* Echo server for 'cm' test, serves one connection at a time */
+static int test_cm_echo(const struct opts *o)
+{
+	struct rio_cm_channel cc;
+	struct rio_cm_accept acc;
+	struct rio_cm_msg msg;
+	char buf[RIO_MSG_MAX];
+	uint16_t ch = o->cm_chan;
+	uint32_t len;
+	int fd, ret;
+
+	fd = open(RIO_CM_DEV, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", RIO_CM_DEV, strerror(errno));
+		return -errno;
+	}
+
+	ret = cm_create(fd, &ch);
+	if (ret)
+		goto out;
+
+	memset(&cc, 0, sizeof(cc));
+	cc.id = ch;
+	cc.mport_id = o->mport;
+	if (ioctl(fd, RIO_CM_CHAN_BIND, &cc) ||
+	    ioctl(fd, RIO_CM_CHAN_LISTEN, &ch)) {
+		ret = -errno;
+		fprintf(stderr, "listen on %u: %s\n", ch, strerror(errno));
+		goto out_close;
+	}
+
+	for (;;) {
+		memset(&acc, 0, sizeof(acc));
+		acc.ch_num = ch;
+		acc.wait_to = 0;
+		if (ioctl(fd, RIO_CM_CHAN_ACCEPT, &acc)) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			fprintf(stderr, "accept: %s\n", strerror(errno));
+			break;
+		}
+
+		for (;;) {
+			msg.ch_num = acc.ch_num;
+			msg.size = RIO_MSG_MAX;
+			msg.rxto = 0;
+			msg.msg = (uintptr_t)buf;
+			if (ioctl(fd, RIO_CM_CHAN_RECEIVE, &msg))
+				break;
+
+			memcpy(&len, buf + CM_HDR_SIZE, sizeof(len));
+			if (len < CM_MIN_SIZE || len > RIO_MSG_MAX)
+				len = CM_MIN_SIZE;
+
+			msg.size = len;
+			if (ioctl(fd, RIO_CM_CHAN_SEND, &msg))
+				break;
+		}
+
+		ioctl(fd, RIO_CM_CHAN_CLOSE, &acc.ch_num);
+	}
+
+out_close:
+	ioctl(fd, RIO_CM_CHAN_CLOSE, &ch);
+out:
+	close(fd);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <test>\n"
+		"Tests:\n"
+		"  mbox     mailbox message rate and RTT (rio_bench driver)\n"
+		"  dbell    doorbell RTT (rio_bench driver)\n"
+		"  dma      BDMA bandwidth per channel and striped (rio_bench driver)\n"
+		"  maint    maintenance read latency (rio_mport_cdev)\n"
+		"  cm       rio_cm channel RTT, peer runs cm-echo (rio_cm)\n"
+		"  cm-echo  rio_cm echo server\n"
+		"Options:\n"
+		"  -m <id>    local mport (maint, cm; default 0)\n"
+		"  -d <id>    destID of peer (default 0)\n"
+		"  -s <list>  comma separated message/transfer sizes\n"
+		"  -n <num>   operations per result (default 1000)\n"
+		"  -q <num>   outstanding mailbox messages (default 1)\n"
+		"  -c <num>   DMA channel, -1 = striped (default: all, then striped)\n"
+		"  -a <addr>  RapidIO address of DMA target\n"
+		"  -r         DMA read (default write)\n"
+		"  -h <num>   hopcount of maint target (default 0xff)\n"
+		"  -o <off>   maint register offset (default 0)\n"
+		"  -p <num>   rio_cm channel of echo server (default 64)\n"
+		"  -t <ms>    rio_cm receive timeout (default 1000)\n"
+		"  -D <path>  rio_bench debugfs directory (default "
+		DEFAULT_DEBUGFS ")\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct opts o = {
+		.count = 1000,
+		.depth = 1,
+		.chan = -2,
+		.hopcount = 0xff,
+		.cm_chan = 64,
+		.timeout = 1000,
+		.dbgfs = DEFAULT_DEBUGFS,
+	};
+	const char *test;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "m:d:s:n:q:c:a:rh:o:p:t:D:")) != -1) {
+		switch (c) {
+		case 'm':
+			o.mport = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			o.destid = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			o.sizes = optarg;
+			break;
+		case 'n':
+			o.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'q':
+			o.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			o.chan = strtol(optarg, NULL, 0);
+			if (o.chan < -1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'a':
+			o.raddr = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			o.read = 1;
+			break;
+		case 'h':
+			o.hopcount = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			o.offset = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			o.cm_chan = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			o.timeout = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			o.dbgfs = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	test = argv[optind];
+
+	if (!strcmp(test, "mbox"))
+		ret = test_mbox(&o);
+	else if (!strcmp(test, "dbell"))
+		ret = test_dbell(&o);
+	else if (!strcmp(test, "dma"))
+		ret = test_dma(&o);
+	else if (!strcmp(test, "maint"))
+		ret = test_maint(&o);
+	else if (!strcmp(test, "cm"))
+		ret = test_cm(&o);
+	else if (!strcmp(test, "cm-echo"))
+		ret = test_cm_echo(&o);
+	else {
+		usage(argv[0]);
+		return 1;
+	}
+
+	return ret ? 1 : 0;
+}